@@ -0,0 +1,637 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "benchmark.h"
+#include <chrono>
+#include <ctime>
+#include <algorithm>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+using namespace std::chrono;
+using namespace libusb;
+
+/**
+ * State shared by the transfers of a repetition
+ */
+struct Run
+{
+	const BenchParams *params;
+	int maxPacket;               ///< wMaxPacketSize of the endpoint
+	steady_clock::time_point start; ///< When the measurement starts
+	steady_clock::time_point end;   ///< When the measurement ended
+	bool finished;               ///< True when transfers are not resubmitted
+	int failure;                 ///< libusb status that ended the run, or 0
+	bool measuring;              ///< True after the first measured transfer
+	clock_t cpuStart;            ///< Process CPU time when measuring started
+	///When each transfer in flight was submitted
+	unordered_map<Transfer*,steady_clock::time_point> submitted;
+	BenchResult result;
+	///Event threads may complete transfers while the first ones are submitted
+	mutex lock;
+};
+
+/**
+ * \param pattern data pattern
+ * \param i byte index within a transfer
+ * \param maxPacket wMaxPacketSize of the endpoint
+ * \return the value of that byte
+ */
+static unsigned char patternByte(BenchPattern pattern, int i, int maxPacket)
+{
+	return pattern==ZEROS ? 0 : (i % maxPacket) % 63;
+}
+
+/**
+ * \param transfer completed IN transfer
+ * \param pattern data pattern
+ * \param maxPacket wMaxPacketSize of the endpoint
+ * \return true if the data matches the pattern. Since a short packet ends a
+ * transfer, every packet but the last one is maxPacket bytes
+ */
+static bool checkPattern(Transfer& transfer, BenchPattern pattern,
+	int maxPacket)
+{
+	if(pattern==NONE) return true;
+	for(int i=0;i<transfer.getActualLength();i++)
+		if(transfer.getData()[i]!=patternByte(pattern,i,maxPacket))
+			return false;
+	return true;
+}
+
+/**
+ * Completion handler of the benchmark transfers
+ * \param run state of the repetition
+ * \param transfer completed transfer
+ * \return true to resubmit the transfer
+ */
+static bool completed(Run& run, Transfer& transfer)
+{
+	auto now=steady_clock::now();
+	lock_guard<mutex> l(run.lock);
+	const BenchParams& params=*run.params;
+	if(run.finished==false && now>=run.start)
+	{
+		if(run.measuring==false)
+		{
+			run.measuring=true;
+			run.cpuStart=clock();
+		}
+		auto limit=run.start+duration_cast<steady_clock::duration>(
+			duration<double>(params.duration));
+		if(params.duration>0 && now>=limit)
+		{
+			run.finished=true;
+			run.end=limit;
+		} else {
+			BenchResult& r=run.result;
+			if(transfer.getStatus()==LIBUSB_TRANSFER_COMPLETED &&
+			   ((params.endpoint & Endpoint::IN)==0 ||
+			    checkPattern(transfer,params.pattern,run.maxPacket)))
+			{
+				r.transfers++;
+				r.bytes+=transfer.getActualLength();
+				//A transfer is made of full packets, plus a short one
+				r.packets+=max(1,(transfer.getActualLength()+run.maxPacket-1)/
+					run.maxPacket);
+				r.latencies.push_back(duration<double,micro>(
+					now-run.submitted[&transfer]).count());
+			} else r.errors++;
+			if(params.duration==0 && r.transfers+r.errors>=params.count)
+			{
+				run.finished=true;
+				run.end=now;
+			}
+		}
+	}
+	//Resubmitting after these errors would fail again immediately
+	if(transfer.getStatus()==LIBUSB_TRANSFER_STALL ||
+	   transfer.getStatus()==LIBUSB_TRANSFER_NO_DEVICE)
+	{
+		run.failure=transfer.getStatus()==LIBUSB_TRANSFER_STALL ?
+			LIBUSB_ERROR_PIPE : LIBUSB_ERROR_NO_DEVICE;
+		if(run.finished==false)
+		{
+			run.finished=true;
+			run.end=now;
+		}
+	}
+	if(run.finished) return false;
+	run.submitted[&transfer]=steady_clock::now();
+	return true;
+}
+
+/**
+ * \return bytes sent by a StreamReader, which only receives
+ */
+static unsigned long long bytesSent(StreamReader&)
+{
+	return 0;
+}
+
+/**
+ * \return bytes sent by a DuplexSession
+ */
+static unsigned long long bytesSent(DuplexSession& session)
+{
+	return session.getBytesSent();
+}
+
+/**
+ * Measure a repetition, reading from a started StreamReader or DuplexSession
+ * \param stream StreamReader or DuplexSession
+ * \param params benchmark parameters
+ * \param maxPacket wMaxPacketSize of the IN endpoint
+ * \param timeout a read that returns nothing for this long, in ms, is
+ * counted as an error
+ * \return the result, whose bytes are those received plus those sent, and
+ * whose transfers are the reads that returned data
+ */
+template<typename T>
+static BenchResult measure(T& stream, const BenchParams& params,
+	int maxPacket, unsigned int timeout)
+{
+	vector<unsigned char> data(params.transferSize);
+	BenchResult r;
+	r.transfers=0;
+	r.errors=0;
+	r.devices=1;
+	auto start=steady_clock::now()+duration_cast<steady_clock::duration>(
+		duration<double>(params.warmup));
+	auto limit=start+duration_cast<steady_clock::duration>(
+		duration<double>(params.duration));
+	auto end=start;
+	auto last=start;
+	bool measuring=false;
+	unsigned long long received=0, sent=0, overruns=0;
+	clock_t cpu=clock();
+	for(;;)
+	{
+		int result=stream.read(&data[0],data.size(),timeout);
+		auto now=steady_clock::now();
+		if(now<start) continue;
+		if(measuring==false)
+		{
+			measuring=true;
+			cpu=clock();
+			received=stream.getBytesReceived();
+			sent=bytesSent(stream);
+			overruns=stream.getOverruns();
+		}
+		if(params.duration>0 && now>=limit)
+		{
+			end=limit;
+			break;
+		}
+		if(result==0)
+		{
+			r.errors++;
+			//The device stopped sending, count can't be reached
+			if(params.duration>0) continue;
+			end=now;
+			break;
+		}
+		r.transfers++;
+		r.latencies.push_back(duration<double,micro>(now-last).count());
+		last=now;
+		if(params.duration==0 && stream.getBytesReceived()-received>=
+		   static_cast<unsigned long long>(params.count)*params.transferSize)
+		{
+			end=now;
+			break;
+		}
+	}
+	r.cpuSeconds=static_cast<double>(clock()-cpu)/CLOCKS_PER_SEC;
+	received=stream.getBytesReceived()-received;
+	r.bytes=received+bytesSent(stream)-sent;
+	r.overruns=stream.getOverruns()-overruns;
+	r.packets=(received+maxPacket-1)/maxPacket;
+	sent=r.bytes-received;
+	if(sent) r.packets+=(sent+maxPacket-1)/maxPacket;
+	r.seconds=duration<double>(end-start).count();
+	sort(r.latencies.begin(),r.latencies.end());
+	return r;
+}
+
+/**
+ * \param device USB device
+ * \param endpoint endpoint address
+ * \return wMaxPacketSize of the endpoint
+ * \throws runtime_error if the endpoint is not found
+ */
+static int maxPacketSize(Device& device, unsigned char endpoint)
+{
+	int result=libusb_get_max_packet_size(libusb_get_device(device.get()),
+		endpoint);
+	if(result<=0) throw(runtime_error("Endpoint not found"));
+	return result;
+}
+
+/**
+ * \return the ring buffer size for StreamReader and DuplexSession
+ */
+static int streamBufferSize(const BenchParams& params)
+{
+	if(params.streamBuffer>0) return params.streamBuffer;
+	return 2*params.queueDepth*params.transferSize;
+}
+
+/**
+ * Benchmark of an IN endpoint read through a StreamReader
+ * \param device USB device
+ * \param context USB context
+ * \param params benchmark parameters
+ * \param maxPacket wMaxPacketSize of the endpoint
+ * \return one result per repetition
+ */
+static vector<BenchResult> runStream(Device& device, Context& context,
+	const BenchParams& params, int maxPacket)
+{
+	if((params.endpoint & Endpoint::IN)==0)
+		throw(invalid_argument("Streaming requires an IN endpoint"));
+	unsigned int timeout=device.getTimeout() ? device.getTimeout() : 1000;
+	EventThread events(context);
+	vector<BenchResult> results;
+	for(int i=0;i<params.repetitions;i++)
+	{
+		StreamReader reader(device,params.endpoint,params.queueDepth,
+			params.transferSize,streamBufferSize(params),params.interrupt,
+			params.zeroCopy);
+		reader.start();
+		results.push_back(measure(reader,params,maxPacket,timeout));
+	}
+	return results;
+}
+
+/**
+ * Benchmark of a DuplexSession, writing to params.duplexEndpoint from a
+ * separate thread while reading params.endpoint
+ * \param device USB device
+ * \param params benchmark parameters
+ * \param maxPacket wMaxPacketSize of the IN endpoint
+ * \return one result per repetition
+ */
+static vector<BenchResult> runDuplex(Device& device, const BenchParams& params,
+	int maxPacket)
+{
+	if((params.endpoint & Endpoint::IN)==0 ||
+	   (params.duplexEndpoint & Endpoint::IN))
+		throw(invalid_argument("Duplex requires an IN and an OUT endpoint"));
+	int outMaxPacket=maxPacketSize(device,params.duplexEndpoint);
+	unsigned int timeout=device.getTimeout() ? device.getTimeout() : 1000;
+	vector<unsigned char> data(params.transferSize);
+	for(int i=0;i<params.transferSize;i++)
+		data[i]=patternByte(params.pattern,i,outMaxPacket);
+	vector<BenchResult> results;
+	for(int i=0;i<params.repetitions;i++)
+	{
+		DuplexSession session(device,params.duplexEndpoint,params.endpoint,
+			params.queueDepth,params.transferSize,streamBufferSize(params),
+			params.interrupt,params.zeroCopy);
+		session.start();
+		atomic<bool> done(false);
+		exception_ptr error;
+		thread writer([&]() {
+			try {
+				while(done==false) session.write(&data[0],data.size(),100);
+			} catch(...) {
+				if(done==false) error=current_exception();
+			}
+		});
+		BenchResult r;
+		try {
+			r=measure(session,params,maxPacket,timeout);
+		} catch(...) {
+			done=true;
+			session.stop();
+			writer.join();
+			throw;
+		}
+		done=true;
+		session.stop();
+		writer.join();
+		if(error) rethrow_exception(error);
+		results.push_back(r);
+	}
+	return results;
+}
+
+double percentile(const vector<double>& sorted, double p)
+{
+	if(sorted.empty()) return 0;
+	return sorted.at(static_cast<int>(p/100.0*(sorted.size()-1)+0.5));
+}
+
+double BenchResult::latency(double p) const
+{
+	return percentile(latencies,p);
+}
+
+/**
+ * Prepare the state of a repetition
+ * \param run state to prepare
+ * \param params benchmark parameters
+ * \param maxPacket wMaxPacketSize of the endpoint
+ * \param start when the measurement starts
+ */
+static void startRun(Run& run, const BenchParams& params, int maxPacket,
+	steady_clock::time_point start)
+{
+	run.params=&params;
+	run.maxPacket=maxPacket;
+	run.start=start;
+	run.end=start;
+	run.finished=false;
+	run.failure=0;
+	run.measuring=false;
+	run.cpuStart=clock();
+	run.submitted.clear();
+	run.result.transfers=0;
+	run.result.bytes=0;
+	run.result.packets=0;
+	run.result.errors=0;
+	run.result.overruns=0;
+	run.result.devices=1;
+	run.result.latencies.clear();
+}
+
+/**
+ * Benchmark with an AsyncEndpoint per device, all devices at the same time
+ * \param devices USB devices, with the interface of the endpoint claimed
+ * \param params benchmark parameters
+ * \return one result per repetition, summing all devices
+ */
+static vector<BenchResult> runAsync(const vector<Device*>& devices,
+	const BenchParams& params)
+{
+	//Declared before the endpoints, as completion handlers use them till
+	//the endpoints are destroyed
+	vector<unique_ptr<Run>> runs;
+	vector<unique_ptr<AsyncEndpoint>> endpoints;
+	vector<int> maxPackets;
+	for(auto device : devices)
+	{
+		int maxPacket=maxPacketSize(*device,params.endpoint);
+		maxPackets.push_back(maxPacket);
+		runs.emplace_back(new Run);
+		endpoints.emplace_back(new AsyncEndpoint(*device,params.endpoint,
+			params.queueDepth,params.transferSize,params.interrupt,
+			params.zeroCopy));
+		AsyncEndpoint& endpoint=*endpoints.back();
+		//Acquire all transfers before releasing them, else the same one
+		//would be returned every time
+		vector<Transfer*> transfers;
+		for(int i=0;i<params.queueDepth;i++)
+		{
+			transfers.push_back(endpoint.acquire());
+			for(int j=0;j<params.transferSize;j++)
+				transfers.back()->getData()[j]=
+					patternByte(params.pattern,j,maxPacket);
+		}
+		for(auto t : transfers) endpoint.release(t);
+		Run& run=*runs.back();
+		endpoint.setCompletionHandler([&run](Transfer& t) {
+			return completed(run,t);
+		});
+	}
+
+	vector<BenchResult> results;
+	for(int i=0;i<params.repetitions;i++)
+	{
+		auto start=steady_clock::now()+duration_cast<steady_clock::duration>(
+			duration<double>(params.warmup));
+		for(size_t j=0;j<runs.size();j++)
+			startRun(*runs[j],params,maxPackets[j],start);
+		for(size_t j=0;j<endpoints.size();j++)
+		{
+			//All transfers are in the pool, tryAcquire() does not handle
+			//events, which would deadlock on the lock
+			lock_guard<mutex> l(runs[j]->lock);
+			for(int k=0;k<params.queueDepth;k++)
+			{
+				if(params.duration==0 && k>=params.count) break;
+				Transfer *t=endpoints[j]->tryAcquire();
+				if(t==0) break;
+				runs[j]->submitted[t]=steady_clock::now();
+				endpoints[j]->submit(t);
+			}
+		}
+		//Wait for all transfers, also those completing after the end
+		for(auto& endpoint : endpoints) endpoint->wait();
+		BenchResult r;
+		r.transfers=0;
+		r.bytes=0;
+		r.packets=0;
+		r.errors=0;
+		r.overruns=0;
+		r.devices=0;
+		auto end=start;
+		clock_t cpuStart=clock();
+		for(auto& run : runs)
+		{
+			if(run->failure!=0)
+				throw(runtime_error(string("Transfer failed: ")+
+					libusb_error_name(run->failure)));
+			r.transfers+=run->result.transfers;
+			r.bytes+=run->result.bytes;
+			r.packets+=run->result.packets;
+			r.errors+=run->result.errors;
+			r.devices++;
+			r.latencies.insert(r.latencies.end(),
+				run->result.latencies.begin(),run->result.latencies.end());
+			end=max(end,run->end);
+			cpuStart=min(cpuStart,run->cpuStart);
+		}
+		r.cpuSeconds=static_cast<double>(clock()-cpuStart)/CLOCKS_PER_SEC;
+		r.seconds=duration<double>(end-start).count();
+		sort(r.latencies.begin(),r.latencies.end());
+		results.push_back(r);
+	}
+	return results;
+}
+
+vector<BenchResult> runBenchmark(Device& device, Context& context,
+	const BenchParams& params)
+{
+	if(params.queueDepth<=0 || params.transferSize<=0 ||
+	   params.repetitions<=0 || params.warmup<0 ||
+	   (params.duration<=0 && params.count<=0))
+		throw(invalid_argument("Wrong benchmark parameters"));
+	int maxPacket=maxPacketSize(device,params.endpoint);
+	if(params.duplexEndpoint!=0) return runDuplex(device,params,maxPacket);
+	if(params.streamBuffer>0)
+		return runStream(device,context,params,maxPacket);
+	return runAsync(vector<Device*>(1,&device),params);
+}
+
+vector<BenchResult> runBenchmark(DeviceManager& manager,
+	const BenchParams& params)
+{
+	if(params.queueDepth<=0 || params.transferSize<=0 ||
+	   params.repetitions<=0 || params.warmup<0 ||
+	   (params.duration<=0 && params.count<=0) ||
+	   params.streamBuffer!=0 || params.duplexEndpoint!=0)
+		throw(invalid_argument("Wrong benchmark parameters"));
+	if(manager.getNumDevices()==0) throw(runtime_error("No device open"));
+	vector<Device*> devices;
+	for(int i=0;i<manager.getNumDevices();i++)
+		devices.push_back(&manager.getDevice(i));
+	return runAsync(devices,params);
+}
+
+BenchResult summarize(const vector<BenchResult>& results)
+{
+	BenchResult summary;
+	summary.seconds=0;
+	summary.cpuSeconds=0;
+	summary.transfers=0;
+	summary.bytes=0;
+	summary.packets=0;
+	summary.errors=0;
+	summary.overruns=0;
+	summary.devices=0;
+	for(auto& r : results)
+	{
+		summary.devices=max(summary.devices,r.devices);
+		summary.seconds+=r.seconds;
+		summary.cpuSeconds+=r.cpuSeconds;
+		summary.transfers+=r.transfers;
+		summary.bytes+=r.bytes;
+		summary.packets+=r.packets;
+		summary.errors+=r.errors;
+		summary.overruns+=r.overruns;
+		summary.latencies.insert(summary.latencies.end(),
+			r.latencies.begin(),r.latencies.end());
+	}
+	sort(summary.latencies.begin(),summary.latencies.end());
+	return summary;
+}
+
+/**
+ * Print a result as a JSON object
+ */
+static void printJson(ostream& os, const BenchResult& r)
+{
+	os<<"{\"seconds\": "<<r.seconds<<", \"transfers\": "<<r.transfers
+	  <<", \"bytes\": "<<r.bytes<<", \"errors\": "<<r.errors
+	  <<", \"overruns\": "<<r.overruns<<", \"devices\": "<<r.devices
+	  <<", \"throughputKBps\": "<<r.throughput()
+	  <<", \"packetsPerFrame\": "<<r.packetsPerFrame()
+	  <<", \"cpuUsPerMB\": "<<r.cpuPerMegabyte()
+	  <<", \"latencyUs\": {\"p50\": "<<r.latency(50)
+	  <<", \"p90\": "<<r.latency(90)<<", \"p99\": "<<r.latency(99)
+	  <<", \"max\": "<<r.latency(100)<<"}}";
+}
+
+/**
+ * Print a result as a CSV line, after the given label
+ */
+static void printCsv(ostream& os, const string& label, const BenchResult& r)
+{
+	os<<label<<","<<r.seconds<<","<<r.transfers<<","<<r.bytes<<","
+	  <<r.errors<<","<<r.overruns<<","<<r.throughput()<<","
+	  <<r.packetsPerFrame()<<","<<r.cpuPerMegabyte()<<","
+	  <<r.latency(50)<<","<<r.latency(90)<<","<<r.latency(99)<<","
+	  <<r.latency(100)<<","<<r.devices<<endl;
+}
+
+/**
+ * Print a result in human readable form, after the given label
+ */
+static void printText(ostream& os, const string& label, const BenchResult& r)
+{
+	ios::fmtflags flags=os.flags();
+	streamsize precision=os.precision();
+	os<<" "<<label<<fixed<<setprecision(1)<<": "<<r.throughput()<<"KB/s "
+	  <<r.packetsPerFrame()<<" packets/frame, latency (us) p50="
+	  <<r.latency(50)<<" p90="<<r.latency(90)<<" p99="<<r.latency(99)
+	  <<" max="<<r.latency(100);
+	if(r.errors) os<<" errors="<<r.errors;
+	if(r.overruns) os<<" overruns="<<r.overruns;
+	if(r.devices>1) os<<" devices="<<r.devices;
+	os<<" cpu="<<r.cpuPerMegabyte()<<"us/MB";
+	os<<endl;
+	os.flags(flags);
+	os.precision(precision);
+}
+
+void printResults(ostream& os, const BenchParams& params,
+	const vector<BenchResult>& results, BenchFormat format)
+{
+	BenchResult summary=summarize(results);
+	switch(format)
+	{
+		case JSON:
+			os<<"{\"endpoint\": "<<static_cast<int>(params.endpoint)
+			  <<", \"type\": \""<<(params.interrupt ? "interrupt" : "bulk")
+			  <<"\", \"queueDepth\": "<<params.queueDepth
+			  <<", \"transferSize\": "<<params.transferSize
+			  <<", \"duration\": "<<params.duration
+			  <<", \"count\": "<<params.count
+			  <<", \"warmup\": "<<params.warmup
+			  <<", \"streamBuffer\": "<<params.streamBuffer
+			  <<", \"duplexEndpoint\": "<<static_cast<int>(params.duplexEndpoint)
+			  <<", \"zeroCopy\": "<<(params.zeroCopy ? "true" : "false")
+			  <<","<<endl
+			  <<" \"repetitions\": ["<<endl;
+			for(size_t i=0;i<results.size();i++)
+			{
+				os<<"  ";
+				printJson(os,results[i]);
+				os<<(i+1<results.size() ? "," : "")<<endl;
+			}
+			os<<" ],"<<endl<<" \"summary\": ";
+			printJson(os,summary);
+			os<<endl<<"}"<<endl;
+			break;
+		case CSV:
+			os<<"repetition,seconds,transfers,bytes,errors,overruns,"
+			    "throughputKBps,packetsPerFrame,cpuUsPerMB,p50Us,p90Us,p99Us,"
+			    "maxUs,devices"<<endl;
+			for(size_t i=0;i<results.size();i++)
+				printCsv(os,to_string(i+1),results[i]);
+			printCsv(os,"summary",summary);
+			break;
+		default:
+			os<<"Endpoint 0x"<<hex<<static_cast<int>(params.endpoint)<<dec
+			  <<(params.interrupt ? " interrupt" : " bulk")
+			  <<", queue depth "<<params.queueDepth
+			  <<", transfer size "<<params.transferSize<<endl;
+			if(results.size()>1)
+				for(size_t i=0;i<results.size();i++)
+					printText(os,"Repetition "+to_string(i+1),results[i]);
+			printText(os,"Summary",summary);
+			break;
+	}
+}
@@ -0,0 +1,190 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Throughput and latency benchmark of an endpoint, with a configurable
+ * number of transfers in flight. Shared by usbbench and the testsuite.
+ */
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include "libusbwrapper.h"
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+/**
+ * Data patterns, same values as the pattern parameter of usbtest and of the
+ * benchmark function of mxusb
+ */
+enum BenchPattern
+{
+	ZEROS=0, ///< All bytes zero
+	MOD63=1, ///< Byte i of each packet is i % 63
+	NONE=2   ///< IN data is not checked, OUT data is MOD63
+};
+
+/**
+ * Benchmark parameters
+ */
+struct BenchParams
+{
+	BenchParams() : endpoint(0x82), interrupt(false), queueDepth(19),
+		transferSize(64), duration(0), count(19000), warmup(0),
+		repetitions(1), streamBuffer(0), duplexEndpoint(0), zeroCopy(true),
+		pattern(NONE) {}
+
+	unsigned char endpoint; ///< Endpoint address, direction included
+	bool interrupt;         ///< True for interrupt endpoints, else bulk
+	int queueDepth;         ///< Transfers in flight
+	int transferSize;       ///< Bytes per transfer
+	double duration;        ///< Seconds per repetition, if zero use count
+	int count;              ///< Transfers per repetition, if duration is 0
+	double warmup;          ///< Unmeasured seconds at start of each
+	int repetitions;        ///< Number of measurements
+	int streamBuffer;       ///< If not 0, read IN endpoints with a
+	                        ///< StreamReader with this ring buffer size
+	unsigned char duplexEndpoint; ///< If not 0, an OUT endpoint written
+	                        ///< while reading endpoint, with a DuplexSession
+	bool zeroCopy;          ///< Try to use buffers shared with the kernel
+	BenchPattern pattern;   ///< Pattern of the data sent to OUT endpoints,
+	                        ///< IN data not matching it counts as an error
+};
+
+/**
+ * \param sorted sorted values
+ * \param p percentile, from 0 to 100
+ * \return the given percentile of the values, zero if there are none
+ */
+double percentile(const std::vector<double>& sorted, double p);
+
+/**
+ * Result of one repetition
+ */
+struct BenchResult
+{
+	double seconds;            ///< Measurement time
+	double cpuSeconds;         ///< Process CPU time, all threads included
+	long long transfers;       ///< Transfers completed successfully
+	long long bytes;           ///< Bytes transferred
+	long long packets;         ///< Packets, from bytes and wMaxPacketSize
+	int errors;                ///< Transfers that failed, timed out or did
+	                           ///< not match the pattern
+	long long overruns;        ///< Times the StreamReader ring buffer was full
+	int devices;               ///< Devices measured at the same time
+	std::vector<double> latencies; ///< Submit to completion, in us, sorted
+
+	/**
+	 * \return throughput in KB/s
+	 */
+	double throughput() const
+	{
+		return seconds>0 ? bytes/1024.0/seconds : 0;
+	}
+
+	/**
+	 * \return average packets per 1ms frame
+	 */
+	double packetsPerFrame() const
+	{
+		return seconds>0 ? packets/(seconds*1000.0) : 0;
+	}
+
+	/**
+	 * \return process CPU time per MB transferred, in us
+	 */
+	double cpuPerMegabyte() const
+	{
+		return bytes>0 ? cpuSeconds*1e6/(bytes/1048576.0) : 0;
+	}
+
+	/**
+	 * \param p percentile, from 0 to 100
+	 * \return the latency percentile in us, zero if no transfer completed
+	 */
+	double latency(double p) const;
+};
+
+/**
+ * Run a benchmark. Data sent to OUT endpoints follows params.pattern, so
+ * that the benchmark function of mxusb can check it, and so does data read
+ * from IN endpoints, except when read through a StreamReader or
+ * DuplexSession, that don't preserve packet boundaries.
+ * If params.streamBuffer is not 0, data is read through a StreamReader, and
+ * latencies are the time between reads that returned data. If
+ * params.duplexEndpoint is not 0, data is also written to it through a
+ * DuplexSession, and bytes are the sum of both directions
+ * \param device USB device, with the interface of the endpoint claimed
+ * \param context USB context
+ * \param params benchmark parameters
+ * \return one result per repetition
+ */
+std::vector<BenchResult> runBenchmark(libusb::Device& device,
+	libusb::Context& context, const BenchParams& params);
+
+/**
+ * Run a benchmark on all the devices of a DeviceManager at the same time,
+ * with an AsyncEndpoint per device, to measure how throughput scales with
+ * the number of devices and of event threads. Each device transfers
+ * params.count transfers, or for params.duration seconds. Streaming and
+ * duplex are not supported
+ * \param manager devices, with the interface of the endpoint claimed
+ * \param params benchmark parameters
+ * \return one result per repetition, the sum of all devices
+ */
+std::vector<BenchResult> runBenchmark(libusb::DeviceManager& manager,
+	const BenchParams& params);
+
+/**
+ * Merge the results of the repetitions
+ * \param results results of the repetitions
+ * \return the result of all the repetitions, as if they were a single one
+ */
+BenchResult summarize(const std::vector<BenchResult>& results);
+
+/**
+ * Output formats
+ */
+enum BenchFormat
+{
+	TEXT, ///< Human readable
+	JSON, ///< A JSON object, that can be used as a baseline
+	CSV   ///< One line per repetition, and a summary line
+};
+
+/**
+ * Print benchmark results
+ * \param os stream where to print
+ * \param params benchmark parameters
+ * \param results one result per repetition
+ * \param format output format
+ */
+void printResults(std::ostream& os, const BenchParams& params,
+	const std::vector<BenchResult>& results, BenchFormat format);
+
+#endif //BENCHMARK_H
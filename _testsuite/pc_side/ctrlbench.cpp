@@ -0,0 +1,100 @@
+/***************************************************************************
+ *   Copyright (C) 2011-2024 by Terraneo Federico                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Control transfer benchmark, to be used with the device side of the
+ * testsuite. It issues short vendor requests on endpoint zero back to back
+ * and reports the number of control transfers per second, and latency
+ * percentiles of individual requests.
+ * Usage: ctrlbench [num requests] [wLength]
+ * with wLength from 0 to 64. If zero, OUT requests without data stage are
+ * used, otherwise IN requests with a wLength bytes data stage.
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include <stdexcept>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include "libusbwrapper.h"
+#include "benchmark.h"
+
+using namespace std;
+using namespace std::chrono;
+using namespace libusb;
+
+int main(int argc, char *argv[])
+{
+	int numRequests=10000;
+	int wLength=0;
+	if(argc>1) numRequests=atoi(argv[1]);
+	if(argc>2) wLength=atoi(argv[2]);
+	if(numRequests<=0 || wLength<0 || wLength>64)
+	{
+		cerr<<"Usage: ctrlbench [num requests] [wLength 0..64]"<<endl;
+		return 1;
+	}
+
+	try {
+		Context context;
+		Device device(context,0xdead,0xbeef);
+		if(device.getConfiguration()!=1) device.setConfiguration(1);
+		device.setTimeout(1000); //1s
+		device.claimInterface(0);
+
+		unsigned char data[64];
+		const unsigned char bmRequestType= wLength>0 ? 0xc0 : 0x40;
+		vector<double> latencies;
+		latencies.reserve(numRequests);
+		auto t1=steady_clock::now();
+		for(int i=0;i<numRequests;i++)
+		{
+			auto start=steady_clock::now();
+			int result=device.controlTransfer(bmRequestType,3,0,0,
+				wLength>0 ? data : 0,wLength);
+			auto end=steady_clock::now();
+			if(result!=wLength) throw(runtime_error("Short transfer"));
+			latencies.push_back(duration<double,micro>(end-start).count());
+		}
+		auto t2=steady_clock::now();
+		double time=duration<double>(t2-t1).count();
+
+		sort(latencies.begin(),latencies.end());
+		cout<<"Requests="<<numRequests<<" wLength="<<wLength<<endl;
+		cout<<" Transfers per second="<<static_cast<int>(numRequests/time)<<endl;
+		cout<<" Latency (us) p50="<<percentile(latencies,50)
+		    <<" p90="<<percentile(latencies,90)
+		    <<" p99="<<percentile(latencies,99)
+		    <<" max="<<latencies.back()<<endl;
+	} catch(exception& e)
+	{
+		cout<<"Exception:"<<e.what()<<endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,254 @@
+/***************************************************************************
+ *   Copyright (C) 2011-2024 by Terraneo Federico                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Enumeration benchmark, to be used with the device side of the testsuite,
+ * built with MXUSB_ENABLE_DIAG_REQUEST defined in usb_config.h.
+ * It makes the device enumerate again, then reads the enumeration log
+ * recorded by the device, and checks the time taken by each request against
+ * the limits in chapter 9 of the USB specification.
+ * Usage: enumbench [iterations] [reset|replug]
+ * - reset: the host resets the device, and the kernel enumerates it again.
+ *   Times are relative to when the log was cleared, just before the reset.
+ * - replug: the device disconnects and connects again, as when it is
+ *   plugged in. Times are relative to the device connecting to the bus.
+ *   Requires the device to be in configuration 1.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "libusbwrapper.h"
+
+using namespace std;
+using namespace std::chrono;
+using namespace libusb;
+
+//These constants must match with enum_log.h and def_ctrl_pipe.h
+static const unsigned char DIAG_REQUEST=0xfe;
+static const unsigned char LOG_VERSION=1;
+static const unsigned char CONNECT=0xfe;
+static const unsigned char RESET=0xff;
+static const unsigned char GET_DESCRIPTOR=6;
+static const unsigned char SET_ADDRESS=5;
+static const unsigned char SET_CONFIGURATION=9;
+static const int HEADER_SIZE=4;
+static const int ENTRY_SIZE=16;
+static const int MAX_ENTRIES=16;
+
+/**
+ * An entry of the enumeration log, all times are in microseconds
+ */
+struct Entry
+{
+	unsigned char event;
+	unsigned short wValue;
+	unsigned int start;
+	unsigned int ready;
+	unsigned int end;
+};
+
+static unsigned short toShort(const unsigned char *p)
+{
+	return p[0] | p[1]<<8;
+}
+
+static unsigned int toInt(const unsigned char *p)
+{
+	return p[0] | p[1]<<8 | p[2]<<16 | p[3]<<24;
+}
+
+/**
+ * Open the device, retrying till it appears on the bus
+ * \param device device to open
+ * \param timeout max time to wait
+ */
+static void openWithRetry(Device& device, milliseconds timeout)
+{
+	auto deadline=steady_clock::now()+timeout;
+	for(;;)
+	{
+		try {
+			device.open(0xdead,0xbeef);
+			return;
+		} catch(runtime_error&)
+		{
+			if(steady_clock::now()>deadline) throw;
+			this_thread::sleep_for(10ms);
+		}
+	}
+}
+
+/**
+ * Read the enumeration log from the device
+ * \param device USB device
+ * \return the log entries
+ */
+static vector<Entry> readLog(Device& device)
+{
+	unsigned char data[HEADER_SIZE+MAX_ENTRIES*ENTRY_SIZE];
+	int size=device.controlTransfer(0xc0,DIAG_REQUEST,0,0,data,sizeof(data));
+	if(size<HEADER_SIZE || data[0]!=LOG_VERSION)
+		throw(runtime_error("Unsupported enumeration log format"));
+	if(data[2]!=0) cout<<" Warning: "<<(int)data[2]<<" entries dropped"<<endl;
+	vector<Entry> result;
+	for(int i=0;i<data[1] && HEADER_SIZE+(i+1)*ENTRY_SIZE<=size;i++)
+	{
+		const unsigned char *p=data+HEADER_SIZE+i*ENTRY_SIZE;
+		Entry e;
+		e.event=p[0];
+		e.wValue=toShort(p+2);
+		e.start=toInt(p+4);
+		e.ready=toInt(p+8);
+		e.end=toInt(p+12);
+		result.push_back(e);
+	}
+	return result;
+}
+
+/**
+ * Print the log and check it against the timing limits of the USB spec
+ * \param log log entries
+ * \return time to configured in microseconds, or 0 if the device was not
+ * configured. Throws if a limit is exceeded
+ */
+static unsigned int checkLog(const vector<Entry>& log)
+{
+	unsigned int configured=0;
+	bool violation=false;
+	for(const Entry& e : log)
+	{
+		cout<<" "<<setw(9)<<e.start<<"us ";
+		//Device side response time, and time to the end of the status stage
+		unsigned int response=e.ready-e.start;
+		unsigned int total= e.end!=0 ? e.end-e.start : 0;
+		unsigned int limit=0;
+		switch(e.event)
+		{
+			case CONNECT:
+				cout<<"CONNECT"<<endl;
+				continue;
+			case RESET:
+				cout<<"RESET"<<endl;
+				continue;
+			case SET_ADDRESS:
+				cout<<"SET_ADDRESS "<<(e.wValue & 0xff);
+				limit=50000; //50ms, no data stage
+				break;
+			case GET_DESCRIPTOR:
+				cout<<"GET_DESCRIPTOR type="<<(e.wValue>>8)
+				    <<" index="<<(e.wValue & 0xff);
+				limit=500000; //500ms to the first data packet
+				break;
+			case SET_CONFIGURATION:
+				cout<<"SET_CONFIGURATION "<<(e.wValue & 0xff);
+				limit=50000; //50ms, no data stage
+				if(e.end!=0) configured=e.end;
+				break;
+			default:
+				cout<<"bRequest="<<(int)e.event<<endl;
+				continue;
+		}
+		cout<<" response="<<response<<"us";
+		if(e.end!=0) cout<<" completed="<<total<<"us"<<endl;
+		else cout<<" not completed"<<endl;
+		if(response>limit)
+		{
+			cout<<" ** exceeds the "<<limit/1000<<"ms limit"<<endl;
+			violation=true;
+		}
+	}
+	if(violation) throw(runtime_error("Chapter 9 timing limits exceeded"));
+	return configured;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations=10;
+	bool replug=false;
+	if(argc>1) iterations=atoi(argv[1]);
+	if(argc>2) replug=strcmp(argv[2],"replug")==0;
+	if(iterations<=0 || (argc>2 && !replug && strcmp(argv[2],"reset")!=0))
+	{
+		cerr<<"Usage: enumbench [iterations] [reset|replug]"<<endl;
+		return 1;
+	}
+
+	try {
+		Context context;
+		Device device(context,0xdead,0xbeef);
+		if(device.getConfiguration()!=1) device.setConfiguration(1);
+		device.setTimeout(5000); //5s
+		vector<unsigned int> times;
+		for(int i=0;i<iterations;i++)
+		{
+			cout<<"Iteration "<<i+1<<endl;
+			if(replug)
+			{
+				unsigned char disconnectRequest[1]={0xaa};
+				device.claimInterface(0);
+				//When the device sees this, it will disconnect for two seconds
+				device.interruptTransfer(1 | Endpoint::OUT,disconnectRequest,1);
+				device.close();
+				this_thread::sleep_for(1s);
+				openWithRetry(device,10s);
+			} else {
+				device.controlTransfer(0x40,DIAG_REQUEST,0,0,0,0);
+				try {
+					device.reset();
+				} catch(runtime_error&)
+				{
+					//Reset may invalidate the handle, reopen the device
+					openWithRetry(device,10s);
+				}
+			}
+			//The kernel sets the configuration after the device reappears
+			if(device.getConfiguration()!=1) device.setConfiguration(1);
+			unsigned int configured=checkLog(readLog(device));
+			if(configured==0) throw(runtime_error("Device not configured"));
+			cout<<" Time to configured="<<configured/1000.0<<"ms"<<endl;
+			times.push_back(configured);
+		}
+		sort(times.begin(),times.end());
+		unsigned long long sum=0;
+		for(unsigned int t : times) sum+=t;
+		cout<<"Time to configured (ms) min="<<times.front()/1000.0
+		    <<" avg="<<sum/times.size()/1000.0
+		    <<" max="<<times.back()/1000.0<<endl;
+	} catch(exception& e)
+	{
+		cout<<"Exception:"<<e.what()<<endl;
+		return 1;
+	}
+	return 0;
+}
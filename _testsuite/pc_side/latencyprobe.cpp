@@ -0,0 +1,351 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Latency probe, to be used with the device side of the testsuite, which
+ * answers the LatencyProbe protocol in configuration 3. See latency_probe.h
+ * for the protocol.
+ * It first sends ECHO requests to measure round trip time and to estimate
+ * the offset and drift between the device cycle counter and the host clock,
+ * then it splits each round trip into its OUT and IN one-way latencies.
+ * The split assumes that the fastest round trips are symmetric, so one-way
+ * latencies are uncertain by up to half the minimum round trip.
+ * Then it sends a STREAM request and, for each packet, it tells apart the
+ * time spent in the device buffer waiting for the host to read it, from the
+ * time taken by the host to deliver it to this program.
+ * Usage: latencyprobe [int|bulk] [num packets]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include "libusbwrapper.h"
+#include "benchmark.h"
+
+using namespace std;
+using namespace std::chrono;
+using namespace libusb;
+
+//These constants must match with latency_probe.h
+static const unsigned short ECHO=0;
+static const unsigned short STREAM=1;
+static const int REQUEST_SIZE=8;
+static const int PACKET_SIZE=24;
+
+/**
+ * A packet received from the device, with the times when the request was
+ * sent and the packet received, in seconds since the start of the program.
+ * Device times are in cycles, unwrapped to 64 bit
+ */
+struct Sample
+{
+	unsigned int sequence;
+	int64_t rxCycles;
+	int64_t txCycles;
+	int64_t lastCycles;
+	unsigned short txFrame;
+	unsigned short lastFrame;
+	double sent;
+	double received;
+};
+
+static unsigned short toShort(const unsigned char *p)
+{
+	return p[0] | p[1]<<8;
+}
+
+static unsigned int toInt(const unsigned char *p)
+{
+	return p[0] | p[1]<<8 | p[2]<<16 | p[3]<<24;
+}
+
+static void fromInt(unsigned char *p, unsigned int x)
+{
+	for(int i=0;i<4;i++) p[i]=x>>(8*i);
+}
+
+/**
+ * Talks to a LatencyProbe on the device
+ */
+class Probe
+{
+public:
+	/**
+	 * \param device USB device, in configuration 3
+	 * \param bulk true to use the bulk probe, false for the interrupt one
+	 */
+	Probe(Device& device, bool bulk) : device(device), bulk(bulk),
+		outEp(bulk ? 0x02 : 0x01), inEp(bulk ? 0x83 : 0x81),
+		start(steady_clock::now()), last(0), cyclesPerSecond(0) {}
+
+	/**
+	 * Send a request
+	 * \param sequence sequence number of the first reply
+	 * \param command ECHO or STREAM
+	 * \param count number of packets for STREAM
+	 * \return the time when the request was sent
+	 */
+	double request(unsigned int sequence, unsigned short command,
+		unsigned short count)
+	{
+		unsigned char data[REQUEST_SIZE];
+		fromInt(data,sequence);
+		data[4]=command;
+		data[5]=command>>8;
+		data[6]=count;
+		data[7]=count>>8;
+		double result=now();
+		if(transfer(outEp,data,REQUEST_SIZE)!=REQUEST_SIZE)
+			throw(runtime_error("Short write"));
+		return result;
+	}
+
+	/**
+	 * Receive a packet, discarding stale packets of previous requests
+	 * \param sequence expected sequence number
+	 * \param sent when the request was sent
+	 * \return the packet
+	 */
+	Sample receive(unsigned int sequence, double sent)
+	{
+		for(;;)
+		{
+			unsigned char data[64];
+			int size=transfer(inEp,data,sizeof(data));
+			double received=now();
+			if(size!=PACKET_SIZE) throw(runtime_error("Wrong packet size"));
+			if(toInt(data)!=sequence) continue;
+			cyclesPerSecond=toShort(data+20)*1e6;
+			Sample s;
+			s.sequence=sequence;
+			s.rxCycles=unwrap(toInt(data+4));
+			s.txCycles=unwrap(toInt(data+8));
+			s.lastCycles=unwrap(toInt(data+12));
+			s.txFrame=toShort(data+16);
+			s.lastFrame=toShort(data+18);
+			s.sent=sent;
+			s.received=received;
+			return s;
+		}
+	}
+
+	/**
+	 * \param cycles a number of device cycles
+	 * \return the same time in seconds
+	 */
+	double toSeconds(int64_t cycles) const { return cycles/cyclesPerSecond; }
+
+private:
+	double now() const
+	{
+		return duration<double>(steady_clock::now()-start).count();
+	}
+
+	int transfer(unsigned char endpoint, unsigned char *data, int size)
+	{
+		if(bulk) return device.bulkTransfer(endpoint,data,size);
+		return device.interruptTransfer(endpoint,data,size);
+	}
+
+	/**
+	 * Extend a 32 bit cycle counter value to 64 bit, assuming it is within
+	 * half the wraparound period of the previous one
+	 */
+	int64_t unwrap(unsigned int cycles)
+	{
+		last+=static_cast<int32_t>(cycles-static_cast<unsigned int>(last));
+		return last;
+	}
+
+	Device& device;
+	bool bulk;
+	unsigned char outEp, inEp;
+	steady_clock::time_point start;
+	int64_t last;
+	double cyclesPerSecond;
+};
+
+/**
+ * Device to host clock offset, modeled as offset+drift*t
+ */
+struct ClockModel
+{
+	double offset;
+	double drift;
+
+	double at(double t) const { return offset+drift*t; }
+};
+
+/**
+ * Estimate the clock model from ECHO samples. The round trips are split in
+ * windows, and the fastest of each window is assumed to be symmetric.
+ * \param samples ECHO samples
+ * \param probe the probe, to convert cycles to seconds
+ * \return the clock model
+ */
+static ClockModel fitClock(const vector<Sample>& samples, const Probe& probe)
+{
+	const size_t windowSize=max<size_t>(samples.size()/10,1);
+	vector<double> x, y;
+	for(size_t i=0;i<samples.size();i+=windowSize)
+	{
+		size_t best=i;
+		double bestDelay=1e9;
+		for(size_t j=i;j<min(i+windowSize,samples.size());j++)
+		{
+			const Sample& s=samples[j];
+			double delay=(s.received-s.sent)-
+				probe.toSeconds(s.txCycles-s.rxCycles);
+			if(delay<bestDelay) { bestDelay=delay; best=j; }
+		}
+		const Sample& s=samples[best];
+		x.push_back((s.sent+s.received)/2);
+		y.push_back((s.sent+s.received)/2-
+			probe.toSeconds(s.rxCycles+s.txCycles)/2);
+	}
+	//Least squares fit
+	ClockModel result={y.front(),0};
+	if(x.size()<2) return result;
+	double mx=0, my=0;
+	for(size_t i=0;i<x.size();i++) { mx+=x[i]; my+=y[i]; }
+	mx/=x.size();
+	my/=y.size();
+	double sxy=0, sxx=0;
+	for(size_t i=0;i<x.size();i++)
+	{
+		sxy+=(x[i]-mx)*(y[i]-my);
+		sxx+=(x[i]-mx)*(x[i]-mx);
+	}
+	result.drift= sxx>0 ? sxy/sxx : 0;
+	result.offset=my-result.drift*mx;
+	return result;
+}
+
+/**
+ * Print the distribution of a set of values
+ * \param name what was measured
+ * \param values the values
+ * \param scale multiplied to the values before printing, by default it
+ * converts seconds to microseconds
+ */
+static void print(const string& name, vector<double> values, double scale=1e6)
+{
+	if(values.empty()) return;
+	sort(values.begin(),values.end());
+	auto p=[&values,scale](double x) { return percentile(values,x)*scale; };
+	cout<<" "<<left<<setw(22)<<name<<right<<fixed<<setprecision(0)
+	    <<" min="<<setw(6)<<p(0)<<" p50="<<setw(6)<<p(50)
+	    <<" p90="<<setw(6)<<p(90)<<" p99="<<setw(6)<<p(99)
+	    <<" max="<<setw(6)<<p(100)<<endl;
+}
+
+int main(int argc, char *argv[])
+{
+	bool bulk=false;
+	int numPackets=1000;
+	if(argc>1) bulk=strcmp(argv[1],"bulk")==0;
+	if(argc>2) numPackets=atoi(argv[2]);
+	if((argc>1 && bulk==false && strcmp(argv[1],"int")!=0) ||
+	   numPackets<2 || numPackets>65535)
+	{
+		cerr<<"Usage: latencyprobe [int|bulk] [num packets 2..65535]"<<endl;
+		return 1;
+	}
+
+	try {
+		Context context;
+		Device device(context,0xdead,0xbeef);
+		if(device.getConfiguration()!=3) device.setConfiguration(3);
+		device.setTimeout(1000); //1s
+		device.claimInterface(0);
+		Probe probe(device,bulk);
+
+		unsigned int sequence=0;
+		vector<Sample> echo;
+		for(int i=0;i<numPackets;i++,sequence++)
+		{
+			double sent=probe.request(sequence,ECHO,0);
+			echo.push_back(probe.receive(sequence,sent));
+		}
+
+		double stream=probe.request(sequence,STREAM,numPackets);
+		vector<Sample> packets;
+		for(int i=0;i<numPackets;i++,sequence++)
+			packets.push_back(probe.receive(sequence,stream));
+
+		ClockModel clock=fitClock(echo,probe);
+		cout<<(bulk ? "Bulk" : "Interrupt")<<" endpoints, latencies in us"<<endl
+		    <<" Clock drift="<<setprecision(1)<<fixed<<clock.drift*1e6
+		    <<"ppm"<<endl;
+
+		vector<double> roundTrip, turnaround, out, in;
+		for(auto& s : echo)
+		{
+			double offset=clock.at(s.received);
+			roundTrip.push_back(s.received-s.sent);
+			turnaround.push_back(probe.toSeconds(s.txCycles-s.rxCycles));
+			out.push_back(probe.toSeconds(s.rxCycles)+offset-s.sent);
+			in.push_back(s.received-(probe.toSeconds(s.txCycles)+offset));
+		}
+		cout<<"ECHO"<<endl;
+		print("Round trip",roundTrip);
+		print("Host to device",out);
+		print("Device turnaround",turnaround);
+		print("Device to host",in);
+
+		//The time when the host read a packet is in the next packet
+		vector<double> waiting, delivery, total, frames;
+		for(size_t i=0;i+1<packets.size();i++)
+		{
+			const Sample& s=packets[i];
+			const Sample& next=packets[i+1];
+			double offset=clock.at(s.received);
+			waiting.push_back(probe.toSeconds(next.lastCycles-s.txCycles));
+			delivery.push_back(s.received-
+				(probe.toSeconds(next.lastCycles)+offset));
+			total.push_back(s.received-(probe.toSeconds(s.txCycles)+offset));
+			//Frame numbers wrap around at 2048
+			frames.push_back((next.lastFrame-s.txFrame) & 0x7ff);
+		}
+		cout<<"STREAM"<<endl;
+		print("Waiting in device",waiting);
+		print("Host delivery",delivery);
+		print("Device to host",total);
+		print("Frames waited",frames,1);
+	} catch(exception& e)
+	{
+		cout<<"Exception:"<<e.what()<<endl;
+		return 1;
+	}
+	return 0;
+}
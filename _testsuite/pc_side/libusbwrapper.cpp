@@ -27,6 +27,10 @@
 
 #include "libusbwrapper.h"
 #include <sstream>
+#include <new>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
 
 namespace libusb {
 
@@ -45,6 +49,125 @@ Context::Context()
 	}
 }
 
+//
+// Device enumeration
+//
+
+/**
+ * RAII style class to prevent forgetting about calling
+ * libusb_free_device_list if an exception is thrown.
+ */
+class DeviceList
+{
+public:
+	/**
+	 * Constructor, gets the list of devices attached to the host
+	 * \param context libusb context
+	 * \throws runtime_error in case of errors
+	 */
+	explicit DeviceList(Context& context) : list(0), size(0)
+	{
+		ssize_t result=libusb_get_device_list(context.get(),&list);
+		if(result<0)
+		{
+			std::stringstream ss;
+			ss<<"libusb_get_device_list: "<<result;
+			throw(std::runtime_error(ss.str()));
+		}
+		size=result;
+	}
+
+	/**
+	 * \return the number of devices
+	 */
+	int getSize() const { return size; }
+
+	/**
+	 * \param i device index
+	 * \return the device
+	 */
+	libusb_device *operator[] (int i) const { return list[i]; }
+
+	/**
+	 * Destructor, frees the list
+	 */
+	~DeviceList() { libusb_free_device_list(list,1); }
+
+private:
+	//Non copyiable
+	DeviceList(const DeviceList& );
+	DeviceList& operator= (const DeviceList& );
+
+	libusb_device **list; ///< The list
+	int size;             ///< Number of devices
+};
+
+/**
+ * Fill a DeviceInfo, except the serial number
+ * \param dev device
+ * \param desc its device descriptor
+ * \return the device info
+ */
+static DeviceInfo deviceInfo(libusb_device *dev,
+		const libusb_device_descriptor& desc)
+{
+	DeviceInfo result;
+	result.vid=desc.idVendor;
+	result.pid=desc.idProduct;
+	result.bus=libusb_get_bus_number(dev);
+	result.address=libusb_get_device_address(dev);
+	std::stringstream ss;
+	ss<<result.bus;
+	#if LIBUSB_API_VERSION >= 0x01000102
+	//USB 3.0 allows at most 7 tiers of hubs
+	uint8_t ports[7];
+	int numPorts=libusb_get_port_numbers(dev,ports,sizeof(ports));
+	for(int i=0;i<numPorts;i++) ss<<(i==0 ? '-' : '.')<<int(ports[i]);
+	#endif //LIBUSB_API_VERSION
+	result.portPath=ss.str();
+	return result;
+}
+
+/**
+ * \param dev device
+ * \param desc its device descriptor
+ * \return the serial number string, or an empty string if the device has
+ * none or it can't be opened, for example because of permissions
+ */
+static std::string serialNumber(libusb_device *dev,
+		const libusb_device_descriptor& desc)
+{
+	if(desc.iSerialNumber==0) return "";
+	libusb_device_handle *handle;
+	if(libusb_open(dev,&handle)!=0) return "";
+	unsigned char serial[256];
+	int length=libusb_get_string_descriptor_ascii(handle,desc.iSerialNumber,
+		serial,sizeof(serial));
+	libusb_close(handle);
+	if(length<=0) return "";
+	return std::string(reinterpret_cast<char*>(serial),length);
+}
+
+std::vector<DeviceInfo> findDevices(Context& context, unsigned short vid,
+		unsigned short pid, const std::string& serial,
+		const std::string& portPath)
+{
+	std::vector<DeviceInfo> result;
+	DeviceList list(context);
+	for(int i=0;i<list.getSize();i++)
+	{
+		libusb_device_descriptor desc;
+		if(libusb_get_device_descriptor(list[i],&desc)!=0) continue;
+		if(desc.idVendor!=vid || desc.idProduct!=pid) continue;
+		DeviceInfo info=deviceInfo(list[i],desc);
+		if(portPath.empty()==false && info.portPath!=portPath) continue;
+		info.serial=serialNumber(list[i],desc);
+		if(serial.empty()==false && info.serial!=serial) continue;
+		result.push_back(info);
+	}
+	return result;
+}
+
 //
 // class Device
 //
@@ -52,8 +175,17 @@ Context::Context()
 void Device::open(unsigned short vid, unsigned short pid)
 {
 	if(handle!=0) close();
-	//FIXME: use libusb_get_device_list instead?
-	handle=libusb_open_device_with_vid_pid(context.get(),vid,pid);
+	{
+		DeviceList list(context);
+		for(int i=0;i<list.getSize();i++)
+		{
+			libusb_device_descriptor desc;
+			if(libusb_get_device_descriptor(list[i],&desc)!=0) continue;
+			if(desc.idVendor!=vid || desc.idProduct!=pid) continue;
+			if(libusb_open(list[i],&handle)!=0) handle=0;
+			break;
+		}
+	}
 	if(handle==0)
 	{
 		std::stringstream ss;
@@ -64,6 +196,39 @@ void Device::open(unsigned short vid, unsigned short pid)
 	if(error!=0) throwRuntimeError("libusb_get_configuration",error);
 }
 
+void Device::open(const DeviceInfo& info)
+{
+	if(handle!=0) close();
+	{
+		//Look the device up again, as info may come from another context
+		DeviceList list(context);
+		for(int i=0;i<list.getSize();i++)
+		{
+			if(libusb_get_bus_number(list[i])!=info.bus ||
+			   libusb_get_device_address(list[i])!=info.address) continue;
+			libusb_device_descriptor desc;
+			if(libusb_get_device_descriptor(list[i],&desc)!=0) continue;
+			if(desc.idVendor!=info.vid || desc.idProduct!=info.pid) continue;
+			int error=libusb_open(list[i],&handle);
+			if(error!=0)
+			{
+				handle=0;
+				throwRuntimeError("libusb_open",error);
+			}
+			break;
+		}
+	}
+	if(handle==0)
+	{
+		std::stringstream ss;
+		ss<<"open(): Could not find "<<std::hex<<info.vid<<":"<<info.pid
+		  <<std::dec<<" at "<<info.portPath;
+		throw(std::runtime_error(ss.str()));
+	}
+	int error=libusb_get_configuration(handle,&configuration);
+	if(error!=0) throwRuntimeError("libusb_get_configuration",error);
+}
+
 void Device::setConfiguration(unsigned int config)
 {
 	if(handle==0) throw(std::logic_error("Not open"));
@@ -229,4 +394,632 @@ bool Device::releaseAllInterfaces()
 	return error;
 }
 
+//
+// class BufferPool
+//
+
+BufferPool::BufferPool(Device& device, int numBuffers, int bufferSize,
+		bool zeroCopy) : handle(device.get()), memory(0),
+		numBuffers(numBuffers), bufferSize(bufferSize), zeroCopy(false),
+		pool(), mutex()
+{
+	if(numBuffers<=0 || bufferSize<=0)
+		throw(std::invalid_argument("BufferPool"));
+	size_t size=static_cast<size_t>(numBuffers)*bufferSize;
+	#if LIBUSB_API_VERSION >= 0x01000105
+	//Fails if the kernel or the platform does not support it
+	if(zeroCopy && handle) memory=libusb_dev_mem_alloc(handle,size);
+	this->zeroCopy=memory!=0;
+	#endif //LIBUSB_API_VERSION
+	if(memory==0) memory=new (std::nothrow) unsigned char[size];
+	if(memory==0) throw(std::runtime_error("Out of memory"));
+	for(int i=0;i<numBuffers;i++) pool.push_back(memory+i*bufferSize);
+}
+
+unsigned char *BufferPool::acquire()
+{
+	std::lock_guard<std::mutex> l(mutex);
+	if(pool.empty()) return 0;
+	unsigned char *result=pool.back();
+	pool.pop_back();
+	return result;
+}
+
+void BufferPool::release(unsigned char *buffer)
+{
+	std::lock_guard<std::mutex> l(mutex);
+	pool.push_back(buffer);
+}
+
+BufferPool::~BufferPool()
+{
+	#if LIBUSB_API_VERSION >= 0x01000105
+	if(zeroCopy)
+	{
+		libusb_dev_mem_free(handle,memory,
+			static_cast<size_t>(numBuffers)*bufferSize);
+		return;
+	}
+	#endif //LIBUSB_API_VERSION
+	delete[] memory;
+}
+
+//
+// class Transfer
+//
+
+void Transfer::setLength(int length)
+{
+	if(length<0 || length>size) throw(std::invalid_argument("setLength()"));
+	transfer->length=length;
+}
+
+Transfer::Transfer(AsyncEndpoint *owner, unsigned char *buffer, int size)
+		: transfer(libusb_alloc_transfer(0)), owner(owner), size(size),
+		inFlight(false)
+{
+	if(transfer==0) throw(std::runtime_error("libusb_alloc_transfer"));
+	transfer->buffer=buffer;
+}
+
+Transfer::~Transfer()
+{
+	libusb_free_transfer(transfer);
+}
+
+//
+// class AsyncEndpoint
+//
+
+AsyncEndpoint::AsyncEndpoint(Device& device, unsigned char endpoint,
+		int numTransfers, int transferSize, bool interrupt, bool zeroCopy)
+		: device(device), buffers(device,numTransfers,transferSize,zeroCopy),
+		transfers(), pool(), handler(), mutex(),
+		inFlight(0), cancelling(false), completed(0), error()
+{
+	try {
+		for(int i=0;i<numTransfers;i++)
+		{
+			Transfer *t=new Transfer(this,buffers.acquire(),transferSize);
+			transfers.push_back(t);
+			if(interrupt)
+				libusb_fill_interrupt_transfer(t->transfer,device.get(),
+					endpoint,t->transfer->buffer,transferSize,callback,t,
+					device.getTimeout());
+			else
+				libusb_fill_bulk_transfer(t->transfer,device.get(),
+					endpoint,t->transfer->buffer,transferSize,callback,t,
+					device.getTimeout());
+		}
+	} catch(...) {
+		for(unsigned int i=0;i<transfers.size();i++) delete transfers[i];
+		throw;
+	}
+	pool=transfers;
+}
+
+Transfer *AsyncEndpoint::acquire()
+{
+	for(;;)
+	{
+		{
+			std::lock_guard<std::mutex> l(mutex);
+			if(!pool.empty()) break;
+			if(inFlight==0) throw(std::logic_error("No transfer to acquire"));
+			completed=0;
+		}
+		handleEvents();
+		checkError();
+	}
+	return tryAcquire();
+}
+
+Transfer *AsyncEndpoint::tryAcquire()
+{
+	std::lock_guard<std::mutex> l(mutex);
+	if(pool.empty()) return 0;
+	Transfer *result=pool.back();
+	pool.pop_back();
+	return result;
+}
+
+void AsyncEndpoint::release(Transfer *transfer)
+{
+	std::lock_guard<std::mutex> l(mutex);
+	pool.push_back(transfer);
+}
+
+void AsyncEndpoint::submit(Transfer *transfer)
+{
+	std::unique_lock<std::mutex> l(mutex);
+	int error=libusb_submit_transfer(transfer->transfer);
+	if(error==0)
+	{
+		transfer->inFlight=true;
+		inFlight++;
+		return;
+	}
+	pool.push_back(transfer);
+	l.unlock();
+	std::stringstream ss;
+	ss<<"libusb_submit_transfer: "<<error;
+	throw(std::runtime_error(ss.str()));
+}
+
+void AsyncEndpoint::cancel()
+{
+	{
+		std::lock_guard<std::mutex> l(mutex);
+		cancelling=true;
+		for(unsigned int i=0;i<transfers.size();i++)
+			if(transfers[i]->inFlight)
+				libusb_cancel_transfer(transfers[i]->transfer);
+	}
+	try {
+		wait();
+	} catch(...) {
+		std::lock_guard<std::mutex> l(mutex);
+		cancelling=false;
+		throw;
+	}
+	std::lock_guard<std::mutex> l(mutex);
+	cancelling=false;
+}
+
+void AsyncEndpoint::wait()
+{
+	for(;;)
+	{
+		{
+			std::lock_guard<std::mutex> l(mutex);
+			if(inFlight==0) break;
+			completed=0;
+		}
+		handleEvents();
+	}
+	checkError();
+}
+
+int AsyncEndpoint::getInFlight() const
+{
+	std::lock_guard<std::mutex> l(mutex);
+	return inFlight;
+}
+
+AsyncEndpoint::~AsyncEndpoint()
+{
+	try { cancel(); } catch(...) {}
+	for(unsigned int i=0;i<transfers.size();i++) delete transfers[i];
+}
+
+void LIBUSB_CALL AsyncEndpoint::callback(libusb_transfer *transfer)
+{
+	Transfer *t=reinterpret_cast<Transfer*>(transfer->user_data);
+	AsyncEndpoint *ep=t->owner;
+	bool resubmit=false;
+	//Exceptions can't propagate through libusb, they are rethrown by wait()
+	if(ep->handler)
+	{
+		try {
+			resubmit=ep->handler(*t);
+		} catch(...) {
+			std::lock_guard<std::mutex> l(ep->mutex);
+			if(!ep->error) ep->error=std::current_exception();
+			resubmit=false;
+		}
+	}
+	std::lock_guard<std::mutex> l(ep->mutex);
+	if(resubmit && ep->cancelling==false)
+	{
+		int error=libusb_submit_transfer(transfer);
+		if(error==0) return;
+		if(!ep->error)
+		{
+			std::stringstream ss;
+			ss<<"libusb_submit_transfer: "<<error;
+			ep->error=std::make_exception_ptr(std::runtime_error(ss.str()));
+		}
+	}
+	t->inFlight=false;
+	ep->inFlight--;
+	ep->pool.push_back(t);
+	ep->completed=1;
+}
+
+void AsyncEndpoint::handleEvents()
+{
+	int error=libusb_handle_events_completed(device.getContext().get(),
+		&completed);
+	if(error!=0 && error!=LIBUSB_ERROR_INTERRUPTED)
+	{
+		std::stringstream ss;
+		ss<<"libusb_handle_events: "<<error;
+		throw(std::runtime_error(ss.str()));
+	}
+}
+
+void AsyncEndpoint::checkError()
+{
+	std::exception_ptr e;
+	{
+		std::lock_guard<std::mutex> l(mutex);
+		std::swap(e,error);
+	}
+	if(e) std::rethrow_exception(e);
+}
+
+//
+// class EventThread
+//
+
+EventThread::EventThread(Context& context)
+		: context(context), quit(0), thread(&EventThread::run,this) {}
+
+EventThread::~EventThread()
+{
+	quit=1;
+	#if LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(context.get());
+	#endif //LIBUSB_API_VERSION
+	thread.join();
+}
+
+void EventThread::run()
+{
+	while(quit==0)
+	{
+		//Older libusb lack libusb_interrupt_event_handler, so wake up
+		//periodically to check quit
+		struct timeval tv={1,0};
+		libusb_handle_events_timeout_completed(context.get(),&tv,&quit);
+	}
+}
+
+//
+// class StreamReader
+//
+
+StreamReader::StreamReader(Device& device, unsigned char endpoint,
+		int numTransfers, int transferSize, int bufferSize, bool interrupt,
+		bool zeroCopy)
+		: endpoint(device,endpoint,numTransfers,transferSize,interrupt,
+		zeroCopy),
+		buffer(), transferSize(transferSize), head(0), tail(0), reserved(0),
+		running(false), failure(-1), overruns(0), waitMutex(), dataReady()
+{
+	if((endpoint & Endpoint::IN)==0 || bufferSize<transferSize)
+		throw(std::invalid_argument("StreamReader"));
+	buffer.resize(bufferSize);
+	this->endpoint.setCompletionHandler([this](Transfer& t) {
+		return completed(t);
+	});
+}
+
+void StreamReader::start()
+{
+	failure=-1;
+	running=true;
+	refill();
+}
+
+void StreamReader::stop()
+{
+	running=false;
+	endpoint.cancel();
+	dataReady.notify_all();
+}
+
+int StreamReader::read(unsigned char *data, int size)
+{
+	unsigned long long t=tail.load(std::memory_order_relaxed);
+	unsigned long long h=head.load(std::memory_order_acquire);
+	int result=std::min<unsigned long long>(size,h-t);
+	if(result==0)
+	{
+		int status=failure.load();
+		if(status>=0)
+		{
+			std::stringstream ss;
+			ss<<"StreamReader: transfer failed, status "<<status;
+			throw(std::runtime_error(ss.str()));
+		}
+		refill();
+		return 0;
+	}
+	int index=t % buffer.size();
+	int first=std::min<int>(result,buffer.size()-index);
+	memcpy(data,&buffer[index],first);
+	memcpy(data+first,&buffer[0],result-first);
+	tail.store(t+result,std::memory_order_release);
+	refill();
+	return result;
+}
+
+int StreamReader::read(unsigned char *data, int size, unsigned int ms)
+{
+	using namespace std::chrono;
+	auto end=steady_clock::now()+milliseconds(ms);
+	for(;;)
+	{
+		int result=read(data,size);
+		if(result>0) return result;
+		auto now=steady_clock::now();
+		if(now>=end || running==false) return 0;
+		//Transfers not resubmitted by a completion racing with read() are
+		//resubmitted only by refill(), so don't wait too long between calls
+		std::unique_lock<std::mutex> l(waitMutex);
+		if(getAvailable()==0)
+			dataReady.wait_for(l,std::min<steady_clock::duration>(end-now,
+				milliseconds(10)));
+	}
+}
+
+StreamReader::~StreamReader()
+{
+	//Transfers must complete before the ring buffer is deallocated
+	try { stop(); } catch(...) {}
+}
+
+bool StreamReader::completed(Transfer& transfer)
+{
+	switch(transfer.getStatus())
+	{
+		case LIBUSB_TRANSFER_COMPLETED:
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			//A transfer that times out may have received some packets
+			store(transfer);
+			break;
+		case LIBUSB_TRANSFER_CANCELLED:
+			store(transfer);
+			return false;
+		default:
+			reserved-=transferSize;
+			failure=transfer.getStatus();
+			running=false;
+			dataReady.notify_all();
+			return false;
+	}
+	if(running==false) return false;
+	if(reserve()) return true;
+	overruns++;
+	return false;
+}
+
+void StreamReader::store(Transfer& transfer)
+{
+	int size=transfer.getActualLength();
+	if(size>0)
+	{
+		//Room is reserved, so there is no need to check for space
+		unsigned long long h=head.load(std::memory_order_relaxed);
+		int index=h % buffer.size();
+		int first=std::min<int>(size,buffer.size()-index);
+		memcpy(&buffer[index],transfer.getData(),first);
+		memcpy(&buffer[0],transfer.getData()+first,size-first);
+		head.store(h+size,std::memory_order_release);
+	}
+	reserved-=transferSize;
+	if(size>0)
+	{
+		{
+			std::lock_guard<std::mutex> l(waitMutex);
+		}
+		dataReady.notify_one();
+	}
+}
+
+bool StreamReader::reserve()
+{
+	int r=reserved.load();
+	do {
+		int used=head.load()-tail.load();
+		if(static_cast<int>(buffer.size())-used-r<transferSize) return false;
+	} while(!reserved.compare_exchange_weak(r,r+transferSize));
+	return true;
+}
+
+void StreamReader::refill()
+{
+	while(running && reserve())
+	{
+		Transfer *t=endpoint.tryAcquire();
+		if(t==0)
+		{
+			reserved-=transferSize;
+			return;
+		}
+		try {
+			endpoint.submit(t);
+		} catch(...) {
+			reserved-=transferSize;
+			throw;
+		}
+	}
+}
+
+//
+// class DuplexSession
+//
+
+DuplexSession::DuplexSession(Device& device, unsigned char outEndpoint,
+		unsigned char inEndpoint, int numTransfers, int transferSize,
+		int queueSize, bool interrupt, bool zeroCopy)
+		: events(device.getContext()),
+		writer(device,outEndpoint,numTransfers,transferSize,interrupt,
+		zeroCopy),
+		reader(device,inEndpoint,numTransfers,transferSize,queueSize,interrupt,
+		zeroCopy),
+		txQueue(), txHead(0), txTail(0), transferSize(transferSize),
+		running(false), error(), bytesSent(0), txMutex(), txReady(),
+		txSpace(), txThread()
+{
+	if((outEndpoint & Endpoint::IN) || queueSize<numTransfers*transferSize)
+		throw(std::invalid_argument("DuplexSession"));
+	txQueue.resize(queueSize);
+	writer.setCompletionHandler([this](Transfer& t) {
+		if(t.getStatus()==LIBUSB_TRANSFER_COMPLETED)
+			bytesSent+=t.getActualLength();
+		std::lock_guard<std::mutex> l(txMutex);
+		if(t.getStatus()!=LIBUSB_TRANSFER_COMPLETED &&
+		   t.getStatus()!=LIBUSB_TRANSFER_CANCELLED && !error)
+		{
+			std::stringstream ss;
+			ss<<"DuplexSession: transfer failed, status "<<t.getStatus();
+			error=std::make_exception_ptr(std::runtime_error(ss.str()));
+			txReady.notify_all();
+		}
+		txSpace.notify_all();
+		return false;
+	});
+}
+
+void DuplexSession::start()
+{
+	{
+		std::lock_guard<std::mutex> l(txMutex);
+		if(running) return;
+		running=true;
+		error=std::exception_ptr();
+	}
+	txThread=std::thread(&DuplexSession::transmit,this);
+	reader.start();
+}
+
+void DuplexSession::stop()
+{
+	{
+		std::lock_guard<std::mutex> l(txMutex);
+		running=false;
+		txTail=txHead;
+	}
+	txReady.notify_all();
+	txSpace.notify_all();
+	//Cancelling first unblocks the transmit thread if waiting for a transfer.
+	//It submits with txMutex held and running checked, so nothing is in
+	//flight after this
+	writer.cancel();
+	if(txThread.joinable()) txThread.join();
+	reader.stop();
+}
+
+int DuplexSession::write(const unsigned char *data, int size, unsigned int ms)
+{
+	auto end=std::chrono::steady_clock::now()+std::chrono::milliseconds(ms);
+	std::unique_lock<std::mutex> l(txMutex);
+	int result=0;
+	while(result<size)
+	{
+		checkError();
+		if(running==false) throw(std::runtime_error("DuplexSession: stopped"));
+		int space=txQueue.size()-(txHead-txTail);
+		if(space==0)
+		{
+			if(txSpace.wait_until(l,end)==std::cv_status::timeout) break;
+			continue;
+		}
+		int n=std::min(space,size-result);
+		int index=txHead % txQueue.size();
+		int first=std::min<int>(n,txQueue.size()-index);
+		memcpy(&txQueue[index],data+result,first);
+		memcpy(&txQueue[0],data+result+first,n-first);
+		txHead+=n;
+		result+=n;
+		txReady.notify_one();
+	}
+	return result;
+}
+
+bool DuplexSession::flush(unsigned int ms)
+{
+	auto end=std::chrono::steady_clock::now()+std::chrono::milliseconds(ms);
+	std::unique_lock<std::mutex> l(txMutex);
+	for(;;)
+	{
+		checkError();
+		if(txHead==txTail && writer.getInFlight()==0) return true;
+		if(std::chrono::steady_clock::now()>=end) return false;
+		//Transfers return to the pool after the completion handler, so
+		//don't rely on notifications only
+		txSpace.wait_for(l,std::chrono::milliseconds(1));
+	}
+}
+
+DuplexSession::~DuplexSession()
+{
+	try { stop(); } catch(...) {}
+}
+
+void DuplexSession::transmit()
+{
+	try {
+		for(;;)
+		{
+			{
+				std::unique_lock<std::mutex> l(txMutex);
+				while(txHead==txTail && running && !error) txReady.wait(l);
+				if(running==false || error) return;
+			}
+			Transfer *t=writer.acquire();
+			//Submit with the lock held, so that stop() either sees the
+			//transfer in flight and cancels it, or it is not submitted
+			std::lock_guard<std::mutex> l(txMutex);
+			int size=std::min<unsigned long long>(transferSize,txHead-txTail);
+			if(running==false || size==0)
+			{
+				writer.release(t);
+				continue;
+			}
+			int index=txTail % txQueue.size();
+			int first=std::min<int>(size,txQueue.size()-index);
+			memcpy(t->getData(),&txQueue[index],first);
+			memcpy(t->getData()+first,&txQueue[0],size-first);
+			txTail+=size;
+			t->setLength(size);
+			writer.submit(t);
+			txSpace.notify_all();
+		}
+	} catch(...) {
+		std::lock_guard<std::mutex> l(txMutex);
+		if(!error) error=std::current_exception();
+		txSpace.notify_all();
+	}
+}
+
+void DuplexSession::checkError()
+{
+	if(error) std::rethrow_exception(error);
+}
+
+//
+// class DeviceManager
+//
+
+DeviceManager::DeviceManager(Context& context, int numThreads)
+		: context(context), extra(), threads(), devices()
+{
+	if(numThreads<1) throw(std::invalid_argument("DeviceManager"));
+	threads.emplace_back(new EventThread(context));
+	for(int i=1;i<numThreads;i++)
+	{
+		extra.emplace_back(new Context);
+		threads.emplace_back(new EventThread(*extra.back()));
+	}
+}
+
+Device& DeviceManager::open(const DeviceInfo& info)
+{
+	int i=devices.size() % threads.size();
+	Context& c= i==0 ? context : *extra.at(i-1);
+	devices.emplace_back(new Device(c,info));
+	return *devices.back();
+}
+
+int DeviceManager::openAll(unsigned short vid, unsigned short pid,
+		const std::string& serial, const std::string& portPath)
+{
+	std::vector<DeviceInfo> found=enumerate(vid,pid,serial,portPath);
+	for(auto& info : found) open(info);
+	return found.size();
+}
+
 } //namespace libusb
\ No newline at end of file
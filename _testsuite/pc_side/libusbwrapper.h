@@ -28,6 +28,15 @@
 #include <libusb.h>
 #include <stdexcept>
 #include <map>
+#include <vector>
+#include <functional>
+#include <exception>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <string>
 
 #ifndef LIBUSBWRAPPER_H
 #define LIBUSBWRAPPER_H
@@ -102,6 +111,34 @@ private:
 	Endpoint();//Just a wrapper class, disallow making instances
 };
 
+/**
+ * Identifies one USB device attached to the host, as returned by
+ * findDevices(). Useful to tell apart devices with the same vid and pid.
+ */
+struct DeviceInfo
+{
+	unsigned short vid;  ///< Device vid
+	unsigned short pid;  ///< Device pid
+	int bus;             ///< Bus number
+	int address;         ///< Device address, changes if the device is plugged again
+	std::string portPath;///< Port path, like "1-2.3", stable across replugs
+	std::string serial;  ///< Serial number string, empty if not available
+};
+
+/**
+ * Find all the USB devices with the given vid and pid
+ * \param context libusb context
+ * \param vid device vid
+ * \param pid device pid
+ * \param serial if not empty, only the device with this serial number
+ * \param portPath if not empty, only the device attached to this port
+ * \return the devices found, ordered as libusb lists them
+ * \throws runtime_error if the device list can't be read
+ */
+std::vector<DeviceInfo> findDevices(Context& context, unsigned short vid,
+		unsigned short pid, const std::string& serial="",
+		const std::string& portPath="");
+
 /**
  * USB device class
  */
@@ -131,13 +168,36 @@ public:
 	}
 	
 	/**
-	 * Open device
+	 * Constructor, device is opened.
+	 * \param context libusb context
+	 * \param info device, as returned by findDevices()
+	 * \throws runtime_error if device could not be opened
+	 */
+	Device(Context& context, const DeviceInfo& info)
+			: context(context), handle(0), configuration(0),
+			interfaces(), timeout(0)
+	{
+		this->open(info);
+	}
+	
+	/**
+	 * Open device. If more devices have the same vid and pid, the first one
+	 * is opened
 	 * \param vid device vid
 	 * \param pid device pid
 	 * \throws runtime_error if device could not be opened
 	 */
 	void open(unsigned short vid, unsigned short pid);
 	
+	/**
+	 * Open device
+	 * \param info device, as returned by findDevices(), also with a
+	 * different context
+	 * \throws runtime_error if device could not be opened, for example
+	 * because it was unplugged
+	 */
+	void open(const DeviceInfo& info);
+	
 	/**
 	 * \return true if the device is configured
 	 * If the device is not already configured, you have to do so before
@@ -301,6 +361,11 @@ public:
 	 * \return the handle
 	 */
 	libusb_device_handle *get() const { return handle; }
+
+	/**
+	 * \return the context of this device
+	 */
+	Context& getContext() const { return context; }
 	
 	/**
 	 * Destructor. 
@@ -337,6 +402,700 @@ private:
 	unsigned int timeout; ///< Timeout for read/write operations
 };
 
+/**
+ * A pool of equally sized buffers for transfers. If possible, they are
+ * allocated with libusb_dev_mem_alloc(), that on Linux maps memory shared
+ * with the kernel, so that the kernel does not copy data to and from them
+ * for each transfer. Otherwise, or if libusb is too old, they are allocated
+ * on the heap. All buffers are carved out of a single allocation.
+ * The pool must be destroyed before the device is closed.
+ */
+class BufferPool
+{
+public:
+	/**
+	 * Constructor
+	 * \param device USB device, must be open
+	 * \param numBuffers number of buffers
+	 * \param bufferSize size of each buffer
+	 * \param zeroCopy if false, don't try libusb_dev_mem_alloc()
+	 * \throws invalid_argument if numBuffers or bufferSize are not positive
+	 * \throws runtime_error if out of memory
+	 */
+	BufferPool(Device& device, int numBuffers, int bufferSize,
+			bool zeroCopy=true);
+
+	/**
+	 * \return a buffer, or 0 if all buffers are in use
+	 */
+	unsigned char *acquire();
+
+	/**
+	 * Return a buffer to the pool
+	 * \param buffer a buffer obtained by acquire()
+	 */
+	void release(unsigned char *buffer);
+
+	/**
+	 * \return the size of each buffer
+	 */
+	int getBufferSize() const { return bufferSize; }
+
+	/**
+	 * \return the number of buffers
+	 */
+	int getNumBuffers() const { return numBuffers; }
+
+	/**
+	 * \return true if the buffers were allocated with libusb_dev_mem_alloc()
+	 */
+	bool isZeroCopy() const { return zeroCopy; }
+
+	/**
+	 * Destructor
+	 */
+	~BufferPool();
+
+private:
+	//Non copyiable
+	BufferPool(const BufferPool& );
+	BufferPool& operator= (const BufferPool& );
+
+	libusb_device_handle *handle;     ///< Handle used to allocate memory
+	unsigned char *memory;            ///< Memory of all the buffers
+	int numBuffers;                   ///< Number of buffers
+	int bufferSize;                   ///< Size of each buffer
+	bool zeroCopy;                    ///< True if memory is from libusb
+	std::vector<unsigned char*> pool; ///< Buffers not in use
+	std::mutex mutex;                 ///< Protects pool
+};
+
+class AsyncEndpoint;
+
+/**
+ * A reusable asynchronous transfer, with its buffer. Instances are owned by
+ * an AsyncEndpoint, which keeps them in a pool when they are not in flight.
+ */
+class Transfer
+{
+public:
+	/**
+	 * \return the transfer buffer
+	 */
+	unsigned char *getData() const { return transfer->buffer; }
+
+	/**
+	 * \return the size of the transfer buffer
+	 */
+	int getSize() const { return size; }
+
+	/**
+	 * \return the number of bytes to transfer, by default getSize()
+	 */
+	int getLength() const { return transfer->length; }
+
+	/**
+	 * Set the number of bytes to transfer. For OUT endpoints it is the number
+	 * of bytes to send, for IN endpoints the maximum number of bytes to
+	 * receive. It is kept when the transfer is resubmitted.
+	 * \param length number of bytes, from 0 to getSize()
+	 * \throws invalid_argument if length is out of range
+	 */
+	void setLength(int length);
+
+	/**
+	 * \return the number of bytes actually transferred, valid in the
+	 * completion handler
+	 */
+	int getActualLength() const { return transfer->actual_length; }
+
+	/**
+	 * \return the transfer status, valid in the completion handler
+	 */
+	libusb_transfer_status getStatus() const { return transfer->status; }
+
+	/**
+	 * \return the endpoint address
+	 */
+	unsigned char getEndpoint() const { return transfer->endpoint; }
+
+	/**
+	 * \internal
+	 * \return the transfer
+	 */
+	libusb_transfer *get() const { return transfer; }
+
+private:
+	//Non copyiable
+	Transfer(const Transfer& );
+	Transfer& operator= (const Transfer& );
+
+	/**
+	 * Constructor
+	 * \param owner endpoint owning this transfer
+	 * \param buffer transfer buffer, owned by the endpoint
+	 * \param size buffer size
+	 * \throws runtime_error if out of memory
+	 */
+	Transfer(AsyncEndpoint *owner, unsigned char *buffer, int size);
+
+	/**
+	 * Destructor, the transfer must not be in flight
+	 */
+	~Transfer();
+
+	libusb_transfer *transfer; ///< The transfer
+	AsyncEndpoint *owner;      ///< Endpoint owning this transfer
+	int size;                  ///< Buffer size
+	bool inFlight;             ///< True if submitted and not completed
+
+	friend class AsyncEndpoint;
+};
+
+/**
+ * Completion handler of asynchronous transfers. It is called from the
+ * thread handling libusb events, with the completed transfer. It returns
+ * true to resubmit the same transfer, or false to put it back in the pool.
+ * It should not block, as it delays the completion of all transfers.
+ */
+typedef std::function<bool (Transfer&)> CompletionHandler;
+
+/**
+ * Asynchronous transfers on a bulk or interrupt endpoint, with a pool of
+ * transfers allocated once, and up to the pool size in flight.
+ * Transfers are completed by whoever handles libusb events, either an
+ * EventThread or wait() and acquire(), which handle events themselves.
+ * An instance should be used by one thread, but the completion handler
+ * can run in the EventThread.
+ */
+class AsyncEndpoint
+{
+public:
+	/**
+	 * Constructor
+	 * \param device USB device, with the interface of the endpoint claimed.
+	 * Its timeout is used for all transfers
+	 * \param endpoint endpoint address, direction included
+	 * \param numTransfers number of transfers in the pool
+	 * \param transferSize buffer size of each transfer
+	 * \param interrupt true for interrupt endpoints, false for bulk ones
+	 * \param zeroCopy if false, don't try to allocate buffers with
+	 * libusb_dev_mem_alloc(), see BufferPool
+	 * \throws invalid_argument if numTransfers or transferSize are not
+	 * positive
+	 * \throws runtime_error if out of memory
+	 */
+	AsyncEndpoint(Device& device, unsigned char endpoint, int numTransfers,
+			int transferSize, bool interrupt=false, bool zeroCopy=true);
+
+	/**
+	 * Set the completion handler. Must not be called while transfers are
+	 * in flight.
+	 * \param handler the new completion handler. If not set, completed
+	 * transfers are put back in the pool
+	 */
+	void setCompletionHandler(CompletionHandler handler)
+	{
+		this->handler=handler;
+	}
+
+	/**
+	 * Get a transfer from the pool, to fill it and submit it. If the pool is
+	 * empty, handle libusb events till a transfer completes.
+	 * \return a transfer
+	 * \throws any exception thrown by the completion handler
+	 */
+	Transfer *acquire();
+
+	/**
+	 * \return a transfer from the pool, or 0 if the pool is empty
+	 */
+	Transfer *tryAcquire();
+
+	/**
+	 * Put back in the pool a transfer obtained by acquire() without
+	 * submitting it
+	 * \param transfer transfer to release
+	 */
+	void release(Transfer *transfer);
+
+	/**
+	 * Submit a transfer obtained by acquire()
+	 * \param transfer transfer to submit
+	 * \throws runtime_error if submission failed, in this case the transfer
+	 * is put back in the pool
+	 */
+	void submit(Transfer *transfer);
+
+	/**
+	 * Cancel all transfers in flight, and wait till they complete. The
+	 * completion handler is called with status LIBUSB_TRANSFER_CANCELLED,
+	 * and transfers are not resubmitted till this member function returns.
+	 */
+	void cancel();
+
+	/**
+	 * Handle libusb events till no transfer is in flight
+	 * \throws any exception thrown by the completion handler
+	 */
+	void wait();
+
+	/**
+	 * \return the number of transfers in flight
+	 */
+	int getInFlight() const;
+
+	/**
+	 * \return the number of transfers in the pool
+	 */
+	int getNumTransfers() const { return transfers.size(); }
+
+	/**
+	 * \return true if transfer buffers are shared with the kernel
+	 */
+	bool isZeroCopy() const { return buffers.isZeroCopy(); }
+
+	/**
+	 * Destructor, cancels all transfers in flight
+	 */
+	~AsyncEndpoint();
+
+private:
+	//Non copyiable
+	AsyncEndpoint(const AsyncEndpoint& );
+	AsyncEndpoint& operator= (const AsyncEndpoint& );
+
+	/**
+	 * Called by libusb when a transfer completes
+	 */
+	static void LIBUSB_CALL callback(libusb_transfer *transfer);
+
+	/**
+	 * Handle libusb events till a transfer completes, or events are handled
+	 * by another thread
+	 */
+	void handleEvents();
+
+	/**
+	 * Rethrow an exception thrown by the completion handler, if any
+	 */
+	void checkError();
+
+	Device& device;                  ///< Device
+	BufferPool buffers;              ///< Buffers of the transfers
+	std::vector<Transfer*> transfers;///< All transfers
+	std::vector<Transfer*> pool;     ///< Transfers not in flight
+	CompletionHandler handler;       ///< Completion handler
+	mutable std::mutex mutex;        ///< Protects pool and inFlight
+	int inFlight;                    ///< Number of transfers in flight
+	bool cancelling;                 ///< True if transfers can't be resubmitted
+	int completed;                   ///< Set to 1 when a transfer completes
+	std::exception_ptr error;        ///< Exception thrown by the handler
+};
+
+/**
+ * A thread that handles libusb events of a context, so that asynchronous
+ * transfers complete without calling AsyncEndpoint::wait()
+ */
+class EventThread
+{
+public:
+	/**
+	 * Constructor, starts the thread
+	 * \param context context whose events are handled
+	 */
+	explicit EventThread(Context& context);
+
+	/**
+	 * Destructor, stops the thread
+	 */
+	~EventThread();
+
+private:
+	//Non copyiable
+	EventThread(const EventThread& );
+	EventThread& operator= (const EventThread& );
+
+	/**
+	 * Thread main loop
+	 */
+	void run();
+
+	Context& context;   ///< Context
+	int quit;           ///< Set to 1 to stop the thread
+	std::thread thread; ///< The thread
+};
+
+/**
+ * Continuous reading from a bulk or interrupt IN endpoint. Transfers are
+ * kept in flight, and the data they receive is copied into a ring buffer,
+ * from which read() consumes it. If the consumer lags and the ring buffer
+ * fills up, transfers are not resubmitted, so the device is NAKed instead of
+ * data being lost on the host, and they are resubmitted by read().
+ * libusb events must be handled by another thread, for example an
+ * EventThread. The ring buffer is lock free, with the completion handler as
+ * the producer and read() as the consumer, so if more threads call read()
+ * they must serialize the calls.
+ */
+class StreamReader
+{
+public:
+	/**
+	 * Constructor. Reading does not start till start() is called.
+	 * \param device USB device, with the interface of the endpoint claimed.
+	 * Its timeout is used for all transfers, a transfer that times out is
+	 * resubmitted
+	 * \param endpoint IN endpoint address
+	 * \param numTransfers number of transfers in flight
+	 * \param transferSize buffer size of each transfer
+	 * \param bufferSize ring buffer size, at least numTransfers*transferSize
+	 * to keep all transfers in flight
+	 * \param interrupt true for interrupt endpoints, false for bulk ones
+	 * \param zeroCopy if false, don't try to allocate transfer buffers with
+	 * libusb_dev_mem_alloc(), see BufferPool
+	 * \throws invalid_argument if the endpoint is not IN or sizes are wrong
+	 * \throws runtime_error if out of memory
+	 */
+	StreamReader(Device& device, unsigned char endpoint, int numTransfers,
+			int transferSize, int bufferSize, bool interrupt=false,
+			bool zeroCopy=true);
+
+	/**
+	 * Start reading, submitting transfers while there is room for their
+	 * data in the ring buffer
+	 * \throws runtime_error if submission failed
+	 */
+	void start();
+
+	/**
+	 * Stop reading, cancelling transfers in flight. Data in the ring buffer
+	 * can still be read.
+	 */
+	void stop();
+
+	/**
+	 * Read data from the ring buffer, without blocking
+	 * \param data buffer where data is copied
+	 * \param size buffer size
+	 * \return number of bytes read, 0 if the ring buffer is empty
+	 * \throws runtime_error if the ring buffer is empty and a transfer
+	 * failed, for example because the endpoint was halted
+	 */
+	int read(unsigned char *data, int size);
+
+	/**
+	 * Read data from the ring buffer, waiting till some data is available
+	 * \param data buffer where data is copied
+	 * \param size buffer size
+	 * \param ms maximum time to wait, in milliseconds
+	 * \return number of bytes read, 0 on timeout
+	 * \throws runtime_error if the ring buffer is empty and a transfer
+	 * failed, for example because the endpoint was halted
+	 */
+	int read(unsigned char *data, int size, unsigned int ms);
+
+	/**
+	 * \return the number of bytes in the ring buffer
+	 */
+	int getAvailable() const { return head.load()-tail.load(); }
+
+	/**
+	 * \return the number of bytes received since the constructor
+	 */
+	unsigned long long getBytesReceived() const { return head.load(); }
+
+	/**
+	 * \return the number of times a transfer was not resubmitted because
+	 * the ring buffer was full, leaving the endpoint with fewer transfers
+	 * in flight. Data sent by the device is not lost, but a device that can't
+	 * hold it may have to drop it
+	 */
+	unsigned long long getOverruns() const { return overruns.load(); }
+
+	/**
+	 * \return true if transfer buffers are shared with the kernel
+	 */
+	bool isZeroCopy() const { return endpoint.isZeroCopy(); }
+
+	/**
+	 * Destructor, stops reading
+	 */
+	~StreamReader();
+
+private:
+	//Non copyiable
+	StreamReader(const StreamReader& );
+	StreamReader& operator= (const StreamReader& );
+
+	/**
+	 * Completion handler, the producer of the ring buffer
+	 * \param transfer completed transfer
+	 * \return true to resubmit the transfer
+	 */
+	bool completed(Transfer& transfer);
+
+	/**
+	 * Copy the data received by a transfer into its reserved room in the
+	 * ring buffer, and release the rest of the room
+	 * \param transfer transfer, also partially completed
+	 */
+	void store(Transfer& transfer);
+
+	/**
+	 * Reserve room in the ring buffer for the data of a transfer
+	 * \return true on success, false if the ring buffer is full
+	 */
+	bool reserve();
+
+	/**
+	 * Submit transfers not in flight while there is room for their data
+	 */
+	void refill();
+
+	AsyncEndpoint endpoint;            ///< Endpoint
+	std::vector<unsigned char> buffer; ///< Ring buffer
+	int transferSize;                  ///< Buffer size of each transfer
+	std::atomic<unsigned long long> head; ///< Total bytes written
+	std::atomic<unsigned long long> tail; ///< Total bytes read
+	std::atomic<int> reserved;         ///< Bytes reserved for transfers
+	std::atomic<bool> running;         ///< True between start() and stop()
+	std::atomic<int> failure;          ///< Status of a failed transfer, or -1
+	std::atomic<unsigned long long> overruns; ///< Transfers not resubmitted
+	std::mutex waitMutex;              ///< Used with dataReady
+	std::condition_variable dataReady; ///< Notified when data arrives
+};
+
+/**
+ * Full duplex communication on a pair of OUT and IN endpoints, with
+ * independent pipelines. Data passed to write() is queued, and a dedicated
+ * thread sends it through transfers kept in flight on the OUT endpoint,
+ * while a StreamReader keeps receiving from the IN endpoint. Both have
+ * flow control: write() blocks while the transmit queue is full, and the IN
+ * endpoint is NAKed while the receive ring buffer is full. The session
+ * handles libusb events with its own EventThread. One thread can call
+ * write() while another calls read().
+ */
+class DuplexSession
+{
+public:
+	/**
+	 * Constructor. Communication does not start till start() is called.
+	 * \param device USB device, with the interface of the endpoints claimed
+	 * \param outEndpoint OUT endpoint address
+	 * \param inEndpoint IN endpoint address
+	 * \param numTransfers number of transfers in flight in each direction
+	 * \param transferSize buffer size of each transfer. If the device
+	 * expects packets of a given size, write data in multiples of it
+	 * \param queueSize size of the transmit queue and of the receive ring
+	 * buffer, at least numTransfers*transferSize
+	 * \param interrupt true for interrupt endpoints, false for bulk ones
+	 * \param zeroCopy if false, don't try to allocate transfer buffers with
+	 * libusb_dev_mem_alloc(), see BufferPool
+	 * \throws invalid_argument if endpoints or sizes are wrong
+	 * \throws runtime_error if out of memory
+	 */
+	DuplexSession(Device& device, unsigned char outEndpoint,
+			unsigned char inEndpoint, int numTransfers, int transferSize,
+			int queueSize, bool interrupt=false, bool zeroCopy=true);
+
+	/**
+	 * Start the transmit thread and receiving
+	 * \throws runtime_error if submission failed
+	 */
+	void start();
+
+	/**
+	 * Stop communication. Queued data not yet sent is discarded, and
+	 * transfers in flight are cancelled.
+	 */
+	void stop();
+
+	/**
+	 * Queue data to send, waiting while the transmit queue is full
+	 * \param data data to send
+	 * \param size data size
+	 * \param ms maximum time to wait, in milliseconds
+	 * \return number of bytes queued, less than size on timeout
+	 * \throws runtime_error if a transfer failed, or the session is stopped
+	 */
+	int write(const unsigned char *data, int size, unsigned int ms);
+
+	/**
+	 * Wait till all queued data has been sent
+	 * \param ms maximum time to wait, in milliseconds
+	 * \return true if all data was sent, false on timeout
+	 * \throws runtime_error if a transfer failed
+	 */
+	bool flush(unsigned int ms);
+
+	/**
+	 * Read received data, waiting till some data is available
+	 * \param data buffer where data is copied
+	 * \param size buffer size
+	 * \param ms maximum time to wait, in milliseconds
+	 * \return number of bytes read, 0 on timeout
+	 * \throws runtime_error if a transfer failed
+	 */
+	int read(unsigned char *data, int size, unsigned int ms)
+	{
+		return reader.read(data,size,ms);
+	}
+
+	/**
+	 * \return the number of bytes sent since the constructor
+	 */
+	unsigned long long getBytesSent() const { return bytesSent.load(); }
+
+	/**
+	 * \return the number of bytes received since the constructor
+	 */
+	unsigned long long getBytesReceived() const
+	{
+		return reader.getBytesReceived();
+	}
+
+	/**
+	 * \return the number of times the receive ring buffer was full, see
+	 * StreamReader::getOverruns()
+	 */
+	unsigned long long getOverruns() const { return reader.getOverruns(); }
+
+	/**
+	 * \return true if transfer buffers are shared with the kernel
+	 */
+	bool isZeroCopy() const { return writer.isZeroCopy(); }
+
+	/**
+	 * Destructor, stops communication
+	 */
+	~DuplexSession();
+
+private:
+	//Non copyiable
+	DuplexSession(const DuplexSession& );
+	DuplexSession& operator= (const DuplexSession& );
+
+	/**
+	 * Transmit thread, moves data from the queue into OUT transfers
+	 */
+	void transmit();
+
+	/**
+	 * Throw if a transfer failed, must be called with txMutex locked
+	 */
+	void checkError();
+
+	EventThread events;                  ///< Handles events of both pipelines
+	AsyncEndpoint writer;                ///< OUT pipeline
+	StreamReader reader;                 ///< IN pipeline
+	std::vector<unsigned char> txQueue;  ///< Transmit queue, a ring buffer
+	unsigned long long txHead;           ///< Total bytes queued
+	unsigned long long txTail;           ///< Total bytes moved to transfers
+	int transferSize;                    ///< Buffer size of each transfer
+	bool running;                        ///< True between start() and stop()
+	std::exception_ptr error;            ///< Error of the OUT pipeline
+	std::atomic<unsigned long long> bytesSent; ///< Bytes sent
+	std::mutex txMutex;                  ///< Protects the transmit queue
+	std::condition_variable txReady;     ///< Data queued, or stopping
+	std::condition_variable txSpace;     ///< Room in the queue, or error
+	std::thread txThread;                ///< Transmit thread
+};
+
+/**
+ * Opens many devices and handles their events, so that asynchronous
+ * transfers on all of them complete without calling AsyncEndpoint::wait().
+ * With one thread all devices share the context passed to the constructor
+ * and a single EventThread. As libusb handles the events of a context in
+ * one thread at a time, with more threads each thread gets its own context,
+ * and devices are assigned to threads round robin, so that transfers to
+ * different devices complete in parallel.
+ */
+class DeviceManager
+{
+public:
+	/**
+	 * Constructor, starts the event threads
+	 * \param context libusb context, used by the first thread
+	 * \param numThreads number of event threads
+	 * \throws invalid_argument if numThreads is less than one
+	 * \throws runtime_error if a context can't be created
+	 */
+	DeviceManager(Context& context, int numThreads=1);
+
+	/**
+	 * Find devices, see findDevices()
+	 * \param vid device vid
+	 * \param pid device pid
+	 * \param serial if not empty, only the device with this serial number
+	 * \param portPath if not empty, only the device attached to this port
+	 * \return the devices found
+	 * \throws runtime_error if the device list can't be read
+	 */
+	std::vector<DeviceInfo> enumerate(unsigned short vid, unsigned short pid,
+			const std::string& serial="", const std::string& portPath="")
+	{
+		return findDevices(context,vid,pid,serial,portPath);
+	}
+
+	/**
+	 * Open a device, assigning it to the next event thread
+	 * \param info device, as returned by enumerate()
+	 * \return the device, valid till closeAll() or the destructor
+	 * \throws runtime_error if device could not be opened
+	 */
+	Device& open(const DeviceInfo& info);
+
+	/**
+	 * Open all matching devices
+	 * \param vid device vid
+	 * \param pid device pid
+	 * \param serial if not empty, only the device with this serial number
+	 * \param portPath if not empty, only the device attached to this port
+	 * \return the number of devices opened
+	 * \throws runtime_error if a device could not be opened, devices opened
+	 * till then are kept open
+	 */
+	int openAll(unsigned short vid, unsigned short pid,
+			const std::string& serial="", const std::string& portPath="");
+
+	/**
+	 * \return the number of open devices
+	 */
+	int getNumDevices() const { return devices.size(); }
+
+	/**
+	 * \param i index of the device, in the order they were opened
+	 * \return the device
+	 */
+	Device& getDevice(int i) { return *devices.at(i); }
+
+	/**
+	 * \return the number of event threads
+	 */
+	int getNumThreads() const { return threads.size(); }
+
+	/**
+	 * Close all devices. All asynchronous transfers on them must have been
+	 * destroyed before.
+	 */
+	void closeAll() { devices.clear(); }
+
+	/**
+	 * Destructor, closes all devices and stops the event threads
+	 */
+	~DeviceManager() { closeAll(); }
+
+private:
+	//Non copyiable
+	DeviceManager(const DeviceManager& );
+	DeviceManager& operator= (const DeviceManager& );
+
+	Context& context;                           ///< Context of thread 0
+	std::vector<std::unique_ptr<Context>> extra;///< Contexts of other threads
+	std::vector<std::unique_ptr<EventThread>> threads;///< Event threads
+	std::vector<std::unique_ptr<Device>> devices;     ///< Open devices
+};
+
 } //namespace libusb
 
 #endif //LIBUSBWRAPPER_H
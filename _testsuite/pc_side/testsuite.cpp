@@ -32,8 +32,12 @@
 #include <sstream>
 #include <chrono>
 #include <thread>
+#include <atomic>
 #include <functional>
+#include <vector>
+#include <exception>
 #include "libusbwrapper.h"
+#include "benchmark.h"
 
 using namespace std;
 using namespace std::chrono;
@@ -73,6 +77,30 @@ void testVendorRequests(Device& device, Context& context)
 	memset(data,1,128);
 	device.controlTransfer(0x40,0,0,0,data,128);
 	
+	//Step 6: test IN transfer with data generated one packet at a time
+	vector<unsigned char> stream(4000);
+	device.controlTransfer(0xc0,1,0,0,&stream[0],stream.size());
+	for(unsigned int i=0;i<stream.size();i++)
+		if(stream[i]!=i % 251) throw(runtime_error("Data receive error"));
+	
+	//Step 7: test OUT transfer with data consumed one packet at a time
+	device.controlTransfer(0x40,1,0,0,&stream[0],stream.size());
+	
+	//Step 8: test requests completed later by a thread on the device
+	memset(data,0,4);
+	device.controlTransfer(0xc0,2,0,0,data,4);
+	for(int i=0;i<4;i++)
+		if(data[i]!=i+1) throw(runtime_error("Data receive error"));
+	device.controlTransfer(0x40,2,0,0,0,0);
+	failed=true;
+	try {
+		device.controlTransfer(0x40,2,1,0,0,0);
+	} catch(exception& e)
+	{
+		failed=false;
+	}
+	if(failed) throw(runtime_error("Not rejected failed deferred request"));
+	
 	cout<<"OK"<<endl;
 }
 
@@ -168,90 +196,319 @@ void testBulkEndpoints(Device& device, Context& context)
 	cout<<"OK"<<endl;
 }
 
-int numPackets=0; ///Used by decCount, testBulkInSpeed() and testBulkOutSpeed()
+/**
+ * Test bulk endpoints through a DuplexSession, to check if data transfer
+ * are correct when packets are sent from a separate thread while echoed
+ * ones are received, so more packets can be transferred per frame.
+ * \param device USB device
+ * \param context USB context
+ */
+void testBulkDuplex(Device& device, Context& context)
+{
+	cout<<"Testing full duplex bulk transfers... ";
+	cout.flush();
+	const int numPackets=500;
+	vector<unsigned char> out(numPackets*32);
+	vector<unsigned char> in(numPackets*32);
+	for(auto& x : out) x=rand();
+	//The device reads and writes 32 byte packets, so queue a multiple of 32
+	DuplexSession session(device,3 | Endpoint::OUT,4 | Endpoint::IN,4,32,256);
+	session.start();
+	atomic<bool> done(false);
+	exception_ptr error;
+	thread writer([&]() {
+		try {
+			for(int i=0;i<numPackets && done==false;i++)
+				if(session.write(&out[i*32],32,device.getTimeout())!=32)
+					throw(TimeoutException());
+		} catch(...) {
+			if(done==false) error=current_exception();
+		}
+	});
+	int received=0;
+	try {
+		while(received<static_cast<int>(in.size()))
+		{
+			int result=session.read(&in[received],in.size()-received,
+				device.getTimeout());
+			if(result==0) break;
+			received+=result;
+		}
+	} catch(...) {
+		done=true;
+		session.stop();
+		writer.join();
+		throw;
+	}
+	done=true;
+	session.stop();
+	writer.join();
+	if(received!=static_cast<int>(in.size()))
+	{
+		stringstream ss; ss<<"Received wrong # of bytes: "<<received;
+		throw(runtime_error(ss.str()));
+	}
+	if(error) rethrow_exception(error);
+	for(unsigned int i=0;i<out.size();i++)
+	{
+		//The device applies this to incoming data
+		if(in[i]!=(out[i]^0x56)) throw(runtime_error("Data transfer error"));
+	}
+	cout<<"OK"<<endl;
+}
+
+/**
+ * Halt an endpoint through a vendor request, and check that transfers fail
+ * until the halt is cleared
+ * \param device USB device
+ * \param endpoint endpoint address
+ */
+void haltEndpoint(Device& device, unsigned char endpoint)
+{
+	unsigned char data[64];
+	memset(data,0,64);
+	device.controlTransfer(0x40,0x5a,0,endpoint,0,0);
+	bool failed=true;
+	try {
+		device.bulkTransfer(endpoint,data,64);
+	} catch(TimeoutException& e)
+	{
+		throw(runtime_error("Halted endpoint did not stall"));
+	} catch(exception& e)
+	{
+		failed=false;
+	}
+	if(failed) throw(runtime_error("Halted endpoint transferred data"));
+	device.clearHalt(endpoint);
+}
 
 /**
- * Callback called by libusb when an asynchronous transfer completes.
- * Used by testBulkInSpeed() and testBulkOutSpeed()
- * \param transfer pointer to relative libusb_transfer struct
+ * Test if bulk endpoints recover from a halt when the host clears it.
+ * Clearing the halt resets the data toggle, so transfers after the halt
+ * fail if the device does not reset it too.
+ * \param device USB device
+ * \param context USB context
  */
-void decCount(struct libusb_transfer *transfer)
+void testEndpointHalt(Device& device, Context& context)
 {
-	if(numPackets>0) libusb_submit_transfer(transfer);
-	numPackets--;
+	cout<<"Testing endpoint halt... ";
+	cout.flush();
+	unsigned char data[64];
+	memset(data,0,64);
+	//Step 1: halt an OUT endpoint, then check that it works again
+	haltEndpoint(device,1 | Endpoint::OUT);
+	for(int i=0;i<10;i++) device.bulkTransfer(1 | Endpoint::OUT,data,64);
+	//Step 2: halt an IN endpoint, then check that it works again
+	haltEndpoint(device,2 | Endpoint::IN);
+	for(int i=0;i<10;i++)
+		if(device.bulkTransfer(2 | Endpoint::IN,data,64)!=64)
+			throw(runtime_error("Received wrong # of bytes"));
+	cout<<"OK"<<endl;
 }
 
 /**
- * Test bulk out endpoints speed.
- * Note: data sent to the device is discareded, the correctness of
- * data transfers is tested in testBulkEndpoints()
+ * Test bulk endpoints speed, with 19 outstanding transfers, since this is
+ * the max number of 64 byte bulk packets per frame.
+ * Note: data transferred is discarded, the correctness of data transfers is
+ * tested in testBulkEndpoints(). For more thorough measurements use usbbench
  * \param device USB device
  * \param context USB context
+ * \param endpoint endpoint to test
  */
-void testBulkOutSpeed(Device& device, Context& context)
+void testBulkSpeed(Device& device, Context& context, unsigned char endpoint)
 {
-	cout<<"Testing bulk out speed... ";
+	cout<<"Testing bulk "<<(endpoint & Endpoint::IN ? "in" : "out")
+	    <<" speed... ";
 	cout.flush();
-	numPackets=19000-19; //Number of transfers minus the initial ones
-	vector<unsigned char *> buffers;
-	vector<libusb_transfer *> transfers;
+	BenchParams params;
+	params.endpoint=endpoint;
+	params.queueDepth=19;
+	params.transferSize=64;
+	params.count=19000;
+	auto results=runBenchmark(device,context,params);
+	if(results.at(0).errors) throw(runtime_error("Transfer errors"));
+	cout<<"OK"<<endl;
+	printResults(cout,params,results,TEXT);
+}
 
-	//Have 19 outstanding transfers, since this is the max
-	//number of 64 bulk packets per frame
-	for(int i=0;i<19;i++)
+/**
+ * Status of the message queue test of configuration 5, fields are in little
+ * endian. Producer 3 enqueues from the USB interrupt, the others are threads
+ */
+struct QueueStatus
+{
+	unsigned int enqueued[4]; ///< Messages enqueued by each producer
+	unsigned int full[4];     ///< Times each producer found the queue full
+	unsigned int flushState;  ///< 0=idle, 1=flushing, 2=flushed, 3=failed
+	unsigned int discarded;   ///< Bytes discarded by the last cancel
+};
+
+/**
+ * \param device USB device, in configuration 5
+ * \return the status of the message queue test
+ */
+QueueStatus getQueueStatus(Device& device)
+{
+	QueueStatus status;
+	device.controlTransfer(0xc0,0x61,0,0,
+		reinterpret_cast<unsigned char*>(&status),sizeof(status));
+	return status;
+}
+
+/**
+ * Checks the stream of messages enqueued by the producers of configuration 5.
+ * Every message is [0xa5, producer, sequence number low and high byte,
+ * payload size, payload], where payload byte i is producer+sequence+i
+ */
+class MessageChecker
+{
+public:
+	MessageChecker() : next(4,0), count(0) {}
+
+	/**
+	 * Check the data received from the device
+	 * \param data received data, messages may span more calls
+	 * \param size data size
+	 * \throws runtime_error if a message is lost, duplicated, out of order or
+	 * split by a message of another producer
+	 */
+	void add(const unsigned char *data, int size)
 	{
-		unsigned char *buffer=new unsigned char[64];
-		memset(buffer,0,64);
-		libusb_transfer *transfer=libusb_alloc_transfer(0);
-		buffers.push_back(buffer);
-		transfers.push_back(transfer);
-		libusb_fill_bulk_transfer(transfer,device.get(),
-				1 | Endpoint::OUT,buffer,64,decCount,0,
-				device.getTimeout());
-		libusb_submit_transfer(transfer);
+		pending.insert(pending.end(),data,data+size);
+		unsigned int i=0;
+		while(pending.size()-i>=5)
+		{
+			unsigned char *m=&pending[i];
+			if(m[0]!=0xa5 || m[1]>=next.size())
+				throw(runtime_error("Message split or corrupted"));
+			unsigned int producer=m[1];
+			unsigned int sequence=m[2] | m[3]<<8;
+			if(sequence!=next[producer])
+				throw(runtime_error("Message lost, duplicated or out of order"));
+			unsigned int payload=m[4];
+			if(payload!=(producer*7+sequence*13) % 41)
+				throw(runtime_error("Message split or corrupted"));
+			if(pending.size()-i<5+payload) break;
+			for(unsigned int j=0;j<payload;j++)
+				if(m[5+j]!=static_cast<unsigned char>(producer+sequence+j))
+					throw(runtime_error("Message split or corrupted"));
+			next[producer]++;
+			count++;
+			i+=5+payload;
+		}
+		pending.erase(pending.begin(),pending.begin()+i);
 	}
-	//When all transfer complete, we reach -19
-	while(numPackets>-19) libusb_handle_events(context.get());
 
-	for(int i=0;i<transfers.size();i++) delete[] buffers[i];
-	for(int i=0;i<transfers.size();i++) libusb_free_transfer(transfers[i]);
-	cout<<"OK"<<endl;
-}
+	/**
+	 * \param producer producer number
+	 * \return the number of messages of that producer received so far
+	 */
+	unsigned int received(int producer) const { return next.at(producer); }
+
+	/**
+	 * \return the number of messages received so far
+	 */
+	unsigned int received() const { return count; }
+
+	/**
+	 * \return true if there is part of a message yet to be received
+	 */
+	bool isPartial() const { return pending.empty()==false; }
+
+private:
+	vector<unsigned char> pending;
+	vector<unsigned int> next;
+	unsigned int count;
+};
 
 /**
- * Test bulk in endpoints speed.
- * Note: data received from the device is discareded, the correctness of
- * data transfers is tested in testBulkEndpoints()
+ * Test the message queue, with three threads and the USB interrupt of the
+ * device enqueueing messages on the same endpoint. The host pauses from time
+ * to time so that the queue is found full, and the queue buffer is 256 bytes
+ * so that it wraps around many times. Then test that flush() waits until the
+ * host reads the messages, and that cancel() discards them.
  * \param device USB device
  * \param context USB context
  */
-void testBulkInSpeed(Device& device, Context& context)
+void testMessageQueue(Device& device, Context& context)
 {
-	cout<<"Testing bulk in speed... ";
+	cout<<"Testing message queue... ";
 	cout.flush();
-	numPackets=19000-19; //Number of transfers minus the initial ones
-	vector<unsigned char *> buffers;
-	vector<libusb_transfer *> transfers;
-
-	//Have 19 outstanding transfers, since this is the max
-	//number of 64 bulk packets per frame
-	for(int i=0;i<19;i++)
+	//Step 1: concurrent producers
+	const unsigned int numMessages=2000;
+	device.controlTransfer(0x40,0x60,numMessages,0,0,0);
+	MessageChecker checker;
+	unsigned char data[64];
+	for(int i=0;checker.received()<4*numMessages;i++)
 	{
-		unsigned char *buffer=new unsigned char[64];
-		memset(buffer,0,64);
-		libusb_transfer *transfer=libusb_alloc_transfer(0);
-		buffers.push_back(buffer);
-		transfers.push_back(transfer);
-		libusb_fill_bulk_transfer(transfer,device.get(),
-				2 | Endpoint::IN,buffer,64,decCount,0,
-				device.getTimeout());
-		libusb_submit_transfer(transfer);
+		if(i % 50==0) this_thread::sleep_for(20ms);
+		checker.add(data,device.bulkTransfer(1 | Endpoint::IN,data,64));
+	}
+	if(checker.isPartial()) throw(runtime_error("Message split or corrupted"));
+	//The last messages are received before the producer threads terminate
+	this_thread::sleep_for(100ms);
+	QueueStatus status=getQueueStatus(device);
+	unsigned int full=0;
+	for(int i=0;i<4;i++)
+	{
+		if(status.enqueued[i]!=numMessages || checker.received(i)!=numMessages)
+			throw(runtime_error("Wrong # of messages"));
+		full+=status.full[i];
+	}
+	if(full==0) throw(runtime_error("Queue was never full"));
+	//Nothing more has to be sent
+	unsigned int timeout=device.getTimeout();
+	device.setTimeout(100);
+	bool failed=true;
+	try {
+		device.bulkTransfer(1 | Endpoint::IN,data,64);
+	} catch(TimeoutException& e)
+	{
+		failed=false;
 	}
-	//When all transfer complete, we reach -19
-	while(numPackets>-19) libusb_handle_events(context.get());
+	device.setTimeout(timeout);
+	if(failed) throw(runtime_error("Received too many bytes"));
 
-	for(int i=0;i<transfers.size();i++) delete[] buffers[i];
-	for(int i=0;i<transfers.size();i++) libusb_free_transfer(transfers[i]);
+	//Step 2: flush() returns only after the host has read the messages
+	const int numFlushed=4; //Less than the queue buffer, even if not read
+	device.controlTransfer(0x40,0x62,numFlushed,0,0,0);
+	this_thread::sleep_for(200ms);
+	status=getQueueStatus(device);
+	if(status.enqueued[0]!=numFlushed || status.flushState!=1)
+		throw(runtime_error("Flush returned while the host was not reading"));
+	MessageChecker flushChecker;
+	while(flushChecker.received()<numFlushed)
+		flushChecker.add(data,device.bulkTransfer(1 | Endpoint::IN,data,64));
+	if(flushChecker.isPartial())
+		throw(runtime_error("Message split or corrupted"));
+	this_thread::sleep_for(10ms);
+	if(getQueueStatus(device).flushState!=2)
+		throw(runtime_error("Flush did not return after data was read"));
+
+	//Step 3: cancel() discards the messages the host has not read, and wakes
+	//the thread blocked in flush()
+	device.controlTransfer(0x40,0x62,numFlushed,0,0,0);
+	this_thread::sleep_for(200ms);
+	if(getQueueStatus(device).flushState!=1)
+		throw(runtime_error("Flush returned while the host was not reading"));
+	device.controlTransfer(0x40,0x63,0,0,0,0);
+	this_thread::sleep_for(10ms);
+	status=getQueueStatus(device);
+	if(status.flushState!=2) throw(runtime_error("Cancel did not wake flush"));
+	unsigned int bytes=0;
+	for(int i=0;i<numFlushed;i++) bytes+=5+(i*13) % 41;
+	if(status.discarded!=bytes)
+		throw(runtime_error("Cancel discarded wrong # of bytes"));
+	device.setTimeout(100);
+	failed=true;
+	try {
+		device.bulkTransfer(1 | Endpoint::IN,data,64);
+	} catch(TimeoutException& e)
+	{
+		failed=false;
+	}
+	device.setTimeout(timeout);
+	if(failed) throw(runtime_error("Cancelled data was sent"));
 	cout<<"OK"<<endl;
 }
 
@@ -260,19 +517,15 @@ void testBulkInSpeed(Device& device, Context& context)
  * \param func test function
  * \param device USB device
  * \param context USB context
- * \param numPackets optional, to have packet transfer statistics for BULK ep
  */
 void measureTime(function<void (Device&,Context&)> func, Device& device,
-		Context& context, int numPackets=0)
+		Context& context)
 {
 	auto t1=steady_clock::now();
 	func(device,context);
 	auto t2=steady_clock::now();
 	float time=duration<float>(t2-t1).count();
 	cout<<" Time required="<<time<<"s"<<endl;
-	if(numPackets==0) return;
-	cout<<" Average packets per frame="<<(numPackets/1000)/time<<endl;
-	cout<<" Speed="<<static_cast<int>((numPackets*64/1024)/time)<<"KB/s"<<endl;
 }
 
 int main()
@@ -290,8 +543,14 @@ int main()
 		device.claimInterface(0);
 		this_thread::sleep_for(10ms);
 		measureTime(testBulkEndpoints,device,context);
-		measureTime(testBulkOutSpeed,device,context,19000);
-		measureTime(testBulkInSpeed,device,context,19000);
+		measureTime(testBulkDuplex,device,context);
+		testEndpointHalt(device,context);
+		testBulkSpeed(device,context,1 | Endpoint::OUT);
+		testBulkSpeed(device,context,2 | Endpoint::IN);
+		device.setConfiguration(5);
+		device.claimInterface(0);
+		this_thread::sleep_for(10ms);
+		measureTime(testMessageQueue,device,context);
 		device.setConfiguration(1);
 		cout<<"Test passed"<<endl;
 	} catch(exception& e)
@@ -0,0 +1,334 @@
+/***************************************************************************
+ *   Copyright (C) 2011-2024 by Terraneo Federico                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Convert binary traces of mxusb, as read by tracedecode, to pcapng, to view
+ * them in Wireshark alongside host side captures of the same bus.
+ * Setup packets and the packets traced by IN_BUF_FILL and OUT_BUF_READ are
+ * written to an interface with the Linux usbmon link type, so Wireshark
+ * decodes setup packets. Packet data is not traced, so only lengths are
+ * available. All other records are written to a second interface with the
+ * USER0 link type, and every packet has a comment with the decoded record.
+ * Usage: trace2pcapng [-b bus] [-t seconds] output [input]
+ * -b sets the bus number, to match a host capture, default is 0.
+ * -t sets the absolute time of the first record, as seconds since the epoch,
+ * default is the time when the first record is read, which is accurate when
+ * piping from tracecapture. If no input is given, stdin is read.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "tracereader.h"
+
+using namespace std;
+using namespace std::chrono;
+using namespace mxusb;
+
+//pcapng link types
+static const unsigned short LINKTYPE_USB_LINUX_MMAPPED=220;
+static const unsigned short LINKTYPE_USER0=147;
+
+/**
+ * Header of a packet with the LINKTYPE_USB_LINUX_MMAPPED link type, as
+ * documented in the Linux usbmon documentation. Fields are in host byte order
+ */
+struct UsbmonHeader
+{
+	unsigned long long id;    ///< URB id, to match submission and completion
+	unsigned char type;       ///< 'S' submission, 'C' completion, 'E' error
+	unsigned char xferType;   ///< 0 isochronous, 1 interrupt, 2 control, 3 bulk
+	unsigned char epnum;      ///< Endpoint number, bit 7 set for IN
+	unsigned char devnum;     ///< Device address
+	unsigned short busnum;    ///< Bus number
+	char flagSetup;           ///< Zero if setup is valid
+	char flagData;            ///< Zero if data is present
+	long long tsSec;          ///< Timestamp, seconds
+	int tsUsec;               ///< Timestamp, microseconds
+	int status;               ///< URB status
+	unsigned int length;      ///< Length of data
+	unsigned int lenCap;      ///< Length of data captured
+	unsigned char setup[8];   ///< Setup packet
+	int interval;             ///< Interval, for interrupt and isochronous
+	int startFrame;           ///< Start frame, for isochronous
+	unsigned int xferFlags;   ///< URB transfer flags
+	unsigned int ndesc;       ///< Number of isochronous descriptors
+};
+static_assert(sizeof(UsbmonHeader)==64,"Wrong usbmon header size");
+
+/**
+ * Writes a pcapng file with a single section
+ */
+class PcapngWriter
+{
+public:
+	/**
+	 * \param out file to write, opened in binary mode
+	 */
+	explicit PcapngWriter(ostream& out);
+
+	/**
+	 * Add an interface, to be done before writing packets
+	 * \param linkType link type of the interface
+	 * \return the interface id
+	 */
+	int addInterface(unsigned short linkType);
+
+	/**
+	 * Write a packet
+	 * \param interface interface id
+	 * \param us timestamp, microseconds since the epoch
+	 * \param data packet data
+	 * \param comment packet comment
+	 */
+	void packet(int interface, unsigned long long us,
+		const vector<unsigned char>& data, const string& comment);
+
+private:
+	/**
+	 * Write a block
+	 * \param type block type
+	 * \param body block body, padded to 32 bits
+	 */
+	void block(unsigned int type, const vector<unsigned char>& body);
+
+	ostream& out;
+	int interfaces;
+};
+
+/**
+ * Append a value in host byte order
+ */
+template<typename T>
+static void append(vector<unsigned char>& v, T x)
+{
+	const unsigned char *p=reinterpret_cast<const unsigned char*>(&x);
+	v.insert(v.end(),p,p+sizeof(T));
+}
+
+/**
+ * Pad to a multiple of 32 bits
+ */
+static void pad(vector<unsigned char>& v)
+{
+	while(v.size() % 4) v.push_back(0);
+}
+
+PcapngWriter::PcapngWriter(ostream& out) : out(out), interfaces(0)
+{
+	//Section header block
+	vector<unsigned char> body;
+	append<unsigned int>(body,0x1a2b3c4d); //Byte order magic
+	append<unsigned short>(body,1);        //Major version
+	append<unsigned short>(body,0);        //Minor version
+	append<long long>(body,-1);            //Section length, unspecified
+	block(0x0a0d0d0a,body);
+}
+
+int PcapngWriter::addInterface(unsigned short linkType)
+{
+	//Interface description block, default timestamp resolution is 1us
+	vector<unsigned char> body;
+	append<unsigned short>(body,linkType);
+	append<unsigned short>(body,0);     //Reserved
+	append<unsigned int>(body,0);       //Snap length, no limit
+	block(1,body);
+	return interfaces++;
+}
+
+void PcapngWriter::packet(int interface, unsigned long long us,
+	const vector<unsigned char>& data, const string& comment)
+{
+	//Enhanced packet block
+	vector<unsigned char> body;
+	append<unsigned int>(body,interface);
+	append<unsigned int>(body,us>>32);
+	append<unsigned int>(body,us & 0xffffffff);
+	append<unsigned int>(body,data.size()); //Captured length
+	append<unsigned int>(body,data.size()); //Original length
+	body.insert(body.end(),data.begin(),data.end());
+	pad(body);
+	//opt_comment, then opt_endofopt
+	append<unsigned short>(body,1);
+	append<unsigned short>(body,comment.size());
+	body.insert(body.end(),comment.begin(),comment.end());
+	pad(body);
+	append<unsigned int>(body,0);
+	block(6,body);
+}
+
+void PcapngWriter::block(unsigned int type, const vector<unsigned char>& body)
+{
+	const unsigned int length=body.size()+12;
+	out.write(reinterpret_cast<const char*>(&type),4);
+	out.write(reinterpret_cast<const char*>(&length),4);
+	out.write(reinterpret_cast<const char*>(body.data()),body.size());
+	out.write(reinterpret_cast<const char*>(&length),4);
+}
+
+int main(int argc, char *argv[])
+{
+	int bus=0;
+	double start=-1; //Negative means the time the first record is read
+	const char *outName=0, *inName=0;
+	for(int i=1;i<argc;i++)
+	{
+		if(strcmp(argv[i],"-b")==0 && i+1<argc) bus=atoi(argv[++i]);
+		else if(strcmp(argv[i],"-t")==0 && i+1<argc) start=atof(argv[++i]);
+		else if(outName==0 && argv[i][0]!='-') outName=argv[i];
+		else if(inName==0 && argv[i][0]!='-') inName=argv[i];
+		else {
+			outName=0;
+			break;
+		}
+	}
+	if(outName==0)
+	{
+		cerr<<"Usage: trace2pcapng [-b bus] [-t seconds] output [input]"<<endl;
+		return 1;
+	}
+
+	FILE *in=stdin;
+	if(inName)
+	{
+		in=fopen(inName,"rb");
+		if(in==0)
+		{
+			cerr<<"Can't open "<<inName<<endl;
+			return 1;
+		}
+	}
+	ofstream out(outName,ios::binary);
+	if(!out)
+	{
+		cerr<<"Can't open "<<outName<<endl;
+		return 1;
+	}
+
+	PcapngWriter writer(out);
+	const int usbmon=writer.addInterface(LINKTYPE_USB_LINUX_MMAPPED);
+	const int events=writer.addInterface(LINKTYPE_USER0);
+
+	TraceReader reader(in);
+	unsigned char record[TraceFormat::MAX_RECORD_SIZE];
+	int size;
+	unsigned long long base=0; //Time of the first record, us since the epoch
+	unsigned char address=0;
+	unsigned char xferType[32]; //Indexed by endpoint number, bit 4 set for IN
+	memset(xferType,3,sizeof(xferType)); //Bulk until configured
+	xferType[0]=xferType[0x10]=2;        //Endpoint zero is control
+	unsigned long long id=0, packets=0, others=0;
+	while((size=reader.next(record))>0)
+	{
+		if(id==0)
+		{
+			if(start<0) base=duration_cast<microseconds>(
+				system_clock::now().time_since_epoch()).count();
+			else base=start*1e6;
+		}
+		id++;
+		const unsigned long long us=base+reader.toMicroseconds(
+			reader.getCycles());
+		const unsigned char *p=record+TraceFormat::RECORD_HEADER_SIZE;
+		const int paramSize=size-TraceFormat::RECORD_HEADER_SIZE;
+		const string comment=describeRecord(record,size);
+
+		UsbmonHeader h;
+		memset(&h,0,sizeof(h));
+		h.id=id;
+		h.devnum=address;
+		h.busnum=bus;
+		h.flagSetup='-';
+		h.tsSec=us/1000000;
+		h.tsUsec=us % 1000000;
+		bool isPacket=false;
+		switch(record[0])
+		{
+			case Ut::EP0_VALID_SETUP:
+				if(paramSize<8) break;
+				//The host submits a control request
+				h.type='S';
+				h.xferType=2;
+				h.epnum=p[0] & 0x80;
+				h.flagSetup=0;
+				h.flagData= p[0] & 0x80 ? '<' : '>';
+				h.length=toShort(p+6);
+				memcpy(h.setup,p,8);
+				isPacket=true;
+				break;
+			case Ut::IN_BUF_FILL:
+			case Ut::OUT_BUF_READ:
+				if(paramSize<2) break;
+				//A packet, data is not traced so only its length is known
+				h.type='C';
+				h.epnum=p[0] & 0xf;
+				if(record[0]==Ut::IN_BUF_FILL) h.epnum|=0x80;
+				h.xferType=xferType[(p[0] & 0xf) | (h.epnum & 0x80 ? 0x10 : 0)];
+				h.flagData='>';
+				h.length=p[1];
+				isPacket=true;
+				break;
+			case Ut::CONFIGURING_EP:
+				if(paramSize<2) break;
+				//Linux usbmon uses a different numbering for transfer types
+				{
+					static const unsigned char toUsbmon[]={2,0,3,1};
+					xferType[(p[0] & 0xf) | (p[0] & 0x80 ? 0x10 : 0)]=
+						toUsbmon[p[1] & 0x3];
+				}
+				break;
+			case Ut::ADDRESS_SET:
+				if(paramSize>=1) address=p[0];
+				break;
+			case Ut::DEVICE_RESET:
+				address=0;
+				break;
+		}
+		if(isPacket)
+		{
+			vector<unsigned char> data;
+			append(data,h);
+			writer.packet(usbmon,us,data,comment);
+			packets++;
+		} else {
+			vector<unsigned char> data(record,record+size);
+			writer.packet(events,us,data,comment);
+			others++;
+		}
+	}
+	if(inName) fclose(in);
+	cerr<<"Wrote "<<packets<<" packets and "<<others<<" events, "
+	    <<reader.getCorrupted()<<" corrupted frames skipped"<<endl;
+	if(reader.getCyclesPerSecond()==0)
+		cerr<<"Warning: no TRACE_CLOCK record, timestamps are in cycles"<<endl;
+	return 0;
+}
@@ -0,0 +1,141 @@
+/***************************************************************************
+ *   Copyright (C) 2011-2024 by Terraneo Federico                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Capture traces from a device built with MXUSB_ENABLE_TRACE and
+ * MXUSB_TRACE_USB defined in usb_config.h. It drains the tracer of the
+ * device through a vendor request on endpoint zero, and writes the binary
+ * trace stream to a file, or to stdout so it can be piped into tracedecode.
+ * Usage: tracecapture [-t seconds] [-f categories] [-e endpoints] [file]
+ * If no time is given, it captures until interrupted with Ctrl-C.
+ * -f and -e set the trace filter of the device before capturing, as bitmasks
+ * of Ut::Category values and endpoint numbers, so -f 0x14 -e 0x2 traces all
+ * packets of endpoint 1 and nothing else. Prefix with 0x for hexadecimal.
+ */
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include "libusbwrapper.h"
+#include "trace_format.h"
+
+using namespace std;
+using namespace std::chrono;
+using namespace libusb;
+using mxusb::Ut;
+
+//Must match with def_ctrl_pipe.h
+static const unsigned char TRACE_REQUEST=0xfd;
+//Largest control transfer, a short one means the device has no more records
+static const int MAX_TRANSFER=4096;
+
+static volatile sig_atomic_t quit=0;
+
+/**
+ * Stop capturing on Ctrl-C, so that the output is flushed
+ */
+static void sigintHandler(int)
+{
+	quit=1;
+}
+
+int main(int argc, char *argv[])
+{
+	int seconds=0;
+	int categories=-1, endpoints=0xffff; //-1 means don't set the filter
+	const char *filename=0;
+	for(int i=1;i<argc;i++)
+	{
+		if(strcmp(argv[i],"-t")==0 && i+1<argc) seconds=atoi(argv[++i]);
+		else if(strcmp(argv[i],"-f")==0 && i+1<argc)
+			categories=strtol(argv[++i],0,0) & 0xffff;
+		else if(strcmp(argv[i],"-e")==0 && i+1<argc)
+			endpoints=strtol(argv[++i],0,0) & 0xffff;
+		else if(filename==0 && argv[i][0]!='-') filename=argv[i];
+		else {
+			cerr<<"Usage: tracecapture [-t seconds] [-f categories] "
+			      "[-e endpoints] [file]"<<endl;
+			return 1;
+		}
+	}
+	if(categories<0 && endpoints!=0xffff) categories=Ut::CAT_ALL;
+
+	FILE *out=stdout;
+	if(filename)
+	{
+		out=fopen(filename,"wb");
+		if(out==0)
+		{
+			cerr<<"Can't open "<<filename<<endl;
+			return 1;
+		}
+	}
+	signal(SIGINT,sigintHandler);
+
+	unsigned long long total=0;
+	try {
+		Context context;
+		Device device(context,0xdead,0xbeef);
+		device.setTimeout(1000); //1s
+		if(categories>=0)
+			device.controlTransfer(0x40,TRACE_REQUEST,categories,endpoints,
+				0,0);
+		unsigned char data[MAX_TRANSFER];
+		//The first request asks for the CPU clock, needed to decode
+		//timestamps, the following ones only drain records
+		unsigned short wValue=1;
+		auto end=steady_clock::now()+std::chrono::seconds(seconds);
+		while(quit==0)
+		{
+			if(seconds>0 && steady_clock::now()>=end) break;
+			int result=device.controlTransfer(0xc0,TRACE_REQUEST,wValue,0,
+				data,MAX_TRANSFER);
+			wValue=0;
+			if(result>0)
+			{
+				fwrite(data,1,result,out);
+				fflush(out);
+				total+=result;
+			}
+			//Nothing more to read, don't poll endpoint zero continuously
+			if(result<MAX_TRANSFER) this_thread::sleep_for(milliseconds(10));
+		}
+	} catch(exception& e)
+	{
+		cerr<<"Exception:"<<e.what()<<endl;
+		if(filename) fclose(out);
+		return 1;
+	}
+	if(filename) fclose(out);
+	cerr<<"Captured "<<total<<" bytes"<<endl;
+	return 0;
+}
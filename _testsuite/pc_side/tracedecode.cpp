@@ -0,0 +1,213 @@
+/***************************************************************************
+ *   Copyright (C) 2011-2024 by Terraneo Federico                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Decoder for the binary traces that mxusb writes to stdout when
+ * MXUSB_ENABLE_TRACE and MXUSB_TRACE_BINARY are defined, or that tracecapture
+ * reads through USB when MXUSB_TRACE_USB is defined. Record format and
+ * framing are shared with the device through trace_format.h.
+ * It prints a timeline of the trace, with the time of each record and the
+ * time elapsed since the previous one, followed by a summary with packets,
+ * bytes and throughput of each endpoint. Per packet statistics require
+ * verbose TracePoints to be enabled on the device side.
+ * Usage: tracedecode [-s] [file]
+ * If no file is given, the trace is read from stdin, so it can be piped from
+ * a serial port. With -s, only the summary is printed.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include "tracereader.h"
+
+using namespace std;
+using namespace mxusb;
+
+/**
+ * Statistics of a single endpoint direction
+ */
+struct EndpointStats
+{
+	EndpointStats() : packets(0), bytes(0), first(0), last(0) {}
+
+	unsigned int packets;    ///< Number of packets
+	unsigned long long bytes;///< Total bytes
+	long long first;         ///< Cycle count of the first packet
+	long long last;          ///< Cycle count of the last packet
+};
+
+/**
+ * Decodes records, prints the timeline and collects statistics
+ */
+class TraceDecoder
+{
+public:
+	/**
+	 * \param reader where records are read from
+	 * \param timeline true to print the timeline
+	 */
+	TraceDecoder(const TraceReader& reader, bool timeline) : reader(reader),
+		timeline(timeline), lastCycles(0), records(0), setups(0), resets(0),
+		dropped(0) {}
+
+	/**
+	 * Decode a record
+	 * \param record record data, with a valid checksum
+	 * \param size record size
+	 */
+	void decode(const unsigned char *record, int size);
+
+	/**
+	 * Print the summary
+	 */
+	void printSummary();
+
+private:
+	/**
+	 * Update per endpoint statistics
+	 */
+	void packet(map<int,EndpointStats>& stats, int ep, int size);
+
+	const TraceReader& reader;
+	bool timeline;
+	long long lastCycles;
+	unsigned int records;
+	unsigned int setups;
+	unsigned int resets;
+	unsigned int dropped;
+	map<int,EndpointStats> in, out;
+};
+
+void TraceDecoder::decode(const unsigned char *record, int size)
+{
+	const unsigned char *p=record+TraceFormat::RECORD_HEADER_SIZE;
+	const int paramSize=size-TraceFormat::RECORD_HEADER_SIZE;
+	records++;
+	switch(record[0])
+	{
+		case Ut::TRACE_DROPPED:
+			if(paramSize>=4) dropped+=toInt(p);
+			break;
+		case Ut::DEVICE_RESET:
+			resets++;
+			break;
+		case Ut::EP0_VALID_SETUP:
+			setups++;
+			break;
+		case Ut::IN_BUF_FILL:
+			if(paramSize>=2) packet(in,p[0],p[1]);
+			break;
+		case Ut::OUT_BUF_READ:
+			if(paramSize>=2) packet(out,p[0],p[1]);
+			break;
+	}
+	const long long cycles=reader.getCycles();
+	if(timeline)
+		cout<<fixed<<setprecision(1)<<'['<<setw(12)
+		    <<reader.toMicroseconds(cycles)<<"] (+"<<setw(9)
+		    <<reader.toMicroseconds(cycles-lastCycles)<<") "
+		    <<describeRecord(record,size)<<endl;
+	lastCycles=cycles;
+}
+
+void TraceDecoder::packet(map<int,EndpointStats>& stats, int ep, int size)
+{
+	EndpointStats& s=stats[ep];
+	const long long cycles=reader.getCycles();
+	if(s.packets==0) s.first=cycles;
+	s.last=cycles;
+	s.packets++;
+	s.bytes+=size;
+}
+
+void TraceDecoder::printSummary()
+{
+	const bool clock=reader.getCyclesPerSecond()!=0;
+	cout<<"Summary"<<endl
+	    <<" Records="<<records<<" dropped="<<dropped
+	    <<" corrupted frames="<<reader.getCorrupted()<<endl
+	    <<" Duration="<<fixed<<setprecision(1)
+	    <<reader.toMicroseconds(reader.getCycles())<<(clock ? "us" : "cycles")
+	    <<" resets="<<resets<<" setups="<<setups<<endl;
+	const char *dir[]={"IN ","OUT"};
+	map<int,EndpointStats> *stats[]={&in,&out};
+	for(int i=0;i<2;i++)
+	{
+		map<int,EndpointStats>::const_iterator it;
+		for(it=stats[i]->begin();it!=stats[i]->end();++it)
+		{
+			const EndpointStats& s=it->second;
+			cout<<' '<<dir[i]<<" endpoint "<<it->first<<": packets="
+			    <<s.packets<<" bytes="<<s.bytes;
+			double time=reader.toMicroseconds(s.last-s.first);
+			if(clock && time>0)
+				cout<<" throughput="<<setprecision(1)
+				    <<s.bytes/time*1e6/1024.0<<"KB/s";
+			cout<<endl;
+		}
+	}
+	if(in.empty() && out.empty())
+		cout<<" No packet traces, enable verbose traces on the device"
+		    <<endl;
+}
+
+int main(int argc, char *argv[])
+{
+	bool timeline=true;
+	const char *filename=0;
+	for(int i=1;i<argc;i++)
+	{
+		if(strcmp(argv[i],"-s")==0) timeline=false;
+		else if(filename==0 && argv[i][0]!='-') filename=argv[i];
+		else {
+			cerr<<"Usage: tracedecode [-s] [file]"<<endl;
+			return 1;
+		}
+	}
+
+	FILE *in=stdin;
+	if(filename)
+	{
+		in=fopen(filename,"rb");
+		if(in==0)
+		{
+			cerr<<"Can't open "<<filename<<endl;
+			return 1;
+		}
+	}
+
+	TraceReader reader(in);
+	TraceDecoder decoder(reader,timeline);
+	unsigned char record[TraceFormat::MAX_RECORD_SIZE];
+	int size;
+	while((size=reader.next(record))>0) decoder.decode(record,size);
+	if(filename) fclose(in);
+	decoder.printSummary();
+	return 0;
+}
@@ -0,0 +1,227 @@
+/***************************************************************************
+ *   Copyright (C) 2011-2024 by Terraneo Federico                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include <sstream>
+#include "tracereader.h"
+
+using namespace std;
+using namespace mxusb;
+
+//
+// class TraceReader
+//
+
+int TraceReader::next(unsigned char *record)
+{
+	for(;;)
+	{
+		//Skip anything that is not the start of a frame, it may be the
+		//tail of a frame that was partially lost
+		while(!window.empty() && window.front()!=TraceFormat::SYNC)
+			window.pop_front();
+		int size= window.size()>=2 ? window[1] : 0;
+		if(window.size()>=2 && (size<TraceFormat::RECORD_HEADER_SIZE ||
+		   size>TraceFormat::MAX_RECORD_SIZE))
+		{
+			window.pop_front();
+			corrupted++;
+			continue;
+		}
+		if(window.size()<2 || window.size()<
+		   static_cast<size_t>(size)+TraceFormat::FRAME_OVERHEAD)
+		{
+			int c=getc(in);
+			if(c==EOF) return 0;
+			window.push_back(c);
+			continue;
+		}
+		for(int i=0;i<size;i++) record[i]=window[2+i];
+		if(TraceFormat::checksum(record,size)!=window[2+size])
+		{
+			//Not a frame, resync starting from the next byte
+			window.pop_front();
+			corrupted++;
+			continue;
+		}
+		window.erase(window.begin(),
+			window.begin()+size+TraceFormat::FRAME_OVERHEAD);
+
+		//Records may be slightly out of order, so the difference is signed
+		const unsigned int timestamp=TraceFormat::timestamp(record);
+		if(started) cycles+=static_cast<int>(timestamp-lastTimestamp);
+		started=true;
+		lastTimestamp=timestamp;
+		if(record[0]==Ut::TRACE_CLOCK &&
+		   size>=TraceFormat::RECORD_HEADER_SIZE+4)
+			cyclesPerSecond=toInt(record+TraceFormat::RECORD_HEADER_SIZE);
+		return size;
+	}
+}
+
+string describeRecord(const unsigned char *record, int size)
+{
+	const unsigned char *p=record+TraceFormat::RECORD_HEADER_SIZE;
+	const int paramSize=size-TraceFormat::RECORD_HEADER_SIZE;
+	ostringstream os;
+	switch(record[0])
+	{
+		//Standard traces
+		case Ut::DEVICE_STATE_CHANGE:
+			os<<"++DEV New device state=";
+			if(paramSize<1) break;
+			switch(p[0])
+			{
+				case 0: os<<"DEFAULT"; break;
+				case 1: os<<"ADDRESS"; break;
+				case 2: os<<"CONFIGURED"; break;
+				default: os<<static_cast<int>(p[0]);
+			}
+			break;
+		case Ut::DEVICE_RESET:
+			os<<"++DEV Device RESET";
+			break;
+		case Ut::EP0_VALID_SETUP:
+			if(paramSize<8) break;
+			os<<"++EP0 Setup={ bmRequestType=0x"<<hex<<static_cast<int>(p[0])
+			    <<dec<<" bRequest="<<static_cast<int>(p[1])
+			    <<" wValue="<<toShort(p+2)<<" wIndex="<<toShort(p+4)
+			    <<" wLength="<<toShort(p+6)<<" }";
+			break;
+		case Ut::SUSPEND_REQUEST:
+			os<<"++DEV Suspend request";
+			break;
+		case Ut::RESUME_REQUEST:
+			os<<"++DEV Resume request";
+			break;
+		case Ut::EP0_INTERRUPTED_SETUP:
+			os<<"**EP0 Setup interrupts previous transaction";
+			break;
+		case Ut::EP0_IN_ABORT:
+			os<<"**EP0 IN data stage aborted by host";
+			break;
+		case Ut::DESC_ERROR:
+			os<<"**DEV Failed parsing descriptors";
+			break;
+		case Ut::OUT_OF_SHMEM:
+			os<<"**DEV Out of shared memory";
+			break;
+		case Ut::ADDRESS_SET:
+			if(paramSize<1) break;
+			os<<"++DEV Host assigned adress "<<static_cast<int>(p[0]);
+			break;
+		case Ut::CONFIGURING_EP:
+			if(paramSize<2) break;
+			os<<"++DEV configuring "<<(p[0] & 0x80 ? "IN" : "OUT")
+			    <<" endpoint "<<(p[0] & 0x7f)<<" as ";
+			switch(p[1] & 0x3)
+			{
+				case 0: os<<"CONTROL"; break;
+				case 1: os<<"ISOCHRONOUS"; break;
+				case 2: os<<"BULK"; break;
+				case 3: os<<"INTERRUPT"; break;
+			}
+			break;
+		case Ut::EP0_OUT_OVERRUN:
+			os<<"**EP0 Overrun within OUT data stage";
+			break;
+		case Ut::REMOTE_WAKEUP:
+			os<<"++DEV Remote wakeup";
+			break;
+		case Ut::REMOTE_WAKEUP_FEATURE:
+			if(paramSize<1) break;
+			os<<"++DEV Host "<<(p[0] ? "enabled" : "disabled")
+			    <<" remote wakeup";
+			break;
+		case Ut::FIRST_PACKET_AFTER_WAKEUP:
+			os<<"++DEV First packet after remote wakeup";
+			break;
+		case Ut::ENDPOINT_HALT:
+			if(paramSize<2) break;
+			os<<(p[0] & 0x80 ? "++IN  endpoint " : "++OUT endpoint ")
+			    <<(p[0] & 0x7f)<<": "<<(p[1] ? "halted" : "halt cleared");
+			break;
+
+		//Verbose only traces
+		case Ut::EP0_SETUP_IRQ:
+			os<<"+ EP0 SETUP irq";
+			break;
+		case Ut::EP0_IN_IRQ:
+			os<<"+ EP0 IN irq";
+			break;
+		case Ut::EP0_OUT_IRQ:
+			os<<"+ EP0 OUT irq";
+			break;
+		case Ut::EP0_UNSUPP_BREQ:
+			os<<"* EP0 Unsupported bRequest";
+			break;
+		case Ut::EP0_UNSUPP_DESC:
+			os<<"* EP0 Unsupported descriptor";
+			break;
+		case Ut::EP0_STATUS_OUT:
+			os<<"+ EP0 OUT transaction completed";
+			break;
+		case Ut::EP0_STATUS_IN:
+			os<<"+ EP0 IN transaction completed";
+			break;
+		case Ut::IN_BUF_FILL:
+			if(paramSize<2) break;
+			os<<"+ IN  endpoint "<<static_cast<int>(p[0])
+			    <<": buffer filled with "<<static_cast<int>(p[1])<<" bytes";
+			break;
+		case Ut::OUT_BUF_READ:
+			if(paramSize<2) break;
+			os<<"+ OUT endpoint "<<static_cast<int>(p[0])
+			    <<": reading "<<static_cast<int>(p[1])<<" bytes";
+			break;
+		case Ut::RESUME_SIGNAL_END:
+			os<<"+ DEV End of resume signaling";
+			break;
+		case Ut::EP0_DEFERRED:
+			os<<"+ EP0 Request deferred by user code";
+			break;
+
+		//Special traces
+		case Ut::TRACE_CLOCK:
+			if(paramSize<4) break;
+			os<<"++    Tracer started, CPU clock "<<toInt(p)<<"Hz";
+			break;
+		case Ut::TRACE_DROPPED:
+			if(paramSize<4) break;
+			os<<"**    "<<toInt(p)<<" trace records dropped";
+			break;
+		case Ut::DBG_DUMP_EPnR:
+			if(paramSize<2) break;
+			os<<"--> EPnR=0x"<<hex<<toShort(p)<<dec;
+			break;
+		case Ut::MARKER:
+			os<<"-->   Marker";
+			break;
+		default:
+			os<<"+ Error: unknown TracePoint "<<static_cast<int>(record[0]);
+	}
+	return os.str();
+}
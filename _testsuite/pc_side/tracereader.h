@@ -0,0 +1,129 @@
+/***************************************************************************
+ *   Copyright (C) 2011-2024 by Terraneo Federico                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Shared by the host tools that read the binary traces mxusb writes when
+ * MXUSB_TRACE_BINARY or MXUSB_TRACE_USB are defined. The record format and
+ * framing are described in trace_format.h.
+ */
+
+#include <cstdio>
+#include <string>
+#include <deque>
+#include "trace_format.h"
+
+#ifndef TRACEREADER_H
+#define TRACEREADER_H
+
+/**
+ * Reads records from a binary trace stream, resynchronizing if frames are
+ * corrupted, and converts their timestamps to time
+ */
+class TraceReader
+{
+public:
+	/**
+	 * \param in file to read, can be stdin
+	 */
+	explicit TraceReader(FILE *in) : in(in), corrupted(0), started(false),
+		lastTimestamp(0), cycles(0), cyclesPerSecond(0) {}
+
+	/**
+	 * Read the next record. Blocks if the input is a pipe and no data is
+	 * available, so records can be decoded as they are captured
+	 * \param record buffer of at least TraceFormat::MAX_RECORD_SIZE bytes
+	 * \return the record size, or zero at the end of the input
+	 */
+	int next(unsigned char *record);
+
+	/**
+	 * \return the time of the last record read, in CPU cycles since the
+	 * first record. Does not wrap
+	 */
+	long long getCycles() const { return cycles; }
+
+	/**
+	 * \return the CPU clock frequency, or zero if the stream did not start
+	 * with a TRACE_CLOCK record
+	 */
+	unsigned int getCyclesPerSecond() const { return cyclesPerSecond; }
+
+	/**
+	 * \param c a cycle count
+	 * \return the time in microseconds, or c if the clock is unknown
+	 */
+	double toMicroseconds(long long c) const
+	{
+		if(cyclesPerSecond==0) return c;
+		return c*1e6/cyclesPerSecond;
+	}
+
+	/**
+	 * \return the number of frames discarded because they were corrupted
+	 */
+	unsigned int getCorrupted() const { return corrupted; }
+
+private:
+	TraceReader(const TraceReader&);
+	TraceReader& operator= (const TraceReader&);
+
+	FILE *in;
+	std::deque<unsigned char> window; ///< Bytes read, not yet decoded
+	unsigned int corrupted;
+	bool started;
+	unsigned int lastTimestamp;
+	long long cycles;
+	unsigned int cyclesPerSecond;
+};
+
+/**
+ * \param p pointer to two bytes, little endian
+ * \return the value
+ */
+inline unsigned int toShort(const unsigned char *p)
+{
+	return p[0] | p[1]<<8;
+}
+
+/**
+ * \param p pointer to four bytes, little endian
+ * \return the value
+ */
+inline unsigned int toInt(const unsigned char *p)
+{
+	return p[0] | p[1]<<8 | p[2]<<16 | static_cast<unsigned int>(p[3])<<24;
+}
+
+/**
+ * \param record a record
+ * \param size record size
+ * \return a description of the record, in the format used by the tracer
+ * when it prints traces on the device
+ */
+std::string describeRecord(const unsigned char *record, int size);
+
+#endif //TRACEREADER_H
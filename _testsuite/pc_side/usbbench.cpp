@@ -0,0 +1,333 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Bulk and interrupt endpoint benchmark, to be used with the device side of
+ * the testsuite. It keeps a number of transfers in flight on an endpoint and
+ * reports throughput, packets per frame and latency percentiles of individual
+ * transfers. Results can be saved as JSON or CSV, and compared with a JSON
+ * baseline saved from a previous run, for example with an older firmware.
+ * Usage: usbbench [options]
+ * -c config       configuration to select, default 4 (benchmark function)
+ * -a altsetting   alternate setting of interface 0, default 0
+ * -e endpoint     endpoint address, bit 7 set for IN, default 0x82
+ * -i              use interrupt transfers instead of bulk ones
+ * -q depth        number of transfers in flight, default 19
+ * -s size         size of each transfer in bytes, default 64
+ * -t seconds      duration of each repetition, overrides -n
+ * -n count        number of transfers of each repetition, default 19000
+ * -w seconds      warm-up time not measured, default 0
+ * -r repetitions  number of repetitions, default 1
+ * -S size         read an IN endpoint with a StreamReader, with a ring buffer
+ *                 of the given size. Latencies are the time between reads
+ * -d endpoint     also write this OUT endpoint while reading the IN one,
+ *                 through a DuplexSession, to measure aggregate throughput
+ * -Z              don't use transfer buffers shared with the kernel, to
+ *                 compare CPU usage with and without them
+ * -f format       output format, text (default), json or csv
+ * -o file         write output to file instead of stdout
+ * -b baseline     JSON file from a previous run to compare with. The exit
+ *                 code is 2 if throughput or p99 latency are worse than the
+ *                 baseline by more than the threshold
+ * -T percent      regression threshold, default 10
+ * -u serial       benchmark the device with this serial number, when more
+ *                 devices are attached
+ * -p port path    benchmark the device attached to this port, like 1-2.3
+ * -l              list the attached devices that match -u and -p, and exit
+ * -M threads      benchmark all the devices that match -u and -p at the same
+ *                 time, handling their events with the given number of
+ *                 threads. Results are the sum of all devices
+ * The following options drive the benchmark function of configuration 4:
+ * -m mode         source (default) or loop. In loop mode use -d to send the
+ *                 data that is echoed back
+ * -P pattern      zeros, mod63 (default) or none. IN data not matching the
+ *                 pattern counts as an error, except with -S and -d
+ * -k size         IN packet size in source mode, default the endpoint size
+ * -g              print the counters of the device after the benchmark
+ * -G              clear the counters of the device before the benchmark
+ * If none of -m, -P and -k is given the mode is not set, and IN data is not
+ * checked.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "libusbwrapper.h"
+#include "benchmark.h"
+
+using namespace std;
+using namespace libusb;
+
+/**
+ * Find a number in a JSON file written by printResults()
+ * \param json file content
+ * \param key name of the value to find within the summary object
+ * \return the value
+ */
+static double findSummaryValue(const string& json, const string& key)
+{
+	size_t pos=json.find("\"summary\"");
+	if(pos!=string::npos) pos=json.find("\""+key+"\"",pos);
+	if(pos==string::npos) throw(runtime_error("Baseline has no "+key));
+	pos=json.find(':',pos);
+	if(pos==string::npos) throw(runtime_error("Malformed baseline"));
+	return strtod(json.c_str()+pos+1,0);
+}
+
+/**
+ * Compare results with a baseline
+ * \param filename baseline JSON file
+ * \param summary results to compare
+ * \param threshold regression threshold, in percent
+ * \return true if there is a regression
+ */
+static bool compareBaseline(const string& filename, const BenchResult& summary,
+	double threshold)
+{
+	ifstream in(filename);
+	if(!in) throw(runtime_error("Can't open "+filename));
+	stringstream ss;
+	ss<<in.rdbuf();
+	double oldThroughput=findSummaryValue(ss.str(),"throughputKBps");
+	double oldP99=findSummaryValue(ss.str(),"p99");
+	double newThroughput=summary.throughput();
+	double newP99=summary.latency(99);
+	double dThroughput=oldThroughput>0 ?
+		100.0*(newThroughput-oldThroughput)/oldThroughput : 0;
+	double dP99=oldP99>0 ? 100.0*(newP99-oldP99)/oldP99 : 0;
+	cerr<<"Baseline throughput "<<oldThroughput<<"KB/s now "<<newThroughput
+	    <<"KB/s ("<<showpos<<dThroughput<<noshowpos<<"%)"<<endl
+	    <<"Baseline p99 latency "<<oldP99<<"us now "<<newP99
+	    <<"us ("<<showpos<<dP99<<noshowpos<<"%)"<<endl;
+	bool regression=dThroughput< -threshold || dP99>threshold;
+	if(regression) cerr<<"Regression above "<<threshold<<"%"<<endl;
+	return regression;
+}
+
+/**
+ * Vendor requests of the benchmark function
+ */
+enum BenchRequests
+{
+	SET_MODE=0x5d,    ///< wValue is mode and pattern, wIndex IN packet size
+	GET_COUNTERS=0x5e ///< IN returns the counters, OUT clears them
+};
+
+/**
+ * Options of the benchmark function
+ */
+struct FunctionOptions
+{
+	FunctionOptions() : setMode(false), mode(0), pattern(MOD63),
+		inPacketSize(0), clearCounters(false), printCounters(false) {}
+
+	bool setMode;       ///< True to send the SET_MODE request
+	int mode;           ///< 0 for source/sink, 1 for loopback
+	BenchPattern pattern; ///< Data pattern
+	int inPacketSize;   ///< IN packet size, 0 for the endpoint size
+	bool clearCounters; ///< Clear the counters before the benchmark
+	bool printCounters; ///< Print the counters after the benchmark
+};
+
+/**
+ * Select the configuration and alternate setting to benchmark, and set up
+ * the benchmark function
+ * \param device USB device
+ * \param config configuration
+ * \param altSetting alternate setting of interface 0
+ * \param options options of the benchmark function
+ */
+static void prepareDevice(Device& device, int config, int altSetting,
+	const FunctionOptions& options)
+{
+	if(device.getConfiguration()!=config) device.setConfiguration(config);
+	device.setTimeout(1000); //1s
+	device.claimInterface(0);
+	if(altSetting!=0) device.setAltSettings(0,altSetting);
+	if(options.setMode)
+		device.controlTransfer(0x40,SET_MODE,options.mode | options.pattern<<8,
+			options.inPacketSize,0,0);
+	if(options.clearCounters)
+		device.controlTransfer(0x40,GET_COUNTERS,0,0,0,0);
+}
+
+/**
+ * Print the counters of the benchmark function
+ * \param os stream where to print
+ * \param device USB device
+ */
+static void printCounters(ostream& os, Device& device)
+{
+	static const char *names[]=
+	{
+		"inPackets", "inBytes", "outPackets", "outBytes", "patternErrors",
+		"ctrlRequests"
+	};
+	const int numCounters=sizeof(names)/sizeof(names[0]);
+	unsigned char data[4*numCounters];
+	if(device.controlTransfer(0xc0,GET_COUNTERS,0,0,data,sizeof(data))!=
+	   sizeof(data)) throw(runtime_error("Wrong counters size"));
+	for(int i=0;i<numCounters;i++)
+	{
+		unsigned int value=data[4*i] | data[4*i+1]<<8 | data[4*i+2]<<16 |
+			static_cast<unsigned int>(data[4*i+3])<<24;
+		os<<names[i]<<"="<<value<<(i<numCounters-1 ? " " : "\n");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	BenchParams params;
+	int config=4;
+	int altSetting=0;
+	BenchFormat format=TEXT;
+	string outFile, baseline;
+	double threshold=10;
+	string serial, portPath;
+	bool list=false;
+	int threads=0;
+	FunctionOptions options;
+	bool usage=false;
+	for(int i=1;i<argc;i++)
+	{
+		string opt=argv[i];
+		if(opt=="-i") { params.interrupt=true; continue; }
+		if(opt=="-Z") { params.zeroCopy=false; continue; }
+		if(opt=="-l") { list=true; continue; }
+		if(opt=="-g") { options.printCounters=true; continue; }
+		if(opt=="-G") { options.clearCounters=true; continue; }
+		if(i+1>=argc) { usage=true; break; }
+		const char *arg=argv[++i];
+		if(opt=="-c") config=atoi(arg);
+		else if(opt=="-a") altSetting=atoi(arg);
+		else if(opt=="-e") params.endpoint=strtol(arg,0,0);
+		else if(opt=="-q") params.queueDepth=atoi(arg);
+		else if(opt=="-s") params.transferSize=atoi(arg);
+		else if(opt=="-t") params.duration=atof(arg);
+		else if(opt=="-n") params.count=atoi(arg);
+		else if(opt=="-w") params.warmup=atof(arg);
+		else if(opt=="-r") params.repetitions=atoi(arg);
+		else if(opt=="-S") params.streamBuffer=atoi(arg);
+		else if(opt=="-d") params.duplexEndpoint=strtol(arg,0,0);
+		else if(opt=="-o") outFile=arg;
+		else if(opt=="-b") baseline=arg;
+		else if(opt=="-T") threshold=atof(arg);
+		else if(opt=="-u") serial=arg;
+		else if(opt=="-p") portPath=arg;
+		else if(opt=="-M") threads=atoi(arg);
+		else if(opt=="-k")
+		{
+			options.setMode=true;
+			options.inPacketSize=atoi(arg);
+		} else if(opt=="-m")
+		{
+			options.setMode=true;
+			if(strcmp(arg,"source")==0) options.mode=0;
+			else if(strcmp(arg,"loop")==0) options.mode=1;
+			else usage=true;
+		} else if(opt=="-P")
+		{
+			options.setMode=true;
+			if(strcmp(arg,"zeros")==0) options.pattern=ZEROS;
+			else if(strcmp(arg,"mod63")==0) options.pattern=MOD63;
+			else if(strcmp(arg,"none")==0) options.pattern=NONE;
+			else usage=true;
+		} else if(opt=="-f")
+		{
+			if(strcmp(arg,"text")==0) format=TEXT;
+			else if(strcmp(arg,"json")==0) format=JSON;
+			else if(strcmp(arg,"csv")==0) format=CSV;
+			else usage=true;
+		} else usage=true;
+	}
+	if(usage || config<=0 || altSetting<0 || params.queueDepth<=0 ||
+	   params.transferSize<=0 || params.repetitions<=0 || params.warmup<0 ||
+	   params.streamBuffer<0 || threads<0 || options.inPacketSize<0 ||
+	   options.inPacketSize>0xffff ||
+	   (threads>0 && (params.streamBuffer>0 || params.duplexEndpoint!=0)) ||
+	   (params.duration<=0 && params.count<=0))
+	{
+		cerr<<"Usage: usbbench [-c config] [-a altsetting] [-e endpoint] [-i]"
+		      " [-q depth] [-s size] [-t seconds] [-n count] [-w seconds]"
+		      " [-r repetitions] [-S ring buffer size] [-d out endpoint]"
+		      " [-Z] [-f text|json|csv] [-o file] [-b baseline.json]"
+		      " [-T percent] [-u serial] [-p port path] [-l] [-M threads]"
+		      " [-m source|loop] [-P zeros|mod63|none] [-k size] [-g] [-G]"
+		   <<endl;
+		return 1;
+	}
+	if(options.setMode) params.pattern=options.pattern;
+
+	try {
+		Context context;
+		auto found=findDevices(context,0xdead,0xbeef,serial,portPath);
+		if(list)
+		{
+			for(auto& d : found)
+				cout<<d.portPath<<" bus "<<d.bus<<" address "<<d.address
+				    <<" serial \""<<d.serial<<"\""<<endl;
+			return 0;
+		}
+		if(found.empty()) throw(runtime_error("No device found"));
+		vector<BenchResult> results;
+		if(threads>0)
+		{
+			DeviceManager manager(context,threads);
+			for(auto& d : found)
+				prepareDevice(manager.open(d),config,altSetting,options);
+			results=runBenchmark(manager,params);
+			if(options.printCounters)
+				for(int i=0;i<manager.getNumDevices();i++)
+				{
+					cerr<<found.at(i).portPath<<": ";
+					printCounters(cerr,manager.getDevice(i));
+				}
+		} else {
+			Device device(context,found.front());
+			prepareDevice(device,config,altSetting,options);
+			results=runBenchmark(device,context,params);
+			if(options.printCounters) printCounters(cerr,device);
+		}
+		if(outFile.empty()) printResults(cout,params,results,format);
+		else {
+			ofstream out(outFile);
+			if(!out) throw(runtime_error("Can't open "+outFile));
+			printResults(out,params,results,format);
+		}
+		if(!baseline.empty() &&
+		   compareBaseline(baseline,summarize(results),threshold)) return 2;
+	} catch(exception& e)
+	{
+		cerr<<"Exception:"<<e.what()<<endl;
+		return 1;
+	}
+	return 0;
+}
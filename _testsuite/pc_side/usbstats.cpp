@@ -0,0 +1,195 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Performance counter viewer, to be used with a device built with
+ * MXUSB_ENABLE_DIAG_REQUEST defined in usb_config.h.
+ * It periodically reads the counters of USBdevice::getStats() and
+ * USBdevice::getEndpointStats() through the diagnostic vendor request, and
+ * prints the rate of each counter of the endpoints that were active.
+ * Usage: usbstats [-c] [interval ms] [count]
+ * -c clears the counters on the device before starting. If count is omitted,
+ * it runs till interrupted.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "libusbwrapper.h"
+
+using namespace std;
+using namespace std::chrono;
+using namespace libusb;
+
+//These constants must match with usb.h, usb_impl.h and def_ctrl_pipe.h
+static const unsigned char DIAG_REQUEST=0xfe;
+static const unsigned short DIAG_STATS=1;
+static const unsigned char STATS_VERSION=1;
+static const int HEADER_SIZE=4;
+static const int NUM_DEVICE_COUNTERS=6;
+static const int NUM_ENDPOINT_COUNTERS=10;
+static const int MAX_ENDPOINTS=16;
+
+///Order of the counters in EndpointStats
+enum EndpointCounter
+{
+	IN_PACKETS, IN_BYTES, OUT_PACKETS, OUT_BYTES, WRITE_FULL, READ_EMPTY,
+	IN_NAK, OUT_NAK, WAKEUPS, STALLS
+};
+
+static const char *deviceNames[NUM_DEVICE_COUNTERS]=
+{
+	"resets", "suspends", "resumes", "remoteWakeups", "setups", "ep0Aborts"
+};
+
+/**
+ * A snapshot of the device counters
+ */
+struct Stats
+{
+	unsigned int device[NUM_DEVICE_COUNTERS];
+	vector<vector<unsigned int>> endpoints;
+};
+
+static unsigned int toInt(const unsigned char *p)
+{
+	return p[0] | p[1]<<8 | p[2]<<16 | p[3]<<24;
+}
+
+/**
+ * Read the counters from the device
+ * \param device USB device
+ * \return the counters
+ */
+static Stats readStats(Device& device)
+{
+	const int maxSize=HEADER_SIZE+4*(NUM_DEVICE_COUNTERS+
+		MAX_ENDPOINTS*NUM_ENDPOINT_COUNTERS);
+	unsigned char data[maxSize];
+	int size=device.controlTransfer(0xc0,DIAG_REQUEST,0,DIAG_STATS,data,maxSize);
+	if(size<HEADER_SIZE || data[0]!=STATS_VERSION || data[1]>MAX_ENDPOINTS ||
+	   size<HEADER_SIZE+4*(NUM_DEVICE_COUNTERS+data[1]*NUM_ENDPOINT_COUNTERS))
+		throw(runtime_error("Unsupported statistics format"));
+	Stats result;
+	const unsigned char *p=data+HEADER_SIZE;
+	for(int i=0;i<NUM_DEVICE_COUNTERS;i++,p+=4) result.device[i]=toInt(p);
+	result.endpoints.resize(data[1]);
+	for(auto& ep : result.endpoints)
+	{
+		ep.resize(NUM_ENDPOINT_COUNTERS);
+		for(auto& counter : ep) { counter=toInt(p); p+=4; }
+	}
+	return result;
+}
+
+/**
+ * Print the difference between two snapshots as rates
+ * \param a older snapshot
+ * \param b newer snapshot
+ * \param time time between the two snapshots, in seconds
+ */
+static void printRates(const Stats& a, const Stats& b, double time)
+{
+	//Unsigned subtraction handles counters that wrapped around
+	bool first=true;
+	for(int i=0;i<NUM_DEVICE_COUNTERS;i++)
+	{
+		unsigned int delta=b.device[i]-a.device[i];
+		if(delta==0) continue;
+		cout<<(first ? " " : ", ")<<deviceNames[i]<<"="<<delta;
+		first=false;
+	}
+	if(!first) cout<<endl;
+	for(size_t i=0;i<b.endpoints.size() && i<a.endpoints.size();i++)
+	{
+		unsigned int d[NUM_ENDPOINT_COUNTERS];
+		bool active=false;
+		for(int j=0;j<NUM_ENDPOINT_COUNTERS;j++)
+		{
+			d[j]=b.endpoints[i][j]-a.endpoints[i][j];
+			if(d[j]) active=true;
+		}
+		if(!active) continue;
+		cout<<" ep"<<i<<fixed<<setprecision(1)
+		    <<" in: "<<d[IN_PACKETS]/time<<" pkt/s "
+		    <<d[IN_BYTES]/time/1024.0<<" KB/s"
+		    <<" out: "<<d[OUT_PACKETS]/time<<" pkt/s "
+		    <<d[OUT_BYTES]/time/1024.0<<" KB/s"<<endl
+		    <<"     writeFull="<<d[WRITE_FULL]/time<<"/s"
+		    <<" readEmpty="<<d[READ_EMPTY]/time<<"/s"
+		    <<" inNak="<<d[IN_NAK]/time<<"/s"
+		    <<" outNak="<<d[OUT_NAK]/time<<"/s"
+		    <<" wakeups="<<d[WAKEUPS]/time<<"/s"
+		    <<" stalls="<<d[STALLS]<<endl;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	bool clear=false;
+	int interval=1000;
+	int count=-1;
+	int i=1;
+	if(argc>i && strcmp(argv[i],"-c")==0) { clear=true; i++; }
+	if(argc>i) interval=atoi(argv[i++]);
+	if(argc>i) count=atoi(argv[i++]);
+	if(argc>i || interval<=0 || count==0)
+	{
+		cerr<<"Usage: usbstats [-c] [interval ms] [count]"<<endl;
+		return 1;
+	}
+
+	try {
+		Context context;
+		Device device(context,0xdead,0xbeef);
+		device.setTimeout(1000); //1s
+		if(clear) device.controlTransfer(0x40,DIAG_REQUEST,0,DIAG_STATS,0,0);
+
+		Stats prev=readStats(device);
+		auto t1=steady_clock::now();
+		for(int j=0;count<0 || j<count;j++)
+		{
+			this_thread::sleep_for(milliseconds(interval));
+			Stats next=readStats(device);
+			auto t2=steady_clock::now();
+			cout<<"-- "<<duration<double>(t2-t1).count()<<"s"<<endl;
+			printRates(prev,next,duration<double>(t2-t1).count());
+			prev=next;
+			t1=t2;
+		}
+	} catch(exception& e)
+	{
+		cout<<"Exception:"<<e.what()<<endl;
+		return 1;
+	}
+	return 0;
+}
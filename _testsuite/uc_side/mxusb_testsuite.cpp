@@ -29,6 +29,8 @@
 #include <config/usb_config.h>
 #include "miosix.h"
 #include "mxusb/ep0.h"
+#include "mxusb/latency_probe.h"
+#include "mxusb/bench_function.h"
 #include <cstdio>
 #include <cstring>
 
@@ -54,7 +56,7 @@ const unsigned char device[]=
     0x1,        //iManufacturer (string index 1)
     0x2,        //iProduct      (string index 2)
     0x0,        //iSerialNumber (no string)
-    0x2         //bNumConfigrations
+    0x5         //bNumConfigrations
 };
 
 const unsigned char stringLangId[]=
@@ -178,9 +180,148 @@ const unsigned char config2[]=
             0x0,         //bInterval (ignored for bulk)
 };
 
+const unsigned char config3[]=
+{
+    Descriptor::CONFIGURATION_DESC_SIZE,
+    Descriptor::CONFIGURATION,
+    46,0,       //wTotalLength
+    0x1,        //bNumInterfaces
+    0x3,        //bConfigurationValue
+    0x0,        //iConfiguration (no string)
+    0xc0,       //bmAtributes=self powered
+    100/2,      //bMaxPower=100mA
+
+        Descriptor::INTERFACE_DESC_SIZE,
+        Descriptor::INTERFACE,
+        0x0,        //bInterfaceNumber
+        0x0,        //bAlternateSetting
+        0x4,        //bNumEndpoints
+        0xff,       //bInterfaceClass=vendor specific
+        0xff,       //bInterfaceSubClass=vendor specific
+        0xff,       //bInterfaceProtocol=vendor specific
+        0x0,        //iInterface (no string)
+
+            Descriptor::ENDPOINT_DESC_SIZE,
+            Descriptor::ENDPOINT,
+            0x01,        //bEndpointAddress=OUT1
+            Descriptor::INTERRUPT,
+            32,0,        //wMaxPacketSize
+            0x1,         //bInterval (poll every 1ms)
+
+            Descriptor::ENDPOINT_DESC_SIZE,
+            Descriptor::ENDPOINT,
+            0x81,        //bEndpointAddress=IN1
+            Descriptor::INTERRUPT,
+            32,0,        //wMaxPacketSize
+            0x1,         //bInterval (poll every 1ms)
+
+            Descriptor::ENDPOINT_DESC_SIZE,
+            Descriptor::ENDPOINT,
+            0x02,        //bEndpointAddress=OUT2
+            Descriptor::BULK,
+            32,0,        //wMaxPacketSize
+            0x0,         //bInterval (ignored for bulk)
+
+            Descriptor::ENDPOINT_DESC_SIZE,
+            Descriptor::ENDPOINT,
+            0x83,        //bEndpointAddress=IN3
+            Descriptor::BULK,
+            32,0,        //wMaxPacketSize
+            0x0,         //bInterval (ignored for bulk)
+};
+
+const unsigned char config4[]=
+{
+    Descriptor::CONFIGURATION_DESC_SIZE,
+    Descriptor::CONFIGURATION,
+    55,0,       //wTotalLength
+    0x1,        //bNumInterfaces
+    0x4,        //bConfigurationValue
+    0x0,        //iConfiguration (no string)
+    0xc0,       //bmAtributes=self powered
+    100/2,      //bMaxPower=100mA
+
+        Descriptor::INTERFACE_DESC_SIZE,
+        Descriptor::INTERFACE,
+        0x0,        //bInterfaceNumber
+        0x0,        //bAlternateSetting
+        0x2,        //bNumEndpoints
+        0xff,       //bInterfaceClass=vendor specific
+        0xff,       //bInterfaceSubClass=vendor specific
+        0xff,       //bInterfaceProtocol=vendor specific
+        0x0,        //iInterface (no string)
+
+            Descriptor::ENDPOINT_DESC_SIZE,
+            Descriptor::ENDPOINT,
+            0x01,        //bEndpointAddress=OUT1
+            Descriptor::BULK,
+            64,0,        //wMaxPacketSize
+            0x0,         //bInterval (ignored for bulk)
+
+            Descriptor::ENDPOINT_DESC_SIZE,
+            Descriptor::ENDPOINT,
+            0x82,        //bEndpointAddress=IN2
+            Descriptor::BULK,
+            64,0,        //wMaxPacketSize
+            0x0,         //bInterval (ignored for bulk)
+
+        Descriptor::INTERFACE_DESC_SIZE,
+        Descriptor::INTERFACE,
+        0x0,        //bInterfaceNumber
+        0x1,        //bAlternateSetting
+        0x2,        //bNumEndpoints
+        0xff,       //bInterfaceClass=vendor specific
+        0xff,       //bInterfaceSubClass=vendor specific
+        0xff,       //bInterfaceProtocol=vendor specific
+        0x0,        //iInterface (no string)
+
+            Descriptor::ENDPOINT_DESC_SIZE,
+            Descriptor::ENDPOINT,
+            0x01,        //bEndpointAddress=OUT1
+            Descriptor::INTERRUPT,
+            64,0,        //wMaxPacketSize
+            0x1,         //bInterval (poll every 1ms)
+
+            Descriptor::ENDPOINT_DESC_SIZE,
+            Descriptor::ENDPOINT,
+            0x82,        //bEndpointAddress=IN2
+            Descriptor::INTERRUPT,
+            64,0,        //wMaxPacketSize
+            0x1,         //bInterval (poll every 1ms)
+};
+
+const unsigned char config5[]=
+{
+    Descriptor::CONFIGURATION_DESC_SIZE,
+    Descriptor::CONFIGURATION,
+    25,0,       //wTotalLength
+    0x1,        //bNumInterfaces
+    0x5,        //bConfigurationValue
+    0x0,        //iConfiguration (no string)
+    0xc0,       //bmAtributes=self powered
+    100/2,      //bMaxPower=100mA
+
+        Descriptor::INTERFACE_DESC_SIZE,
+        Descriptor::INTERFACE,
+        0x0,        //bInterfaceNumber
+        0x0,        //bAlternateSetting
+        0x1,        //bNumEndpoints
+        0xff,       //bInterfaceClass=vendor specific
+        0xff,       //bInterfaceSubClass=vendor specific
+        0xff,       //bInterfaceProtocol=vendor specific
+        0x0,        //iInterface (no string)
+
+            Descriptor::ENDPOINT_DESC_SIZE,
+            Descriptor::ENDPOINT,
+            0x81,        //bEndpointAddress=IN1
+            Descriptor::BULK,
+            64,0,        //wMaxPacketSize
+            0x0,         //bInterval (ignored for bulk)
+};
+
 const unsigned char * const configurations[]=
 {
-    config1,config2
+    config1,config2,config3,config4,config5
 };
 
 /**
@@ -292,6 +433,19 @@ public:
         }
     }
 
+    /**
+     * Called when the host clears the halt of an endpoint. Since clearing
+     * the halt discards buffered data, refill the buffer of endpoint 2,
+     * otherwise IRQendpoint() would not be called anymore for it.
+     */
+    void IRQhaltCleared(unsigned char epNum, Endpoint::Direction dir)
+    {
+        if(epNum!=2 || dir!=Endpoint::IN) return;
+        unsigned char data[64];
+        int written;
+        Endpoint::IRQget(2).IRQwrite(data,64,written);
+    }
+
     /**
      * \return true if there were errors while reading or writing on endpoint
      * 1 or 2
@@ -350,13 +504,369 @@ void configuration2()
         iprintf("Note: there were errors while reading/wrting on ep 1 or 2\n");
 }
 
+/**
+ * Callbacks that are set up when configuration 3 is selected, to answer the
+ * latency probe used by the latencyprobe tool.
+ */
+class ProbeCallbacks : public Callbacks
+{
+public:
+    ProbeCallbacks() : Callbacks(), interruptProbe(1,1), bulkProbe(2,3) {}
+
+    void IRQendpoint(unsigned char epNum, Endpoint::Direction dir)
+    {
+        interruptProbe.IRQendpoint(epNum,dir);
+        bulkProbe.IRQendpoint(epNum,dir);
+    }
+
+private:
+    LatencyProbe interruptProbe;
+    LatencyProbe bulkProbe;
+};
+
+/**
+ * Handles configuration 3.
+ * There are four endpoints:
+ * - EP1 OUT/IN: interrupt latency probe, handled by the callbacks
+ * - EP2 OUT, EP3 IN: bulk latency probe, handled by the callbacks
+ */
+void configuration3()
+{
+    iprintf("Configuration 3 chosen\n");
+    ProbeCallbacks callbacks;
+    Callbacks::setCallbacks(&callbacks);
+    while(USBdevice::getConfiguration()==3) Thread::sleep(100);
+    Callbacks::setCallbacks(0); //Disable callbacks
+}
+
+///Benchmark function of configuration 4
+static BenchFunction bench(1,2);
+
+/**
+ * Callbacks that are set up when configuration 4 is selected, forwarding
+ * events to the benchmark function.
+ */
+class BenchCallbacks : public Callbacks
+{
+public:
+    void IRQendpoint(unsigned char epNum, Endpoint::Direction dir)
+    {
+        bench.IRQendpoint(epNum,dir);
+    }
+
+    void IRQhaltCleared(unsigned char epNum, Endpoint::Direction dir)
+    {
+        bench.IRQhaltCleared(epNum,dir);
+    }
+
+    void IRQalternateSettingChanged(unsigned char interface)
+    {
+        bench.IRQstart();
+    }
+};
+
+/**
+ * Handles configuration 4, used by the usbbench tool and by the Linux usbtest
+ * driver. There are two endpoints, bulk in alternate setting 0 and interrupt
+ * in alternate setting 1:
+ * - EP1 OUT: benchmark function sink, or loopback
+ * - EP2 IN: benchmark function source, or loopback
+ */
+void configuration4()
+{
+    iprintf("Configuration 4 chosen\n");
+    BenchCallbacks callbacks;
+    Callbacks::setCallbacks(&callbacks);
+    {
+        InterruptDisableLock dLock;
+        bench.IRQstart();
+    }
+    while(USBdevice::getConfiguration()==4) Thread::sleep(100);
+    Callbacks::setCallbacks(0); //Disable callbacks
+    BenchFunction::Counters counters=bench.getCounters();
+    if(counters.patternErrors)
+        iprintf("Note: %u packets did not match the pattern\n",
+                counters.patternErrors);
+}
+
+/**
+ * Message queue test of configuration 5. Three threads and the USB interrupt
+ * enqueue messages on endpoint 1 IN at the same time, so that the host can
+ * check that no message is lost, duplicated or split by another producer.
+ * It also tests flush() and cancel() while the host is not reading.
+ * Every message is [0xa5, producer, sequence number low and high byte,
+ * payload size, payload], where payload byte i is producer+sequence+i.
+ */
+class QueueTest
+{
+public:
+    ///Vendor requests of the message queue test
+    enum Requests
+    {
+        START=0x60, ///< OUT, every producer enqueues wValue messages
+        STATUS=0x61, ///< IN, returns the Status
+        FLUSH=0x62, ///< OUT, producer 0 enqueues wValue messages and flushes
+        CANCEL=0x63 ///< OUT, discards the data not yet read by the host
+    };
+
+    ///State of the flush started by the FLUSH request
+    enum FlushState
+    {
+        FLUSH_IDLE=0,   ///< No flush started
+        FLUSHING=1,     ///< Waiting for the host to read the data
+        FLUSHED=2,      ///< flush() returned true
+        FLUSH_FAILED=3  ///< flush() returned false
+    };
+
+    ///Number of producers, the last one is the USB interrupt
+    static const int PRODUCERS=4;
+
+    ///Producer that enqueues from the USB interrupt
+    static const int IRQ_PRODUCER=PRODUCERS-1;
+
+    ///Returned by the STATUS request, fields are in little endian
+    struct Status
+    {
+        unsigned int enqueued[PRODUCERS]; ///< Messages enqueued by producer
+        unsigned int full[PRODUCERS]; ///< Times a producer found queue full
+        unsigned int flushState; ///< One of FlushState
+        unsigned int discarded; ///< Bytes discarded by the CANCEL request
+    };
+
+    QueueTest() : messages(0), irqSequence(0), started(false),
+            flushStarted(false), running(false)
+    {
+        memset(&status,0,sizeof(status));
+    }
+
+    /**
+     * Handles the vendor requests of the message queue test
+     * \param setup setup packet
+     * \return true if the request was handled
+     */
+    bool IRQsetup(const Setup *setup)
+    {
+        if(setup->bmRequestType==0x40 && setup->bRequest==START &&
+           setup->wIndex==0 && setup->wLength==0)
+        {
+            if(running) return false;
+            memset(&status,0,sizeof(status));
+            messages=setup->wValue;
+            irqSequence=0;
+            running=true;
+            started=true;
+            //The interrupt producer is then kept going by IRQendpoint()
+            IRQproduce();
+            return true;
+        }
+
+        if(setup->bmRequestType==0x40 && setup->bRequest==FLUSH &&
+           setup->wIndex==0 && setup->wLength==0)
+        {
+            if(running) return false;
+            memset(&status,0,sizeof(status));
+            messages=setup->wValue;
+            irqSequence=messages; //No messages from the interrupt
+            status.flushState=FLUSHING;
+            running=true;
+            flushStarted=true;
+            return true;
+        }
+
+        if(setup->bmRequestType==0x40 && setup->bRequest==CANCEL &&
+           setup->wValue==0 && setup->wIndex==0 && setup->wLength==0)
+        {
+            //Also wakes up the thread blocked in flush()
+            status.discarded=Endpoint::IRQget(1).IRQcancel();
+            return true;
+        }
+
+        if(setup->bmRequestType==0xc0 && setup->bRequest==STATUS &&
+           setup->wValue==0 && setup->wIndex==0 &&
+           setup->wLength==sizeof(Status))
+        {
+            memcpy(&snapshot,&status,sizeof(Status));
+            EndpointZeroCallbacks::IRQsetDataBuffer(
+                    reinterpret_cast<unsigned char*>(&snapshot));
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Called every time the host reads a packet from endpoint 1, enqueues the
+     * next message of the interrupt producer. Since there is data in flight
+     * until the queue is empty, it is called again if the queue is full.
+     */
+    void IRQendpoint(unsigned char epNum, Endpoint::Direction dir)
+    {
+        if(epNum==1 && dir==Endpoint::IN) IRQproduce();
+    }
+
+    /**
+     * Runs the test until the configuration is changed
+     */
+    void run()
+    {
+        Endpoint::get(1).setQueueBuffer(queue,sizeof(queue));
+        while(USBdevice::getConfiguration()==5)
+        {
+            if(flushStarted)
+            {
+                flushStarted=false;
+                produce(0);
+                bool success=Endpoint::get(1).flush();
+                status.flushState=success ? FLUSHED : FLUSH_FAILED;
+                running=false;
+                continue;
+            }
+            if(started==false)
+            {
+                Thread::sleep(10);
+                continue;
+            }
+            started=false;
+            Thread *producers[IRQ_PRODUCER];
+            for(int i=0;i<IRQ_PRODUCER;i++)
+            {
+                producerIds[i]=i;
+                producers[i]=Thread::create(producerThread,1024,1,
+                        &producerIds[i],Thread::JOINABLE);
+            }
+            for(int i=0;i<IRQ_PRODUCER;i++) producers[i]->join();
+            running=false;
+        }
+        Endpoint::get(1).setQueueBuffer(0,0);
+    }
+
+private:
+    /**
+     * \param message buffer of at least MAX_MESSAGE_SIZE bytes where the
+     * message is generated
+     * \param producer producer number
+     * \param sequence sequence number of the message
+     * \return the message size
+     */
+    static int makeMessage(unsigned char *message, int producer, int sequence)
+    {
+        //Odd size, so that messages are never aligned to packets or to the
+        //queue buffer
+        int size=(producer*7+sequence*13) % (MAX_MESSAGE_SIZE-5+1);
+        message[0]=0xa5;
+        message[1]=producer;
+        message[2]=sequence & 0xff;
+        message[3]=sequence>>8;
+        message[4]=size;
+        for(int i=0;i<size;i++) message[5+i]=producer+sequence+i;
+        return size+5;
+    }
+
+    /**
+     * Enqueue the next message of the interrupt producer, if any
+     */
+    void IRQproduce()
+    {
+        if(irqSequence>=messages) return;
+        unsigned char message[MAX_MESSAGE_SIZE];
+        int size=makeMessage(message,IRQ_PRODUCER,irqSequence);
+        if(Endpoint::IRQget(1).IRQenqueue(message,size)==false)
+        {
+            status.full[IRQ_PRODUCER]++;
+            return;
+        }
+        status.enqueued[IRQ_PRODUCER]++;
+        irqSequence++;
+    }
+
+    /**
+     * Enqueue the messages of a producer thread, retrying while the queue
+     * is full
+     * \param producer producer number
+     */
+    void produce(int producer)
+    {
+        Endpoint ep=Endpoint::get(1);
+        unsigned char message[MAX_MESSAGE_SIZE];
+        for(unsigned int i=0;i<messages;i++)
+        {
+            int size=makeMessage(message,producer,i);
+            while(ep.enqueue(message,size)==false)
+            {
+                if(USBdevice::isSuspended() || USBdevice::getConfiguration()!=5)
+                    return; //No errors, just suspended/reconfigured
+                status.full[producer]++;
+                Thread::yield();
+            }
+            status.enqueued[producer]++;
+        }
+    }
+
+    static void producerThread(void *argv);
+
+    ///Small queue, so that it is often full and wraps around
+    unsigned char queue[256];
+    static const int MAX_MESSAGE_SIZE=45;
+    Status status;
+    Status snapshot; ///< Copy of status being sent to the host
+    int producerIds[IRQ_PRODUCER]; ///< Arguments of the producer threads
+    volatile unsigned int messages; ///< Messages to enqueue per producer
+    unsigned int irqSequence; ///< Next message of the interrupt producer
+    volatile bool started; ///< Set by START, producer threads to be spawned
+    volatile bool flushStarted; ///< Set by FLUSH, flush to be started
+    volatile bool running; ///< Producers are running
+};
+
+///Message queue test of configuration 5
+static QueueTest queueTest;
+
+void QueueTest::producerThread(void *argv)
+{
+    queueTest.produce(*reinterpret_cast<int*>(argv));
+}
+
+/**
+ * Callbacks that are set up when configuration 5 is selected, forwarding
+ * events to the message queue test.
+ */
+class QueueCallbacks : public Callbacks
+{
+public:
+    void IRQendpoint(unsigned char epNum, Endpoint::Direction dir)
+    {
+        queueTest.IRQendpoint(epNum,dir);
+    }
+};
+
+/**
+ * Handles configuration 5, used to test the message queue.
+ * There is one endpoint:
+ * - EP1 IN: bulk, messages enqueued by three threads and by the callbacks
+ */
+void configuration5()
+{
+    iprintf("Configuration 5 chosen\n");
+    QueueCallbacks callbacks;
+    Callbacks::setCallbacks(&callbacks);
+    queueTest.run();
+    Callbacks::setCallbacks(0); //Disable callbacks
+}
+
 class MyEndpointZeroCallbacks : public EndpointZeroCallbacks
 {
 public:
-    MyEndpointZeroCallbacks() : EndpointZeroCallbacks(), error(false) {}
+    MyEndpointZeroCallbacks() : EndpointZeroCallbacks(), error(false),
+            streamError(false), deferredSuccess(false), benchCounter(0) {}
 
     virtual bool IRQsetup(const Setup* setup)
     {
+        //Requests of the benchmark function, only in configuration 4 since
+        //they can change its endpoints
+        if(USBdevice::IRQgetConfiguration()==4 && bench.IRQsetup(setup))
+            return true;
+        //Requests of the message queue test, only in configuration 5
+        if(USBdevice::IRQgetConfiguration()==5 && queueTest.IRQsetup(setup))
+            return true;
+
         if(setup->bmRequestType==0x40 && setup->bRequest==0xaa &&
            setup->wValue==0xabcd && setup->wIndex==0xcdef && setup->wLength==0)
         {
@@ -375,6 +885,15 @@ public:
             return false; //This is a to test unsupported requests, so reject it
         }
 
+        if(setup->bmRequestType==0x40 && setup->bRequest==0x5a &&
+           setup->wValue==0x0 && setup->wLength==0)
+        {
+            //Halt the endpoint whose address is in wIndex, to test recovery
+            Endpoint::Direction dir=(setup->wIndex & 0x80) ?
+                Endpoint::IN : Endpoint::OUT;
+            return Endpoint::IRQget(setup->wIndex & 0xf).IRQstall(dir);
+        }
+
         if(setup->bmRequestType==0xc0 && setup->bRequest==0x0 &&
            setup->wValue==0x0 && setup->wIndex==0x0 && setup->wLength==128)
         {
@@ -391,28 +910,111 @@ public:
             return true; //OK
         }
 
+        if(setup->bmRequestType==0xc0 && setup->bRequest==0x1 &&
+           setup->wValue==0x0 && setup->wIndex==0x0 && setup->wLength==4000)
+        {
+            //Too large for a buffer, data is generated by IRQinData()
+            EndpointZeroCallbacks::IRQsetDataStream(4000);
+            return true; //OK
+        }
+
+        if(setup->bmRequestType==0x40 && setup->bRequest==0x1 &&
+           setup->wValue==0x0 && setup->wIndex==0x0 && setup->wLength==4000)
+        {
+            //Too large for a buffer, data is checked by IRQoutData()
+            streamError=false;
+            EndpointZeroCallbacks::IRQsetDataStream(4000);
+            return true; //OK
+        }
+
+        if((setup->bmRequestType & 0x7f)==0x40 && setup->bRequest==0x3 &&
+           setup->wValue==0x0 && setup->wIndex==0x0 && setup->wLength<=64 &&
+           ((setup->bmRequestType & 0x80) || setup->wLength==0))
+        {
+            //Short requests used by ctrlbench to measure control transfer
+            //rate, the IN version returns a request counter
+            benchCounter++;
+            for(int i=0;i<setup->wLength;i++) buffer[i]=benchCounter>>(8*(i%4));
+            if(setup->wLength>0) EndpointZeroCallbacks::IRQsetDataBuffer(buffer);
+            return true; //OK
+        }
+
+        if((setup->bmRequestType & 0x7f)==0x40 && setup->bRequest==0x2 &&
+           setup->wValue<=1 && setup->wIndex==0x0 &&
+           setup->wLength==((setup->bmRequestType & 0x80) ? 4 : 0))
+        {
+            //Completed later by completeDeferredRequests(), wValue==1 means
+            //that the request has to fail
+            deferredSuccess=setup->wValue==0;
+            return deferred.IRQput(EndpointZeroCallbacks::IRQdeferRequest());
+        }
+
         error=true;
         return false;
     }
 
     virtual bool IRQendOfOutDataStage(const Setup *setup)
     {
+        if(setup->bRequest==BenchFunction::CTRL_WRITE)
+            return bench.IRQendOfOutDataStage(setup);
+        if(setup->bRequest==0x1) return streamError==false;
         for(int i=0;i<128;i++) if(buffer[i]!=1) return false;
         return true;
     }
 
+    virtual bool IRQinData(const Setup *setup, unsigned short offset,
+            unsigned char *data, unsigned short size)
+    {
+        for(int i=0;i<size;i++) data[i]=(offset+i) % 251;
+        return true;
+    }
+
+    virtual bool IRQoutData(const Setup *setup, unsigned short offset,
+            const unsigned char *data, unsigned short size)
+    {
+        for(int i=0;i<size;i++)
+            if(data[i]!=(offset+i) % 251) streamError=true;
+        return true;
+    }
+
     bool getError() const { return error; }
 
+    /**
+     * Completes deferred requests from a thread, never returns
+     */
+    void completeDeferredRequests()
+    {
+        static const unsigned char reply[]={1,2,3,4};
+        for(;;)
+        {
+            unsigned int token;
+            deferred.get(token);
+            Thread::sleep(100); //Simulate a slow operation
+            EndpointZeroCallbacks::completeRequest(token,deferredSuccess,
+                    reply,sizeof(reply));
+        }
+    }
+
 private:
     volatile bool error;
+    bool streamError;
+    volatile bool deferredSuccess;
+    unsigned int benchCounter;
+    Queue<unsigned int,1> deferred;
     unsigned char buffer[128];
 };
 
+static void deferredThread(void *argv)
+{
+    reinterpret_cast<MyEndpointZeroCallbacks*>(argv)->completeDeferredRequests();
+}
+
 int main()
 {
     USBdevice::enable(device,configurations,strings,nstr);
     MyEndpointZeroCallbacks callbacks;
     EndpointZeroCallbacks::setCallbacks(&callbacks);
+    Thread::create(deferredThread,2048,1,&callbacks);
     for(;;)
     {
         iprintf("Waiting for USB host to configure device\n");
@@ -420,6 +1022,9 @@ int main()
         unsigned char configuration=USBdevice::getConfiguration();
         if(configuration==1) configuration1();
         else if(configuration==2) configuration2();
+        else if(configuration==3) configuration3();
+        else if(configuration==4) configuration4();
+        else if(configuration==5) configuration5();
         else {
             iprintf("Error: wrong configuration %d\n",configuration);
             break;
@@ -0,0 +1,255 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "bench_function.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef _MIOSIX
+#include "kernel/kernel.h"
+using namespace miosix;
+#else //_MIOSIX
+#include "stm32f10x.h"
+#endif //_MIOSIX
+
+using namespace std;
+
+namespace mxusb {
+
+//
+// class BenchFunction
+//
+
+BenchFunction::BenchFunction(unsigned char outEp, unsigned char inEp)
+        : outEp(outEp), inEp(inEp), mode(SOURCE_SINK), pattern(MOD63),
+          inPacketSize(0), pendingSize(0)
+{
+    memset(ctrlBuffer,0,sizeof(ctrlBuffer));
+    memset(&counters,0,sizeof(counters));
+    memset(&snapshot,0,sizeof(snapshot));
+}
+
+void BenchFunction::setMode(Mode mode, Pattern pattern,
+        unsigned short inPacketSize)
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    IRQsetMode(mode,pattern,inPacketSize);
+    #else //_MIOSIX
+    __disable_irq();
+    IRQsetMode(mode,pattern,inPacketSize);
+    __enable_irq();
+    #endif //_MIOSIX
+}
+
+void BenchFunction::IRQsetMode(Mode mode, Pattern pattern,
+        unsigned short inPacketSize)
+{
+    this->mode=mode;
+    this->pattern=pattern;
+    this->inPacketSize=inPacketSize;
+    //Data generated in the previous mode must not reach the host
+    Endpoint::IRQget(inEp).IRQcancel();
+    IRQstart();
+}
+
+BenchFunction::Counters BenchFunction::getCounters() const
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    return counters;
+    #else //_MIOSIX
+    __disable_irq();
+    Counters result=counters;
+    __enable_irq();
+    return result;
+    #endif //_MIOSIX
+}
+
+void BenchFunction::clearCounters()
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    memset(&counters,0,sizeof(counters));
+    #else //_MIOSIX
+    __disable_irq();
+    memset(&counters,0,sizeof(counters));
+    __enable_irq();
+    #endif //_MIOSIX
+}
+
+void BenchFunction::IRQstart()
+{
+    pendingSize=0;
+    if(mode==LOOPBACK) IRQloop();
+    else IRQsource();
+}
+
+void BenchFunction::IRQendpoint(unsigned char epNum, Endpoint::Direction dir)
+{
+    if(mode==LOOPBACK)
+    {
+        if((epNum==outEp && dir==Endpoint::OUT) ||
+           (epNum==inEp && dir==Endpoint::IN)) IRQloop();
+    } else {
+        if(epNum==outEp && dir==Endpoint::OUT) IRQsink();
+        else if(epNum==inEp && dir==Endpoint::IN) IRQsource();
+    }
+}
+
+void BenchFunction::IRQhaltCleared(unsigned char epNum, Endpoint::Direction dir)
+{
+    if(epNum!=inEp || dir!=Endpoint::IN) return;
+    if(mode==LOOPBACK) IRQloop();
+    else IRQsource();
+}
+
+bool BenchFunction::IRQsetup(const Setup *setup)
+{
+    if((setup->bmRequestType & (Setup::TYPE_MASK | Setup::RECIPIENT_MASK))!=
+        (Setup::TYPE_VENDOR | Setup::RECIPIENT_DEVICE)) return false;
+    const bool in=(setup->bmRequestType & Setup::DIR_MASK)==Setup::DIR_IN;
+    switch(setup->bRequest)
+    {
+        case CTRL_WRITE:
+        case CTRL_READ:
+            //As in gadget zero, wValue and wIndex must be zero
+            if(in!=(setup->bRequest==CTRL_READ)) return false;
+            if(setup->wValue!=0 || setup->wIndex!=0) return false;
+            if(setup->wLength>CTRL_BUFFER_SIZE) return false;
+            counters.ctrlRequests++;
+            if(setup->wLength>0)
+                EndpointZeroCallbacks::IRQsetDataBuffer(ctrlBuffer);
+            return true;
+        case SET_MODE:
+        {
+            if(in || setup->wLength!=0) return false;
+            const unsigned char newMode=setup->wValue & 0xff;
+            const unsigned char newPattern=setup->wValue>>8;
+            if(newMode>LOOPBACK || newPattern>NONE) return false;
+            IRQsetMode(static_cast<Mode>(newMode),
+                    static_cast<Pattern>(newPattern),setup->wIndex);
+            return true;
+        }
+        case GET_COUNTERS:
+            if(setup->wValue!=0 || setup->wIndex!=0) return false;
+            if(in==false)
+            {
+                if(setup->wLength!=0) return false;
+                memset(&counters,0,sizeof(counters));
+                return true;
+            }
+            if(setup->wLength>sizeof(snapshot)) return false;
+            //Counters may change during the data stage, send a snapshot
+            snapshot=counters;
+            EndpointZeroCallbacks::IRQsetDataBuffer(
+                    reinterpret_cast<unsigned char*>(&snapshot));
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool BenchFunction::IRQendOfOutDataStage(const Setup *setup)
+{
+    return setup->bRequest==CTRL_WRITE;
+}
+
+void BenchFunction::IRQsource()
+{
+    Endpoint ep=Endpoint::IRQget(inEp);
+    if(ep.IRQisInSideEnabled()==false) return;
+    unsigned char packet[64];
+    int size=min<int>(ep.inSize(),sizeof(packet));
+    if(inPacketSize!=0) size=min<int>(size,inPacketSize);
+    if(pattern==MOD63) for(int i=0;i<size;i++) packet[i]=i % 63;
+    else memset(packet,0,size);
+    //Bulk endpoints are double buffered, so more packets may fit
+    for(;;)
+    {
+        int written;
+        if(ep.IRQwrite(packet,size,written)==false || written==0) return;
+        counters.inPackets++;
+        counters.inBytes+=written;
+    }
+}
+
+void BenchFunction::IRQsink()
+{
+    Endpoint ep=Endpoint::IRQget(outEp);
+    unsigned char packet[64];
+    for(;;)
+    {
+        int readBytes;
+        if(ep.IRQread(packet,readBytes)==false || readBytes==0) return;
+        counters.outPackets++;
+        counters.outBytes+=readBytes;
+        if(checkPattern(packet,readBytes)==false) counters.patternErrors++;
+    }
+}
+
+void BenchFunction::IRQloop()
+{
+    Endpoint out=Endpoint::IRQget(outEp);
+    Endpoint in=Endpoint::IRQget(inEp);
+    for(;;)
+    {
+        if(pendingSize==0)
+        {
+            int readBytes;
+            if(out.IRQread(pending,readBytes)==false || readBytes==0) return;
+            counters.outPackets++;
+            counters.outBytes+=readBytes;
+            pendingSize=readBytes;
+        }
+        int written;
+        if(in.IRQwrite(pending,pendingSize,written)==false || written==0)
+            return; //Retried when the host reads the IN endpoint
+        counters.inPackets++;
+        counters.inBytes+=written;
+        //Only if the IN endpoint is smaller than the OUT one
+        pendingSize-=written;
+        memmove(pending,pending+written,pendingSize);
+    }
+}
+
+bool BenchFunction::checkPattern(const unsigned char *data, int size) const
+{
+    switch(pattern)
+    {
+        case ZEROS:
+            for(int i=0;i<size;i++) if(data[i]!=0) return false;
+            return true;
+        case MOD63:
+            for(int i=0;i<size;i++) if(data[i]!=i % 63) return false;
+            return true;
+        default:
+            return true;
+    }
+}
+
+} //namespace mxusb
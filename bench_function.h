@@ -0,0 +1,226 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#ifndef BENCH_FUNCTION_H
+#define	BENCH_FUNCTION_H
+
+#include "usb.h"
+#include "ep0.h"
+
+namespace mxusb {
+
+/**
+ * A benchmark function, compatible with the source/sink and loopback
+ * functions of the Linux gadget zero, so that it can be driven by the Linux
+ * usbtest driver and by the usbbench tool in the testsuite. It uses a pair
+ * of endpoints, that can be bulk or interrupt:
+ * - in SOURCE_SINK mode, the IN endpoint always has a packet ready with the
+ *   selected pattern, and packets received on the OUT endpoint are checked
+ *   against the pattern and discarded.
+ * - in LOOPBACK mode, packets received on the OUT endpoint are sent back on
+ *   the IN endpoint. When the IN endpoint is full, the OUT endpoint is not
+ *   read, so the host is NAKed instead of losing data.
+ * To use it, forward to it the events of Callbacks and EndpointZeroCallbacks,
+ * as explained in each member function.
+ * With usbtest, use the vendor and product module parameters if the device
+ * does not use the gadget zero ids, 0x0525:0xa4a0. Control requests longer
+ * than CTRL_BUFFER_SIZE are stalled, so run the control write/read test with
+ * a smaller length, e.g: testusb -t 14 -s 256, as the default is 1024.
+ */
+class BenchFunction
+{
+public:
+    /**
+     * Operating modes
+     */
+    enum Mode
+    {
+        SOURCE_SINK=0, ///< Send and discard packets with a pattern
+        LOOPBACK=1     ///< Send back received packets
+    };
+
+    /**
+     * Data patterns, same values as the pattern parameter of gadget zero
+     */
+    enum Pattern
+    {
+        ZEROS=0, ///< All bytes zero
+        MOD63=1, ///< Byte i of each packet is i % 63
+        NONE=2   ///< Data is not generated nor checked
+    };
+
+    /**
+     * Vendor requests on endpoint zero. The first two are the same as gadget
+     * zero, the others are specific to mxusb.
+     */
+    enum Requests
+    {
+        CTRL_WRITE=0x5b,  ///< OUT, data stage is stored in a buffer
+        CTRL_READ=0x5c,   ///< IN, data stage is read from the buffer
+        SET_MODE=0x5d,    ///< OUT without data stage. wValue is the Mode in
+                          ///< the low byte, and the Pattern in the high byte,
+                          ///< wIndex the IN packet size, or zero for the
+                          ///< endpoint size
+        GET_COUNTERS=0x5e ///< IN, returns Counters. OUT without data stage
+                          ///< clears them
+    };
+
+    ///Size of the buffer for CTRL_WRITE and CTRL_READ
+    static const unsigned short CTRL_BUFFER_SIZE=256;
+
+    /**
+     * Counters, as returned by the GET_COUNTERS request. All fields are
+     * little endian
+     */
+    struct Counters
+    {
+        unsigned int inPackets;     ///< Packets written to the IN endpoint
+        unsigned int inBytes;       ///< Bytes written to the IN endpoint
+        unsigned int outPackets;    ///< Packets read from the OUT endpoint
+        unsigned int outBytes;      ///< Bytes read from the OUT endpoint
+        unsigned int patternErrors; ///< OUT packets not matching the pattern
+        unsigned int ctrlRequests;  ///< CTRL_WRITE and CTRL_READ requests
+    };
+
+    /**
+     * Constructor. The function starts in SOURCE_SINK mode with the MOD63
+     * pattern.
+     * \param outEp number of the OUT endpoint
+     * \param inEp number of the IN endpoint, can be the same as outEp for
+     * interrupt endpoints
+     */
+    BenchFunction(unsigned char outEp, unsigned char inEp);
+
+    /**
+     * Select the operating mode. Data written to the IN endpoint and not yet
+     * read by the host is discarded. Can also be selected by the host with
+     * the SET_MODE request.
+     * \param mode operating mode
+     * \param pattern data pattern, used only in SOURCE_SINK mode
+     * \param inPacketSize size of IN packets in SOURCE_SINK mode, or zero
+     * for the endpoint size
+     */
+    void setMode(Mode mode, Pattern pattern, unsigned short inPacketSize=0);
+
+    /**
+     * Same as setMode(), but must be called with interrupts disabled or
+     * within an IRQ.
+     */
+    void IRQsetMode(Mode mode, Pattern pattern, unsigned short inPacketSize=0);
+
+    /**
+     * \return the counters
+     */
+    Counters getCounters() const;
+
+    /**
+     * Reset the counters to zero
+     */
+    void clearCounters();
+
+    /**
+     * Must be called from Callbacks::IRQconfigurationChanged() and
+     * Callbacks::IRQalternateSettingChanged(), to start sending data.
+     */
+    void IRQstart();
+
+    /**
+     * Must be called from Callbacks::IRQendpoint() for every event on the
+     * two endpoints. Events on other endpoints are ignored.
+     * \param epNum endpoint number
+     * \param dir endpoint direction
+     */
+    void IRQendpoint(unsigned char epNum, Endpoint::Direction dir);
+
+    /**
+     * Must be called from Callbacks::IRQhaltCleared(), since clearing the
+     * halt discards buffered data.
+     * \param epNum endpoint number
+     * \param dir endpoint direction
+     */
+    void IRQhaltCleared(unsigned char epNum, Endpoint::Direction dir);
+
+    /**
+     * Must be called from EndpointZeroCallbacks::IRQsetup(). If it returns
+     * true, the request was handled and IRQsetup() must return true.
+     * \param setup the setup packet
+     * \return true if the request is one of Requests, and is valid
+     */
+    bool IRQsetup(const Setup *setup);
+
+    /**
+     * Must be called from EndpointZeroCallbacks::IRQendOfOutDataStage()
+     * for requests accepted by IRQsetup().
+     * \param setup the setup packet
+     * \return true if the data stage was accepted
+     */
+    bool IRQendOfOutDataStage(const Setup *setup);
+
+private:
+    BenchFunction(const BenchFunction&);
+    BenchFunction& operator= (const BenchFunction&);
+
+    /**
+     * In SOURCE_SINK mode, write packets to the IN endpoint till it is full
+     */
+    void IRQsource();
+
+    /**
+     * In SOURCE_SINK mode, read and check all packets of the OUT endpoint
+     */
+    void IRQsink();
+
+    /**
+     * In LOOPBACK mode, move packets from the OUT to the IN endpoint till
+     * the first is empty or the second is full
+     */
+    void IRQloop();
+
+    /**
+     * \param data a packet
+     * \param size packet size
+     * \return true if the packet matches the pattern
+     */
+    bool checkPattern(const unsigned char *data, int size) const;
+
+    unsigned char outEp;         ///< OUT endpoint number
+    unsigned char inEp;          ///< IN endpoint number
+    unsigned char mode;          ///< Current Mode
+    unsigned char pattern;       ///< Current Pattern
+    unsigned short inPacketSize; ///< IN packet size, or zero
+    unsigned short pendingSize;  ///< Size of pending, zero if empty
+    ///In LOOPBACK mode, a packet read but not yet written. Full speed BULK
+    ///and INTERRUPT endpoints are at most 64 bytes
+    unsigned char pending[64];
+    unsigned char ctrlBuffer[CTRL_BUFFER_SIZE]; ///< For CTRL_WRITE/CTRL_READ
+    Counters counters;
+    Counters snapshot; ///< Counters sent by GET_COUNTERS
+};
+
+} //namespace mxusb
+
+#endif //BENCH_FUNCTION_H
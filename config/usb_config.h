@@ -53,6 +53,38 @@ const unsigned short EP0_SIZE=32;
 /// code size it can be disabled.
 //#define MXUSB_ENABLE_DESC_VALIDATION
 
+/// Keep endpoints configured while the device is suspended.<br>
+/// By default, when the host suspends the device all endpoints are
+/// deconfigured, so threads blocked in Endpoint::read() and Endpoint::write()
+/// return with an error and buffered data is lost, and when the host resumes
+/// the device endpoints are configured again. If this is enabled, endpoint
+/// registers and buffers are left untouched, so transfers simply pause while
+/// the device is suspended and continue after it is resumed. This is useful
+/// with hosts that suspend devices aggressively.
+//#define MXUSB_KEEP_ENDPOINTS_ON_SUSPEND
+
+/// Enable the diagnostic vendor request.<br>
+/// When enabled, mxusb records the time taken by the requests that make up
+/// enumeration, and answers vendor requests to the device with bRequest=0xfe
+/// itself, so bRequest 0xfe is reserved and never forwarded to user code.
+/// Only requests with wValue=0 are accepted, others are stalled. With wIndex=0
+/// an IN request returns the enumeration log, an OUT request without data
+/// stage clears it. See enum_log.h for the log format, and enumbench in the
+/// testsuite for a host side tool that uses it. Costs about 270 bytes of RAM.
+/// With wIndex=1 the same requests return and clear the performance counters
+/// of USBdevice::getStats(), see usbstats in the testsuite. The counters are
+/// copied before being sent, which costs about 350 more bytes of RAM.
+//#define MXUSB_ENABLE_DIAG_REQUEST
+
+/// Enable the IRQ profiler.<br>
+/// When enabled, mxusb measures with the cycle counter how long the USB
+/// interrupts take to handle each event, and how long Endpoint::write() and
+/// Endpoint::read() keep interrupts disabled, to check the worst case
+/// interrupt latency they add. Histograms can be read with
+/// USBdevice::getIrqProfile(). Costs about 1KB of RAM, and a few cycles per
+/// event.
+//#define MXUSB_ENABLE_IRQ_PROFILING
+
 /// Enable trace mode.<br>
 /// This spawns a background thread which prints debug data.<br>
 /// Since data is printed in a thread, the time needed to print does not cause
@@ -60,11 +92,27 @@ const unsigned short EP0_SIZE=32;
 //#define MXUSB_ENABLE_TRACE
 
 /// Enable printing also TracePoints tagged as verbose.<br>
-/// Useful for debugging enumeration issues.
+/// Useful for debugging enumeration issues. This only selects the default,
+/// verbose TracePoints can also be enabled at runtime, for selected
+/// endpoints only, with USBdevice::setTraceFilter().
 //#define MXUSB_PRINT_VERBOSE
 
+/// Write traces to stdout as compact binary records instead of formatting
+/// them on the device.<br>
+/// Needs less stack and less bandwidth, so verbose traces can be used
+/// without dropping records. Decode them with tracedecode in the testsuite.
+//#define MXUSB_TRACE_BINARY
+
+/// Instead of using a thread to write traces to stdout, let the host drain
+/// them as binary records through a vendor request on endpoint zero.<br>
+/// Allows to trace devices without a serial port. Capture traces with
+/// tracecapture in the testsuite. Requires no endpoint and no descriptor
+/// changes, but bRequest 0xfd of vendor requests to the device is reserved.
+//#define MXUSB_TRACE_USB
+
 /// Size of buffer used to move data from the interrupt routine to the
-/// printing thread.
+/// printing thread. Must be a power of two. Each trace takes from 7 to 18
+/// bytes, when the buffer is full traces are dropped and counted.
 const unsigned int QUEUE_SIZE=1024;
 
 } //namespace mxusb
@@ -0,0 +1,112 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#ifndef MXUSB_LIBRARY
+#error "This is header is private, it can be used only within mxusb."
+#error "If your code depends on a private header, it IS broken."
+#endif //MXUSB_LIBRARY
+
+#ifdef _MIOSIX
+#include "interfaces/arch_registers.h"
+#else //_MIOSIX
+#include "stm32f10x.h"
+#endif //_MIOSIX
+
+#ifndef CYCLE_COUNTER_H
+#define	CYCLE_COUNTER_H
+
+namespace mxusb {
+
+/**
+ * \internal
+ * Access to the cycle counter of the Cortex-M3 DWT unit, used to take
+ * timestamps for measurements. The counter is 32 bit, so it wraps around
+ * after about a minute at 72MHz. Differences between two timestamps are
+ * correct as long as they are shorter than that.
+ */
+class CycleCounter
+{
+public:
+    /**
+     * Start the cycle counter
+     */
+    static void init()
+    {
+        reg(DEMCR_ADDR)|=DEMCR_TRCENA;
+        reg(DWT_CTRL_ADDR)|=DWT_CTRL_CYCCNTENA;
+    }
+
+    /**
+     * \return the current value of the cycle counter
+     */
+    static unsigned int get() { return reg(DWT_CYCCNT_ADDR); }
+
+    /**
+     * \param cycles a number of cycles
+     * \return the same time interval in microseconds
+     */
+    static unsigned int toMicroseconds(unsigned int cycles)
+    {
+        return cycles/cyclesPerMicrosecond();
+    }
+
+    /**
+     * \return the number of cycles in a microsecond
+     */
+    static unsigned int cyclesPerMicrosecond()
+    {
+        #if __CM3_CMSIS_VERSION >= 0x010030 //CMSIS 1.3 changed variable names
+        return SystemCoreClock/1000000;
+        #else //__CM3_CMSIS_VERSION
+        return SystemFrequency/1000000;
+        #endif //__CM3_CMSIS_VERSION
+    }
+
+private:
+    CycleCounter();
+
+    /**
+     * Old versions of the CMSIS don't define the DWT, so registers are
+     * accessed by address
+     * \param addr register address
+     * \return a reference to the register
+     */
+    static volatile unsigned int& reg(unsigned int addr)
+    {
+        return *reinterpret_cast<volatile unsigned int*>(addr);
+    }
+
+    static const unsigned int DEMCR_ADDR=0xe000edfc;
+    static const unsigned int DWT_CTRL_ADDR=0xe0001000;
+    static const unsigned int DWT_CYCCNT_ADDR=0xe0001004;
+    static const unsigned int DEMCR_TRCENA=1<<24;
+    static const unsigned int DWT_CTRL_CYCCNTENA=1<<0;
+};
+
+} //namespace mxusb
+
+#endif //CYCLE_COUNTER_H
@@ -34,6 +34,7 @@
 #include "usb_tracer.h"
 #include "usb_impl.h"
 #include "ep0.h"
+#include "enum_log.h"
 
 using namespace std;
 
@@ -89,6 +90,7 @@ void DefCtrlPipe::IRQsetup()
     unsigned char *packet=reinterpret_cast<unsigned char*>(&setup);
     SharedMemory::copyBytesFrom(packet,SharedMemory::EP0RX_ADDR,sizeof(setup));
     Tracer::IRQtraceArray(Ut::EP0_VALID_SETUP,packet,sizeof(setup));
+    StatsImpl::IRQdevice().setups++;
 
     if(controlState.state!=CTR_NO_REQ_PENDING)
     {
@@ -98,17 +100,55 @@ void DefCtrlPipe::IRQsetup()
         //Clear EP_KIND in case the interruption happened while EP_KIND was set
         USBREGS->endpoint[0].IRQclearEpKind();
         fixForStallTiming=false;
+        StatsImpl::IRQdevice().ep0Aborts++;
         Tracer::IRQtrace(Ut::EP0_INTERRUPTED_SETUP);
     }
+    EnumerationLog::IRQbegin(setup);
+    //Reset for every request, as IRQin() checks streaming also for standard
+    //requests
+    controlState.ptr=0;
+    controlState.streaming=false;
+    controlState.deferred=false;
+    #ifdef MXUSB_TRACE_USB
+    traceStreaming=false;
+    #endif //MXUSB_TRACE_USB
+
+    #ifdef MXUSB_ENABLE_DIAG_REQUEST
+    if((setup.bmRequestType & (Setup::TYPE_MASK | Setup::RECIPIENT_MASK))==
+        (Setup::TYPE_VENDOR | Setup::RECIPIENT_DEVICE) &&
+        setup.bRequest==DIAG_REQUEST)
+    {
+        IRQdiagRequest();
+        return; //Do not forward to user code
+    }
+    #endif //MXUSB_ENABLE_DIAG_REQUEST
+
+    #ifdef MXUSB_TRACE_USB
+    if((setup.bmRequestType & (Setup::TYPE_MASK | Setup::RECIPIENT_MASK))==
+        (Setup::TYPE_VENDOR | Setup::RECIPIENT_DEVICE) &&
+        setup.bRequest==TRACE_REQUEST)
+    {
+        IRQtraceRequest();
+        return; //Do not forward to user code
+    }
+    #endif //MXUSB_TRACE_USB
 
     //Forward non standard requests to user code via callbacks
     if((setup.bmRequestType & Setup::TYPE_MASK)!=Setup::TYPE_STANDARD)
     {
-        controlState.ptr=0;
-
         if(EndpointZeroCallbacks::IRQgetCallbacks()->IRQsetup(&setup)==false)
             return; //Not recognized as a valid setup request for this device
 
+        //If deferred, NAK the data stage of IN requests, or the status stage
+        //of OUT requests without data, until user code completes the request
+        if(controlState.deferred && (setup.wLength==0 ||
+           (setup.bmRequestType & Setup::DIR_MASK)==Setup::DIR_IN))
+        {
+            controlState.state=CTR_DEFERRED;
+            Tracer::IRQtrace(Ut::EP0_DEFERRED);
+            return;
+        }
+
         if(setup.wLength==0)
         {
                 /*
@@ -125,11 +165,12 @@ void DefCtrlPipe::IRQsetup()
 
         //This is an error, user code has accepted the request, but has
         //not set the buffer for the data stage. So reject the transfer
-        if(controlState.ptr==0) return;
+        if(controlState.ptr==0 && controlState.streaming==false) return;
 
         if(setup.bmRequestType & 0x80)
         {
-            IRQstartInData(controlState.ptr,controlState.size);
+            if(controlState.streaming) IRQstreamInData();
+            else IRQstartInData(controlState.ptr,controlState.size);
         } else {
             controlState.state=CTR_CUSTOM_OUT_IN_PROGRESS;
             IRQsetEp0RxValid();
@@ -139,14 +180,18 @@ void DefCtrlPipe::IRQsetup()
     
     switch(setup.bRequest)
     {
-//        case Setup::CLEAR_FEATURE: TODO
+        case Setup::CLEAR_FEATURE:
+            IRQsetClearFeature(false);
+            break;
         case Setup::GET_CONFIGURATION:
             IRQgetConfiguration();
             break;
         case Setup::GET_DESCRIPTOR:
             IRQgetDescriptor();
             break;
-//        case Setup::GET_INTERFACE: TODO
+        case Setup::GET_INTERFACE:
+            IRQgetInterface();
+            break;
         case Setup::GET_STATUS:
             IRQgetStatus();
             break;
@@ -158,14 +203,19 @@ void DefCtrlPipe::IRQsetup()
             break;
             Tracer::IRQtrace(Ut::EP0_UNSUPP_BREQ);
             break;
-//        case Setup::SET_FEATURE: TODO
-//        case Setup::SET_INTERFACE: TODO
+        case Setup::SET_FEATURE:
+            IRQsetClearFeature(true);
+            break;
+        case Setup::SET_INTERFACE:
+            IRQsetInterface();
+            break;
         case Setup::SET_DESCRIPTOR: //(fallthrough) This won't be implemented.
         case Setup::SYNCH_FRAME:    //(fallthrough) This won't be implemented.
         default:
             Tracer::IRQtrace(Ut::EP0_UNSUPP_BREQ);
             break;
     }
+    EnumerationLog::IRQready();
 }
 
 void DefCtrlPipe::IRQin()
@@ -174,11 +224,12 @@ void DefCtrlPipe::IRQin()
     switch(controlState.state)
     {
         case CTR_IN_IN_PROGRESS:
-            IRQstartInData(controlState.ptr,controlState.size);
+            if(controlState.streaming) IRQstreamInData();
+            else IRQstartInData(controlState.ptr,controlState.size);
             break;
         case CTR_IN_STATUS_BEGIN:
+            //EP_KIND is already set by IRQstartInData()
             controlState.state=CTR_IN_STATUS_END;
-            USBREGS->endpoint[0].IRQsetEpKind();
             IRQsetEp0RxValid();
             break;
         case CTR_SET_ADDRESS:
@@ -190,11 +241,13 @@ void DefCtrlPipe::IRQin()
                 DeviceStateImpl::IRQsetState(USBdevice::ADDRESS);
             else DeviceStateImpl::IRQsetState(USBdevice::DEFAULT);
             Tracer::IRQtrace(Ut::ADDRESS_SET,setup.wValue);
+            EnumerationLog::IRQend();
             break;
         case CTR_OUT_STATUS:
             //End of control OUT request
             controlState.state=CTR_NO_REQ_PENDING;
             Tracer::IRQtrace(Ut::EP0_STATUS_OUT);
+            EnumerationLog::IRQend();
             break;
         default:
             break;
@@ -211,6 +264,7 @@ void DefCtrlPipe::IRQout()
             controlState.state=CTR_NO_REQ_PENDING;
             USBREGS->endpoint[0].IRQclearEpKind();
             Tracer::IRQtrace(Ut::EP0_STATUS_IN);
+            EnumerationLog::IRQend();
             break;
         case CTR_CUSTOM_OUT_IN_PROGRESS:
             IRQstartCustomOutData();
@@ -246,7 +300,10 @@ void DefCtrlPipe::IRQout()
              */
             controlState.state=CTR_NO_REQ_PENDING;
             USBREGS->endpoint[0].IRQclearEpKind();
+            StatsImpl::IRQdevice().ep0Aborts++;
             Tracer::IRQtrace(Ut::EP0_IN_ABORT);
+            //The host ended the data stage early, but the request completed
+            EnumerationLog::IRQend();
             break;
         default:
             break;
@@ -263,33 +320,41 @@ void DefCtrlPipe::IRQdefaultStatus()
     epr.IRQsetRxBuffer(SharedMemory::EP0RX_ADDR,SharedMemory::EP0_SIZE);
     USBREGS->endpoint[0].IRQsetTxStatus(EndpointRegister::STALL);
     USBREGS->endpoint[0].IRQsetRxStatus(EndpointRegister::STALL);
+    //Any ongoing transaction, deferred ones included, is lost
+    controlState.state=CTR_NO_REQ_PENDING;
+    fixForStallTiming=false;
 }
 
 void DefCtrlPipe::IRQrestoreStatus()
 {
-    if(fixForStallTiming==false)
-    {
-        if(txUntouchedFlag)
-            USBREGS->endpoint[0].IRQsetTxStatus(EndpointRegister::STALL);
-        if(rxUntouchedFlag)
-            USBREGS->endpoint[0].IRQsetRxStatus(EndpointRegister::STALL);
-    } else {
-        if(txUntouchedFlag)
-            USBREGS->endpoint[0].IRQsetTxStatus(EndpointRegister::NAK);
-        if(rxUntouchedFlag)
-            USBREGS->endpoint[0].IRQsetRxStatus(EndpointRegister::NAK);
-    }
+    //Status already set by IRQcommitStatus(), the host may have already
+    //completed the transaction, so don't touch the endpoint again
+    if(statusCommitted) return;
+    //A deferred request keeps endpoint zero NAKing till it is completed
+    EndpointRegister::Status untouched=EndpointRegister::STALL;
+    if(fixForStallTiming || controlState.state==CTR_DEFERRED)
+        untouched=EndpointRegister::NAK;
+    //Both directions are written at once, to minimize EPnR accesses
+    USBREGS->endpoint[0].IRQsetTxRxStatus(
+        txUntouchedFlag ? untouched : EndpointRegister::VALID,
+        rxUntouchedFlag ? untouched : EndpointRegister::VALID);
+}
+
+void DefCtrlPipe::IRQcommitStatus()
+{
+    IRQrestoreStatus();
+    statusCommitted=true;
 }
 
 void DefCtrlPipe::IRQsetEp0TxValid()
 {
-    USBREGS->endpoint[0].IRQsetTxStatus(EndpointRegister::VALID);
+    //The endpoint becomes valid when IRQrestoreStatus() is called
     txUntouchedFlag=false;
 }
 
 void DefCtrlPipe::IRQsetEp0RxValid()
 {
-    USBREGS->endpoint[0].IRQsetRxStatus(EndpointRegister::VALID);
+    //The endpoint becomes valid when IRQrestoreStatus() is called
     rxUntouchedFlag=false;
 }
 
@@ -365,22 +430,32 @@ void DefCtrlPipe::IRQsetConfiguration()
     if(config>deviceDesc[17]) return;
     
     //In any case, deconfigure all endpoints except endpoint zero.
-    //Then, if config!=0 reconfigure endpoints
+    //Then, if config!=0 reconfigure endpoints. This has to be done before
+    //the status stage, as the host may use the endpoints right after it
     EndpointImpl::IRQdeconfigureAll();
-    
     if(config!=0)
     {
-        DeviceStateImpl::IRQsetConfiguration(config);
+        DeviceStateImpl::IRQresetAlternateSettings();
         EndpointImpl::IRQconfigureAll(IRQgetConfigDesc(config));
+    }
+
+    //STATUS handshake is an IN with zero bytes. Arm it now, so that the
+    //host doesn't have to wait for the callbacks and threads woken up by
+    //the configuration and state change
+    controlState.state=CTR_OUT_STATUS;
+    USBREGS->endpoint[0].IRQsetTxDataSize(0);
+    IRQsetEp0TxValid();
+    EnumerationLog::IRQready();
+    IRQcommitStatus();
+
+    if(config!=0)
+    {
+        DeviceStateImpl::IRQsetConfiguration(config);
         DeviceStateImpl::IRQsetState(USBdevice::CONFIGURED);
     } else {
         DeviceStateImpl::IRQsetConfiguration(0);
         DeviceStateImpl::IRQsetState(USBdevice::ADDRESS);
     }
-    //STATUS handshake is an IN with zero bytes
-    controlState.state=CTR_OUT_STATUS;
-    USBREGS->endpoint[0].IRQsetTxDataSize(0);
-    IRQsetEp0TxValid();
 }
 
 void DefCtrlPipe::IRQgetStatus()
@@ -397,17 +472,117 @@ void DefCtrlPipe::IRQgetStatus()
             //Get SELF_POWERED information from current configuration descriptor
             if(configDesc[USBdevice::IRQgetConfiguration()-1][7] & 0x40)
                 result=1;
-            //Remote wakeup not yet implemented
+            if(DeviceStateImpl::isRemoteWakeupEnabled()) result|=2;
             IRQstartInData(reinterpret_cast<unsigned char*>(&result),2);
             break;
         case Setup::RECIPIENT_INTERFACE:
             //The standard says to return zero, so just do it
             IRQstartInData(reinterpret_cast<unsigned char*>(&result),2);
             break;
-//        case Setup::RECIPIENT_ENDPOINT: TODO
+        case Setup::RECIPIENT_ENDPOINT:
+        {
+            if(setup.wIndex & 0xff70) return; //Not an endpoint address
+            const unsigned char epNum=setup.wIndex & 0xf;
+            const Endpoint::Direction dir=(setup.wIndex & 0x80) ?
+                Endpoint::IN : Endpoint::OUT;
+            if(epNum!=0)
+            {
+                if(USBdevice::IRQgetState()!=USBdevice::CONFIGURED) return;
+                EndpointImpl *epi=EndpointImpl::IRQget(epNum);
+                //Request invalid if the endpoint does not exist
+                if(dir==Endpoint::IN && epi->getData().enabledIn==0) return;
+                if(dir==Endpoint::OUT && epi->getData().enabledOut==0) return;
+                if(epi->IRQisHalted(dir)) result=1;
+            }
+            IRQstartInData(reinterpret_cast<unsigned char*>(&result),2);
+            break;
+        }
+        default:
+            return;
+    }
+}
+
+void DefCtrlPipe::IRQsetClearFeature(bool set)
+{
+    //If wrong direction or length, ignore
+    if((setup.bmRequestType & Setup::DIR_MASK)==Setup::DIR_IN) return;
+    if(setup.wLength!=0) return;
+    switch(setup.bmRequestType & Setup::RECIPIENT_MASK)
+    {
+        case Setup::RECIPIENT_DEVICE:
+            //TEST_MODE is only for high speed devices
+            if(setup.wValue!=Setup::DEVICE_REMOTE_WAKEUP) return;
+            if(setup.wIndex!=0) return;
+            if(USBdevice::IRQgetState()!=USBdevice::CONFIGURED) return;
+            //Reject the request if the configuration descriptor does not
+            //declare remote wakeup support in bmAttributes
+            if((configDesc[USBdevice::IRQgetConfiguration()-1][7] & 0x20)==0)
+                return;
+            DeviceStateImpl::IRQsetRemoteWakeupEnabled(set);
+            Tracer::IRQtrace(Ut::REMOTE_WAKEUP_FEATURE,set ? 1 : 0);
+            break;
+        case Setup::RECIPIENT_ENDPOINT:
+        {
+            if(setup.wValue!=Setup::ENDPOINT_HALT) return;
+            if(setup.wIndex & 0xff70) return; //Not an endpoint address
+            const unsigned char epNum=setup.wIndex & 0xf;
+            const Endpoint::Direction dir=(setup.wIndex & 0x80) ?
+                Endpoint::IN : Endpoint::OUT;
+            if(epNum==0)
+            {
+                //Halting endpoint zero is not supported, but clearing its
+                //halt is allowed in any state, and does nothing
+                if(set) return;
+                break;
+            }
+            if(USBdevice::IRQgetState()!=USBdevice::CONFIGURED) return;
+            EndpointImpl *epi=EndpointImpl::IRQget(epNum);
+            if(epi->IRQsetHalt(dir,set)==false) return; //Not enabled
+            if(set==false)
+                Callbacks::IRQgetCallbacks()->IRQhaltCleared(epNum,dir);
+            break;
+        }
         default:
             return;
     }
+    //STATUS handshake is an IN with zero bytes
+    controlState.state=CTR_OUT_STATUS;
+    USBREGS->endpoint[0].IRQsetTxDataSize(0);
+    IRQsetEp0TxValid();
+}
+
+void DefCtrlPipe::IRQgetInterface()
+{
+    //Shorthand for DIR_IN and RECIPIENT_INTERFACE
+    if(setup.bmRequestType!=(Setup::DIR_IN | Setup::RECIPIENT_INTERFACE))
+        return;
+    if(setup.wValue!=0 || setup.wLength!=1) return;
+    //Request invalid if device not configured.
+    if(USBdevice::IRQgetState()!=USBdevice::CONFIGURED) return;
+    const unsigned char *config=IRQgetConfigDesc(USBdevice::IRQgetConfiguration());
+    //config[4]=bNumInterfaces
+    if(setup.wIndex>=config[4] || setup.wIndex>=MAX_INTERFACES) return;
+    unsigned char alt=DeviceStateImpl::getAlternateSetting(setup.wIndex);
+    IRQstartInData(&alt,1);
+}
+
+void DefCtrlPipe::IRQsetInterface()
+{
+    //Shorthand for DIR_OUT and RECIPIENT_INTERFACE
+    if(setup.bmRequestType!=Setup::RECIPIENT_INTERFACE) return;
+    if(setup.wLength!=0 || (setup.wValue & 0xff00) || (setup.wIndex & 0xff00))
+        return;
+    //Request invalid if device not configured.
+    if(USBdevice::IRQgetState()!=USBdevice::CONFIGURED) return;
+    const unsigned char *config=IRQgetConfigDesc(USBdevice::IRQgetConfiguration());
+    //Only the endpoints of this interface are reconfigured, so data transfer
+    //on other interfaces is not interrupted
+    if(EndpointImpl::IRQsetAlternateSetting(config,setup.wIndex,
+            setup.wValue)==false) return;
+    //STATUS handshake is an IN with zero bytes
+    controlState.state=CTR_OUT_STATUS;
+    USBREGS->endpoint[0].IRQsetTxDataSize(0);
+    IRQsetEp0TxValid();
 }
 
 void DefCtrlPipe::IRQstartInData(const unsigned char* data, unsigned short size)
@@ -426,24 +601,30 @@ void DefCtrlPipe::IRQstartInData(const unsigned char* data, unsigned short size)
         //transaction no one will write to that pointer, so the cast is safe
         controlState.ptr=const_cast<unsigned char *>(data)+EP0_SIZE;
         controlState.size=size-EP0_SIZE;
-        Tracer::IRQtrace(Ut::IN_BUF_FILL,0,EP0_SIZE);
+        size=EP0_SIZE;
     } else {
         SharedMemory::copyBytesTo(SharedMemory::EP0TX_ADDR,data,size);
         ep.IRQsetTxDataSize(size);
         controlState.state=CTR_IN_STATUS_BEGIN;
-        Tracer::IRQtrace(Ut::IN_BUF_FILL,0,size);
     }
+    EndpointStats& stats=StatsImpl::IRQendpoint(0);
+    stats.inPackets++;
+    stats.inBytes+=size;
+    Tracer::IRQtrace(Ut::IN_BUF_FILL,0,size);
     IRQsetEp0TxValid();
     //It looks like the host can abort an IN data stage by issuing the STATUS
     //packet (a zero-byte OUT packet) sooner than expected. To support this,
     //we enable the endpoint for RX too, only for zero-size packets (EP_KIND)
-    USBREGS->endpoint[0].IRQsetEpKind();
+    if((ep.get() & USB_EP0R_EP_KIND)==0) ep.IRQsetEpKind();
     IRQsetEp0RxValid();
 }
 
 void DefCtrlPipe::IRQstartCustomOutData()
 {
     const unsigned short received=USBREGS->endpoint[0].IRQgetReceivedBytes();
+    EndpointStats& stats=StatsImpl::IRQendpoint(0);
+    stats.outPackets++;
+    stats.outBytes+=received;
     Tracer::IRQtrace(Ut::OUT_BUF_READ,0,received);
 
     if(received>controlState.size)
@@ -452,9 +633,24 @@ void DefCtrlPipe::IRQstartCustomOutData()
         return;
     }
 
-    SharedMemory::copyBytesFrom(controlState.ptr,SharedMemory::EP0RX_ADDR,
-            received);
-    controlState.ptr+=received;
+    if(controlState.streaming)
+    {
+        SharedMemory::copyBytesFrom(streamBuffer,SharedMemory::EP0RX_ADDR,
+                received);
+        if(EndpointZeroCallbacks::IRQgetCallbacks()->IRQoutData(&setup,
+            controlState.offset,streamBuffer,received)==false)
+        {
+            //STALL, since the received data was not acknowledged by user code
+            controlState.state=CTR_NO_REQ_PENDING;
+            fixForStallTiming=false;
+            return;
+        }
+        controlState.offset+=received;
+    } else {
+        SharedMemory::copyBytesFrom(controlState.ptr,SharedMemory::EP0RX_ADDR,
+                received);
+        controlState.ptr+=received;
+    }
     controlState.size-=received;
     
     if(controlState.size>0)
@@ -468,6 +664,13 @@ void DefCtrlPipe::IRQstartCustomOutData()
 
     //We reach here when the last transfer arrived, disable the fix
     fixForStallTiming=false;
+
+    if(controlState.deferred)
+    {
+        controlState.state=CTR_DEFERRED;
+        Tracer::IRQtrace(Ut::EP0_DEFERRED);
+        return;
+    }
     
     if(EndpointZeroCallbacks::IRQgetCallbacks()->IRQendOfOutDataStage(&setup))
     {
@@ -478,10 +681,138 @@ void DefCtrlPipe::IRQstartCustomOutData()
     } //else STALL, since the received data was not acknowledged by user code
 }
 
+void DefCtrlPipe::IRQstreamInData()
+{
+    #ifdef MXUSB_TRACE_USB
+    if(traceStreaming)
+    {
+        const int size=min<unsigned short>(controlState.size,EP0_SIZE);
+        const int drained=Tracer::IRQdrain(streamBuffer,size);
+        //When there are no more records a short packet ends the data stage,
+        //even if it is shorter than wLength
+        if(drained<size) controlState.size=drained;
+        IRQstartInData(streamBuffer,controlState.size);
+        return;
+    }
+    #endif //MXUSB_TRACE_USB
+    //A zero size packet, sent when size is a multiple of EP0_SIZE, does not
+    //need data from user code
+    const unsigned short size=min<unsigned short>(controlState.size,EP0_SIZE);
+    if(size>0 && EndpointZeroCallbacks::IRQgetCallbacks()->IRQinData(&setup,
+        controlState.offset,streamBuffer,size)==false)
+    {
+        //STALL, since user code has aborted the transfer
+        controlState.state=CTR_NO_REQ_PENDING;
+        USBREGS->endpoint[0].IRQclearEpKind();
+        return;
+    }
+    controlState.offset+=size;
+    //streamBuffer holds the first bytes of the data left to send, and that's
+    //all IRQstartInData() reads, as it sends at most one packet
+    IRQstartInData(streamBuffer,controlState.size);
+}
+
+bool DefCtrlPipe::IRQcompleteCustomRequest(unsigned int token, bool success,
+        const unsigned char *data, unsigned short size)
+{
+    if(controlState.state!=CTR_DEFERRED || token!=deferToken) return false;
+    controlState.deferred=false;
+    const bool in=(setup.bmRequestType & Setup::DIR_MASK)==Setup::DIR_IN;
+    if(in && setup.wLength>0 && controlState.streaming==false && data==0)
+        success=false; //No data to send
+    //Endpoint zero is NAKing, so it is safe to change its status here, even
+    //if we aren't called from the USB interrupt handler
+    txUntouchedFlag=true;
+    rxUntouchedFlag=true;
+    statusCommitted=false;
+    if(success==false)
+    {
+        controlState.state=CTR_NO_REQ_PENDING;
+    } else if(in && setup.wLength>0) {
+        if(controlState.streaming) IRQstreamInData();
+        else IRQstartInData(data,min(size,setup.wLength));
+    } else {
+        //STATUS handshake is an IN with zero bytes
+        controlState.state=CTR_OUT_STATUS;
+        USBREGS->endpoint[0].IRQsetTxDataSize(0);
+        IRQsetEp0TxValid();
+    }
+    //Same as at the end of the USB interrupt, STALLs untouched directions
+    IRQrestoreStatus();
+    return true;
+}
+
+#ifdef MXUSB_ENABLE_DIAG_REQUEST
+/// \internal Counters sent by the diagnostic request. Interrupts keep
+/// incrementing the counters during the data stage, so a copy is sent to
+/// keep them consistent
+static StatsImpl::Statistics statsSnapshot;
+
+void DefCtrlPipe::IRQdiagRequest()
+{
+    //wIndex selects the diagnostic data, 0 is the enumeration log and
+    //1 the performance counters
+    if(setup.wValue!=0 || setup.wIndex>DIAG_STATS) return;
+    if((setup.bmRequestType & Setup::DIR_MASK)==Setup::DIR_IN)
+    {
+        if(setup.wLength==0) return;
+        if(setup.wIndex==DIAG_STATS)
+        {
+            statsSnapshot=StatsImpl::IRQget();
+            IRQstartInData(
+                    reinterpret_cast<const unsigned char*>(&statsSnapshot),
+                    min<unsigned short>(sizeof(statsSnapshot),setup.wLength));
+            return;
+        }
+        const EnumerationLog::Log& log=EnumerationLog::IRQget();
+        unsigned short size=4+log.numEntries*sizeof(EnumerationLog::Entry);
+        IRQstartInData(reinterpret_cast<const unsigned char*>(&log),
+                min(size,setup.wLength));
+    } else {
+        //An OUT request clears the log, to measure a reset started by the
+        //host, or the counters, to measure a benchmark run
+        if(setup.wLength!=0) return;
+        if(setup.wIndex==DIAG_STATS) StatsImpl::IRQclear();
+        else EnumerationLog::IRQclear();
+        //STATUS handshake is an IN with zero bytes
+        controlState.state=CTR_OUT_STATUS;
+        USBREGS->endpoint[0].IRQsetTxDataSize(0);
+        IRQsetEp0TxValid();
+    }
+}
+#endif //MXUSB_ENABLE_DIAG_REQUEST
+
+#ifdef MXUSB_TRACE_USB
+void DefCtrlPipe::IRQtraceRequest()
+{
+    if((setup.bmRequestType & Setup::DIR_MASK)!=Setup::DIR_IN)
+    {
+        //An OUT request sets the filter, wValue is the bitmask of categories
+        //and wIndex the bitmask of endpoints
+        if(setup.wLength!=0) return;
+        Tracer::IRQsetFilter(setup.wValue,setup.wIndex);
+        //STATUS handshake is an IN with zero bytes
+        controlState.state=CTR_OUT_STATUS;
+        USBREGS->endpoint[0].IRQsetTxDataSize(0);
+        IRQsetEp0TxValid();
+        return;
+    }
+    //wValue=1 asks for the CPU clock before the records
+    if(setup.wLength==0 || setup.wValue>1 || setup.wIndex!=0) return;
+    if(setup.wValue==1) Tracer::IRQrequestClock();
+    controlState.streaming=true;
+    traceStreaming=true;
+    controlState.size=setup.wLength;
+    IRQstreamInData();
+}
+#endif //MXUSB_TRACE_USB
+
 bool DefCtrlPipe::validateConfigEndpoint(const unsigned char* config, int num)
 {
     xassert(config[0]==9);     //Descriptor size
     xassert(config[5]==num+1); //Expecting config descriptors in order
+    const unsigned char bNumInterfaces=config[4];
+    xassert(bNumInterfaces<=MAX_INTERFACES);
 
     //Parse descriptors nested in the configuration descriptor
     const unsigned short wTotalLength=toShort(&config[2]);
@@ -495,7 +826,14 @@ bool DefCtrlPipe::validateConfigEndpoint(const unsigned char* config, int num)
         bool out;       //True if OUT side used
         bool interrupt; //True if INTERRUPT type
     };
-    EpCheck used[NUM_ENDPOINTS-1];
+    EpCheck used[NUM_ENDPOINTS-1]; //Endpoints of current alternate setting
+
+    //Endpoints can be shared among alternate settings of an interface, but
+    //not among interfaces, since changing alternate setting reconfigures them
+    unsigned char owner[NUM_ENDPOINTS-1];
+    for(int i=0;i<NUM_ENDPOINTS-1;i++) owner[i]=0xff;
+    unsigned char numAlternateSettings[MAX_INTERFACES]={0};
+    int interface=-1; //Interface being parsed
 
     for(;;)
     {
@@ -511,7 +849,12 @@ bool DefCtrlPipe::validateConfigEndpoint(const unsigned char* config, int num)
         {
             case Descriptor::INTERFACE:
                 xassert(config[curDescBase+0]==9); //Descriptor size
-                xassert(config[curDescBase+3]==0); //Alt settings unsupported
+                interface=config[curDescBase+2];
+                xassert(interface<bNumInterfaces);
+                //Alternate settings must be in order, starting from zero
+                xassert(config[curDescBase+3]==numAlternateSettings[interface]);
+                numAlternateSettings[interface]++;
+                for(int i=0;i<NUM_ENDPOINTS-1;i++) used[i]=EpCheck();
                 break;
             case Descriptor::ENDPOINT:
                 xassert(config[curDescBase+0]==7); //Descriptor size
@@ -524,6 +867,11 @@ bool DefCtrlPipe::validateConfigEndpoint(const unsigned char* config, int num)
                 //This limits the number of endpoints to NUM_ENDPOINTS
                 xassert(epAddr<NUM_ENDPOINTS && epAddr!=0);
 
+                //Endpoints must be nested in an interface descriptor
+                xassert(interface!=-1);
+                xassert(owner[epAddr-1]==0xff || owner[epAddr-1]==interface);
+                owner[epAddr-1]=interface;
+
                 //No two descriptor with same ep address and same direction
                 //Moreover, if two endpoint have the same number and opposite
                 //direction, they must be of type INTERRUPT
@@ -573,6 +921,16 @@ bool DefCtrlPipe::validateConfigEndpoint(const unsigned char* config, int num)
                         config[curDescBase+1]);
         }
     }
+
+    //Every interface needs at least alternate setting zero
+    for(int i=0;i<bNumInterfaces;i++) xassert(numAlternateSettings[i]!=0);
+
+    //Every interface gets enough shared memory for its largest alternate
+    //setting, check that they all fit
+    unsigned int memory=0;
+    for(int i=0;i<bNumInterfaces;i++)
+        memory+=EndpointImpl::interfaceMemorySize(config,i);
+    xassert(memory<=SharedMemory::END-SharedMemory::DYNAMIC_AREA);
     return true;
 }
 
@@ -582,11 +940,17 @@ const unsigned char * const * DefCtrlPipe::stringsDesc=0;
 unsigned char DefCtrlPipe::numStringDesc=0;
 DefCtrlPipe::ControlStateMachine DefCtrlPipe::controlState=
 {
-    DefCtrlPipe::CTR_NO_REQ_PENDING,0,0
+    DefCtrlPipe::CTR_NO_REQ_PENDING,0,0,false,0,false
 };
 Setup DefCtrlPipe::setup;
 bool DefCtrlPipe::txUntouchedFlag;
 bool DefCtrlPipe::rxUntouchedFlag;
 bool DefCtrlPipe::fixForStallTiming=false;
+bool DefCtrlPipe::statusCommitted=false;
+unsigned char DefCtrlPipe::streamBuffer[EP0_SIZE];
+#ifdef MXUSB_TRACE_USB
+bool DefCtrlPipe::traceStreaming=false;
+#endif //MXUSB_TRACE_USB
+unsigned int DefCtrlPipe::deferToken=0;
 
 } //namespace mxusb
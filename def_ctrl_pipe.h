@@ -92,6 +92,46 @@ public:
         controlState.size=setup.wLength;
     }
 
+    /**
+     * Allows custom requests to transfer data one packet at a time, through
+     * the IRQinData() and IRQoutData() callbacks
+     * \param size if data transfer is IN, the number of bytes to send. It is
+     * clamped to wLength. If data transfer is OUT, wLength bytes are received
+     */
+    static void IRQsetStreamForCustomRequest(unsigned short size)
+    {
+        controlState.streaming=true;
+        controlState.offset=0;
+        if(setup.bmRequestType & Setup::DIR_IN)
+            controlState.size=size<setup.wLength ? size : setup.wLength;
+        else controlState.size=setup.wLength;
+    }
+
+    /**
+     * Allows custom requests to defer their completion to a later call to
+     * IRQcompleteCustomRequest(). Meant to be called from within the IRQsetup()
+     * callback.
+     * \return a token that identifies the deferred request
+     */
+    static unsigned int IRQdeferCustomRequest()
+    {
+        controlState.deferred=true;
+        return ++deferToken;
+    }
+
+    /**
+     * Complete a custom request that was deferred
+     * \param token the value returned by IRQdeferCustomRequest()
+     * \param success if false, the request is STALLed
+     * \param data for IN requests that did not set up streaming, the data to
+     * send. Ignored otherwise
+     * \param size size of data, clamped to wLength
+     * \return false if the request was not pending anymore, because it was
+     * already completed or aborted by the host
+     */
+    static bool IRQcompleteCustomRequest(unsigned int token, bool success,
+            const unsigned char *data, unsigned short size);
+
     /**
      * Set default status for endpoint zero.
      * This configures endpoint zero as CONTROL endpoint, setting tx/rx buffers.
@@ -115,10 +155,11 @@ public:
      */
     static void IRQstatusNak()
     {
-        USBREGS->endpoint[0].IRQsetTxStatus(EndpointRegister::NAK);
-        USBREGS->endpoint[0].IRQsetRxStatus(EndpointRegister::NAK);
+        USBREGS->endpoint[0].IRQsetTxRxStatus(EndpointRegister::NAK,
+                EndpointRegister::NAK);
         txUntouchedFlag=true;
         rxUntouchedFlag=true;
+        statusCommitted=false;
     }
 
     /**
@@ -129,10 +170,24 @@ public:
      * 0 handling code is called. If that code has to set a direction to valid,
      * it calls IRQsetEp0[Tx|Rx]Valid() which clears the untouched flag for that
      * direction. Therefore, this member function will simply set to STALL the
-     * directions where the untouched flag is still set.
+     * directions where the untouched flag is still set, and to VALID the
+     * others. Both directions are set with a single EPnR write, so it must be
+     * called after every change to the untouched flags.
      */
     static void IRQrestoreStatus();
 
+    #ifdef MXUSB_ENABLE_DIAG_REQUEST
+    ///bRequest of the diagnostic vendor request
+    static const unsigned char DIAG_REQUEST=0xfe;
+    ///wIndex of the diagnostic request that selects the performance counters
+    static const unsigned short DIAG_STATS=1;
+    #endif //MXUSB_ENABLE_DIAG_REQUEST
+
+    #ifdef MXUSB_TRACE_USB
+    ///bRequest of the vendor request that drains the tracer
+    static const unsigned char TRACE_REQUEST=0xfd;
+    #endif //MXUSB_TRACE_USB
+
     /**
      * Get a configuration descriptor
      * \param config a valid configuration descriptor number.
@@ -158,7 +213,8 @@ private:
         CTR_IN_STATUS_BEGIN,///<Last data loaded to SharedMemory for host to get
         CTR_IN_STATUS_END,  ///<Waiting for OUT packet with size 0 from host
         CTR_SET_ADDRESS,    ///<Same as CTR_OUT_STATUS, but adress will change
-        CTR_CUSTOM_OUT_IN_PROGRESS///< OUT in progress, for custom requests
+        CTR_CUSTOM_OUT_IN_PROGRESS,///< OUT in progress, for custom requests
+        CTR_DEFERRED        ///<Waiting for user code to complete a request
     };
 
     /**
@@ -174,22 +230,52 @@ private:
         ///Number of bytes yet to send.
         ///Valid iff state==(CTR_IN_IN_PROGRESS | CTR_CUSTOM_OUT_IN_PROGRESS)
         unsigned short size;
+        ///True if data of a custom request is passed one packet at a time
+        ///through callbacks, in this case ptr is not used
+        bool streaming;
+        ///Position within the data stage. Valid iff streaming==true
+        unsigned short offset;
+        ///True if user code has deferred the completion of a custom request
+        bool deferred;
     };
 
     /**
      * Code for endpoint 0 handling must call this function instead of
      * USBREGS->endpoint[0].setTxStatus(Endpoint::VALID), since this member function
-     * clears the untouched flag on tx direction
+     * clears the untouched flag on tx direction. The endpoint becomes valid
+     * only when IRQrestoreStatus() is called
      */
     static void IRQsetEp0TxValid();
 
     /**
      * Code for endpoint 0 handling must call this function instead of
      * USBREGS->endpoint[0].setRxStatus(Endpoint::VALID), since this member function
-     * clears the untouched flag on rx direction
+     * clears the untouched flag on rx direction. The endpoint becomes valid
+     * only when IRQrestoreStatus() is called
      */
     static void IRQsetEp0RxValid();
 
+    /**
+     * Same as IRQrestoreStatus(), but can be called while processing a
+     * request, when the rest of the processing does not affect the response.
+     * The USB interrupt handler will then leave endpoint zero untouched.
+     */
+    static void IRQcommitStatus();
+
+    #ifdef MXUSB_ENABLE_DIAG_REQUEST
+    /**
+     * Handles the diagnostic vendor request
+     */
+    static void IRQdiagRequest();
+    #endif //MXUSB_ENABLE_DIAG_REQUEST
+
+    #ifdef MXUSB_TRACE_USB
+    /**
+     * Handles the vendor request that drains the tracer
+     */
+    static void IRQtraceRequest();
+    #endif //MXUSB_TRACE_USB
+
     /**
      * Handles the GET_DESCRIPTOR request
      */
@@ -215,6 +301,22 @@ private:
      */
     static void IRQgetStatus();
 
+    /**
+     * Handles the SET_FEATURE and CLEAR_FEATURE requests
+     * \param set true if SET_FEATURE, false if CLEAR_FEATURE
+     */
+    static void IRQsetClearFeature(bool set);
+
+    /**
+     * Handles the GET_INTERFACE request
+     */
+    static void IRQgetInterface();
+
+    /**
+     * Handles the SET_INTERFACE request
+     */
+    static void IRQsetInterface();
+
     /**
      * Validate a configuration endpoint
      * \param config configuration endpoint
@@ -238,6 +340,13 @@ private:
      */
     static void IRQstartCustomOutData();
 
+    /**
+     * Same as IRQstartInData(), but data is requested to user code one packet
+     * at a time, for custom requests that use streaming, or to the tracer
+     * for the trace request
+     */
+    static void IRQstreamInData();
+
     static const unsigned char *deviceDesc; ///<Pointer to device descriptor
     static const unsigned char * const * configDesc; ///<Array of config desc
     static const unsigned char * const * stringsDesc;  ///<Array of string desc
@@ -265,6 +374,18 @@ private:
     /// variable temporarily to true causes IRQrestoreStatus() to NAK instead
     /// of STALL. It is not a clean fix, but it's the best I've found.
     static bool fixForStallTiming;
+    ///True if IRQcommitStatus() was called while processing the current
+    ///endpoint zero interrupt
+    static bool statusCommitted;
+    ///Packet buffer for custom requests that use streaming
+    static unsigned char streamBuffer[EP0_SIZE] __attribute__((aligned(4)));
+    ///Identifies the last deferred request, so that completing a request the
+    ///host has already aborted has no effect
+    static unsigned int deferToken;
+    #ifdef MXUSB_TRACE_USB
+    ///True if the current streaming request is the trace request
+    static bool traceStreaming;
+    #endif //MXUSB_TRACE_USB
 };
 
 } //namespace mxusb
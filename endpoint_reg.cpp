@@ -70,6 +70,20 @@ void EndpointRegister::IRQsetRxStatus(Status status)
     EPR=reg;
 }
 
+void EndpointRegister::IRQsetTxRxStatus(Status tx, Status rx)
+{
+    unsigned short reg=EPR;
+    //Clear all toggle bits except STAT_TX and STAT_RX
+    reg &= ~(USB_EP0R_DTOG_RX | USB_EP0R_DTOG_TX);
+    //Avoid clearing an interrupt flag because of a read-modify-write
+    reg |= USB_EP0R_CTR_RX | USB_EP0R_CTR_TX;
+    if(tx & (1<<0)) reg ^=USB_EP0R_STAT_TX_0;
+    if(tx & (1<<1)) reg ^=USB_EP0R_STAT_TX_1;
+    if(rx & (1<<0)) reg ^=USB_EP0R_STAT_RX_0;
+    if(rx & (1<<1)) reg ^=USB_EP0R_STAT_RX_1;
+    EPR=reg;
+}
+
 void EndpointRegister::IRQsetTxBuffer(shmem_ptr addr, unsigned short size)
 {
     int ep=EPR & USB_EP0R_EA;
@@ -110,6 +110,15 @@ public:
         return static_cast<EndpointRegister::Status>((EPR>>12) & 0x3);
     }
 
+    /**
+     * Set the way an endpoint answers both IN and OUT transactions.
+     * Faster than calling IRQsetTxStatus() and IRQsetRxStatus(), since the
+     * register is written only once
+     * \param tx DISABLED/STALL/NAK/VALID for IN transactions
+     * \param rx DISABLED/STALL/NAK/VALID for OUT transactions
+     */
+    void IRQsetTxRxStatus(Status tx, Status rx);
+
     /**
      * Set tx buffer for an endpoint. It is used for IN transactions
      * \param addr address of buffer, as returned by SharedMemory::allocate()
@@ -167,6 +176,34 @@ public:
         SharedMemory::shortAt(SharedMemory::BTABLE_ADDR+8*ep+6)=size;
     }
 
+    /**
+     * \return the size of the data in the tx buffer
+     */
+    unsigned short IRQgetTxDataSize() const
+    {
+        int ep=EPR & USB_EP0R_EA;
+        return SharedMemory::shortAt(SharedMemory::BTABLE_ADDR+8*ep+2) & 0x3ff;
+    }
+
+    /**
+     * \return the size of the data in alternate tx buffer 0.
+     * It is used for double buffered BULK IN endpoints.
+     */
+    unsigned short IRQgetTxDataSize0() const
+    {
+        return IRQgetTxDataSize();
+    }
+
+    /**
+     * \return the size of the data in alternate tx buffer 1.
+     * It is used for double buffered BULK IN endpoints.
+     */
+    unsigned short IRQgetTxDataSize1() const
+    {
+        int ep=EPR & USB_EP0R_EA;
+        return SharedMemory::shortAt(SharedMemory::BTABLE_ADDR+8*ep+6) & 0x3ff;
+    }
+
     /**
      * Set rx buffer for an endpoint. It is used for OUT transactions
      * \param addr address of buffer, as returned by SharedMemory::allocate()
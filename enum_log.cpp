@@ -0,0 +1,116 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "enum_log.h"
+#include "cycle_counter.h"
+#include <cstring>
+
+#ifdef MXUSB_ENABLE_DIAG_REQUEST
+
+namespace mxusb {
+
+//
+// class EnumerationLog
+//
+
+void EnumerationLog::IRQclear()
+{
+    memset(&log,0,sizeof(log));
+    log.version=VERSION;
+    base=CycleCounter::get();
+    pending=0;
+    IRQadd(CONNECT,0);
+}
+
+void EnumerationLog::IRQreset()
+{
+    pending=0;
+    IRQadd(RESET,0);
+}
+
+void EnumerationLog::IRQbegin(const Setup& setup)
+{
+    pending=0;
+    if((setup.bmRequestType & Setup::TYPE_MASK)!=Setup::TYPE_STANDARD) return;
+    switch(setup.bRequest)
+    {
+        case Setup::SET_ADDRESS:
+        case Setup::GET_DESCRIPTOR:
+        case Setup::SET_CONFIGURATION:
+            pending=IRQadd(setup.bRequest,setup.wValue);
+            //Events without stages have start==ready==end, but requests
+            //have yet to complete
+            if(pending) pending->end=0;
+            break;
+        default:
+            break;
+    }
+}
+
+void EnumerationLog::IRQready()
+{
+    //Only the first call counts, requests may arm their response before
+    //completing their processing
+    if(pending && pending->ready==pending->start) pending->ready=IRQnow();
+}
+
+void EnumerationLog::IRQend()
+{
+    if(pending==0) return;
+    pending->end=IRQnow();
+    pending=0;
+}
+
+EnumerationLog::Entry *EnumerationLog::IRQadd(unsigned char event,
+        unsigned short wValue)
+{
+    if(log.numEntries>=MAX_ENTRIES)
+    {
+        if(log.dropped<255) log.dropped++;
+        return 0;
+    }
+    Entry *result=&log.entries[log.numEntries++];
+    result->event=event;
+    result->wValue=wValue;
+    result->start=IRQnow();
+    result->ready=result->start;
+    result->end=result->start;
+    return result;
+}
+
+unsigned int EnumerationLog::IRQnow()
+{
+    return CycleCounter::toMicroseconds(CycleCounter::get()-base);
+}
+
+EnumerationLog::Log EnumerationLog::log;
+unsigned int EnumerationLog::base=0;
+EnumerationLog::Entry *EnumerationLog::pending=0;
+
+} //namespace mxusb
+
+#endif //MXUSB_ENABLE_DIAG_REQUEST
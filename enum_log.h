@@ -0,0 +1,157 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#ifndef MXUSB_LIBRARY
+#error "This is header is private, it can be used only within mxusb."
+#error "If your code depends on a private header, it IS broken."
+#endif //MXUSB_LIBRARY
+
+#include <config/usb_config.h>
+#include "ep0.h"
+
+#ifndef ENUM_LOG_H
+#define	ENUM_LOG_H
+
+namespace mxusb {
+
+/**
+ * \internal
+ * Records when the requests that make up the enumeration of the device are
+ * received and completed, to measure enumeration time. The log can be read
+ * by the host through the diagnostic vendor request, see
+ * MXUSB_ENABLE_DIAG_REQUEST in usb_config.h. If that option is disabled,
+ * all member functions do nothing.
+ */
+class EnumerationLog
+{
+public:
+    ///Event recorded when the device connects to the bus
+    static const unsigned char CONNECT=0xfe;
+    ///Event recorded when the host resets the device
+    static const unsigned char RESET=0xff;
+    ///Maximum number of events in the log. Further events are dropped
+    static const int MAX_ENTRIES=16;
+    ///Log format version, incremented on incompatible changes
+    static const unsigned char VERSION=1;
+
+    /**
+     * A log entry. All times are in microseconds since the device connected
+     * to the bus, that is, since the last call to IRQclear()
+     */
+    struct Entry
+    {
+        unsigned char event;   ///<bRequest of the setup packet, or CONNECT/RESET
+        unsigned char reserved;///<Unused, always zero
+        unsigned short wValue; ///<wValue of the setup packet
+        unsigned int start;    ///<When the setup packet was received
+        unsigned int ready;    ///<When the device armed its response
+        unsigned int end;      ///<When the status stage completed, or zero
+    };
+
+    /**
+     * The log, as sent to the host. All fields are little endian
+     */
+    struct Log
+    {
+        unsigned char version;   ///<Log format version
+        unsigned char numEntries;///<Number of valid entries
+        unsigned char dropped;   ///<Number of entries dropped, saturates at 255
+        unsigned char reserved;  ///<Unused, always zero
+        Entry entries[MAX_ENTRIES];
+    };
+
+    #ifdef MXUSB_ENABLE_DIAG_REQUEST
+
+    /**
+     * Clear the log, and start measuring time from now. A CONNECT event is
+     * added to the log
+     */
+    static void IRQclear();
+
+    /**
+     * Called when the host resets the device
+     */
+    static void IRQreset();
+
+    /**
+     * Called when a setup packet is received. Only the standard requests
+     * used during enumeration are recorded
+     * \param setup the setup packet
+     */
+    static void IRQbegin(const Setup& setup);
+
+    /**
+     * Called when the device has armed its response to the setup packet.
+     * Calls after the first one for the same request are ignored
+     */
+    static void IRQready();
+
+    /**
+     * Called when the status stage of a request completes
+     */
+    static void IRQend();
+
+    /**
+     * \return the log. Its size is 4+numEntries*sizeof(Entry) bytes
+     */
+    static const Log& IRQget() { return log; }
+
+    #else //MXUSB_ENABLE_DIAG_REQUEST
+    //Do nothing stubs
+    static void IRQclear() {}
+    static void IRQreset() {}
+    static void IRQbegin(const Setup&) {}
+    static void IRQready() {}
+    static void IRQend() {}
+    #endif //MXUSB_ENABLE_DIAG_REQUEST
+
+private:
+    EnumerationLog();
+
+    #ifdef MXUSB_ENABLE_DIAG_REQUEST
+    /**
+     * Add an entry to the log
+     * \param event event type
+     * \param wValue wValue of the setup packet, if any
+     * \return the new entry, or 0 if the log is full
+     */
+    static Entry *IRQadd(unsigned char event, unsigned short wValue);
+
+    /**
+     * \return microseconds since the last call to IRQclear()
+     */
+    static unsigned int IRQnow();
+
+    static Log log;
+    static unsigned int base;  ///<Cycle counter value at the last IRQclear()
+    static Entry *pending;     ///<Entry of the request in progress, or 0
+    #endif //MXUSB_ENABLE_DIAG_REQUEST
+};
+
+} //namespace mxusb
+
+#endif //ENUM_LOG_H
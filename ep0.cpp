@@ -58,6 +58,18 @@ bool EndpointZeroCallbacks::IRQendOfOutDataStage(const Setup *setup)
     return false;
 }
 
+bool EndpointZeroCallbacks::IRQinData(const Setup *setup,
+        unsigned short offset, unsigned char *data, unsigned short size)
+{
+    return false;
+}
+
+bool EndpointZeroCallbacks::IRQoutData(const Setup *setup,
+        unsigned short offset, const unsigned char *data, unsigned short size)
+{
+    return false;
+}
+
 EndpointZeroCallbacks::~EndpointZeroCallbacks() {}
 
 void EndpointZeroCallbacks::IRQsetDataBuffer(unsigned char *data)
@@ -65,6 +77,36 @@ void EndpointZeroCallbacks::IRQsetDataBuffer(unsigned char *data)
     DefCtrlPipe::IRQsetDataForCustomRequest(data);
 }
 
+void EndpointZeroCallbacks::IRQsetDataStream(unsigned short size)
+{
+    DefCtrlPipe::IRQsetStreamForCustomRequest(size);
+}
+
+unsigned int EndpointZeroCallbacks::IRQdeferRequest()
+{
+    return DefCtrlPipe::IRQdeferCustomRequest();
+}
+
+bool EndpointZeroCallbacks::completeRequest(unsigned int token, bool success,
+        const unsigned char *data, unsigned short size)
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    return IRQcompleteRequest(token,success,data,size);
+    #else //_MIOSIX
+    __disable_irq();
+    bool result=IRQcompleteRequest(token,success,data,size);
+    __enable_irq();
+    return result;
+    #endif //_MIOSIX
+}
+
+bool EndpointZeroCallbacks::IRQcompleteRequest(unsigned int token,
+        bool success, const unsigned char *data, unsigned short size)
+{
+    return DefCtrlPipe::IRQcompleteCustomRequest(token,success,data,size);
+}
+
 void EndpointZeroCallbacks::setCallbacks(EndpointZeroCallbacks * callback)
 {
     #ifdef _MIOSIX
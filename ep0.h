@@ -111,7 +111,8 @@ public:
      * This callback is called when a class or vendor request is received on
      * endpoint zero. If setup.wLength>0, a data stage is required and in this
      * case the callback must either return false or call IRQsetDataBuffer()
-     * to set up the buffer used for the data stage.
+     * to set up the buffer used for the data stage. Requests that can't be
+     * handled within the USB interrupt can be deferred with IRQdeferRequest().
      * \param setup the associated setup request
      * \return if this is an expected request for the device being built,
      * return true. This means the request will be accepted, otherwise return
@@ -135,6 +136,40 @@ public:
      */
     virtual bool IRQendOfOutDataStage(const Setup *setup);
 
+    /**
+     * This callback is called for each packet of the data stage of an IN
+     * (device to host) request, if IRQsetup() called IRQsetDataStream()
+     * instead of IRQsetDataBuffer(). It allows to generate the data to send
+     * one packet at a time. If IRQsetDataStream() is never used, there is no
+     * need to override this member function.
+     * \param setup the same setup request passed to the previous IRQsetup()
+     * call
+     * \param offset position of this packet within the data stage
+     * \param data buffer where to write the packet
+     * \param size number of bytes to write into data, at most EP0_SIZE
+     * \return true to send the packet, false to STALL the request
+     */
+    virtual bool IRQinData(const Setup *setup, unsigned short offset,
+            unsigned char *data, unsigned short size);
+
+    /**
+     * This callback is called for each packet of the data stage of an OUT
+     * (host to device) request, if IRQsetup() called IRQsetDataStream()
+     * instead of IRQsetDataBuffer(). It allows to consume received data one
+     * packet at a time. IRQendOfOutDataStage() is still called after the
+     * last packet. If IRQsetDataStream() is never used, there is no need to
+     * override this member function.
+     * \param setup the same setup request passed to the previous IRQsetup()
+     * call
+     * \param offset position of this packet within the data stage
+     * \param data received packet. It is valid only until this callback
+     * returns
+     * \param size packet size, at most EP0_SIZE
+     * \return true to accept the packet, false to STALL the request
+     */
+    virtual bool IRQoutData(const Setup *setup, unsigned short offset,
+            const unsigned char *data, unsigned short size);
+
     /**
      * Destructor
      */
@@ -151,6 +186,61 @@ public:
      */
     static void IRQsetDataBuffer(unsigned char *data);
 
+    /**
+     * Alternative to IRQsetDataBuffer() for requests with a long data stage.
+     * Instead of requiring a buffer of setup.wLength bytes, data is passed
+     * one packet at a time through IRQinData() or IRQoutData(), so the RAM
+     * required is EP0_SIZE bytes regardless of setup.wLength. It is meant to
+     * be called from within IRQsetup() if setup.wLength>0.
+     * \param size for IN requests, the number of bytes to send, which is
+     * clamped to setup.wLength. For OUT requests it is ignored, as the host
+     * always sends setup.wLength bytes.
+     */
+    static void IRQsetDataStream(unsigned short size);
+
+    /**
+     * Allows to handle requests that can't be completed within the USB
+     * interrupt, for example because they require access to slow peripherals.
+     * It is meant to be called from within IRQsetup(), which must then return
+     * true. Endpoint zero will NAK the host till completeRequest() is called:
+     * - for IN requests, the data stage is deferred. There is no need to call
+     *   IRQsetDataBuffer(), since the data is passed to completeRequest(),
+     *   but IRQsetDataStream() can still be used.
+     * - for OUT requests without data stage, the status stage is deferred.
+     * - for OUT requests with a data stage, IRQsetDataBuffer() or
+     *   IRQsetDataStream() must be called as usual. The data stage takes
+     *   place, then the status stage is deferred, and IRQendOfOutDataStage()
+     *   is not called.
+     * Other endpoints are not affected by a deferred request.
+     * \return a token to pass to completeRequest()
+     */
+    static unsigned int IRQdeferRequest();
+
+    /**
+     * Complete a request deferred with IRQdeferRequest(). Can be called from
+     * any thread. If the host has meanwhile aborted the request, for example
+     * by sending a new setup packet after a timeout, or the device has been
+     * reset, nothing happens.
+     * \param token the value returned by IRQdeferRequest()
+     * \param success if false, the request is STALLed
+     * \param data for IN requests, the data to send. Not needed if
+     * IRQsetDataStream() was called. Do not allocate the buffer on the stack,
+     * since it will be accessed after this member function returns, and till
+     * the data stage ends.
+     * \param size size of data, clamped to setup.wLength
+     * \return true if the request was completed, false if it was not
+     * pending anymore
+     */
+    static bool completeRequest(unsigned int token, bool success,
+            const unsigned char *data=0, unsigned short size=0);
+
+    /**
+     * Same as completeRequest(), but must be called with interrupts disabled
+     * or from within an IRQ.
+     */
+    static bool IRQcompleteRequest(unsigned int token, bool success,
+            const unsigned char *data=0, unsigned short size=0);
+
     /**
      * Set callbacks for USB nonstandard requests on endpoint zero.
      * \param callback an instance of a class that derives from
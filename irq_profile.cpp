@@ -0,0 +1,70 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "irq_profile.h"
+#include <cstring>
+
+#ifdef MXUSB_ENABLE_IRQ_PROFILING
+
+namespace mxusb {
+
+//
+// class IrqProfiler
+//
+
+IrqHistogram IrqProfiler::IRQget(USBdevice::ProfiledEvent event,
+        unsigned char epNum)
+{
+    if(event==USBdevice::PROFILE_CTR && epNum>=NUM_ENDPOINTS)
+    {
+        IrqHistogram result;
+        memset(&result,0,sizeof(result));
+        return result;
+    }
+    return histograms[IRQindex(event,epNum)];
+}
+
+void IrqProfiler::IRQclear()
+{
+    memset(histograms,0,sizeof(histograms));
+}
+
+void IrqProfiler::IRQadd(int index, unsigned int cycles)
+{
+    IrqHistogram& h=histograms[index];
+    //Bucket i counts durations from 2^i to 2^(i+1)-1 cycles
+    int bucket= cycles==0 ? 0 : 31-__builtin_clz(cycles);
+    if(bucket>=IrqHistogram::NUM_BUCKETS) bucket=IrqHistogram::NUM_BUCKETS-1;
+    h.buckets[bucket]++;
+    if(cycles>h.max) h.max=cycles;
+}
+
+IrqHistogram IrqProfiler::histograms[NUM_HISTOGRAMS];
+
+} //namespace mxusb
+
+#endif //MXUSB_ENABLE_IRQ_PROFILING
@@ -0,0 +1,176 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#ifndef MXUSB_LIBRARY
+#error "This is header is private, it can be used only within mxusb."
+#error "If your code depends on a private header, it IS broken."
+#endif //MXUSB_LIBRARY
+
+#include <config/usb_config.h>
+#include "usb.h"
+#include "stm32_usb_regs.h"
+#include "cycle_counter.h"
+
+#ifndef IRQ_PROFILE_H
+#define	IRQ_PROFILE_H
+
+namespace mxusb {
+
+/**
+ * \internal
+ * Measures with the cycle counter how long the USB interrupts take to handle
+ * each event, and how long interrupts stay disabled in Endpoint::write() and
+ * Endpoint::read(), keeping a histogram for each. If MXUSB_ENABLE_IRQ_PROFILING
+ * is not defined in usb_config.h all member functions do nothing.
+ * A measurement is taken by getting a timestamp with IRQstart(), and passing
+ * it to IRQrecord(), which updates it so that consecutive events handled by
+ * the same interrupt are measured without gaps.
+ */
+class IrqProfiler
+{
+public:
+    #ifdef MXUSB_ENABLE_IRQ_PROFILING
+
+    /**
+     * \return a timestamp for IRQrecord()
+     */
+    static unsigned int IRQstart() { return CycleCounter::get(); }
+
+    /**
+     * Record the time elapsed since start
+     * \param event event type
+     * \param epNum endpoint number, only used for USBdevice::PROFILE_CTR
+     * \param start timestamp taken with IRQstart(), it is set to the current
+     * time so that it can be used to measure the following event
+     */
+    static void IRQrecord(USBdevice::ProfiledEvent event, unsigned char epNum,
+            unsigned int& start)
+    {
+        unsigned int now=CycleCounter::get();
+        IRQadd(IRQindex(event,epNum),now-start);
+        start=now;
+    }
+
+    /**
+     * \param event event type
+     * \param epNum endpoint number, only used for USBdevice::PROFILE_CTR
+     * \return the histogram of that event, or an empty one if epNum is not
+     * valid
+     */
+    static IrqHistogram IRQget(USBdevice::ProfiledEvent event,
+            unsigned char epNum);
+
+    /**
+     * Clear all histograms
+     */
+    static void IRQclear();
+
+    #else //MXUSB_ENABLE_IRQ_PROFILING
+    //Do nothing stubs
+    static unsigned int IRQstart() { return 0; }
+    static void IRQrecord(USBdevice::ProfiledEvent, unsigned char,
+            unsigned int&) {}
+    static IrqHistogram IRQget(USBdevice::ProfiledEvent, unsigned char)
+    {
+        IrqHistogram result={{0},0};
+        return result;
+    }
+    static void IRQclear() {}
+    #endif //MXUSB_ENABLE_IRQ_PROFILING
+
+private:
+    IrqProfiler();
+
+    #ifdef MXUSB_ENABLE_IRQ_PROFILING
+    /**
+     * \param event event type
+     * \param epNum endpoint number, only used for USBdevice::PROFILE_CTR
+     * \return the index into histograms
+     */
+    static int IRQindex(USBdevice::ProfiledEvent event, unsigned char epNum)
+    {
+        if(event!=USBdevice::PROFILE_CTR) return event;
+        return USBdevice::PROFILE_CTR+epNum;
+    }
+
+    /**
+     * Add a measurement to a histogram
+     * \param index index into histograms
+     * \param cycles measured time
+     */
+    static void IRQadd(int index, unsigned int cycles);
+
+    ///One for each event, except PROFILE_CTR which has one per endpoint
+    static const int NUM_HISTOGRAMS=USBdevice::PROFILE_CTR+NUM_ENDPOINTS;
+    static IrqHistogram histograms[NUM_HISTOGRAMS];
+    #endif //MXUSB_ENABLE_IRQ_PROFILING
+};
+
+/**
+ * \internal
+ * Measures a critical section with IrqProfiler, from the constructor to the
+ * destructor. If interrupts are temporarily enabled within the critical
+ * section, pause() and resume() allow to measure the two parts separately.
+ */
+class CriticalSectionProfiler
+{
+public:
+    /**
+     * Constructor, to be called with interrupts disabled
+     * \param event event type
+     */
+    explicit CriticalSectionProfiler(USBdevice::ProfiledEvent event)
+            : event(event), start(IrqProfiler::IRQstart()) {}
+
+    /**
+     * Record the critical section so far, to be called before enabling
+     * interrupts
+     */
+    void pause() { IrqProfiler::IRQrecord(event,0,start); }
+
+    /**
+     * Start measuring again, to be called after disabling interrupts
+     */
+    void resume() { start=IrqProfiler::IRQstart(); }
+
+    /**
+     * Destructor, records the critical section. Must be called before
+     * interrupts are enabled
+     */
+    ~CriticalSectionProfiler() { IrqProfiler::IRQrecord(event,0,start); }
+
+private:
+    CriticalSectionProfiler(const CriticalSectionProfiler&);
+    CriticalSectionProfiler& operator= (const CriticalSectionProfiler&);
+
+    USBdevice::ProfiledEvent event;
+    unsigned int start;
+};
+
+} //namespace mxusb
+
+#endif //IRQ_PROFILE_H
@@ -0,0 +1,94 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "latency_probe.h"
+#include "cycle_counter.h"
+#include <cstring>
+
+namespace mxusb {
+
+//
+// class LatencyProbe
+//
+
+LatencyProbe::LatencyProbe(unsigned char outEp, unsigned char inEp)
+        : outEp(outEp), inEp(inEp), lastFrame(0), lastCycles(0), rxCycles(0),
+          sequence(0), streamLeft(0) {}
+
+void LatencyProbe::IRQendpoint(unsigned char epNum, Endpoint::Direction dir)
+{
+    //Stamp first, to keep the time taken by this function out of the stamps
+    const unsigned int now=CycleCounter::get();
+    const unsigned short frame=USBdevice::IRQgetFrameNumber();
+    if(epNum==inEp && dir==Endpoint::IN)
+    {
+        lastCycles=now;
+        lastFrame=frame;
+        if(streamLeft>0 && IRQsend(sequence,rxCycles))
+        {
+            sequence++;
+            streamLeft--;
+        }
+    } else if(epNum==outEp && dir==Endpoint::OUT) {
+        //Full speed BULK and INTERRUPT endpoints are at most 64 bytes
+        unsigned char packet[64];
+        int readBytes;
+        if(Endpoint::IRQget(outEp).IRQread(packet,readBytes)==false) return;
+        if(readBytes<static_cast<int>(sizeof(Request))) return;
+        Request request;
+        memcpy(&request,packet,sizeof(Request));
+        rxCycles=now;
+        sequence=request.sequence;
+        streamLeft= request.command==STREAM ? request.count : 1;
+        //If the IN buffer is full, the packet is sent when the host reads it
+        if(streamLeft>0 && IRQsend(sequence,rxCycles))
+        {
+            sequence++;
+            streamLeft--;
+        }
+    }
+}
+
+bool LatencyProbe::IRQsend(unsigned int sequence, unsigned int rxCycles)
+{
+    Endpoint ep=Endpoint::IRQget(inEp);
+    Packet packet;
+    packet.sequence=sequence;
+    packet.rxCycles=rxCycles;
+    packet.lastCycles=lastCycles;
+    packet.lastFrame=lastFrame;
+    packet.cyclesPerMicrosecond=CycleCounter::cyclesPerMicrosecond();
+    packet.reserved=0;
+    packet.txFrame=USBdevice::IRQgetFrameNumber();
+    packet.txCycles=CycleCounter::get();
+    int written;
+    if(ep.IRQwrite(reinterpret_cast<unsigned char*>(&packet),sizeof(packet),
+            written)==false) return false;
+    return written==sizeof(packet);
+}
+
+} //namespace mxusb
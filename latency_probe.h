@@ -0,0 +1,131 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#ifndef LATENCY_PROBE_H
+#define	LATENCY_PROBE_H
+
+#include "usb.h"
+
+namespace mxusb {
+
+/**
+ * Answers the latency probe protocol on a pair of endpoints, to measure the
+ * latency of USB transfers in both directions. The host sends a Request on
+ * the OUT endpoint, the device replies on the IN endpoint with Packets
+ * stamped with the cycle counter and the frame number. The latencyprobe tool
+ * in the testsuite correlates these stamps with its own clock.
+ * Two commands are supported:
+ * - ECHO: reply with a single packet as soon as the request is received.
+ *   Used to measure round trip time, and to estimate the offset between the
+ *   device and host clocks.
+ * - STREAM: reply with count packets, each written as soon as the host has
+ *   read the previous one. Since each packet reports when the host read the
+ *   previous one, the time a packet spent waiting in the device buffer can
+ *   be told apart from the time it took the host to deliver it.
+ * The endpoints can be interrupt or bulk, and can share the endpoint number
+ * if interrupt. Packets are at most 32 bytes, so the endpoints must have a
+ * wMaxPacketSize of at least 32 bytes.
+ */
+class LatencyProbe
+{
+public:
+    /**
+     * Commands of the latency probe
+     */
+    enum Command
+    {
+        ECHO=0,  ///< Reply with a single packet
+        STREAM=1 ///< Reply with count packets, back to back
+    };
+
+    /**
+     * A request, sent by the host on the OUT endpoint. All fields are little
+     * endian
+     */
+    struct Request
+    {
+        unsigned int sequence;  ///< Sequence number of the first reply
+        unsigned short command; ///< A Command
+        unsigned short count;   ///< Number of packets for STREAM
+    };
+
+    /**
+     * A reply, sent by the device on the IN endpoint. All fields are little
+     * endian, times are values of the cycle counter, that wraps around
+     */
+    struct Packet
+    {
+        unsigned int sequence;   ///< Request sequence, +1 for each packet
+        unsigned int rxCycles;   ///< When the request was received
+        unsigned int txCycles;   ///< When this packet was written
+        unsigned int lastCycles; ///< When the host read the previous packet
+        unsigned short txFrame;  ///< Frame number when this packet was written
+        unsigned short lastFrame;///< Frame number when the host read the
+                                 ///< previous packet
+        unsigned short cyclesPerMicrosecond; ///< Cycle counter frequency
+        unsigned short reserved; ///< Unused, always zero
+    };
+
+    /**
+     * Constructor
+     * \param outEp endpoint number on which requests are received
+     * \param inEp endpoint number on which replies are sent
+     */
+    LatencyProbe(unsigned char outEp, unsigned char inEp);
+
+    /**
+     * Must be called from Callbacks::IRQendpoint() for every event on the
+     * two endpoints. Events on other endpoints are ignored.
+     * \param epNum endpoint number
+     * \param dir endpoint direction
+     */
+    void IRQendpoint(unsigned char epNum, Endpoint::Direction dir);
+
+private:
+    LatencyProbe(const LatencyProbe&);
+    LatencyProbe& operator= (const LatencyProbe&);
+
+    /**
+     * Write a stamped packet to the IN endpoint
+     * \param sequence sequence number of the packet
+     * \param rxCycles when the request was received
+     * \return true if the packet was written
+     */
+    bool IRQsend(unsigned int sequence, unsigned int rxCycles);
+
+    unsigned char outEp;        ///< Endpoint receiving requests
+    unsigned char inEp;         ///< Endpoint sending replies
+    unsigned short lastFrame;   ///< Frame when the host read the last packet
+    unsigned int lastCycles;    ///< When the host read the last packet
+    unsigned int rxCycles;      ///< When the STREAM request was received
+    unsigned int sequence;      ///< Sequence of the next STREAM packet
+    unsigned short streamLeft;  ///< STREAM packets left to send
+};
+
+} //namespace mxusb
+
+#endif //LATENCY_PROBE_H
@@ -0,0 +1,146 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#include "message_queue.h"
+#include <algorithm>
+
+#ifdef _MIOSIX
+#include "interfaces/arch_registers.h"
+#else //_MIOSIX
+#include "stm32f10x.h"
+#endif //_MIOSIX
+
+using namespace std;
+
+namespace mxusb {
+
+/**
+ * \internal
+ * Prevent the compiler from reordering memory accesses across this point.
+ * The Cortex-M3 has a single core, so this is enough to make the accesses
+ * happen in program order as seen by an interrupt.
+ */
+static inline void compilerBarrier()
+{
+    asm volatile("":::"memory");
+}
+
+//
+// class MessageQueue
+//
+
+bool MessageQueue::setBuffer(unsigned char *buf, unsigned int size)
+{
+    if(buf!=0 && (size<4 || (size & (size-1))!=0)) return false;
+    if(buf!=0) for(unsigned int i=0;i<size;i++) buf[i]=0;
+    buffer=buf;
+    mask=buf!=0 ? size-1 : 0;
+    head=tail=0;
+    partial=0;
+    return true;
+}
+
+bool MessageQueue::put(const unsigned char *data, int size)
+{
+    if(buffer==0 || size<=0 || size>MAX_MESSAGE_SIZE) return false;
+    const unsigned int needed=size+HEADER_SIZE;
+    unsigned int start;
+    for(;;)
+    {
+        start=__LDREXW(const_cast<unsigned int*>(&head));
+        if(start+needed-tail>mask+1)
+        {
+            __CLREX();
+            return false; //Not enough space
+        }
+        //If an interrupt happened between ldrex and strex, strex fails
+        if(__STREXW(start+needed,const_cast<unsigned int*>(&head))==0) break;
+    }
+    //Now the space from start to start+needed belongs to us
+    for(int i=0;i<size;i++) buffer[(start+HEADER_SIZE+i) & mask]=data[i];
+    buffer[start & mask]=size & 0xff;
+    compilerBarrier();
+    buffer[(start+1) & mask]=(size>>8) | COMMITTED; //Commit message
+    return true;
+}
+
+int MessageQueue::IRQpeek(unsigned char *data, int size) const
+{
+    if(buffer==0) return 0;
+    unsigned int pos=tail;
+    int offset=partial;
+    int result=0;
+    while(result<size && pos!=head)
+    {
+        const int length=messageLength(pos);
+        if(length==0) break; //Message is being written, stop here
+        compilerBarrier();
+        const int n=min(length-offset,size-result);
+        for(int i=0;i<n;i++)
+            data[result++]=buffer[(pos+HEADER_SIZE+offset+i) & mask];
+        if(offset+n<length) break; //Message did not fit entirely
+        pos+=HEADER_SIZE+length;
+        offset=0;
+    }
+    return result;
+}
+
+void MessageQueue::IRQconsume(int size)
+{
+    while(size>0)
+    {
+        const int length=messageLength(tail);
+        if(length==0) return; //Should never happen
+        const int n=min(length-partial,size);
+        partial+=n;
+        size-=n;
+        if(partial<length) return;
+        //Message completely consumed, clear its memory before giving it
+        //back to producers
+        for(int i=0;i<HEADER_SIZE+length;i++) buffer[(tail+i) & mask]=0;
+        compilerBarrier();
+        tail+=HEADER_SIZE+length;
+        partial=0;
+    }
+}
+
+int MessageQueue::IRQdiscard()
+{
+    if(buffer==0) return 0;
+    int result=0;
+    for(;;)
+    {
+        if(tail==head) break;
+        const int length=messageLength(tail);
+        if(length==0) break;
+        result+=length-partial;
+        IRQconsume(length-partial);
+    }
+    return result;
+}
+
+} //namespace mxusb
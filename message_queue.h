@@ -0,0 +1,158 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#ifndef MXUSB_LIBRARY
+#error "This is header is private, it can be used only within mxusb."
+#error "If your code depends on a private header, it IS broken."
+#endif //MXUSB_LIBRARY
+
+#ifndef MESSAGE_QUEUE_H
+#define	MESSAGE_QUEUE_H
+
+namespace mxusb {
+
+/**
+ * \internal
+ * A multiple producer, single consumer queue of variable sized messages.
+ * Producers can be any number of threads and interrupt handlers, and they
+ * never disable interrupts: space for a message is reserved atomically with
+ * the ldrex/strex instructions, then the message is copied and finally
+ * committed. The consumer sees the queued messages as a byte stream, and can
+ * take data out of it in chunks of arbitrary size, so that more small
+ * messages can be packed together, and large messages can be split.
+ *
+ * Each message is stored in the buffer preceded by a two byte header with
+ * its length. The most significant bit of the header is set last, when the
+ * message is complete, so the consumer stops at the first message that is
+ * still being written. Memory is cleared by the consumer after use, so that
+ * a header can never be mistaken for a committed one.
+ */
+class MessageQueue
+{
+public:
+    /// Maximum size of a message
+    static const int MAX_MESSAGE_SIZE=0x7fff;
+
+    /**
+     * Constructor, the queue is detached
+     */
+    MessageQueue() : buffer(0), mask(0), head(0), tail(0), partial(0) {}
+
+    /**
+     * Set the memory used by the queue. Must be called when there are no
+     * producers and no consumer accessing the queue.
+     * \param buf buffer, or 0 to detach the queue. Buffer is cleared.
+     * \param size size of buffer, must be a power of two and at least 4
+     * \return false if the size is not valid
+     */
+    bool setBuffer(unsigned char *buf, unsigned int size);
+
+    /**
+     * \return true if a buffer has been set
+     */
+    bool isAttached() const { return buffer!=0; }
+
+    /**
+     * Enqueue a message. Can be called concurrently by threads and interrupts.
+     * \param data message data
+     * \param size message size, at least one and no more than MAX_MESSAGE_SIZE
+     * \return false if the queue is not attached, the size is wrong or there
+     * is not enough free space in the queue
+     */
+    bool put(const unsigned char *data, int size);
+
+    /**
+     * Copy data out of the queue, without removing it. Only data of messages
+     * that are completely written is returned. Can only be called by the
+     * consumer.
+     * \param data buffer where data will be copied
+     * \param size maximum number of bytes to copy
+     * \return the number of bytes copied
+     */
+    int IRQpeek(unsigned char *data, int size) const;
+
+    /**
+     * Can only be called by the consumer.
+     * \return the number of bytes left in the first message of the queue, or
+     * zero if the queue is empty or the message is still being written. This
+     * allows a consumer to take messages out one at a time.
+     */
+    int IRQmessageSize() const
+    {
+        if(buffer==0 || tail==head) return 0;
+        const int length=messageLength(tail);
+        return length==0 ? 0 : length-partial;
+    }
+
+    /**
+     * Remove data from the queue. Can only be called by the consumer.
+     * \param size number of bytes to remove, must be no more than what the
+     * previous call to IRQpeek() returned
+     */
+    void IRQconsume(int size);
+
+    /**
+     * Remove all the complete messages from the queue. Can only be called by
+     * the consumer.
+     * \return the number of bytes discarded
+     */
+    int IRQdiscard();
+
+    /**
+     * \return true if the queue is empty. Messages that are being written
+     * count as queued data.
+     */
+    bool isEmpty() const { return head==tail; }
+
+private:
+    MessageQueue(const MessageQueue&);
+    MessageQueue& operator= (const MessageQueue&);
+
+    /**
+     * \param pos position of a message header
+     * \return the length of the message, or zero if it is still being written
+     */
+    int messageLength(unsigned int pos) const
+    {
+        unsigned char hi=buffer[(pos+1) & mask];
+        if((hi & COMMITTED)==0) return 0;
+        return buffer[pos & mask] | (hi & ~COMMITTED)<<8;
+    }
+
+    static const int HEADER_SIZE=2;       ///< Size of message header
+    static const unsigned char COMMITTED=0x80; ///< Message complete flag
+
+    unsigned char *buffer;       ///< Queue memory
+    unsigned int mask;           ///< Buffer size minus one
+    volatile unsigned int head;  ///< Free running write index, producers
+    volatile unsigned int tail;  ///< Free running read index, consumer
+    int partial;                 ///< Bytes already consumed of first message
+};
+
+} //namespace mxusb
+
+#endif //MESSAGE_QUEUE_H
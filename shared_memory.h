@@ -103,6 +103,18 @@ public:
      */
     static void reset();
 
+    /**
+     * \return a pointer to the first free byte. Together with setCurrentEnd()
+     * it allows to reserve a region with allocate() and then to allocate
+     * memory within that region, by temporarily moving the current end.
+     */
+    static shmem_ptr getCurrentEnd() { return currentEnd; }
+
+    /**
+     * \param end new pointer to the first free byte
+     */
+    static void setCurrentEnd(shmem_ptr end) { currentEnd=end; }
+
     /**
      * Copy data from the shared memory to RAM
      * \param dest pointer to a normal buffer already allocated in RAM
@@ -0,0 +1,214 @@
+/***************************************************************************
+ *   Copyright (C) 2011 by Terraneo Federico                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * This header describes the format of trace records, and has no
+ * dependencies, so that it can be shared between mxusb and host tools that
+ * decode binary traces.
+ */
+
+#ifndef TRACE_FORMAT_H
+#define	TRACE_FORMAT_H
+
+namespace mxusb {
+
+/**
+ * \internal
+ * Class only meant to wrap the TracePoint enum to prevent namespace pollution
+ */
+class Ut
+{
+public:
+    ///Verbose mode. Some of the TracePoints are tagged with this.
+    ///It allows to select printing everything or only non verbose data
+    static const unsigned char VERBOSE=0x80;
+
+    /**
+     * Each point an USBtrace::trace() is called is uniquely identified by
+     * a TracePoint number.
+     */
+    enum TracePoint
+    {
+        //Standard traces
+        DEVICE_STATE_CHANGE=      1,//1byte paramter (new state)
+        DEVICE_RESET=             2,
+        EP0_VALID_SETUP=          3,//8byte parameter (Setup struct)
+        SUSPEND_REQUEST=          4,
+        RESUME_REQUEST=           5,
+        EP0_INTERRUPTED_SETUP=    6,
+        EP0_IN_ABORT=             7,
+        DESC_ERROR=               8,
+        OUT_OF_SHMEM=             9,
+        ADDRESS_SET=             10,//1byte parameter (new address)
+        CONFIGURING_EP=          11,//1byte bEndpointAddress, 1byte bmAttributes
+        EP0_OUT_OVERRUN=         12,
+        REMOTE_WAKEUP=           13,
+        REMOTE_WAKEUP_FEATURE=   14,//1byte parameter (1=enabled, 0=disabled)
+        FIRST_PACKET_AFTER_WAKEUP=15,
+        ENDPOINT_HALT=           16,//1byte bEndpointAddress, 1byte (1=halt)
+
+        //Verbose only traces
+        EP0_SETUP_IRQ=  VERBOSE | 1,
+        EP0_IN_IRQ=     VERBOSE | 2,
+        EP0_OUT_IRQ=    VERBOSE | 3,
+        EP0_UNSUPP_BREQ=VERBOSE | 4,
+        EP0_UNSUPP_DESC=VERBOSE | 5,
+        EP0_STATUS_OUT= VERBOSE | 6,
+        EP0_STATUS_IN=  VERBOSE | 7,
+        IN_BUF_FILL=    VERBOSE | 8,//two 1byte parameters (ep #, buffer size)
+        OUT_BUF_READ=   VERBOSE | 9,//two 1byte parameters (ep #, buffer size)
+        RESUME_SIGNAL_END=VERBOSE | 10,
+        EP0_DEFERRED=   VERBOSE | 11,
+
+        //Special traces
+        TRACE_CLOCK=  124,//4byte parameter, cycles per second. Binary only
+        TRACE_DROPPED=125,//4byte parameter, records dropped. Binary only
+        DBG_DUMP_EPnR=126,//Two byte parameters (the EPnR 16 bit register)
+        MARKER=127  //Generic marker, used for debugging
+    };
+
+    /**
+     * TracePoints are grouped in categories, to select at runtime which
+     * ones are recorded.
+     */
+    enum Category
+    {
+        CAT_DEVICE=1,  ///< Device state, reset, suspend and resume
+        CAT_EP0=2,     ///< Control transfers on endpoint zero
+        CAT_ENDPOINT=4,///< Endpoint configuration, halt, and packets
+        CAT_DEBUG=8,   ///< EPnR dumps and markers
+        CAT_VERBOSE=16,///< Verbose TracePoints, if their category is enabled
+        CAT_ALL=31     ///< All TracePoints
+    };
+
+    /**
+     * \param tp a TracePoint
+     * \return the categories of the TracePoint, a TracePoint is recorded
+     * only if all of them are enabled
+     */
+    static unsigned int category(unsigned char tp)
+    {
+        const unsigned int verbose= tp & VERBOSE ? CAT_VERBOSE : 0;
+        switch(tp)
+        {
+            case EP0_VALID_SETUP:
+            case EP0_INTERRUPTED_SETUP:
+            case EP0_IN_ABORT:
+            case EP0_OUT_OVERRUN:
+            case EP0_SETUP_IRQ:
+            case EP0_IN_IRQ:
+            case EP0_OUT_IRQ:
+            case EP0_UNSUPP_BREQ:
+            case EP0_UNSUPP_DESC:
+            case EP0_STATUS_OUT:
+            case EP0_STATUS_IN:
+            case EP0_DEFERRED:
+                return CAT_EP0 | verbose;
+            case CONFIGURING_EP:
+            case ENDPOINT_HALT:
+            case IN_BUF_FILL:
+            case OUT_BUF_READ:
+                return CAT_ENDPOINT | verbose;
+            case TRACE_CLOCK:
+            case TRACE_DROPPED:
+            case DBG_DUMP_EPnR:
+            case MARKER:
+                return CAT_DEBUG;
+            default:
+                return CAT_DEVICE | verbose;
+        }
+    }
+
+    /**
+     * \param tp a TracePoint
+     * \return true if the first parameter of the TracePoint is an endpoint
+     * number or address, to select at runtime the endpoints to trace
+     */
+    static bool hasEndpoint(unsigned char tp)
+    {
+        return tp==CONFIGURING_EP || tp==ENDPOINT_HALT || tp==IN_BUF_FILL ||
+               tp==OUT_BUF_READ;
+    }
+
+private:
+    Ut();
+};
+
+/**
+ * \internal
+ * Format of trace records and of the binary trace stream.
+ *
+ * A record is the TracePoint, a four byte little endian timestamp in CPU
+ * cycles, and the parameters of the TracePoint, if any.
+ *
+ * In the binary stream each record is framed as SYNC, the record size,
+ * the record and a checksum, which is the xor of the record bytes. This
+ * allows a decoder to resynchronize if bytes are lost. The stream starts
+ * with a TRACE_CLOCK record, to convert timestamps to time, and a
+ * TRACE_DROPPED record is sent when records were dropped on the device.
+ */
+class TraceFormat
+{
+public:
+    ///Size of the record header, TracePoint and timestamp
+    static const int RECORD_HEADER_SIZE=5;
+    ///Maximum size of a record
+    static const int MAX_RECORD_SIZE=16;
+    ///First byte of a frame in the binary stream
+    static const unsigned char SYNC=0xa5;
+    ///Frame overhead in the binary stream: sync, size and checksum
+    static const int FRAME_OVERHEAD=3;
+
+    /**
+     * \param record a record
+     * \param size record size
+     * \return the checksum of the record
+     */
+    static unsigned char checksum(const unsigned char *record, int size)
+    {
+        unsigned char result=0;
+        for(int i=0;i<size;i++) result^=record[i];
+        return result;
+    }
+
+    /**
+     * \param record a record
+     * \return the timestamp of the record, in CPU cycles
+     */
+    static unsigned int timestamp(const unsigned char *record)
+    {
+        return record[1] | record[2]<<8 | record[3]<<16 |
+               static_cast<unsigned int>(record[4])<<24;
+    }
+
+private:
+    TraceFormat();
+};
+
+} //namespace mxusb
+
+#endif //TRACE_FORMAT_H
@@ -31,9 +31,13 @@
 #include "def_ctrl_pipe.h"
 #include "usb_tracer.h"
 #include "usb_impl.h"
+#include "cycle_counter.h"
+#include "enum_log.h"
+#include "irq_profile.h"
 #include <config/usb_gpio.h>
 #include <config/usb_config.h>
 #include <algorithm>
+#include <cstring>
 
 #if USB_CONFIG_VERSION != 100
 #error Wrong usb_config.h version. You need to upgrade it.
@@ -99,6 +103,43 @@ void USB_HP_CAN1_TX_IRQHandler()
 
 namespace mxusb {
 
+/// \internal Number of ESOF interrupts for which RESUME signaling is held.
+/// The first ESOF may come early, so this results in 3..4ms, well within the
+/// 1..15ms required by the USB standard
+static const unsigned char RESUME_ESOF_COUNT=4;
+
+/// \internal The bus must be idle for 5ms before the device can signal remote
+/// wakeup. Suspend is detected after 3ms of idle, so wait 2ms more
+static const unsigned int MIN_SUSPEND_BEFORE_WAKEUP_US=2000;
+
+/// \internal ESOF interrupts left before RESUME signaling ends, 0 if idle
+static volatile unsigned char resumeEsofCount=0;
+
+/// \internal Cycle counter value when the device was suspended
+static unsigned int suspendTimestamp=0;
+
+/// \internal Cycle counter value when remote wakeup was signaled
+static unsigned int wakeupTimestamp=0;
+
+/// \internal True while waiting for the first packet after a remote wakeup
+static volatile bool wakeupLatencyPending=false;
+
+/// \internal Cycles from the last remote wakeup to the first packet
+static volatile unsigned int wakeupLatency=0;
+
+/**
+ * \internal
+ * Called on every correct transfer on endpoints other than zero, to measure
+ * the latency from a remote wakeup to the first packet exchanged
+ */
+static inline void IRQpacketTransferred()
+{
+    if(wakeupLatencyPending==false) return;
+    wakeupLatency=CycleCounter::get()-wakeupTimestamp;
+    wakeupLatencyPending=false;
+    Tracer::IRQtrace(Ut::FIRST_PACKET_AFTER_WAKEUP);
+}
+
 /**
  * \internal
  * Handles USB device RESET
@@ -106,14 +147,23 @@ namespace mxusb {
 static void IRQhandleReset()
 {
     Tracer::IRQtrace(Ut::DEVICE_RESET);
+    StatsImpl::IRQdevice().resets++;
 
     USBREGS->DADDR=0;  //Disable transaction handling
     USBREGS->ISTR=0;   //When the device is reset, clear all pending interrupts
     USBREGS->BTABLE=SharedMemory::BTABLE_ADDR; //Set BTABLE
 
+    //Reset clears the remote wakeup feature, and aborts RESUME signaling
+    resumeEsofCount=0;
+    wakeupLatencyPending=false;
+    DeviceStateImpl::IRQclearWakeupPending();
+    DeviceStateImpl::IRQsetRemoteWakeupEnabled(false);
+    DeviceStateImpl::IRQsetSuspended(false);
+
     for(int i=1;i<NUM_ENDPOINTS;i++) EndpointImpl::get(i)->IRQdeconfigure(i);
     SharedMemory::reset();
     DefCtrlPipe::IRQdefaultStatus();
+    EnumerationLog::IRQreset();
 
     //After a reset device address is zero, enable transaction handling
     USBREGS->DADDR=0 | USB_DADDR_EF;
@@ -125,6 +175,35 @@ static void IRQhandleReset()
     DeviceStateImpl::IRQsetState(USBdevice::DEFAULT);
 }
 
+/**
+ * \internal
+ * Handles exiting from suspend, be it caused by the host or by remote wakeup
+ */
+static void IRQhandleResume()
+{
+    USBREGS->CNTR&= ~(USB_CNTR_FSUSP | USB_CNTR_LP_MODE);
+    //A wakeup still pending is no longer needed, stop retrying it
+    if(DeviceStateImpl::isWakeupPending())
+    {
+        DeviceStateImpl::IRQclearWakeupPending();
+        if(resumeEsofCount==0) USBREGS->CNTR&= ~USB_CNTR_ESOFM;
+    }
+    //After a remote wakeup the host may also cause a WKUP interrupt, before
+    //or after RESUME signaling ends, only the first one resumes the device
+    if(DeviceStateImpl::isSuspended()==false) return;
+    //Important: suspended is cleared before the callback, so that calling
+    //IRQwrite() from the callback does not try to wake the host again
+    DeviceStateImpl::IRQsetSuspended(false);
+    StatsImpl::IRQdevice().resumes++;
+    Callbacks::IRQgetCallbacks()->IRQresume();
+    #ifndef MXUSB_KEEP_ENDPOINTS_ON_SUSPEND
+    //Reconfigure all previously deconfigured endpoints
+    unsigned char conf=USBdevice::IRQgetConfiguration();
+    if(conf!=0)
+        EndpointImpl::IRQconfigureAll(DefCtrlPipe::IRQgetConfigDesc(conf));
+    #endif //MXUSB_KEEP_ENDPOINTS_ON_SUSPEND
+}
+
 /**
  * \internal
  * Actual low priority interrupt handler.
@@ -132,12 +211,14 @@ static void IRQhandleReset()
 void USBirqLpHandler() __attribute__ ((noinline));
 void USBirqLpHandler()
 {
+    unsigned int start=IrqProfiler::IRQstart();
     unsigned short flags=USBREGS->ISTR;
     Callbacks *callbacks=Callbacks::IRQgetCallbacks();
     if(flags & USB_ISTR_RESET)
     {
         IRQhandleReset();
         callbacks->IRQreset();
+        IrqProfiler::IRQrecord(USBdevice::PROFILE_RESET,0,start);
         return; //Reset causes all interrupt flags to be ignored
     }
     if(flags & USB_ISTR_SUSP)
@@ -145,25 +226,48 @@ void USBirqLpHandler()
         USBREGS->ISTR= ~(unsigned short)USB_ISTR_SUSP; //Clear interrupt flag
         USBREGS->CNTR|=USB_CNTR_FSUSP;
         USBREGS->CNTR|=USB_CNTR_LP_MODE;
+        suspendTimestamp=CycleCounter::get();
         Tracer::IRQtrace(Ut::SUSPEND_REQUEST);
+        StatsImpl::IRQdevice().suspends++;
         DeviceStateImpl::IRQsetSuspended(true);
+        #ifndef MXUSB_KEEP_ENDPOINTS_ON_SUSPEND
         //If device is configured, deconfigure all endpoints. This in turn will
         //wake the threads waiting to write/read on endpoints
         if(USBdevice::IRQgetState()==USBdevice::CONFIGURED)
             EndpointImpl::IRQdeconfigureAll();
+        #endif //MXUSB_KEEP_ENDPOINTS_ON_SUSPEND
         callbacks->IRQsuspend();
+        IrqProfiler::IRQrecord(USBdevice::PROFILE_SUSPEND,0,start);
     }
     if(flags & USB_ISTR_WKUP)
     {
         USBREGS->ISTR= ~(unsigned short)USB_ISTR_WKUP; //Clear interrupt flag
-        USBREGS->CNTR&= ~USB_CNTR_FSUSP;
         Tracer::IRQtrace(Ut::RESUME_REQUEST);
-        DeviceStateImpl::IRQsetSuspended(false);
-        callbacks->IRQresume();
-        //Reconfigure all previously deconfigured endpoints
-        unsigned char conf=USBdevice::IRQgetConfiguration();
-        if(conf!=0)
-            EndpointImpl::IRQconfigureAll(DefCtrlPipe::IRQgetConfigDesc(conf));
+        IRQhandleResume();
+        IrqProfiler::IRQrecord(USBdevice::PROFILE_RESUME,0,start);
+    }
+    if(flags & USB_ISTR_ESOF)
+    {
+        USBREGS->ISTR= ~(unsigned short)USB_ISTR_ESOF; //Clear interrupt flag
+        //ESOF is enabled while signaling remote wakeup, to count 1ms ticks,
+        //and while a refused remote wakeup is pending, to retry it
+        if(resumeEsofCount>0)
+        {
+            if(--resumeEsofCount==0)
+            {
+                USBREGS->CNTR&= ~(USB_CNTR_RESUME | USB_CNTR_ESOFM);
+                Tracer::IRQtrace(Ut::RESUME_SIGNAL_END);
+                //Resume the device here and not in IRQremoteWakeup(), that
+                //can be called by user code, even from within IRQwrite()
+                IRQhandleResume();
+            }
+        } else {
+            if(DeviceStateImpl::isWakeupPending())
+                DeviceStateImpl::IRQrequestWakeup();
+            if(DeviceStateImpl::isWakeupPending()==false && resumeEsofCount==0)
+                USBREGS->CNTR&= ~USB_CNTR_ESOFM;
+        }
+        IrqProfiler::IRQrecord(USBdevice::PROFILE_RESUME,0,start);
     }
     while(flags & USB_ISTR_CTR)
     {
@@ -187,16 +291,22 @@ void USBirqLpHandler()
                 DefCtrlPipe::IRQin();
             }
             DefCtrlPipe::IRQrestoreStatus();
-
+            const bool isSetupPacket=(reg & USB_EP0R_CTR_RX) &&
+                    (reg & USB_EP0R_SETUP);
+            IrqProfiler::IRQrecord(isSetupPacket ? USBdevice::PROFILE_SETUP :
+                    USBdevice::PROFILE_CTR,0,start);
         } else {
             //Transaction on other endpoints
             EndpointImpl *epi=EndpointImpl::IRQget(epNum);
+            IRQpacketTransferred();
             if(reg & USB_EP0R_CTR_RX)
             {
                 USBREGS->endpoint[epNum].IRQclearRxInterruptFlag();
                 //NOTE: Increment buffer before the callabck
                 epi->IRQincBufferCount();
                 callbacks->IRQendpoint(epNum,Endpoint::OUT);
+                if(epi->IRQisOutBufferFull())
+                    StatsImpl::IRQendpoint(epNum).outNak++;
                 epi->IRQwakeWaitingThreadOnOutEndpoint();
             }
 
@@ -207,13 +317,20 @@ void USBirqLpHandler()
                 //NOTE: Decrement buffer before the callabck
                 epi->IRQdecBufferCount();
                 callbacks->IRQendpoint(epNum,Endpoint::IN);
+                //Queued messages are sent at the end of this interrupt
+                if(epi->isInBufferFull()==false && epi->IRQgetQueue().isEmpty())
+                    StatsImpl::IRQendpoint(epNum).inNak++;
                 epi->IRQwakeWaitingThreadOnInEndpoint();
             }
+            IrqProfiler::IRQrecord(USBdevice::PROFILE_CTR,epNum,start);
         }
         //Read again the ISTR register so that if more endpoints have completed
         //a transaction, they are all serviced
         flags=USBREGS->ISTR;
     }
+    //This interrupt is also triggered in software when a message is enqueued
+    EndpointImpl::IRQdrainAllQueues();
+    IrqProfiler::IRQrecord(USBdevice::PROFILE_QUEUE,0,start);
 }
 
 /**
@@ -223,6 +340,7 @@ void USBirqLpHandler()
 void USBirqHpHandler() __attribute__ ((noinline));
 void USBirqHpHandler()
 {
+    unsigned int start=IrqProfiler::IRQstart();
     unsigned short flags=USBREGS->ISTR;
     Callbacks *callbacks=Callbacks::IRQgetCallbacks();
     while(flags & USB_ISTR_CTR)
@@ -230,12 +348,15 @@ void USBirqHpHandler()
         int epNum=flags & USB_ISTR_EP_ID;
         unsigned short reg=USBREGS->endpoint[epNum].get();
         EndpointImpl *epi=EndpointImpl::IRQget(epNum);
+        IRQpacketTransferred();
         if(reg & USB_EP0R_CTR_RX)
         {
             USBREGS->endpoint[epNum].IRQclearRxInterruptFlag();
             //NOTE: Increment buffer before the callabck
             epi->IRQincBufferCount();
             callbacks->IRQendpoint(epNum,Endpoint::OUT);
+            if(epi->IRQisOutBufferFull())
+                StatsImpl::IRQendpoint(epNum).outNak++;
             epi->IRQwakeWaitingThreadOnOutEndpoint();
         }
 
@@ -245,9 +366,16 @@ void USBirqHpHandler()
 
             //NOTE: Decrement buffer before the callabck
             epi->IRQdecBufferCount();
+            //Message queues are drained only by the low priority interrupt,
+            //so that they have a single consumer
+            if(epi->IRQgetQueue().isAttached())
+                NVIC_SetPendingIRQ(USB_LP_CAN1_RX0_IRQn);
             callbacks->IRQendpoint(epNum,Endpoint::IN);
+            if(epi->isInBufferFull()==false && epi->IRQgetQueue().isEmpty())
+                StatsImpl::IRQendpoint(epNum).inNak++;
             epi->IRQwakeWaitingThreadOnInEndpoint();
         }
+        IrqProfiler::IRQrecord(USBdevice::PROFILE_CTR,epNum,start);
         //Read again the ISTR register so that if more endpoints have completed
         //a transaction, they are all serviced
         flags=USBREGS->ISTR;
@@ -293,7 +421,8 @@ bool Endpoint::write(const unsigned char *data, int size, int& written)
     written=0;
     #ifdef _MIOSIX
     InterruptDisableLock dLock;
-    unsigned char initialConfig=DeviceStateImpl::getConfiguration();
+    CriticalSectionProfiler profiler(USBdevice::PROFILE_WRITE);
+    unsigned char initialGeneration=pImpl->getGeneration();
     for(;;)
     {
         int partialWritten;
@@ -308,22 +437,26 @@ bool Endpoint::write(const unsigned char *data, int size, int& written)
             Thread *self=Thread::IRQgetCurrentThread();
             pImpl->IRQsetWaitingThreadOnInEndpoint(self);
             self->IRQwait();
+            profiler.pause();
             {
                 InterruptEnableLock eLock(dLock);
                 Thread::yield(); //The wait becomes effective
             }
-            //If configuration changet in the meantime, return error
-            if(DeviceStateImpl::getConfiguration()!=initialConfig) return false;
+            profiler.resume();
+            //If endpoint was reconfigured in the meantime, return error
+            if(pImpl->getGeneration()!=initialGeneration) return false;
         }
     }
     #else //_MIOSIX
-    unsigned char initialConfig=DeviceStateImpl::getConfiguration();
+    unsigned char initialGeneration=pImpl->getGeneration();
     for(;;)
     {
-        if(DeviceStateImpl::getConfiguration()!=initialConfig) return false;
+        if(pImpl->getGeneration()!=initialGeneration) return false;
         int partialWritten;
         __disable_irq();
+        unsigned int start=IrqProfiler::IRQstart();
         bool result=IRQwrite(data,size,partialWritten);
+        IrqProfiler::IRQrecord(USBdevice::PROFILE_WRITE,0,start);
         __enable_irq();
         written+=partialWritten;
         data+=partialWritten;
@@ -343,7 +476,8 @@ bool Endpoint::read(unsigned char *data, int& readBytes)
 {
     #ifdef _MIOSIX
     InterruptDisableLock dLock;
-    unsigned char initialConfig=DeviceStateImpl::getConfiguration();
+    CriticalSectionProfiler profiler(USBdevice::PROFILE_READ);
+    unsigned char initialGeneration=pImpl->getGeneration();
     for(;;)
     {
         if(IRQread(data,readBytes)==false) return false; //Error
@@ -351,20 +485,24 @@ bool Endpoint::read(unsigned char *data, int& readBytes)
         Thread *self=Thread::IRQgetCurrentThread();
         pImpl->IRQsetWaitingThreadOnOutEndpoint(self);
         self->IRQwait();
+        profiler.pause();
         {
             InterruptEnableLock eLock(dLock);
             Thread::yield(); //The wait becomes effective
         }
-        //If configuration changet in the meantime, return error
-        if(DeviceStateImpl::getConfiguration()!=initialConfig) return false;
+        profiler.resume();
+        //If endpoint was reconfigured in the meantime, return error
+        if(pImpl->getGeneration()!=initialGeneration) return false;
     }
     #else //_MIOSIX
-    unsigned char initialConfig=DeviceStateImpl::getConfiguration();
+    unsigned char initialGeneration=pImpl->getGeneration();
     for(;;)
     {
-        if(DeviceStateImpl::getConfiguration()!=initialConfig) return false;
+        if(pImpl->getGeneration()!=initialGeneration) return false;
         __disable_irq();
+        unsigned int start=IrqProfiler::IRQstart();
         bool result=IRQread(data,readBytes);
+        IrqProfiler::IRQrecord(USBdevice::PROFILE_READ,0,start);
         __enable_irq();
         if(result==false) return false; //Error
         if(readBytes>0) return true;    //Got data
@@ -380,6 +518,9 @@ bool Endpoint::read(unsigned char *data, int& readBytes)
 bool Endpoint::IRQwrite(const unsigned char *data, int size, int& written)
 {
     written=0;
+    //Writing while suspended asks the host to resume, if it allows so.
+    //If it is too early after suspend, the wakeup is retried later
+    if(DeviceStateImpl::isSuspended()) DeviceStateImpl::IRQrequestWakeup();
     if(pImpl->IRQgetData().enabledIn==0) return false;
     EndpointRegister& epr=USBREGS->endpoint[pImpl->IRQgetData().epNumber];
     EndpointRegister::Status stat=epr.IRQgetTxStatus();
@@ -388,7 +529,11 @@ bool Endpoint::IRQwrite(const unsigned char *data, int size, int& written)
     if(pImpl->IRQgetData().type==Descriptor::INTERRUPT)
     {
         //INTERRUPT
-        if(stat!=EndpointRegister::NAK) return true;//No error, just buffer full
+        if(stat!=EndpointRegister::NAK)
+        {
+            StatsImpl::IRQendpoint(pImpl->IRQgetData().epNumber).writeFull++;
+            return true; //No error, just buffer full
+        }
         written=min<unsigned int>(size,pImpl->IRQgetSizeOfInBuf());
         SharedMemory::copyBytesTo(pImpl->IRQgetInBuf(),data,written);
         epr.IRQsetTxDataSize(written);
@@ -409,7 +554,11 @@ bool Endpoint::IRQwrite(const unsigned char *data, int size, int& written)
          * So, filling two buffers in a row stops everything.
          * Solution: Force filling only one buffer.
          */
-        if(pImpl->IRQgetBufferCount()>=1) return true;//No err, just buffer full
+        if(pImpl->IRQgetBufferCount()>=1)
+        {
+            StatsImpl::IRQendpoint(pImpl->IRQgetData().epNumber).writeFull++;
+            return true; //No error, just buffer full
+        }
         pImpl->IRQincBufferCount();
         if(epr.IRQgetDtogRx()) //Actually, SW_BUF
         {
@@ -434,6 +583,9 @@ bool Endpoint::IRQwrite(const unsigned char *data, int size, int& written)
          */
         epr.IRQsetTxStatus(EndpointRegister::VALID);
     }
+    EndpointStats& stats=StatsImpl::IRQendpoint(pImpl->IRQgetData().epNumber);
+    stats.inPackets++;
+    stats.inBytes+=written;
     Tracer::IRQtrace(Ut::IN_BUF_FILL,pImpl->IRQgetData().epNumber,written);
     return true;
 }
@@ -449,13 +601,21 @@ bool Endpoint::IRQread(unsigned char *data, int& readBytes)
     if(pImpl->IRQgetData().type==Descriptor::INTERRUPT)
     {
         //INTERRUPT
-        if(stat!=EndpointRegister::NAK) return true; //No errors, just no data
+        if(stat!=EndpointRegister::NAK)
+        {
+            StatsImpl::IRQendpoint(pImpl->IRQgetData().epNumber).readEmpty++;
+            return true; //No errors, just no data
+        }
         readBytes=epr.IRQgetReceivedBytes();
         SharedMemory::copyBytesFrom(data,pImpl->IRQgetOutBuf(),readBytes);
         epr.IRQsetRxStatus(EndpointRegister::VALID);
     } else {
         //BULK
-        if(pImpl->IRQgetBufferCount()==0) return true; //No errors, just no data
+        if(pImpl->IRQgetBufferCount()==0)
+        {
+            StatsImpl::IRQendpoint(pImpl->IRQgetData().epNumber).readEmpty++;
+            return true; //No errors, just no data
+        }
         pImpl->IRQdecBufferCount();
         if(epr.IRQgetDtogTx()) //Actually, SW_BUF
         {
@@ -467,20 +627,181 @@ bool Endpoint::IRQread(unsigned char *data, int& readBytes)
         }
         epr.IRQtoggleDtogTx();
     }
+    EndpointStats& stats=StatsImpl::IRQendpoint(pImpl->IRQgetData().epNumber);
+    stats.outPackets++;
+    stats.outBytes+=readBytes;
     Tracer::IRQtrace(Ut::OUT_BUF_READ,pImpl->IRQgetData().epNumber,readBytes);
     return true;
 }
 
+bool Endpoint::flush()
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    unsigned char initialGeneration=pImpl->getGeneration();
+    for(;;)
+    {
+        if(pImpl->IRQgetData().enabledIn==0) return false;
+        EndpointRegister& epr=USBREGS->endpoint[pImpl->IRQgetData().epNumber];
+        if(epr.IRQgetTxStatus()==EndpointRegister::STALL) return false;
+        if(pImpl->isInBufferFull()==false && pImpl->IRQgetQueue().isEmpty())
+            return true;
+        Thread *self=Thread::IRQgetCurrentThread();
+        pImpl->IRQsetWaitingThreadOnInEndpoint(self);
+        self->IRQwait();
+        {
+            InterruptEnableLock eLock(dLock);
+            Thread::yield(); //The wait becomes effective
+        }
+        //If endpoint was reconfigured in the meantime, return error
+        if(pImpl->getGeneration()!=initialGeneration) return false;
+    }
+    #else //_MIOSIX
+    unsigned char initialGeneration=pImpl->getGeneration();
+    for(;;)
+    {
+        if(pImpl->getGeneration()!=initialGeneration) return false;
+        if(pImpl->getData().enabledIn==0) return false;
+        EndpointRegister& epr=USBREGS->endpoint[pImpl->getData().epNumber];
+        if(epr.IRQgetTxStatus()==EndpointRegister::STALL) return false;
+        if(pImpl->isInBufferFull()==false && pImpl->getQueue().isEmpty())
+            return true;
+        //FIXME: can't add a __WFI() here, see Endpoint::write()
+    }
+    #endif //_MIOSIX
+}
+
+int Endpoint::cancel()
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    return IRQcancel();
+    #else //_MIOSIX
+    __disable_irq();
+    int result=IRQcancel();
+    __enable_irq();
+    return result;
+    #endif //_MIOSIX
+}
+
+int Endpoint::IRQcancel()
+{
+    if(pImpl->IRQgetData().enabledIn==0) return 0;
+    int result=pImpl->IRQgetQueue().IRQdiscard();
+    EndpointRegister& epr=USBREGS->endpoint[pImpl->IRQgetData().epNumber];
+    EndpointRegister::Status stat=epr.IRQgetTxStatus();
+    if(stat==EndpointRegister::STALL) return result;
+
+    if(pImpl->IRQgetData().type==Descriptor::INTERRUPT)
+    {
+        //INTERRUPT
+        //After the host reads the buffer the hardware sets the status to NAK
+        if(stat!=EndpointRegister::VALID) return result;
+        epr.IRQsetTxStatus(EndpointRegister::NAK);
+        result+=epr.IRQgetTxDataSize();
+    } else {
+        //BULK
+        if(pImpl->IRQgetBufferCount()==0) return result;
+        epr.IRQsetTxStatus(EndpointRegister::NAK);
+        //If CTR_TX is set the host has already read the buffer, but the
+        //interrupt has not yet been serviced. The interrupt will find
+        //bufCount already zero, and that's fine
+        if((epr.get() & USB_EP0R_CTR_TX)==0)
+        {
+            //IRQwrite() toggles SW_BUF after filling a buffer, so the
+            //buffer waiting to be sent is the other one
+            if(epr.IRQgetDtogRx()) result+=epr.IRQgetTxDataSize0();
+            else result+=epr.IRQgetTxDataSize1();
+        }
+        //When SW_BUF==DTOG_TX the peripheral sees both buffers as empty
+        epr.IRQsetDtogRx(epr.IRQgetDtogTx()); //Actually, SW_BUF
+        while(pImpl->IRQgetBufferCount()>0) pImpl->IRQdecBufferCount();
+    }
+    pImpl->IRQwakeWaitingThreadOnInEndpoint();
+    return result;
+}
+
+bool Endpoint::stall(Direction dir)
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    return IRQstall(dir);
+    #else //_MIOSIX
+    __disable_irq();
+    bool result=IRQstall(dir);
+    __enable_irq();
+    return result;
+    #endif //_MIOSIX
+}
+
+bool Endpoint::IRQstall(Direction dir)
+{
+    return pImpl->IRQsetHalt(dir,true);
+}
+
+bool Endpoint::unstall(Direction dir)
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    return IRQunstall(dir);
+    #else //_MIOSIX
+    __disable_irq();
+    bool result=IRQunstall(dir);
+    __enable_irq();
+    return result;
+    #endif //_MIOSIX
+}
+
+bool Endpoint::IRQunstall(Direction dir)
+{
+    return pImpl->IRQsetHalt(dir,false);
+}
+
+bool Endpoint::isStalled(Direction dir) const
+{
+    return pImpl->IRQisHalted(dir);
+}
+
+bool Endpoint::setQueueBuffer(unsigned char *buffer, unsigned int size)
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    #else //_MIOSIX
+    __disable_irq();
+    #endif //_MIOSIX
+
+    bool result=pImpl->getQueue().setBuffer(buffer,size);
+
+    #ifndef _MIOSIX
+    __enable_irq();
+    #endif //_MIOSIX
+    return result;
+}
+
+bool Endpoint::enqueue(const unsigned char *data, int size)
+{
+    if(pImpl->getData().enabledIn==0) return false;
+    if(pImpl->getQueue().put(data,size)==false) return false;
+    //If the IN buffer is full, the interrupt that occurs when the host reads
+    //it will send the message, else trigger the interrupt in software
+    if(pImpl->isInBufferFull()==false) NVIC_SetPendingIRQ(USB_LP_CAN1_RX0_IRQn);
+    return true;
+}
+
 //
 // class Callbacks
 //
 
 void Callbacks::IRQendpoint(unsigned char epNum, Endpoint::Direction dir) {}
 
+void Callbacks::IRQhaltCleared(unsigned char epNum, Endpoint::Direction dir) {}
+
 void Callbacks::IRQstateChanged() {}
 
 void Callbacks::IRQconfigurationChanged() {}
 
+void Callbacks::IRQalternateSettingChanged(unsigned char interface) {}
+
 void Callbacks::IRQsuspend() {}
 
 void Callbacks::IRQresume() {}
@@ -517,6 +838,7 @@ bool USBdevice::enable(const unsigned char *device,
             const unsigned char * const * strings,
             unsigned char numStrings)
 {
+    CycleCounter::init(); //Before the tracer, which uses it for timestamps
     Tracer::init();
     if(DefCtrlPipe::registerAndValidateDescriptors(
             device,configs,strings,numStrings)==false) return false;
@@ -551,6 +873,7 @@ bool USBdevice::enable(const unsigned char *device,
     RCC->APB1ENR |= RCC_APB1ENR_USBEN;
 
     //Connect pull-up to vcc
+    EnumerationLog::IRQclear();
     USBgpio::enablePullup();
 
     USBREGS->CNTR=USB_CNTR_FRES; //Clear PDWN, leave FRES asserted
@@ -617,9 +940,141 @@ void USBdevice::waitUntilConfigured()
     DeviceStateImpl::waitUntilConfigured();
 }
 
+unsigned char USBdevice::getAlternateSetting(unsigned char interface)
+{
+    if(interface>=MAX_INTERFACES) return 0;
+    return DeviceStateImpl::getAlternateSetting(interface);
+}
+
 bool USBdevice::isSuspended()
 {
     return DeviceStateImpl::isSuspended();
 }
 
+bool USBdevice::isRemoteWakeupEnabled()
+{
+    return DeviceStateImpl::isRemoteWakeupEnabled();
+}
+
+bool USBdevice::remoteWakeup()
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    return IRQremoteWakeup();
+    #else //_MIOSIX
+    __disable_irq();
+    bool result=IRQremoteWakeup();
+    __enable_irq();
+    return result;
+    #endif //_MIOSIX
+}
+
+bool USBdevice::IRQremoteWakeup()
+{
+    if(DeviceStateImpl::isSuspended()==false) return false;
+    if(DeviceStateImpl::isRemoteWakeupEnabled()==false) return false;
+    if(resumeEsofCount>0) return true; //Already signaling RESUME
+    unsigned int cycles=CycleCounter::get()-suspendTimestamp;
+    if(CycleCounter::toMicroseconds(cycles)<MIN_SUSPEND_BEFORE_WAKEUP_US)
+        return false;
+
+    Tracer::IRQtrace(Ut::REMOTE_WAKEUP);
+    StatsImpl::IRQdevice().remoteWakeups++;
+    wakeupTimestamp=CycleCounter::get();
+    wakeupLatencyPending=true;
+    //Only start RESUME signaling, the interrupt handler will end it after
+    //RESUME_ESOF_COUNT milliseconds and then resume the device
+    USBREGS->CNTR&= ~(USB_CNTR_FSUSP | USB_CNTR_LP_MODE);
+    USBREGS->ISTR= ~(unsigned short)USB_ISTR_ESOF; //Clear stale ESOF flag
+    resumeEsofCount=RESUME_ESOF_COUNT;
+    USBREGS->CNTR|=USB_CNTR_RESUME | USB_CNTR_ESOFM;
+    return true;
+}
+
+unsigned int USBdevice::getRemoteWakeupLatency()
+{
+    return CycleCounter::toMicroseconds(wakeupLatency);
+}
+
+unsigned short USBdevice::getFrameNumber()
+{
+    return USBREGS->FNR & USB_FNR_FN;
+}
+
+void USBdevice::setTraceFilter(unsigned int categories,
+        unsigned short endpoints)
+{
+    Tracer::setFilter(categories,endpoints);
+}
+
+DeviceStats USBdevice::getStats()
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    return StatsImpl::IRQdevice();
+    #else //_MIOSIX
+    __disable_irq();
+    DeviceStats result=StatsImpl::IRQdevice();
+    __enable_irq();
+    return result;
+    #endif //_MIOSIX
+}
+
+EndpointStats USBdevice::getEndpointStats(unsigned char epNum)
+{
+    if(epNum>=NUM_ENDPOINTS)
+    {
+        EndpointStats result;
+        memset(&result,0,sizeof(result));
+        return result;
+    }
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    return StatsImpl::IRQendpoint(epNum);
+    #else //_MIOSIX
+    __disable_irq();
+    EndpointStats result=StatsImpl::IRQendpoint(epNum);
+    __enable_irq();
+    return result;
+    #endif //_MIOSIX
+}
+
+void USBdevice::clearStats()
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    StatsImpl::IRQclear();
+    #else //_MIOSIX
+    __disable_irq();
+    StatsImpl::IRQclear();
+    __enable_irq();
+    #endif //_MIOSIX
+}
+
+IrqHistogram USBdevice::getIrqProfile(ProfiledEvent event,
+        unsigned char epNum)
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    return IrqProfiler::IRQget(event,epNum);
+    #else //_MIOSIX
+    __disable_irq();
+    IrqHistogram result=IrqProfiler::IRQget(event,epNum);
+    __enable_irq();
+    return result;
+    #endif //_MIOSIX
+}
+
+void USBdevice::clearIrqProfile()
+{
+    #ifdef _MIOSIX
+    InterruptDisableLock dLock;
+    IrqProfiler::IRQclear();
+    #else //_MIOSIX
+    __disable_irq();
+    IrqProfiler::IRQclear();
+    __enable_irq();
+    #endif //_MIOSIX
+}
+
 } //namespace mxusb
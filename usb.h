@@ -28,6 +28,8 @@
 #ifndef USB_H
 #define	USB_H
 
+#include "trace_format.h"
+
 namespace mxusb {
 
 //Forward declaration
@@ -140,7 +142,8 @@ public:
      * it should be equal to size. User code should inspect written in
      * case of errors to know the number of bytes written before the error.
      * \return false in case of errors, or if the host suspended/reconfigured
-     * the device
+     * the device. Suspend is not an error if MXUSB_KEEP_ENDPOINTS_ON_SUSPEND
+     * is defined in usb_config.h
      */
     bool write(const unsigned char *data, int size, int& written);
 
@@ -157,7 +160,8 @@ public:
      * inspect readBytes even in case of errors, since some bytes might be read
      * before the error.
      * \return false in case of errors, or if the host suspended/reconfigured
-     * the device
+     * the device. Suspend is not an error if MXUSB_KEEP_ENDPOINTS_ON_SUSPEND
+     * is defined in usb_config.h
      */
     bool read(unsigned char *data, int& readBytes);
 
@@ -166,7 +170,9 @@ public:
      * This is a nonblocking call that returns immediately. It must be called
      * with interrupts disabled or within an IRQ (such as a Callback).
      * Because of the existence of a buffer, when the function returns some data
-     * might still be in the buffer waiting for the host to read it.
+     * might still be in the buffer waiting for the host to read it.<br>
+     * If the device is suspended and the host enabled remote wakeup, this
+     * call wakes up the host, see USBdevice::remoteWakeup()
      * \param data data to write
      * \param size size of data to write.
      * \param written number of bytes actually written. Contrary to write()
@@ -174,7 +180,8 @@ public:
      * should inspect written in case of errors to know the number of bytes
      * written before the error.
      * \return false in case of errors, or if the host suspended/reconfigured
-     * the device
+     * the device. Suspend is not an error if MXUSB_KEEP_ENDPOINTS_ON_SUSPEND
+     * is defined in usb_config.h
      */
     bool IRQwrite(const unsigned char *data, int size, int& written);
 
@@ -188,10 +195,128 @@ public:
      * inspect readBytes even in case of errors, since some bytes might be read
      * before the error.
      * \return false in case of errors, or if the host suspended/reconfigured
-     * the device
+     * the device. Suspend is not an error if MXUSB_KEEP_ENDPOINTS_ON_SUSPEND
+     * is defined in usb_config.h
      */
     bool IRQread(unsigned char *data, int& readBytes);
 
+    /**
+     * Wait until the host has read all the data written to the IN side of
+     * this endpoint, including the messages in its queue, if any.
+     * This is a blocking call. It can be called by the same thread that calls
+     * write(), but not concurrently by two threads.
+     * \return true when there is no more data to send, false in case of
+     * errors, or if the host suspended/reconfigured the device or the
+     * endpoint is stalled. Suspend is not an error if
+     * MXUSB_KEEP_ENDPOINTS_ON_SUSPEND is defined in usb_config.h
+     */
+    bool flush();
+
+    /**
+     * Discard the data written to the IN side of this endpoint that the host
+     * has not yet read, including the messages in its queue, if any.
+     * Data that the host is reading at the time of the call might still be
+     * sent. If a thread is blocked in write() or flush(), it is woken up.
+     * \return the number of bytes discarded
+     */
+    int cancel();
+
+    /**
+     * Same as cancel(), but must be called with interrupts disabled or within
+     * an IRQ (such as a Callback).
+     * \return the number of bytes discarded
+     */
+    int IRQcancel();
+
+    /**
+     * Halt (stall) one side of this endpoint, to signal the host that an
+     * error occurred. While halted, read()/write() and their IRQ versions
+     * return false, and threads blocked in them are woken up. The host
+     * recovers from the halt with a CLEAR_FEATURE(ENDPOINT_HALT) request,
+     * that resets the data toggle and discards the data buffered in the
+     * endpoint. The application is notified by Callbacks::IRQhaltCleared()
+     * \param dir side of the endpoint to halt
+     * \return false if that side of the endpoint is not enabled
+     */
+    bool stall(Direction dir);
+
+    /**
+     * Same as stall(), but must be called with interrupts disabled or within
+     * an IRQ (such as a Callback).
+     * \param dir side of the endpoint to halt
+     * \return false if that side of the endpoint is not enabled
+     */
+    bool IRQstall(Direction dir);
+
+    /**
+     * Clear the halt of one side of this endpoint from the device side.
+     * This has the same effect as a CLEAR_FEATURE(ENDPOINT_HALT) from the
+     * host, but the host data toggle is not reset, so use it only with
+     * protocols where the host knows about this.
+     * \param dir side of the endpoint
+     * \return false if that side of the endpoint is not enabled
+     */
+    bool unstall(Direction dir);
+
+    /**
+     * Same as unstall(), but must be called with interrupts disabled or
+     * within an IRQ (such as a Callback).
+     * \param dir side of the endpoint
+     * \return false if that side of the endpoint is not enabled
+     */
+    bool IRQunstall(Direction dir);
+
+    /**
+     * \param dir side of the endpoint
+     * \return true if that side of the endpoint is halted
+     */
+    bool isStalled(Direction dir) const;
+
+    /**
+     * Set the memory used by the message queue of the IN side of this
+     * endpoint. Once a queue is set, enqueue() can be used to send data to
+     * the host. The queue is kept across configuration changes, but the
+     * messages that have not yet been sent are discarded when the endpoint is
+     * deconfigured.<br>
+     * This function must not be called while other threads or interrupts are
+     * calling enqueue() on the same endpoint. When a queue is set, write() and
+     * IRQwrite() must not be used on this endpoint.
+     * \param buffer memory for the queue, or NULL to remove the queue. If the
+     * buffer is allocated on the stack, remember to remove the queue before
+     * the function that allocated it returns.
+     * \param size buffer size in bytes, must be a power of two. Every message
+     * takes two more bytes than its size in the buffer.
+     * \return false if size is not valid
+     */
+    bool setQueueBuffer(unsigned char *buffer, unsigned int size);
+
+    /**
+     * Enqueue a message to be sent to the host through the IN side of this
+     * endpoint. Contrary to write(), any number of threads and interrupt
+     * handlers can call this function at the same time on the same endpoint,
+     * and messages will never be interleaved. This is a nonblocking call,
+     * and it does not disable interrupts.<br>
+     * Messages are sent in the order they are enqueued by the USB interrupt
+     * handler, packing as many as possible into each packet, so the host
+     * sees a stream of bytes. Message boundaries are not preserved, so if
+     * the host needs them, messages should contain their own length.
+     * \param data message to send
+     * \param size message size, from 1 to 32767 bytes
+     * \return false if the IN side of the endpoint is not enabled, no queue
+     * has been set with setQueueBuffer(), the size is wrong or the queue is
+     * full.
+     */
+    bool enqueue(const unsigned char *data, int size);
+
+    /**
+     * Same as enqueue(), can be called also from an IRQ or when interrupts
+     * are disabled.
+     */
+    bool IRQenqueue(const unsigned char *data, int size)
+    {
+        return enqueue(data,size);
+    }
+
 private: 
     /**
      * Private constructor
@@ -228,6 +353,17 @@ public:
      */
     virtual void IRQendpoint(unsigned char epNum, Endpoint::Direction dir);
 
+    /**
+     * Called when the host clears the halt of an endpoint, with a
+     * CLEAR_FEATURE(ENDPOINT_HALT) request. Data buffered in that side of the
+     * endpoint has been discarded, so this is the place where to restart the
+     * application protocol. You <b>can</b> cause a context switch from within
+     * this callback, by calling Scheduler::IRQfindNextThread();
+     * \param epNum endpoint number
+     * \param dir direction, endpoint direction
+     */
+    virtual void IRQhaltCleared(unsigned char epNum, Endpoint::Direction dir);
+
     /**
      * Called every time the device state changes, for example from
      * DeviceState::DEFAULT to DeviceState::ADDRESS. Don't cause context
@@ -246,6 +382,17 @@ public:
      */
     virtual void IRQconfigurationChanged();
 
+    /**
+     * This callback is called right <b>after</b> the host selects an
+     * alternate setting for an interface, and the endpoints of that interface
+     * have been reconfigured. Endpoints of other interfaces are not affected.
+     * To get the new alternate setting it is possible to call
+     * USBdevice::IRQgetAlternateSetting().
+     * Don't cause context switches from here.
+     * \param interface bInterfaceNumber of the interface
+     */
+    virtual void IRQalternateSettingChanged(unsigned char interface);
+
     /**
      * Called when the host suspends the device. You <b>can</b> cause a context
      * switch from within this callback, by calling
@@ -254,9 +401,11 @@ public:
     virtual void IRQsuspend();
 
     /**
-     * Called when the host resumes the device. You <b>can</b> cause a context
-     * switch from within this callback, by calling
-     * Scheduler::IRQfindNextThread();
+     * Called when the host resumes the device, and also after a remote wakeup
+     * when the device ends RESUME signaling. It is always called from the USB
+     * interrupt, never from the code that requested the remote wakeup.
+     * You <b>can</b> cause a context switch from within this callback, by
+     * calling Scheduler::IRQfindNextThread();
      */
     virtual void IRQresume();
 
@@ -293,6 +442,53 @@ private:
     static Callbacks *callbacks; ///<Pointer to currently active callbacks
 };
 
+/**
+ * Performance counters of an endpoint. They are always enabled and wrap
+ * around, so rates should be computed from the difference of two readings.
+ * The peripheral has no interrupt for NAKed transactions, so inNak and
+ * outNak count the times the host was left without data or without buffer
+ * space, after which it is NAKed until user code writes or reads.
+ */
+struct EndpointStats
+{
+    unsigned int inPackets;      ///< Packets written to the IN buffer
+    unsigned int inBytes;        ///< Bytes written to the IN buffer
+    unsigned int outPackets;     ///< Packets read from the OUT buffer
+    unsigned int outBytes;       ///< Bytes read from the OUT buffer
+    unsigned int writeFull;      ///< IRQwrite() calls with the buffer full
+    unsigned int readEmpty;      ///< IRQread() calls with no data available
+    unsigned int inNak;          ///< Host read the last buffered IN packet
+    unsigned int outNak;         ///< Host filled all OUT buffers
+    unsigned int wakeups;        ///< Threads blocked on the endpoint woken up
+    unsigned int stalls;         ///< Times the endpoint was halted
+};
+
+/**
+ * Performance counters of the device, see EndpointStats
+ */
+struct DeviceStats
+{
+    unsigned int resets;         ///< USB resets
+    unsigned int suspends;       ///< Times the device was suspended
+    unsigned int resumes;        ///< Resumes, caused by the host or not
+    unsigned int remoteWakeups;  ///< Remote wakeups signaled
+    unsigned int setups;         ///< Setup packets received on endpoint zero
+    unsigned int ep0Aborts;      ///< Control transfers aborted by the host
+};
+
+/**
+ * Histogram of the duration of an event, see USBdevice::getIrqProfile().
+ * Durations are in cycles of the CPU clock, grouped in log2 buckets:
+ * buckets[i] counts the events that took from 2^i to 2^(i+1)-1 cycles,
+ * buckets[0] also counts zero and the last bucket also counts longer events.
+ */
+struct IrqHistogram
+{
+    enum { NUM_BUCKETS=16 };
+    unsigned int buckets[NUM_BUCKETS]; ///< Number of events per bucket
+    unsigned int max;                  ///< Longest duration, in cycles
+};
+
 /**
  * Allows to configure the USB peripheral.
  */
@@ -309,6 +505,21 @@ public:
         CONFIGURED ///<Device is configured
     };
 
+    /**
+     * Events measured by the IRQ profiler, see getIrqProfile()
+     */
+    enum ProfiledEvent
+    {
+        PROFILE_RESET,   ///<USB interrupt handling a reset
+        PROFILE_SUSPEND, ///<USB interrupt handling a suspend
+        PROFILE_RESUME,  ///<USB interrupt handling a resume or remote wakeup
+        PROFILE_SETUP,   ///<USB interrupt handling a setup packet
+        PROFILE_QUEUE,   ///<USB interrupt checking and draining message queues
+        PROFILE_WRITE,   ///<Interrupts disabled within Endpoint::write()
+        PROFILE_READ,    ///<Interrupts disabled within Endpoint::read()
+        PROFILE_CTR      ///<USB interrupt handling a transaction on an endpoint
+    };
+
     /**
      * Configure the USB peripheral, given the descriptors.
      * \param device device descriptor
@@ -358,11 +569,134 @@ public:
      */
     static void waitUntilConfigured();
 
+    /**
+     * \param interface bInterfaceNumber of an interface of the current
+     * configuration
+     * \return the alternate setting that the USB host has selected for that
+     * interface. Initially all interfaces are in alternate setting zero.
+     */
+    static unsigned char getAlternateSetting(unsigned char interface);
+
+    /**
+     * \param interface bInterfaceNumber of an interface of the current
+     * configuration
+     * \return same as getAlternateSetting(), but can be called from IRQ or
+     * with interrupts disabled.
+     */
+    static unsigned char IRQgetAlternateSetting(unsigned char interface)
+    {
+        return getAlternateSetting(interface);
+    }
+
     /**
      * \return true if device is suspended
      */
     static bool isSuspended();
 
+    /**
+     * \return true if the host has enabled remote wakeup, i.e: if the device
+     * is allowed to wake up the host while suspended. The host can enable it
+     * only if bit 5 of bmAttributes is set in the configuration descriptor.
+     */
+    static bool isRemoteWakeupEnabled();
+
+    /**
+     * If the device is suspended and the host enabled remote wakeup, signal
+     * RESUME to the host. This function only starts signaling, the device is
+     * resumed by the USB interrupt when signaling ends, 3..4ms later. Then
+     * Callbacks::IRQresume() is called, and endpoints are reconfigured if
+     * MXUSB_KEEP_ENDPOINTS_ON_SUSPEND is not defined, so till then writing to
+     * them fails. If it is defined, data written in the meantime is sent as
+     * soon as the host resumes the bus.<br>
+     * The USB standard requires the bus to be idle for at least 5ms before
+     * remote wakeup. Since suspend is detected after 3ms of idle bus, calling
+     * this function less than 2ms after the device was suspended fails.<br>
+     * Note that Endpoint::write() and Endpoint::IRQwrite() call this function
+     * automatically when the device is suspended, as does writing to a message
+     * queue. If it fails because it is too early, they retry it till the 2ms
+     * have passed.
+     * \return true if remote wakeup was signaled
+     */
+    static bool remoteWakeup();
+
+    /**
+     * Same as remoteWakeup(), but can be called only with interrupts disabled
+     * or within an interrupt routine.
+     * \return true if remote wakeup was signaled
+     */
+    static bool IRQremoteWakeup();
+
+    /**
+     * \return the time in microseconds from the last remote wakeup to the
+     * first packet transferred on an endpoint other than endpoint zero,
+     * or zero if no measurement is available.
+     */
+    static unsigned int getRemoteWakeupLatency();
+
+    /**
+     * \return the frame number of the last start of frame sent by the host,
+     * which is incremented every millisecond and wraps around at 2048
+     */
+    static unsigned short getFrameNumber();
+
+    /**
+     * \return same as getFrameNumber(), but can be called from IRQ or with
+     * interrupts disabled.
+     */
+    static unsigned short IRQgetFrameNumber() { return getFrameNumber(); }
+
+    /**
+     * Select at runtime which TracePoints are recorded, for example to trace
+     * every packet of a single endpoint. Has no effect if MXUSB_ENABLE_TRACE
+     * is not defined in usb_config.h. With MXUSB_TRACE_USB the host can also
+     * set the filter, see tracecapture in the testsuite.
+     * \param categories bitmask of Ut::Category values, CAT_VERBOSE is needed
+     * to trace individual packets
+     * \param endpoints bitmask, if bit n is zero TracePoints regarding
+     * endpoint n are not recorded
+     */
+    static void setTraceFilter(unsigned int categories,
+            unsigned short endpoints=0xffff);
+
+    /**
+     * \return the performance counters of the device
+     */
+    static DeviceStats getStats();
+
+    /**
+     * \param epNum endpoint number, zero included
+     * \return the performance counters of the endpoint. Counters of endpoint
+     * zero only count data packets. If epNum is not valid all counters are
+     * zero
+     */
+    static EndpointStats getEndpointStats(unsigned char epNum);
+
+    /**
+     * Reset all performance counters to zero
+     */
+    static void clearStats();
+
+    /**
+     * Requires MXUSB_ENABLE_IRQ_PROFILING to be defined in usb_config.h,
+     * otherwise the histograms are always empty.
+     * Interrupt handler times start when the handler is entered, and a
+     * handler that handles more events adds a measurement for each of them,
+     * so that they add up to the time from entry to exit. Critical sections
+     * are measured from when interrupts are disabled to when they are enabled
+     * again, also when Endpoint::write() or Endpoint::read() block.
+     * \param event event type
+     * \param epNum endpoint number, zero included, only used with PROFILE_CTR
+     * \return the histogram of the durations of that event. If epNum is not
+     * valid the histogram is empty
+     */
+    static IrqHistogram getIrqProfile(ProfiledEvent event,
+            unsigned char epNum=0);
+
+    /**
+     * Clear all the histograms of the IRQ profiler
+     */
+    static void clearIrqProfile();
+
 private:
     USBdevice();
 };
@@ -3,13 +3,118 @@
 #include "usb_tracer.h"
 #include "usb_util.h"
 #include "shared_memory.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
 
 namespace mxusb {
 
+/**
+ * \internal
+ * Advance to the next descriptor nested in a configuration descriptor
+ * \param config configuration descriptor
+ * \param offset offset of the current descriptor within config, updated to
+ * the offset of the next one. Start with zero
+ * \return false at the end of the configuration descriptor, or if the
+ * configuration descriptor is wrong
+ */
+static bool nextDescriptor(const unsigned char *config, unsigned short& offset)
+{
+    const unsigned short wTotalLength=toShort(&config[2]);
+    const unsigned char sizeIncrement=config[offset];
+    offset+=sizeIncrement;
+    if(offset==wTotalLength) return false;
+    if(offset>wTotalLength || sizeIncrement==0)
+    {
+        Tracer::IRQtrace(Ut::DESC_ERROR);
+        return false; //configuration descriptor is wrong
+    }
+    return true;
+}
+
 //
 // class EndpointImpl
 //
 
+void EndpointImpl::IRQdrainQueue()
+{
+    if(queue.isAttached()==false || data.enabledIn==0) return;
+    //While suspended the packet would sit in the buffer, and this may run
+    //in the same interrupt that handled suspend, when remote wakeup is still
+    //refused. Ask for a wakeup instead, data is sent after the resume
+    if(DeviceStateImpl::isSuspended())
+    {
+        if(queue.isEmpty()) return;
+        DeviceStateImpl::IRQrequestWakeup();
+        if(DeviceStateImpl::isSuspended()) return;
+    }
+    //Nothing to do if the buffer is still waiting for the host to read it
+    if(isInBufferFull()) return;
+
+    //Full speed BULK and INTERRUPT endpoints are at most 64 bytes
+    unsigned char packet[64];
+    int size=queue.IRQpeek(packet,min<int>(sizeof(packet),size0));
+    if(size==0) return;
+    int written;
+    Endpoint::IRQget(data.epNumber).IRQwrite(packet,size,written);
+    queue.IRQconsume(written);
+}
+
+void EndpointImpl::IRQdrainAllQueues()
+{
+    for(int i=1;i<NUM_ENDPOINTS;i++) EndpointImpl::get(i)->IRQdrainQueue();
+}
+
+bool EndpointImpl::IRQsetHalt(Endpoint::Direction dir, bool halt)
+{
+    EndpointRegister& epr=USBREGS->endpoint[data.epNumber];
+    if(dir==Endpoint::IN)
+    {
+        if(data.enabledIn==0) return false;
+        if(halt) epr.IRQsetTxStatus(EndpointRegister::STALL);
+        else {
+            epr.IRQsetTxStatus(EndpointRegister::NAK);
+            epr.IRQsetDtogTx(false);
+            if(data.type==Descriptor::BULK)
+            {
+                //When SW_BUF==DTOG_TX the peripheral sees both buffers empty
+                epr.IRQsetDtogRx(false); //Actually, SW_BUF
+                bufCount=0;
+            }
+            //Refill the buffer with queued messages, if any
+            if(queue.isAttached()) NVIC_SetPendingIRQ(USB_LP_CAN1_RX0_IRQn);
+        }
+        IRQwakeWaitingThreadOnInEndpoint();
+    } else {
+        if(data.enabledOut==0) return false;
+        if(halt) epr.IRQsetRxStatus(EndpointRegister::STALL);
+        else {
+            epr.IRQsetRxStatus(EndpointRegister::NAK);
+            epr.IRQsetDtogRx(false);
+            if(data.type==Descriptor::BULK)
+            {
+                epr.IRQsetDtogTx(false); //Actually, SW_BUF
+                bufCount=0;
+            }
+            epr.IRQsetRxStatus(EndpointRegister::VALID);
+        }
+        IRQwakeWaitingThreadOnOutEndpoint();
+    }
+    if(halt) StatsImpl::IRQendpoint(data.epNumber).stalls++;
+    Tracer::IRQtrace(Ut::ENDPOINT_HALT,data.epNumber | dir,halt ? 1 : 0);
+    return true;
+}
+
+bool EndpointImpl::IRQisHalted(Endpoint::Direction dir) const
+{
+    const EndpointRegister& epr=USBREGS->endpoint[data.epNumber];
+    if(dir==Endpoint::IN)
+        return data.enabledIn==1 &&
+                epr.IRQgetTxStatus()==EndpointRegister::STALL;
+    return data.enabledOut==1 && epr.IRQgetRxStatus()==EndpointRegister::STALL;
+}
+
 void EndpointImpl::IRQdeconfigureAll()
 {
     for(int i=1;i<NUM_ENDPOINTS;i++) EndpointImpl::get(i)->IRQdeconfigure(i);
@@ -19,24 +124,60 @@ void EndpointImpl::IRQdeconfigureAll()
 
 void EndpointImpl::IRQconfigureAll(const unsigned char *desc)
 {
-    const unsigned short wTotalLength=toShort(&desc[2]);
-    unsigned short descSize=0;
-    for(;;)
+    const int numInterfaces=min<int>(desc[4],MAX_INTERFACES);
+    for(int i=0;i<numInterfaces;i++)
+    {
+        interfaceMemory[i]=SharedMemory::allocate(interfaceMemorySize(desc,i));
+        if(interfaceMemory[i]==0) Tracer::IRQtrace(Ut::OUT_OF_SHMEM);
+    }
+    for(int i=0;i<numInterfaces;i++)
+        IRQconfigureInterface(desc,i,DeviceStateImpl::getAlternateSetting(i));
+}
+
+bool EndpointImpl::IRQsetAlternateSetting(const unsigned char *desc,
+        unsigned char interface, unsigned char alt)
+{
+    if(interface>=min<int>(desc[4],MAX_INTERFACES)) return false;
+    bool found=false;
+    unsigned short offset=0;
+    while(nextDescriptor(desc,offset))
     {
-        //Advance to next descriptor
-        unsigned int sizeIncrement=desc[0];
-        desc+=sizeIncrement;
-        descSize+=sizeIncrement;
-        if(descSize==wTotalLength) break;
-        if(descSize>wTotalLength || sizeIncrement==0)
+        const unsigned char *d=desc+offset;
+        if(d[1]!=Descriptor::INTERFACE) continue;
+        if(d[2]==interface && d[3]==alt) found=true;
+    }
+    if(found==false) return false;
+
+    //Even if alt is the current alternate setting, reconfigure endpoints,
+    //as SET_INTERFACE resets data toggles
+    unsigned char oldAlt=DeviceStateImpl::getAlternateSetting(interface);
+    IRQdeconfigureInterface(desc,interface,oldAlt);
+    DeviceStateImpl::IRQsetAlternateSetting(interface,alt);
+    IRQconfigureInterface(desc,interface,alt);
+    Callbacks::IRQgetCallbacks()->IRQalternateSettingChanged(interface);
+    return true;
+}
+
+unsigned short EndpointImpl::interfaceMemorySize(const unsigned char *desc,
+        unsigned char interface)
+{
+    unsigned short result=0;
+    unsigned short size=0; //Size of the alternate setting being parsed
+    bool inside=false;
+    unsigned short offset=0;
+    while(nextDescriptor(desc,offset))
+    {
+        const unsigned char *d=desc+offset;
+        if(d[1]==Descriptor::INTERFACE)
         {
-            Tracer::IRQtrace(Ut::DESC_ERROR);
-            return; //configuration descriptor is wrong
+            result=max(result,size);
+            size=0;
+            inside=d[2]==interface;
+        } else if(d[1]==Descriptor::ENDPOINT && inside) {
+            size+=endpointMemorySize(d);
         }
-        if(desc[1]!=Descriptor::ENDPOINT) continue;
-        const unsigned char epNum=desc[2] & 0xf;
-        EndpointImpl::get(epNum)->IRQconfigure(desc);
     }
+    return max(result,size);
 }
 
 void EndpointImpl::IRQdeconfigure(int epNum)
@@ -45,6 +186,8 @@ void EndpointImpl::IRQdeconfigure(int epNum)
     this->data.enabledIn=0;
     this->data.enabledOut=0;
     this->data.epNumber=epNum;
+    this->generation++;
+    this->queue.IRQdiscard(); //Queued messages are for the old configuration
     this->IRQwakeWaitingThreadOnInEndpoint();
     this->IRQwakeWaitingThreadOnOutEndpoint();
 }
@@ -180,8 +323,51 @@ void EndpointImpl::IRQconfigureBulkEndpoint(const unsigned char *desc)
     this->bufCount=0;
 }
 
+void EndpointImpl::IRQconfigureInterface(const unsigned char *desc,
+        unsigned char interface, unsigned char alt)
+{
+    if(interfaceMemory[interface]==0) return; //Out of shared memory
+
+    //Allocate buffers within the shared memory region of this interface
+    const shmem_ptr end=SharedMemory::getCurrentEnd();
+    SharedMemory::setCurrentEnd(interfaceMemory[interface]);
+    bool inside=false;
+    unsigned short offset=0;
+    while(nextDescriptor(desc,offset))
+    {
+        const unsigned char *d=desc+offset;
+        if(d[1]==Descriptor::INTERFACE) inside=(d[2]==interface && d[3]==alt);
+        else if(d[1]==Descriptor::ENDPOINT && inside)
+            EndpointImpl::get(d[2] & 0xf)->IRQconfigure(d);
+    }
+    SharedMemory::setCurrentEnd(end);
+}
+
+void EndpointImpl::IRQdeconfigureInterface(const unsigned char *desc,
+        unsigned char interface, unsigned char alt)
+{
+    bool inside=false;
+    unsigned short offset=0;
+    while(nextDescriptor(desc,offset))
+    {
+        const unsigned char *d=desc+offset;
+        if(d[1]==Descriptor::INTERFACE) inside=(d[2]==interface && d[3]==alt);
+        else if(d[1]==Descriptor::ENDPOINT && inside)
+            EndpointImpl::get(d[2] & 0xf)->IRQdeconfigure(d[2] & 0xf);
+    }
+}
+
+unsigned short EndpointImpl::endpointMemorySize(const unsigned char *desc)
+{
+    //Allocations are two bytes aligned, and BULK endpoints are double buffered
+    const unsigned short size=(toShort(&desc[4])+1) & ~1;
+    if((desc[3] & Descriptor::TYPE_MASK)==Descriptor::BULK) return 2*size;
+    return size;
+}
+
 EndpointImpl EndpointImpl::endpoints[NUM_ENDPOINTS-1];
 EndpointImpl EndpointImpl::invalidEp; //Invalid endpoint, always disabled
+shmem_ptr EndpointImpl::interfaceMemory[MAX_INTERFACES];
 
 //
 // class DeviceStateImpl
@@ -205,11 +391,37 @@ void DeviceStateImpl::IRQsetState(USBdevice::State s)
     Callbacks::IRQgetCallbacks()->IRQstateChanged();
 }
 
+void DeviceStateImpl::IRQrequestWakeup()
+{
+    wakeupPending=false;
+    if(suspended==false || remoteWakeupEnabled==false) return;
+    if(USBdevice::IRQremoteWakeup()) return;
+    //Suspended less than 2ms ago, retry on the next ESOF interrupts
+    wakeupPending=true;
+    USBREGS->CNTR|=USB_CNTR_ESOFM;
+}
+
 volatile USBdevice::State DeviceStateImpl::state=USBdevice::DEFAULT;
 volatile unsigned char DeviceStateImpl::configuration=0;
 volatile bool DeviceStateImpl::suspended=false;
+volatile bool DeviceStateImpl::remoteWakeupEnabled=false;
+volatile bool DeviceStateImpl::wakeupPending=false;
+unsigned char DeviceStateImpl::alternateSettings[MAX_INTERFACES]={0};
 #ifdef _MIOSIX
 miosix::Thread *DeviceStateImpl::configWaiting=0;
 #endif //_MIOSIX
 
+//
+// class StatsImpl
+//
+
+void StatsImpl::IRQclear()
+{
+    memset(&stats,0,sizeof(stats));
+    stats.version=VERSION;
+    stats.numEndpoints=NUM_ENDPOINTS;
+}
+
+StatsImpl::Statistics StatsImpl::stats={StatsImpl::VERSION,NUM_ENDPOINTS};
+
 } //namespace mxusb
@@ -33,6 +33,7 @@
 #include "usb.h"
 #include "endpoint_reg.h"
 #include "stm32_usb_regs.h"
+#include "message_queue.h"
 
 #ifdef _MIOSIX
 #include "kernel/kernel.h"
@@ -45,6 +46,66 @@
 
 namespace mxusb {
 
+/// \internal Maximum number of interfaces in a configuration descriptor.
+/// Interfaces past this number are not configured.
+const int MAX_INTERFACES=8;
+
+/**
+ * \internal
+ * Storage for the performance counters. They are kept in a single struct so
+ * that the diagnostic vendor request can send them as they are.
+ * Counters are incremented without disabling interrupts, so on the rare
+ * occasion that interrupts of different priority update the same counter a
+ * count may be lost, but it's only a statistic.
+ */
+class StatsImpl
+{
+public:
+    ///Incremented when the layout of Statistics changes
+    static const unsigned char VERSION=1;
+
+    /**
+     * All the counters, as sent by the diagnostic vendor request
+     */
+    struct Statistics
+    {
+        unsigned char version;      ///< VERSION
+        unsigned char numEndpoints; ///< Size of endpoints
+        unsigned short reserved;
+        DeviceStats device;
+        EndpointStats endpoints[NUM_ENDPOINTS]; ///< Indexed by number
+    };
+
+    /**
+     * \return the device counters
+     */
+    static DeviceStats& IRQdevice() { return stats.device; }
+
+    /**
+     * \param epNum endpoint number, must be less than NUM_ENDPOINTS
+     * \return the counters of an endpoint
+     */
+    static EndpointStats& IRQendpoint(unsigned char epNum)
+    {
+        return stats.endpoints[epNum];
+    }
+
+    /**
+     * \return all the counters
+     */
+    static const Statistics& IRQget() { return stats; }
+
+    /**
+     * Reset all counters to zero
+     */
+    static void IRQclear();
+
+private:
+    StatsImpl();
+
+    static Statistics stats;
+};
+
 /**
  * \internal
  * Implemenation class for Endpoint facade class.
@@ -100,6 +161,7 @@ public:
         #ifdef _MIOSIX
         using namespace miosix;
         if(waitIn==0) return;
+        StatsImpl::IRQendpoint(data.epNumber).wakeups++;
         waitIn->IRQwakeup();
         if(waitIn->IRQgetPriority()>Thread::IRQgetCurrentThread()->IRQgetPriority())
                 Scheduler::IRQfindNextThread();
@@ -115,6 +177,7 @@ public:
         #ifdef _MIOSIX
         using namespace miosix;
         if(waitOut==0) return;
+        StatsImpl::IRQendpoint(data.epNumber).wakeups++;
         waitOut->IRQwakeup();
         if(waitOut->IRQgetPriority()>Thread::IRQgetCurrentThread()->IRQgetPriority())
                 Scheduler::IRQfindNextThread();
@@ -216,17 +279,115 @@ public:
         if(bufCount!=0) bufCount--;
     }
 
+    /**
+     * \return the message queue of the IN side of this endpoint
+     */
+    MessageQueue& getQueue() { return queue; }
+
+    /**
+     * \return the message queue of the IN side of this endpoint
+     */
+    MessageQueue& IRQgetQueue() { return queue; }
+
+    /**
+     * \return true if the IN side of this endpoint has a buffer filled with
+     * data that the host has not yet read. Can be called both when interrupts
+     * are disabled or not.
+     */
+    bool isInBufferFull() const
+    {
+        if(data.type==Descriptor::INTERRUPT)
+            return USBREGS->endpoint[data.epNumber].IRQgetTxStatus()!=
+                    EndpointRegister::NAK;
+        return bufCount!=0;
+    }
+
+    /**
+     * \return true if the OUT side of this endpoint has no free buffer, so
+     * the host is NAKed until user code reads data.
+     */
+    bool IRQisOutBufferFull() const
+    {
+        if(data.type==Descriptor::INTERRUPT)
+            return USBREGS->endpoint[data.epNumber].IRQgetRxStatus()==
+                    EndpointRegister::NAK;
+        return bufCount>=2;
+    }
+
+    /**
+     * If this endpoint has a message queue and its IN buffer is free, fill
+     * the buffer with as much queued data as fits in a packet.
+     * Must be called only from the low priority USB interrupt, which is the
+     * only consumer of message queues.
+     */
+    void IRQdrainQueue();
+
+    /**
+     * Call IRQdrainQueue() on all endpoints
+     */
+    static void IRQdrainAllQueues();
+
+    /**
+     * \return a number that changes every time this endpoint is deconfigured,
+     * used by blocking functions to detect that the endpoint they were
+     * waiting on has been reconfigured in the meantime.
+     */
+    unsigned char getGeneration() const { return generation; }
+
+    /**
+     * Halt or clear the halt of one side of this endpoint. Clearing the halt
+     * resets the data toggle and discards buffered data, as required by the
+     * USB standard for CLEAR_FEATURE(ENDPOINT_HALT). In both cases threads
+     * blocked on that side of the endpoint are woken up.
+     * \param dir side of the endpoint
+     * \param halt true to halt, false to clear the halt
+     * \return false if that side of the endpoint is not enabled
+     */
+    bool IRQsetHalt(Endpoint::Direction dir, bool halt);
+
+    /**
+     * \param dir side of the endpoint
+     * \return true if that side of the endpoint is halted
+     */
+    bool IRQisHalted(Endpoint::Direction dir) const;
+
     /**
      * Deconfigure all endpoints
      */
     static void IRQdeconfigureAll();
 
     /**
-     * Configure all endpoints
+     * Configure all endpoints. Each interface is configured with the alternate
+     * setting returned by DeviceStateImpl::getAlternateSetting().
+     * Shared memory is allocated as a region for each interface, large enough
+     * for the largest of its alternate settings, so that alternate settings
+     * can be changed without touching the endpoints of other interfaces.
      * \param desc configuration descriptor
      */
     static void IRQconfigureAll(const unsigned char *desc);
 
+    /**
+     * Change the alternate setting of an interface, reconfiguring only the
+     * endpoints of that interface. Also calls the alternate setting change
+     * callback.
+     * \param desc configuration descriptor
+     * \param interface bInterfaceNumber of the interface
+     * \param alt new bAlternateSetting
+     * \return false if the configuration descriptor does not contain that
+     * alternate setting
+     */
+    static bool IRQsetAlternateSetting(const unsigned char *desc,
+            unsigned char interface, unsigned char alt);
+
+    /**
+     * \param desc configuration descriptor
+     * \param interface bInterfaceNumber of an interface
+     * \return the shared memory size required by the largest alternate
+     * setting of that interface
+     */
+    static unsigned short interfaceMemorySize(const unsigned char *desc,
+            unsigned char interface);
+
     /**
      * Deconfigure this endpoint.
      * \param epNum the number of this endpoint, used to ser data.epNumber
@@ -245,9 +406,10 @@ private:
 
     #ifdef _MIOSIX
     EndpointImpl(): data(), size0(0), size1(0), buf0(0), buf1(0),
-            waitIn(0), waitOut(0) {}
+            generation(0), waitIn(0), waitOut(0) {}
     #else //_MIOSIX
-    EndpointImpl(): data(), size0(0), size1(0), buf0(0), buf1(0) {}
+    EndpointImpl(): data(), size0(0), size1(0), buf0(0), buf1(0),
+            generation(0) {}
     #endif //_MIOSIX
 
     /**
@@ -262,6 +424,31 @@ private:
      */
     void IRQconfigureBulkEndpoint(const unsigned char *desc);
 
+    /**
+     * Configure the endpoints of an alternate setting of an interface,
+     * allocating them within the shared memory region of that interface
+     * \param desc configuration descriptor
+     * \param interface bInterfaceNumber of the interface
+     * \param alt bAlternateSetting to configure
+     */
+    static void IRQconfigureInterface(const unsigned char *desc,
+            unsigned char interface, unsigned char alt);
+
+    /**
+     * Deconfigure the endpoints of an alternate setting of an interface
+     * \param desc configuration descriptor
+     * \param interface bInterfaceNumber of the interface
+     * \param alt bAlternateSetting to deconfigure
+     */
+    static void IRQdeconfigureInterface(const unsigned char *desc,
+            unsigned char interface, unsigned char alt);
+
+    /**
+     * \param desc endpoint descriptor
+     * \return the shared memory size required by the endpoint
+     */
+    static unsigned short endpointMemorySize(const unsigned char *desc);
+
     // Note: size0 and size1 are unsigned char because the stm32 has a full
     // speed USB peripheral, so max buffer size for and endpoint is 64bytes
 
@@ -271,6 +458,8 @@ private:
     unsigned char size1;    ///< Size of buf1 (if type==BULK size0==size1)
     shmem_ptr buf0;         ///< IN  buffer for INTERRUPT, buf0 for BULK
     shmem_ptr buf1;         ///< OUT buffer for INTERRUPT, buf1 for BULK
+    MessageQueue queue;     ///< Optional message queue for the IN side
+    volatile unsigned char generation; ///< Incremented when deconfigured
 
     #ifdef _MIOSIX
     miosix::Thread *waitIn;  ///< Thread waiting on IN side
@@ -279,6 +468,8 @@ private:
 
     static EndpointImpl endpoints[NUM_ENDPOINTS-1];
     static EndpointImpl invalidEp; //Invalid endpoint, always disabled
+    ///Start of the shared memory region of each interface
+    static shmem_ptr interfaceMemory[MAX_INTERFACES];
 };
 
 /**
@@ -360,12 +551,76 @@ public:
      */
     static bool isSuspended() { return suspended; }
 
+    /**
+     * Set by the host through SET_FEATURE/CLEAR_FEATURE(DEVICE_REMOTE_WAKEUP)
+     * \param enabled true if the device is allowed to wake the host
+     */
+    static void IRQsetRemoteWakeupEnabled(bool enabled)
+    {
+        remoteWakeupEnabled=enabled;
+    }
+
+    /**
+     * \return true if the host enabled remote wakeup
+     */
+    static bool isRemoteWakeupEnabled() { return remoteWakeupEnabled; }
+
+    /**
+     * Called when data is written to an endpoint while the device is
+     * suspended. If the host enabled remote wakeup, signal it. If the bus has
+     * not been idle for long enough yet, the wakeup is left pending and
+     * retried by the ESOF interrupt, which is enabled for that.
+     * Must be called with interrupts disabled or within an interrupt.
+     */
+    static void IRQrequestWakeup();
+
+    /**
+     * Forget a pending remote wakeup, done when the device is resumed or reset
+     */
+    static void IRQclearWakeupPending() { wakeupPending=false; }
+
+    /**
+     * \return true if a remote wakeup has to be retried
+     */
+    static bool isWakeupPending() { return wakeupPending; }
+
+    /**
+     * \param interface bInterfaceNumber, must be less than MAX_INTERFACES
+     * \return the alternate setting selected by the host for that interface
+     */
+    static unsigned char getAlternateSetting(unsigned char interface)
+    {
+        return alternateSettings[interface];
+    }
+
+    /**
+     * \param interface bInterfaceNumber, must be less than MAX_INTERFACES
+     * \param alt alternate setting selected by the host for that interface
+     */
+    static void IRQsetAlternateSetting(unsigned char interface,
+            unsigned char alt)
+    {
+        alternateSettings[interface]=alt;
+    }
+
+    /**
+     * Select alternate setting zero for all interfaces, done when the host
+     * sets a configuration
+     */
+    static void IRQresetAlternateSettings()
+    {
+        for(int i=0;i<MAX_INTERFACES;i++) alternateSettings[i]=0;
+    }
+
 private:
     DeviceStateImpl();
 
     static volatile USBdevice::State state; ///< Current device state
     static volatile unsigned char configuration; ///< Current device config
     static volatile bool suspended; ///< True if suspended
+    static volatile bool remoteWakeupEnabled; ///< True if host allows wakeup
+    static volatile bool wakeupPending; ///< True if wakeup must be retried
+    static unsigned char alternateSettings[MAX_INTERFACES]; ///< Per interface
     #ifdef _MIOSIX
     static miosix::Thread *configWaiting;
     #endif //_MIOSIX
@@ -29,7 +29,10 @@
 #include "usb.h"
 #include "def_ctrl_pipe.h"
 #include "usb_util.h"
+#include "cycle_counter.h"
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
 
 #ifdef MXUSB_ENABLE_TRACE
 
@@ -38,179 +41,390 @@ using namespace miosix;
 
 namespace mxusb {
 
+//MessageQueue requires a power of two size
+typedef char queueSizeCheck[(QUEUE_SIZE & (QUEUE_SIZE-1))==0 ? 1 : -1];
+
+/**
+ * \internal
+ * Increment a counter shared between interrupts of different priority,
+ * without disabling interrupts
+ * \param x counter to increment
+ */
+static void atomicIncrement(volatile unsigned int& x)
+{
+    unsigned int *p=const_cast<unsigned int*>(&x);
+    //If an interrupt happened between ldrex and strex, strex fails
+    while(__STREXW(__LDREXW(p)+1,p)!=0) ;
+}
+
+#if defined(MXUSB_TRACE_BINARY) || defined(MXUSB_TRACE_USB)
+
+/**
+ * \internal
+ * Make a record with a four byte parameter
+ * \param record buffer for the record, RECORD_HEADER_SIZE+4 bytes
+ * \param tp ID of the record, TRACE_CLOCK or TRACE_DROPPED
+ * \param value parameter
+ * \return the record size
+ */
+static int makeRecord(unsigned char *record, Ut::TracePoint tp,
+        unsigned int value)
+{
+    const unsigned int timestamp=CycleCounter::get();
+    record[0]=tp;
+    record[1]=timestamp & 0xff;
+    record[2]=(timestamp>>8) & 0xff;
+    record[3]=(timestamp>>16) & 0xff;
+    record[4]=timestamp>>24;
+    record[5]=value & 0xff;
+    record[6]=(value>>8) & 0xff;
+    record[7]=(value>>16) & 0xff;
+    record[8]=value>>24;
+    return Tracer::RECORD_HEADER_SIZE+4;
+}
+
+/**
+ * \internal
+ * Frame a record for the binary trace stream
+ * \param frame buffer for the frame, MAX_RECORD_SIZE+FRAME_OVERHEAD bytes
+ * \param record record data
+ * \param size record size
+ * \return the frame size
+ */
+static int makeFrame(unsigned char *frame, const unsigned char *record,
+        int size)
+{
+    frame[0]=TraceFormat::SYNC;
+    frame[1]=size;
+    for(int i=0;i<size;i++) frame[2+i]=record[i];
+    frame[2+size]=TraceFormat::checksum(record,size);
+    return size+TraceFormat::FRAME_OVERHEAD;
+}
+
+#endif //MXUSB_TRACE_BINARY || MXUSB_TRACE_USB
+
+#if defined(MXUSB_TRACE_BINARY) && !defined(MXUSB_TRACE_USB)
+
+/**
+ * \internal
+ * Write a record to stdout, in binary format
+ * \param record record data
+ * \param size record size
+ */
+static void writeFrame(const unsigned char *record, int size)
+{
+    unsigned char frame[Tracer::MAX_RECORD_SIZE+TraceFormat::FRAME_OVERHEAD];
+    fwrite(frame,1,makeFrame(frame,record,size),stdout);
+}
+
+/**
+ * \internal
+ * Write a record with a four byte parameter to stdout, in binary format
+ * \param tp ID of the record, TRACE_CLOCK or TRACE_DROPPED
+ * \param value parameter
+ */
+static void writeRecord(Ut::TracePoint tp, unsigned int value)
+{
+    unsigned char record[Tracer::RECORD_HEADER_SIZE+4];
+    writeFrame(record,makeRecord(record,tp,value));
+}
+
+//Records are not formatted on the device, so a smaller stack is enough
+static const unsigned int printerStackSize=1024;
+#elif !defined(MXUSB_TRACE_USB)
+static const unsigned int printerStackSize=2048;
+#endif //MXUSB_TRACE_BINARY && !MXUSB_TRACE_USB
+
 //
 // class USBtracer
 //
 
 void Tracer::init()
 {
-    if(printer!=0) return; //Already initialized
-    error=false;
-    queue.reset();
-    printer=Thread::create(printerThread,2048,1,0,Thread::JOINABLE);
+    if(queue.isAttached()) return; //Already initialized
+    queue.setBuffer(buffer,QUEUE_SIZE);
+    dropped=0;
+    maxCost=0;
+    {
+        InterruptDisableLock dLock;
+        IRQsetFilter(categories,endpoints); //Keep a filter set before init
+    }
+    #ifdef MXUSB_TRACE_USB
+    //No thread, the queue is drained by the USB interrupt
+    pendingSize=pendingPos=0;
+    lastDropped=0;
+    clockRequested=false;
+    #else //MXUSB_TRACE_USB
+    terminate=false;
+    printer=Thread::create(printerThread,printerStackSize,1,0,
+            Thread::JOINABLE);
+    #endif //MXUSB_TRACE_USB
 }
 
 void Tracer::shutdown()
 {
-    queue.put(Ut::TERMINATE);
+    if(queue.isAttached()==false) return;
+    #ifndef MXUSB_TRACE_USB
+    terminate=true;
     printer->join();
     printer=0;
+    #endif //MXUSB_TRACE_USB
+    queue.setBuffer(0,0);
 }
 
-void Tracer::IRQtrace(Ut::TracePoint tp)
+void Tracer::setFilter(unsigned int categories, unsigned short endpoints)
 {
-    if(error) return;
-    #ifndef MXUSB_PRINT_VERBOSE
-    if(tp & Ut::VERBOSE) return; //Discard verbose
-    #endif //MXUSB_PRINT_VERBOSE
-    if(queue.IRQput(tp)==false) error=true;
+    InterruptDisableLock dLock;
+    IRQsetFilter(categories,endpoints);
 }
 
-void Tracer::IRQtrace(Ut::TracePoint tp, unsigned char param)
+void Tracer::IRQsetFilter(unsigned int categories, unsigned short endpoints)
 {
-    if(error) return;
-    #ifndef MXUSB_PRINT_VERBOSE
-    if(tp & Ut::VERBOSE) return; //Discard verbose
-    #endif //MXUSB_PRINT_VERBOSE
-    if(queue.IRQput(tp)==false) error=true;
-    if(queue.IRQput(param)==false) error=true;
+    Tracer::categories=categories;
+    Tracer::endpoints=endpoints;
+    for(int i=0;i<8;i++) enabled[i]=0;
+    for(int i=0;i<256;i++)
+        if((Ut::category(i) & ~categories)==0)
+            enabled[i>>5] |= 1u<<(i & 31);
 }
 
-void Tracer::IRQtrace(Ut::TracePoint tp, unsigned char p1, unsigned char p2)
+void Tracer::IRQrecord(Ut::TracePoint tp, const unsigned char *params,
+        int size)
 {
-    if(error) return;
-    #ifndef MXUSB_PRINT_VERBOSE
-    if(tp & Ut::VERBOSE) return; //Discard verbose
-    #endif //MXUSB_PRINT_VERBOSE
-    if(queue.IRQput(tp)==false) error=true;
-    if(queue.IRQput(p1)==false) error=true;
-    if(queue.IRQput(p2)==false) error=true;
+    if(queue.isAttached()==false) return; //Tracer not started
+    const unsigned int timestamp=CycleCounter::get();
+    unsigned char record[MAX_RECORD_SIZE];
+    record[0]=tp;
+    record[1]=timestamp & 0xff;
+    record[2]=(timestamp>>8) & 0xff;
+    record[3]=(timestamp>>16) & 0xff;
+    record[4]=timestamp>>24;
+    size=min(size,MAX_RECORD_SIZE-RECORD_HEADER_SIZE);
+    for(int i=0;i<size;i++) record[RECORD_HEADER_SIZE+i]=params[i];
+    if(queue.put(record,RECORD_HEADER_SIZE+size)==false)
+        atomicIncrement(dropped);
+    //Not atomic, an interrupt may overwrite maxCost with a lower value, but
+    //it's only a statistic
+    const unsigned int cost=CycleCounter::get()-timestamp;
+    if(cost>maxCost) maxCost=cost;
 }
 
-void Tracer::IRQtraceArray(Ut::TracePoint tp, unsigned char *data, int size)
+#ifdef MXUSB_TRACE_USB
+
+void Tracer::IRQrequestClock()
 {
-    if(error) return;
-    #ifndef MXUSB_PRINT_VERBOSE
-    if(tp & Ut::VERBOSE) return; //Discard verbose
-    #endif //MXUSB_PRINT_VERBOSE
-    if(queue.IRQput(tp)==false) error=true;
-    for(int i=0;i<size;i++) if(queue.IRQput(*data++)==false) error=true;
+    clockRequested=true;
 }
 
-void Tracer::IRQtraceEPnR(unsigned short reg)
+int Tracer::IRQdrain(unsigned char *data, int size)
 {
-    unsigned char *toChar=reinterpret_cast<unsigned char*>(&reg);
-    if(queue.IRQput(Ut::DBG_DUMP_EPnR)==false) error=true;
-    if(queue.IRQput(toChar[0])==false) error=true;
-    if(queue.IRQput(toChar[1])==false) error=true;
+    int written=0;
+    for(;;)
+    {
+        //First send what is left of the frame that did not fit last time
+        const int n=min(pendingSize-pendingPos,size-written);
+        memcpy(data+written,pending+pendingPos,n);
+        pendingPos+=n;
+        written+=n;
+        if(written==size) return written;
+
+        unsigned char record[MAX_RECORD_SIZE];
+        int recordSize;
+        const unsigned int d=dropped;
+        if(clockRequested)
+        {
+            //Let the decoder convert timestamps to time
+            recordSize=makeRecord(record,Ut::TRACE_CLOCK,
+                    CycleCounter::cyclesPerMicrosecond()*1000000);
+            clockRequested=false;
+        } else if(d!=lastDropped) {
+            recordSize=makeRecord(record,Ut::TRACE_DROPPED,d-lastDropped);
+            lastDropped=d;
+        } else {
+            recordSize=queue.IRQmessageSize();
+            if(recordSize==0) return written; //No more records
+            recordSize=queue.IRQpeek(record,min(recordSize,MAX_RECORD_SIZE));
+            queue.IRQconsume(recordSize);
+            if(recordSize<RECORD_HEADER_SIZE) continue; //Should never happen
+        }
+        pendingSize=makeFrame(pending,record,recordSize);
+        pendingPos=0;
+    }
 }
 
+#else //MXUSB_TRACE_USB
+
 void Tracer::printerThread(void *argv)
 {
+    unsigned int lastDropped=0;
+    #ifdef MXUSB_TRACE_BINARY
+    //Let the decoder convert timestamps to time
+    writeRecord(Ut::TRACE_CLOCK,CycleCounter::cyclesPerMicrosecond()*1000000);
+    #else //MXUSB_TRACE_BINARY
+    unsigned int lastTimestamp=CycleCounter::get();
+    unsigned long long cycles=0; //Since the tracer started, does not wrap
+    #endif //MXUSB_TRACE_BINARY
     for(;;)
     {
-        unsigned char c;
-        queue.get(c);
-        if(c==Ut::TERMINATE)
+        //There is a single consumer, so the queue can be read without
+        //disabling interrupts
+        int size=queue.IRQmessageSize();
+        if(size==0)
         {
-            iprintf("++    Tracer thread is terminating\n");
-            return;
-        }
-        if(error)
-        {
-            iprintf("**    Error: trace buffer full\n");
-            return;
+            const unsigned int d=dropped;
+            if(d!=lastDropped)
+            {
+                #ifdef MXUSB_TRACE_BINARY
+                writeRecord(Ut::TRACE_DROPPED,d-lastDropped);
+                #else //MXUSB_TRACE_BINARY
+                iprintf("**    %d trace records dropped\n",d-lastDropped);
+                #endif //MXUSB_TRACE_BINARY
+                lastDropped=d;
+            }
+            #ifdef MXUSB_TRACE_BINARY
+            fflush(stdout);
+            if(terminate) return;
+            #else //MXUSB_TRACE_BINARY
+            if(terminate)
+            {
+                iprintf("++    Tracer thread is terminating, max trace "
+                        "cost %d cycles\n",maxCost);
+                return;
+            }
+            #endif //MXUSB_TRACE_BINARY
+            Thread::sleep(5);
+            continue;
         }
+        unsigned char record[MAX_RECORD_SIZE];
+        size=queue.IRQpeek(record,min(size,MAX_RECORD_SIZE));
+        queue.IRQconsume(size);
+        if(size<RECORD_HEADER_SIZE) continue; //Should never happen
 
-        //Trace printing
-        switch(c)
-        {
-            //Standard traces
-            case Ut::DEVICE_STATE_CHANGE:
-                deviceStateChange();
-                break;
-            case Ut::DEVICE_RESET:
-                iprintf("++DEV Device RESET\n");
-                break;   
-            case Ut::EP0_VALID_SETUP:
-                validSetup();
-                break;
-            case Ut::SUSPEND_REQUEST:
-                iprintf("++DEV Suspend request\n");
-                break;
-            case Ut::RESUME_REQUEST:
-                iprintf("++DEV Resume request\n");
-                break;
-            case Ut::EP0_INTERRUPTED_SETUP:
-                iprintf("**EP0 Setup interrupts previous transaction\n");
-                break;
-            case Ut::EP0_IN_ABORT:
-                iprintf("**EP0 IN data stage aborted by host\n");
-                break;
-            case Ut::DESC_ERROR:
-                iprintf("**DEV Failed parsing descriptors\n");
-                break;
-            case Ut::OUT_OF_SHMEM:
-                iprintf("**DEV Out of shared memory\n");
-                break;
-            case Ut::ADDRESS_SET:
-                addressSet();
-                break;
-            case Ut::CONFIGURING_EP:
-                configuringEp();
-                break;
-            case Ut::EP0_OUT_OVERRUN:
-                iprintf("**EP0 Overrun within OUT data stage\n");
-                break;
-
-            //Verbose only traces
-            case Ut::EP0_SETUP_IRQ:
-                iprintf("+ EP0 SETUP irq\n");
-                break;
-            case Ut::EP0_IN_IRQ:
-                iprintf("+ EP0 IN irq\n");
-                break;
-            case Ut::EP0_OUT_IRQ:
-                iprintf("+ EP0 OUT irq\n");
-                break;
-            case Ut::EP0_UNSUPP_BREQ:
-                iprintf("* EP0 Unsupported bRequest\n");
-                break;
-            case Ut::EP0_UNSUPP_DESC:
-                iprintf("* EP0 Unsupported descriptor\n");
-                break;
-            case Ut::EP0_STATUS_OUT:
-                iprintf("+ EP0 OUT transaction completed\n");
-                break;
-            case Ut::EP0_STATUS_IN:
-                iprintf("+ EP0 IN transaction completed\n");
-                break;
-            case Ut::IN_BUF_FILL:
-                inBufFill();
-                break;
-            case Ut::OUT_BUF_READ:
-                outBufRead();
-                break;
-
-            //Special traces
-            case Ut::DBG_DUMP_EPnR:
-                dumpEPnR();
-                break;
-            case Ut::MARKER:
-                iprintf("-->   Marker\n");
-                break;
-            default:
-                iprintf("+ Error: unknown TracePoint\n");
-        }
+        #ifdef MXUSB_TRACE_BINARY
+        writeFrame(record,size);
+        #else //MXUSB_TRACE_BINARY
+        //Records may be slightly out of order if an interrupt preempts
+        //another between taking the timestamp and reserving the record, so
+        //the difference is signed
+        const unsigned int timestamp=TraceFormat::timestamp(record);
+        cycles+=static_cast<int>(timestamp-lastTimestamp);
+        lastTimestamp=timestamp;
+        iprintf("[%9d] ",static_cast<unsigned int>(
+                cycles/CycleCounter::cyclesPerMicrosecond()));
+        printRecord(record,size);
+        #endif //MXUSB_TRACE_BINARY
+    }
+}
+
+#ifndef MXUSB_TRACE_BINARY
+
+void Tracer::printRecord(const unsigned char *record, int size)
+{
+    const unsigned char *p=record+RECORD_HEADER_SIZE;
+    //Trace printing
+    switch(record[0])
+    {
+        //Standard traces
+        case Ut::DEVICE_STATE_CHANGE:
+            deviceStateChange(p);
+            break;
+        case Ut::DEVICE_RESET:
+            iprintf("++DEV Device RESET\n");
+            break;   
+        case Ut::EP0_VALID_SETUP:
+            validSetup(p);
+            break;
+        case Ut::SUSPEND_REQUEST:
+            iprintf("++DEV Suspend request\n");
+            break;
+        case Ut::RESUME_REQUEST:
+            iprintf("++DEV Resume request\n");
+            break;
+        case Ut::EP0_INTERRUPTED_SETUP:
+            iprintf("**EP0 Setup interrupts previous transaction\n");
+            break;
+        case Ut::EP0_IN_ABORT:
+            iprintf("**EP0 IN data stage aborted by host\n");
+            break;
+        case Ut::DESC_ERROR:
+            iprintf("**DEV Failed parsing descriptors\n");
+            break;
+        case Ut::OUT_OF_SHMEM:
+            iprintf("**DEV Out of shared memory\n");
+            break;
+        case Ut::ADDRESS_SET:
+            addressSet(p);
+            break;
+        case Ut::CONFIGURING_EP:
+            configuringEp(p);
+            break;
+        case Ut::EP0_OUT_OVERRUN:
+            iprintf("**EP0 Overrun within OUT data stage\n");
+            break;
+        case Ut::REMOTE_WAKEUP:
+            iprintf("++DEV Remote wakeup\n");
+            break;
+        case Ut::REMOTE_WAKEUP_FEATURE:
+            remoteWakeupFeature(p);
+            break;
+        case Ut::FIRST_PACKET_AFTER_WAKEUP:
+            iprintf("++DEV First packet after remote wakeup\n");
+            break;
+        case Ut::ENDPOINT_HALT:
+            endpointHalt(p);
+            break;
+
+        //Verbose only traces
+        case Ut::EP0_SETUP_IRQ:
+            iprintf("+ EP0 SETUP irq\n");
+            break;
+        case Ut::EP0_IN_IRQ:
+            iprintf("+ EP0 IN irq\n");
+            break;
+        case Ut::EP0_OUT_IRQ:
+            iprintf("+ EP0 OUT irq\n");
+            break;
+        case Ut::EP0_UNSUPP_BREQ:
+            iprintf("* EP0 Unsupported bRequest\n");
+            break;
+        case Ut::EP0_UNSUPP_DESC:
+            iprintf("* EP0 Unsupported descriptor\n");
+            break;
+        case Ut::EP0_STATUS_OUT:
+            iprintf("+ EP0 OUT transaction completed\n");
+            break;
+        case Ut::EP0_STATUS_IN:
+            iprintf("+ EP0 IN transaction completed\n");
+            break;
+        case Ut::IN_BUF_FILL:
+            inBufFill(p);
+            break;
+        case Ut::OUT_BUF_READ:
+            outBufRead(p);
+            break;
+        case Ut::RESUME_SIGNAL_END:
+            iprintf("+ DEV End of resume signaling\n");
+            break;
+        case Ut::EP0_DEFERRED:
+            iprintf("+ EP0 Request deferred by user code\n");
+            break;
+
+        //Special traces
+        case Ut::DBG_DUMP_EPnR:
+            dumpEPnR(p);
+            break;
+        case Ut::MARKER:
+            iprintf("-->   Marker\n");
+            break;
+        default:
+            iprintf("+ Error: unknown TracePoint\n");
     }
 }
 
-void Tracer::deviceStateChange()
+void Tracer::deviceStateChange(const unsigned char *p)
 {
-    unsigned char c;
-    queue.get(c);
     iprintf("++DEV New device state=");
-    switch(c)
+    switch(p[0])
     {
         case USBdevice::DEFAULT:
             iprintf("DEFAULT\n");
@@ -224,48 +438,34 @@ void Tracer::deviceStateChange()
     }
 }
 
-void Tracer::validSetup()
+void Tracer::validSetup(const unsigned char *p)
 {
     Setup setup;
     unsigned char *packet=reinterpret_cast<unsigned char*>(&setup);
-    for(int i=0;i<8;i++)
-    {
-        queue.get(*packet);
-        packet++;
-    }
+    for(int i=0;i<8;i++) packet[i]=p[i];
     iprintf("++EP0 Setup={ bmRequestType=0x%x bRequest=%d wValue=%d wIndex=%d "
             "wLength=%d }\n",setup.bmRequestType,setup.bRequest,setup.wValue,
             setup.wIndex,setup.wLength);
 }
 
-void Tracer::addressSet()
+void Tracer::addressSet(const unsigned char *p)
 {
-    unsigned char c;
-    queue.get(c);
-    iprintf("++DEV Host assigned adress %d\n",c);
+    iprintf("++DEV Host assigned adress %d\n",p[0]);
 }
 
-void Tracer::inBufFill()
+void Tracer::inBufFill(const unsigned char *p)
 {
-    unsigned char epNum, numBytes;
-    queue.get(epNum);
-    queue.get(numBytes);
-    iprintf("+ IN  endpoint %d: buffer filled with %d bytes\n",epNum,numBytes);
+    iprintf("+ IN  endpoint %d: buffer filled with %d bytes\n",p[0],p[1]);
 }
 
-void Tracer::outBufRead()
+void Tracer::outBufRead(const unsigned char *p)
 {
-    unsigned char epNum, numBytes;
-    queue.get(epNum);
-    queue.get(numBytes);
-    iprintf("+ OUT endpoint %d: reading %d bytes\n",epNum,numBytes);
+    iprintf("+ OUT endpoint %d: reading %d bytes\n",p[0],p[1]);
 }
 
-void Tracer::configuringEp()
+void Tracer::configuringEp(const unsigned char *p)
 {
-    unsigned char bEndpointAddress, bmAttributes;
-    queue.get(bEndpointAddress);
-    queue.get(bmAttributes);
+    const unsigned char bEndpointAddress=p[0], bmAttributes=p[1];
     if(bEndpointAddress & 0x80) iprintf("++DEV configuring IN endpoint ");
     else iprintf("++DEV configuring OUT endpoint ");
     iprintf("%d as ",bEndpointAddress & 0x7f);
@@ -286,17 +486,52 @@ void Tracer::configuringEp()
     }
 }
 
-void Tracer::dumpEPnR()
+void Tracer::remoteWakeupFeature(const unsigned char *p)
+{
+    if(p[0]) iprintf("++DEV Host enabled remote wakeup\n");
+    else iprintf("++DEV Host disabled remote wakeup\n");
+}
+
+void Tracer::endpointHalt(const unsigned char *p)
 {
-    unsigned char a[2];
-    queue.get(a[0]);
-    queue.get(a[1]);
-    iprintf("--> EPnR=0x%x\n",toShort(a));
+    const unsigned char bEndpointAddress=p[0], halt=p[1];
+    if(bEndpointAddress & 0x80) iprintf("++IN  endpoint ");
+    else iprintf("++OUT endpoint ");
+    iprintf("%d: ",bEndpointAddress & 0x7f);
+    if(halt) iprintf("halted\n");
+    else iprintf("halt cleared\n");
 }
 
-miosix::Queue<unsigned char,QUEUE_SIZE> Tracer::queue;
-volatile bool Tracer::error; //True in case of queue overflow
+void Tracer::dumpEPnR(const unsigned char *p)
+{
+    iprintf("--> EPnR=0x%x\n",toShort(p));
+}
+
+#endif //MXUSB_TRACE_BINARY
+
+#endif //MXUSB_TRACE_USB
+
+MessageQueue Tracer::queue;
+unsigned char Tracer::buffer[QUEUE_SIZE];
+volatile unsigned int Tracer::dropped=0;
+volatile unsigned int Tracer::maxCost=0;
+unsigned int Tracer::enabled[8]={0};
+#ifdef MXUSB_PRINT_VERBOSE
+unsigned int Tracer::categories=Ut::CAT_ALL;
+#else //MXUSB_PRINT_VERBOSE
+unsigned int Tracer::categories=Ut::CAT_ALL & ~Ut::CAT_VERBOSE;
+#endif //MXUSB_PRINT_VERBOSE
+unsigned short Tracer::endpoints=0xffff;
+#ifdef MXUSB_TRACE_USB
+unsigned char Tracer::pending[MAX_RECORD_SIZE+TraceFormat::FRAME_OVERHEAD];
+int Tracer::pendingSize=0;
+int Tracer::pendingPos=0;
+unsigned int Tracer::lastDropped=0;
+bool Tracer::clockRequested=false;
+#else //MXUSB_TRACE_USB
+volatile bool Tracer::terminate=false;
 miosix::Thread *Tracer::printer=0;
+#endif //MXUSB_TRACE_USB
 
 } //namespace mxusb
 
@@ -31,74 +31,40 @@
 #endif //MXUSB_LIBRARY
 
 #include <config/usb_config.h>
+#include "trace_format.h"
 
 #ifdef MXUSB_ENABLE_TRACE
 #include "miosix.h"
+#include "message_queue.h"
 #endif //MXUSB_ENABLE_TRACE
 
+#if defined(MXUSB_TRACE_USB) && !defined(MXUSB_ENABLE_TRACE)
+#error "MXUSB_TRACE_USB requires MXUSB_ENABLE_TRACE"
+#endif
+
 #ifndef USB_TRACER_H
 #define	USB_TRACER_H
 
 namespace mxusb {
 
-/**
- * \internal
- * Class only meant to wrap the TracePoint enum to prevent namespace pollution
- */
-class Ut
-{
-public:
-    ///Verbose mode. Some of the TracePoints are tagged with this.
-    ///It allows to select printing everything or only non verbose data
-    static const unsigned char VERBOSE=0x80;
-
-    /**
-     * Each point an USBtrace::trace() is called is uniquely identified by
-     * a TracePoint number.
-     */
-    enum TracePoint
-    {
-        //Standard traces
-        DEVICE_STATE_CHANGE=      1,//1byte paramter (new state)
-        DEVICE_RESET=             2,
-        EP0_VALID_SETUP=          3,//8byte parameter (Setup struct)
-        SUSPEND_REQUEST=          4,
-        RESUME_REQUEST=           5,
-        EP0_INTERRUPTED_SETUP=    6,
-        EP0_IN_ABORT=             7,
-        DESC_ERROR=               8,
-        OUT_OF_SHMEM=             9,
-        ADDRESS_SET=             10,//1byte parameter (new address)
-        CONFIGURING_EP=          11,//1byte bEndpointAddress, 1byte bmAttributes
-        EP0_OUT_OVERRUN=         12,
-
-        //Verbose only traces
-        EP0_SETUP_IRQ=  VERBOSE | 1,
-        EP0_IN_IRQ=     VERBOSE | 2,
-        EP0_OUT_IRQ=    VERBOSE | 3,
-        EP0_UNSUPP_BREQ=VERBOSE | 4,
-        EP0_UNSUPP_DESC=VERBOSE | 5,
-        EP0_STATUS_OUT= VERBOSE | 6,
-        EP0_STATUS_IN=  VERBOSE | 7,
-        IN_BUF_FILL=    VERBOSE | 8,//two 1byte parameters (ep #, buffer size)
-        OUT_BUF_READ=   VERBOSE | 9,//two 1byte parameters (ep #, buffer size)
-
-        //Special traces
-        DBG_DUMP_EPnR=126,//Two byte parameters (the EPnR 16 bit register)
-        MARKER=127, //Generic marker, used for debugging
-        TERMINATE=0 //Used within USBtracer to kill the background therad
-    };
-private:
-    Ut();
-};
-
 /**
  * \internal
  * Class to trace USB data transfer. Mainly designed for endpoint zero debugging
+ *
+ * Each trace is stored as a single record in a MessageQueue, so producers
+ * never disable interrupts and the cost of a trace is bounded: a cycle
+ * counter read, an atomic reservation and a copy of at most MAX_RECORD_SIZE
+ * bytes. The record format is described in trace_format.h. If the queue is
+ * full the record is dropped and counted, and tracing goes on.
  */
 class Tracer
 {
 public:
+    ///Size of the record header, TracePoint and timestamp
+    static const int RECORD_HEADER_SIZE=TraceFormat::RECORD_HEADER_SIZE;
+    ///Maximum size of a record, parameters of IRQtraceArray() are truncated
+    static const int MAX_RECORD_SIZE=TraceFormat::MAX_RECORD_SIZE;
+
     #ifdef MXUSB_ENABLE_TRACE
 
     /**
@@ -111,18 +77,49 @@ public:
      */
     static void shutdown();
 
+    /**
+     * Select which TracePoints are recorded. By default all categories are
+     * enabled, except CAT_VERBOSE if MXUSB_PRINT_VERBOSE is not defined, and
+     * all endpoints are enabled.
+     * \param categories bitmask of Ut::Category
+     * \param endpoints bitmask, if bit n is zero TracePoints regarding
+     * endpoint n are not recorded
+     */
+    static void setFilter(unsigned int categories, unsigned short endpoints);
+
+    /**
+     * Same as setFilter(), but must be called with interrupts disabled or
+     * within an IRQ.
+     */
+    static void IRQsetFilter(unsigned int categories, unsigned short endpoints);
+
+    /**
+     * \param tp ID of a point to trace
+     * \return true if the filter allows recording it
+     */
+    static bool IRQisEnabled(Ut::TracePoint tp)
+    {
+        return enabled[tp>>5] & 1u<<(tp & 31);
+    }
+
     /**
      * Insert calls to this function where you want to trace something
      * \param tp ID of the point to trace
      */
-    static void IRQtrace(Ut::TracePoint tp);
+    static void IRQtrace(Ut::TracePoint tp)
+    {
+        if(IRQisEnabled(tp)) IRQrecord(tp,0,0);
+    }
 
     /**
      * Insert calls to this function where you want to trace something
      * \param tp ID of the point to trace
      * \param param additional trace parameter
      */
-    static void IRQtrace(Ut::TracePoint tp, unsigned char param);
+    static void IRQtrace(Ut::TracePoint tp, unsigned char param)
+    {
+        if(IRQisEnabled(tp)) IRQrecord(tp,&param,1);
+    }
 
     /**
      * Insert calls to this function where you want to trace something
@@ -130,7 +127,14 @@ public:
      * \param p1 additional trace parameter
      * \param p2 additional trace parameter
      */
-    static void IRQtrace(Ut::TracePoint tp, unsigned char p1, unsigned char p2);
+    static void IRQtrace(Ut::TracePoint tp, unsigned char p1, unsigned char p2)
+    {
+        if(IRQisEnabled(tp)==false) return;
+        //tp is usually a constant, so for most TracePoints this goes away
+        if(Ut::hasEndpoint(tp) && (endpoints & 1<<(p1 & 0xf))==0) return;
+        unsigned char params[2]={p1,p2};
+        IRQrecord(tp,params,2);
+    }
 
     /**
      * Insert calls to this function where you want to trace something
@@ -138,18 +142,58 @@ public:
      * \param data additional trace parameter, array type
      * \param size size of array
      */
-    static void IRQtraceArray(Ut::TracePoint tp, unsigned char *data, int size);
+    static void IRQtraceArray(Ut::TracePoint tp, unsigned char *data, int size)
+    {
+        if(IRQisEnabled(tp)) IRQrecord(tp,data,size);
+    }
 
     /**
      * Dump EPnR register
      * \param reg register to dump
      */
-    static void IRQtraceEPnR(unsigned short reg);
+    static void IRQtraceEPnR(unsigned short reg)
+    {
+        if(IRQisEnabled(Ut::DBG_DUMP_EPnR)==false) return;
+        unsigned char *toChar=reinterpret_cast<unsigned char*>(&reg);
+        IRQrecord(Ut::DBG_DUMP_EPnR,toChar,2);
+    }
+
+    /**
+     * \return the number of records dropped because the queue was full
+     */
+    static unsigned int getDropped() { return dropped; }
+
+    /**
+     * \return the maximum time spent by a call to IRQtrace(), in CPU cycles
+     */
+    static unsigned int getMaxCost() { return maxCost; }
+
+    #ifdef MXUSB_TRACE_USB
+    /**
+     * Make the next IRQdrain() start with a TRACE_CLOCK record, so that the
+     * host can convert timestamps to time. Must be called with interrupts
+     * disabled or within an IRQ.
+     */
+    static void IRQrequestClock();
+
+    /**
+     * Fill a buffer with the binary trace stream, framed as described in
+     * trace_format.h. A frame that doesn't fit is continued by the next call.
+     * Must be called with interrupts disabled or within an IRQ.
+     * \param data buffer to fill
+     * \param size buffer size
+     * \return the number of bytes written, less than size only if there are
+     * no more records
+     */
+    static int IRQdrain(unsigned char *data, int size);
+    #endif //MXUSB_TRACE_USB
 
     #else //MXUSB_ENABLE_TRACE
     //Do nothing stubs
     static void init() {}
     static void shutdown() {}
+    static void setFilter(unsigned int, unsigned short) {}
+    static void IRQsetFilter(unsigned int, unsigned short) {}
     static void IRQtrace(Ut::TracePoint) {}
     static void IRQtrace(Ut::TracePoint, unsigned char) {}
     static void IRQtrace(Ut::TracePoint, unsigned char, unsigned char) {}
@@ -159,10 +203,27 @@ public:
 private:
     Tracer();
 
+    #ifdef MXUSB_ENABLE_TRACE
+    /**
+     * Add a record to the queue
+     * \param tp ID of the point to trace
+     * \param params parameters
+     * \param size size of parameters, truncated to fit MAX_RECORD_SIZE
+     */
+    static void IRQrecord(Ut::TracePoint tp, const unsigned char *params,
+            int size);
+    #endif //MXUSB_ENABLE_TRACE
+
     /**
-     * Thread that prints trace data.
-     * Trace data is printed using iprintf, so it is usually redirected to a
-     * serial port. Trace format is this:
+     * Thread that prints trace data. It polls the queue, so that producers
+     * don't need to wake it up.
+     * Not used if MXUSB_TRACE_USB is defined, as the host drains records.
+     * If MXUSB_TRACE_BINARY is defined, records are written to stdout framed
+     * as described in trace_format.h, and tracedecode in the testsuite
+     * decodes them on the host. Otherwise trace data is printed using
+     * iprintf, so it is usually redirected to a serial port. Each line is
+     * prefixed with the timestamp in microseconds since the tracer was
+     * started. Trace format is this:
      * - normal tracepoints start with      "++"
      * - verbose tracepoints start with     "+ "
      * - errors/warnings start with         "**"
@@ -175,45 +236,79 @@ private:
      */
     static void printerThread(void *argv);
 
+    /**
+     * Print a record
+     * \param record record data
+     * \param size record size
+     */
+    static void printRecord(const unsigned char *record, int size);
+
     /**
      * Log device state change
      */
-    static void deviceStateChange();
+    static void deviceStateChange(const unsigned char *p);
 
     /**
      * Log valid setup
      */
-    static void validSetup();
+    static void validSetup(const unsigned char *p);
 
     /**
      * Log when a new address is assigned by the host
      */
-    static void addressSet();
+    static void addressSet(const unsigned char *p);
 
     /**
      * Log when IN buffer of an endpoint is filled
      */
-    static void inBufFill();
+    static void inBufFill(const unsigned char *p);
 
     /**
      * Log when OUT buffer of an endpoint is read
      */
-    static void outBufRead();
+    static void outBufRead(const unsigned char *p);
 
     /**
      * Log when an endpoint is being configured
      */
-    static void configuringEp();
+    static void configuringEp(const unsigned char *p);
+
+    /**
+     * Log when the host enables or disables remote wakeup
+     */
+    static void remoteWakeupFeature(const unsigned char *p);
+
+    /**
+     * Log when an endpoint is halted or its halt is cleared
+     */
+    static void endpointHalt(const unsigned char *p);
 
     /**
      * Dump EPnR register
      */
-    static void dumpEPnR();
+    static void dumpEPnR(const unsigned char *p);
 
     #ifdef MXUSB_ENABLE_TRACE
-    static miosix::Queue<unsigned char,QUEUE_SIZE> queue;
-    static volatile bool error; //True in case of queue overflow
+    static MessageQueue queue;
+    static unsigned char buffer[QUEUE_SIZE]; ///<Memory for the queue
+    static volatile unsigned int dropped; ///<Number of records dropped
+    static volatile unsigned int maxCost; ///<Max IRQtrace() time, in cycles
+    ///Bitmap of TracePoints that are recorded, indexed by TracePoint, so
+    ///that a disabled TracePoint costs a load and a branch
+    static unsigned int enabled[8];
+    static unsigned int categories; ///<Categories selected by setFilter()
+    static unsigned short endpoints; ///<Endpoints selected by setFilter()
+    #ifdef MXUSB_TRACE_USB
+    ///Frame that did not fit in the last IRQdrain()
+    static unsigned char pending[MAX_RECORD_SIZE+TraceFormat::FRAME_OVERHEAD];
+    static int pendingSize; ///<Size of pending frame
+    static int pendingPos;  ///<Bytes of pending frame already sent
+    static unsigned int lastDropped; ///<Value of dropped last reported
+    static bool clockRequested; ///<Send TRACE_CLOCK at next IRQdrain()
+    #else //MXUSB_TRACE_USB
+    static volatile bool terminate; ///<Set to stop the printer thread
     static miosix::Thread *printer;
+    #endif //MXUSB_TRACE_USB
     #endif //MXUSB_ENABLE_TRACE
 };
 